@@ -12,13 +12,18 @@
 #include "RotationProcessor.h"
 #include "TranslationProcessor.h"
 #include "RenderScreenView.h"
+#include "Mesh.h"
+#include "Material.h"
 
 #include <memory>
 #include <array>
+#include <string>
 
 using std::shared_ptr;
+using std::unique_ptr;
 using std::array;
 using std::make_shared;
+using std::string;
 
 #define MAX_LOADSTRING 100
 
@@ -32,6 +37,8 @@ ATOM                MyRegisterClass(HINSTANCE hInstance);
 BOOL                InitInstance(HINSTANCE, int);
 LRESULT CALLBACK    WndProc(HWND, UINT, WPARAM, LPARAM);
 INT_PTR CALLBACK    About(HWND, UINT, WPARAM, LPARAM);
+int                 RunHeadless(uint32_t numFrames);
+shared_ptr<Bonny::Entity> CreateGridEntity(string name, uint32_t numQuads, float size);
 
 Bonny::WorldManager*  g_worldManager;
 unsigned int              g_windowX = 0;
@@ -39,6 +46,8 @@ unsigned int              g_windowY = 0;
 unsigned int              g_windowWidth = 1200;
 unsigned int              g_windowHeight = 800;
 bool g_appDone;
+Bonny::WorldManager::ModelLoadHandle  g_sponzaLoad;
+int                       g_sponzaLoadReported = -1;
 
 
 int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
@@ -47,7 +56,13 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
                      _In_ int       nCmdShow)
 {
     UNREFERENCED_PARAMETER(hPrevInstance);
-    UNREFERENCED_PARAMETER(lpCmdLine);
+
+    // -headless runs the self checks on a generated scene without a window or GPU,
+    // the exit code is the number of failed checks
+    if (lpCmdLine != nullptr && wcsstr(lpCmdLine, L"-headless") != nullptr)
+    {
+      return RunHeadless(4);
+    }
 
     // TODO: Place code here.
 
@@ -102,6 +117,21 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
         }
       }
       g_worldManager->executeFrame();
+
+      // Report the background load in 10% steps until it is in the world
+      if (g_sponzaLoad != nullptr)
+      {
+        int percent = (int)(g_sponzaLoad->m_progress * 10.0f) * 10;
+        if (percent != g_sponzaLoadReported)
+        {
+          g_worldManager->printLog("Loading " + g_sponzaLoad->m_filename + ": " + std::to_string(percent) + "%");
+          g_sponzaLoadReported = percent;
+        }
+        if (g_sponzaLoad->m_state >= Bonny::WorldManager::ModelLoad::LOAD_DONE)
+        {
+          g_sponzaLoad = nullptr;
+        }
+      }
     }
 
     return (int) msg.wParam;
@@ -109,6 +139,125 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 
 
 
+//
+//  FUNCTION: RunHeadless(uint32_t)
+//
+//  PURPOSE: Renders a few frames of a generated scene with the headless backend and runs the checks.
+//
+int RunHeadless(uint32_t numFrames)
+{
+  g_worldManager = new Bonny::WorldManager("WorldManager");
+
+  shared_ptr<Bonny::Entity> rootEntity = make_shared<Bonny::Entity>("Root Entity");
+
+  shared_ptr<Bonny::RenderBuffer> renderBuffer = make_shared<Bonny::RenderBuffer>(800, 600);
+  renderBuffer->createDepthAttatchment(Bonny::RenderBuffer::RB_FLOAT_32);
+  renderBuffer->addColorAttatchment(Bonny::RenderBuffer::RB_UNORM_BGRA);
+
+  shared_ptr<Bonny::RenderScreenView> screenView = make_shared<Bonny::RenderScreenView>("Screen View");
+  screenView->setRenderBuffer(renderBuffer);
+  screenView->setViewportSize(vec2(800, 600));
+  screenView->setViewTransform(glm::lookAt(vec3(0.0f, 0.0f, 0.0f), vec3(0.0f, 0.0f, -1.0f), vec3(0.0f, 1.0f, 0.0f)));
+  g_worldManager->addView(screenView);
+
+  // A grid facing the camera and a grid of lights spread over the view, from close up to far away
+  shared_ptr<Bonny::Entity> gridEntity = CreateGridEntity("Grid", 64, 40.0f);
+  gridEntity->setTransform(glm::translate(mat4(), vec3(0.0f, 0.0f, -30.0f)));
+  rootEntity->addChild(gridEntity);
+
+  for (uint32_t i = 0; i < 8; i++)
+  {
+    for (uint32_t j = 0; j < 8; j++)
+    {
+      string name = "Light " + std::to_string(i * 8 + j);
+      shared_ptr<Bonny::Entity> lightE = make_shared<Bonny::Entity>(name);
+      shared_ptr<Bonny::LightComponent> lightC = make_shared<Bonny::LightComponent>(name, Bonny::LightComponent::POINT, false);
+      lightC->setDiffuse(vec3(1.0f, 1.0f, 1.0f));
+      lightC->setPosition(vec3(i * 5.0f - 17.5f, j * 3.0f - 10.5f, -2.0f - (i + j) * 4.0f));
+      lightE->addComponent(lightC);
+
+      // The lights on the diagonal move, each processor only writes its own light's transform
+      if (i == j)
+      {
+        shared_ptr<Bonny::TranslationProcessor> lightP = make_shared<Bonny::TranslationProcessor>(name + " Translation Processor", -2.0f, 2.0f, 0.05f,
+          vec3(1.0f, 0.0f, 0.0f), lightE);
+        lightP->setIndependent(true);
+        lightE->addComponent(lightP);
+      }
+      rootEntity->addChild(lightE);
+    }
+  }
+
+  g_worldManager->addEntity(rootEntity);
+  g_worldManager->setQuantizeVertices(true);
+  g_worldManager->buildFrame();
+  g_worldManager->printGeometryStats();
+  for (uint32_t i = 0; i < numFrames; i++)
+  {
+    g_worldManager->executeFrame();
+  }
+
+  int numFailed = (int)g_worldManager->runChecks();
+  delete g_worldManager;
+  g_worldManager = nullptr;
+  return numFailed;
+}
+
+//
+//  FUNCTION: CreateGridEntity(string, uint32_t, float)
+//
+//  PURPOSE: Entity with a square grid of quads in the xy plane, centered on the origin and facing +z.
+//
+shared_ptr<Bonny::Entity> CreateGridEntity(string name, uint32_t numQuads, float size)
+{
+  uint32_t numSideVerts = numQuads + 1;
+  size_t numVerts = numSideVerts * numSideVerts;
+  unique_ptr<float[]> positions(new float[numVerts * 3]);
+  unique_ptr<float[]> normals(new float[numVerts * 3]);
+  for (uint32_t y = 0; y < numSideVerts; y++)
+  {
+    for (uint32_t x = 0; x < numSideVerts; x++)
+    {
+      size_t v = (y * numSideVerts + x) * 3;
+      positions[v + 0] = ((float)x / numQuads - 0.5f) * size;
+      positions[v + 1] = ((float)y / numQuads - 0.5f) * size;
+      positions[v + 2] = 0.0f;
+      normals[v + 0] = 0.0f;
+      normals[v + 1] = 0.0f;
+      normals[v + 2] = 1.0f;
+    }
+  }
+
+  // Counter clockwise seen from +z
+  unique_ptr<unsigned int[]> indices(new unsigned int[numQuads * numQuads * 6]);
+  size_t i = 0;
+  for (uint32_t y = 0; y < numQuads; y++)
+  {
+    for (uint32_t x = 0; x < numQuads; x++)
+    {
+      unsigned int v0 = y * numSideVerts + x;
+      indices[i++] = v0;
+      indices[i++] = v0 + 1;
+      indices[i++] = v0 + numSideVerts + 1;
+      indices[i++] = v0;
+      indices[i++] = v0 + numSideVerts + 1;
+      indices[i++] = v0 + numSideVerts;
+    }
+  }
+
+  shared_ptr<Bonny::Mesh> mesh = make_shared<Bonny::Mesh>(name, Bonny::Mesh::TRIANGLES, numVerts, 2);
+  mesh->addVertexBuffer(0, Bonny::Mesh::POSITION, 3, std::move(positions));
+  mesh->addVertexBuffer(1, Bonny::Mesh::NORMAL, 3, std::move(normals));
+  mesh->addIndexBuffer(numQuads * numQuads * 6, std::move(indices));
+  mesh->setMaterial(make_shared<Bonny::Material>(name + " Material", Bonny::Material::LIT_NOTEXTURE));
+
+  shared_ptr<Bonny::RenderComponent> renderComponent = make_shared<Bonny::RenderComponent>(name);
+  renderComponent->addMesh(mesh);
+  shared_ptr<Bonny::Entity> entity = make_shared<Bonny::Entity>(name);
+  entity->addComponent(renderComponent);
+  return entity;
+}
+
 //
 //  FUNCTION: MyRegisterClass()
 //
@@ -170,17 +319,16 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
    //gltfModel->setTransform(gltfcale);
    //rootEntity->addChild(gltfModel);
 
-   shared_ptr<Bonny::Entity> sponzaModel = g_worldManager->loadAssimpModel("models/sponzaPBR/sponza.obj");
-   //shared_ptr<Bonny::Entity> sponzaModel = g_worldManager->loadAssimpModel("models/bistro/Bistro_Research_Interior.fbx");
-   mat4 sponzaScale = glm::scale(mat4(), vec3(0.1f, 0.1f, 0.1f));
-   sponzaModel->setTransform(sponzaScale);
-   rootEntity->addChild(sponzaModel);
-
    shared_ptr<Bonny::Entity> teapotModel = g_worldManager->loadAssimpModel("models/teapot.obj");
    mat4 teapotScale = glm::scale(mat4(), vec3(0.3f, 0.3f, 0.3f));
    teapotModel->setTransform(teapotScale);
    teapotModel->setCastShadow(false);
 
+   // Sponza streams in on a background thread and joins the root entity a few frames in
+   mat4 sponzaScale = glm::scale(mat4(), vec3(0.1f, 0.1f, 0.1f));
+   g_sponzaLoad = g_worldManager->loadAssimpModelAsync("models/sponzaPBR/sponza.obj", rootEntity, sponzaScale);
+   //g_sponzaLoad = g_worldManager->loadAssimpModelAsync("models/bistro/Bistro_Research_Interior.fbx", rootEntity, sponzaScale);
+
    // Create the screen view and its processor
    shared_ptr<Bonny::RenderBuffer> renderBuffer = make_shared<Bonny::RenderBuffer>(1200, 800);
    renderBuffer->createDepthAttatchment(Bonny::RenderBuffer::RB_FLOAT_32);
@@ -208,6 +356,7 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
    //light1C->setCastShadow(false);
    //light1E->addComponent(light1C);
    //shared_ptr<Bonny::RotationProcessor> light1Processor = make_shared<Bonny::RotationProcessor>("Light 1 Rotation Processor", light1E, yAxis, 0.1f);
+   //light1Processor->setIndependent(true);
    //light1E->addComponent(light1Processor);
    //light1E->addChild(teapotTranslation);
    //rootEntity->addChild(light1E);
@@ -236,6 +385,8 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
    light4C->setCastShadow(false);
    light4E->addComponent(light4C);
    shared_ptr<Bonny::TranslationProcessor> light4Processor = make_shared<Bonny::TranslationProcessor>("Light 4 Translation Processor", -5.5f, 5.5f, 0.05f, vec3(0.0f, 0.0f, 1.0f), light4E);
+   // Only moves its own light, it can run next to the other processors
+   light4Processor->setIndependent(true);
    light4E->addComponent(light4Processor);
    rootEntity->addChild(light4E);
 
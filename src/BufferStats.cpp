@@ -0,0 +1,33 @@
+#include "stdafx.h"
+#include "BufferStats.h"
+
+#include <atomic>
+
+namespace Bonny
+{
+  // Meshes are created on the loading thread and the main thread at the same time
+  static std::atomic<uint64_t> s_numCopies(0);
+  static std::atomic<uint64_t> s_bytesCopied(0);
+  static std::atomic<uint64_t> s_numAdopted(0);
+  static std::atomic<uint64_t> s_bytesAdopted(0);
+
+  void BufferStats::recordCopy(size_t numBytes)
+  {
+    s_numCopies++;
+    s_bytesCopied += numBytes;
+  }
+
+  void BufferStats::recordAdopt(size_t numBytes)
+  {
+    s_numAdopted++;
+    s_bytesAdopted += numBytes;
+  }
+
+  void BufferStats::getCounts(Counts& counts)
+  {
+    counts.m_numCopies = s_numCopies;
+    counts.m_bytesCopied = s_bytesCopied;
+    counts.m_numAdopted = s_numAdopted;
+    counts.m_bytesAdopted = s_bytesAdopted;
+  }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace Bonny
+{
+  // Process wide counts of the vertex, index and image buffers meshes and
+  // textures took in, either copied from the caller or adopted without a copy.
+  // Loaders snapshot them around a load to see how many copies it made.
+  class BufferStats
+  {
+  public:
+    struct Counts
+    {
+      uint64_t  m_numCopies;
+      uint64_t  m_bytesCopied;
+      uint64_t  m_numAdopted;
+      uint64_t  m_bytesAdopted;
+    };
+
+    static void recordCopy(size_t numBytes);
+    static void recordAdopt(size_t numBytes);
+    static void getCounts(Counts& counts);
+  };
+}
@@ -0,0 +1,261 @@
+#include "stdafx.h"
+#include "Bvh.h"
+
+#include <algorithm>
+#include <cfloat>
+
+namespace Bonny
+{
+  static const uint32_t c_numBins = 16;
+  static const uint32_t c_maxLeafSize = 4;
+
+  static float surfaceArea(const vec3& boundsMin, const vec3& boundsMax)
+  {
+    vec3 size = boundsMax - boundsMin;
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+  }
+
+  Bvh::Bvh() :
+    m_numNodes(0)
+  {
+  }
+
+
+  Bvh::~Bvh()
+  {
+  }
+
+  void Bvh::build(const vec3* boundsMin, const vec3* boundsMax, uint32_t numPrimitives)
+  {
+    clear();
+    if (numPrimitives == 0)
+    {
+      return;
+    }
+
+    vector<vec3> centroids(numPrimitives);
+    m_primitives.resize(numPrimitives);
+    for (uint32_t i = 0; i < numPrimitives; i++)
+    {
+      m_primitives[i] = i;
+      centroids[i] = (boundsMin[i] + boundsMax[i]) * 0.5f;
+    }
+
+    // A binary tree with one primitive per leaf has at most 2n - 1 nodes
+    m_nodes.resize(numPrimitives * 2 - 1);
+    m_nodes[0].m_leftOrFirst = 0;
+    m_nodes[0].m_count = numPrimitives;
+    m_numNodes = 1;
+    updateNodeBounds(0, boundsMin, boundsMax);
+    subdivide(0, 0, boundsMin, boundsMax, centroids);
+    m_nodes.resize(m_numNodes);
+  }
+
+  void Bvh::refit(const vec3* boundsMin, const vec3* boundsMax)
+  {
+    // Children always follow their parent, walking backwards sees them first
+    for (uint32_t i = m_numNodes; i-- > 0;)
+    {
+      Node& node = m_nodes[i];
+      if (node.m_count > 0)
+      {
+        updateNodeBounds(i, boundsMin, boundsMax);
+      }
+      else
+      {
+        const Node& left = m_nodes[node.m_leftOrFirst];
+        const Node& right = m_nodes[node.m_leftOrFirst + 1];
+        node.m_min = glm::min(left.m_min, right.m_min);
+        node.m_max = glm::max(left.m_max, right.m_max);
+      }
+    }
+  }
+
+  void Bvh::clear()
+  {
+    m_nodes.clear();
+    m_primitives.clear();
+    m_numNodes = 0;
+  }
+
+  size_t Bvh::numNodes()
+  {
+    return m_numNodes;
+  }
+
+  uint32_t Bvh::numPrimitives()
+  {
+    return (uint32_t)m_primitives.size();
+  }
+
+  const Bvh::Node& Bvh::getNode(uint32_t index)
+  {
+    return m_nodes[index];
+  }
+
+  uint32_t Bvh::getPrimitive(uint32_t index)
+  {
+    return m_primitives[index];
+  }
+
+  float Bvh::getSahCost()
+  {
+    if (m_numNodes == 0)
+    {
+      return 0.0f;
+    }
+
+    // Expected cost of a random ray relative to the root, one unit per node visit and primitive test
+    float cost = 0.0f;
+    for (uint32_t i = 0; i < m_numNodes; i++)
+    {
+      const Node& node = m_nodes[i];
+      float area = surfaceArea(node.m_min, node.m_max);
+      cost += node.m_count > 0 ? area * node.m_count : area;
+    }
+    float rootArea = surfaceArea(m_nodes[0].m_min, m_nodes[0].m_max);
+    return rootArea > 0.0f ? cost / rootArea : cost;
+  }
+
+  void Bvh::updateNodeBounds(uint32_t nodeIndex, const vec3* boundsMin, const vec3* boundsMax)
+  {
+    Node& node = m_nodes[nodeIndex];
+    node.m_min = vec3(FLT_MAX);
+    node.m_max = vec3(-FLT_MAX);
+    for (uint32_t i = 0; i < node.m_count; i++)
+    {
+      uint32_t primitive = m_primitives[node.m_leftOrFirst + i];
+      node.m_min = glm::min(node.m_min, boundsMin[primitive]);
+      node.m_max = glm::max(node.m_max, boundsMax[primitive]);
+    }
+  }
+
+  void Bvh::subdivide(uint32_t nodeIndex, uint32_t depth, const vec3* boundsMin, const vec3* boundsMax, const vector<vec3>& centroids)
+  {
+    Node& node = m_nodes[nodeIndex];
+    uint32_t first = node.m_leftOrFirst;
+    uint32_t count = node.m_count;
+    if (count <= 1 || depth >= c_maxDepth)
+    {
+      return;
+    }
+
+    vec3 centroidMin(FLT_MAX);
+    vec3 centroidMax(-FLT_MAX);
+    for (uint32_t i = 0; i < count; i++)
+    {
+      centroidMin = glm::min(centroidMin, centroids[m_primitives[first + i]]);
+      centroidMax = glm::max(centroidMax, centroids[m_primitives[first + i]]);
+    }
+
+    // Bin the centroids along every axis and sweep the bin boundaries for the cheapest split
+    float bestCost = FLT_MAX;
+    int bestAxis = -1;
+    uint32_t bestSplit = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      float extent = centroidMax[axis] - centroidMin[axis];
+      if (extent <= 0.0f)
+      {
+        continue;
+      }
+
+      vec3 binMin[c_numBins];
+      vec3 binMax[c_numBins];
+      uint32_t binCount[c_numBins];
+      for (uint32_t b = 0; b < c_numBins; b++)
+      {
+        binMin[b] = vec3(FLT_MAX);
+        binMax[b] = vec3(-FLT_MAX);
+        binCount[b] = 0;
+      }
+
+      float scale = c_numBins / extent;
+      for (uint32_t i = 0; i < count; i++)
+      {
+        uint32_t primitive = m_primitives[first + i];
+        uint32_t b = std::min((uint32_t)((centroids[primitive][axis] - centroidMin[axis]) * scale), c_numBins - 1);
+        binMin[b] = glm::min(binMin[b], boundsMin[primitive]);
+        binMax[b] = glm::max(binMax[b], boundsMax[primitive]);
+        binCount[b]++;
+      }
+
+      float leftArea[c_numBins - 1];
+      uint32_t leftCount[c_numBins - 1];
+      vec3 sweepMin(FLT_MAX);
+      vec3 sweepMax(-FLT_MAX);
+      uint32_t sweepCount = 0;
+      for (uint32_t b = 0; b < c_numBins - 1; b++)
+      {
+        sweepCount += binCount[b];
+        if (binCount[b] > 0)
+        {
+          sweepMin = glm::min(sweepMin, binMin[b]);
+          sweepMax = glm::max(sweepMax, binMax[b]);
+        }
+        leftCount[b] = sweepCount;
+        leftArea[b] = sweepCount > 0 ? surfaceArea(sweepMin, sweepMax) : 0.0f;
+      }
+
+      sweepMin = vec3(FLT_MAX);
+      sweepMax = vec3(-FLT_MAX);
+      sweepCount = 0;
+      for (uint32_t b = c_numBins - 1; b > 0; b--)
+      {
+        sweepCount += binCount[b];
+        if (binCount[b] > 0)
+        {
+          sweepMin = glm::min(sweepMin, binMin[b]);
+          sweepMax = glm::max(sweepMax, binMax[b]);
+        }
+        if (sweepCount == 0 || leftCount[b - 1] == 0)
+        {
+          continue;
+        }
+
+        float cost = leftArea[b - 1] * leftCount[b - 1] + surfaceArea(sweepMin, sweepMax) * sweepCount;
+        if (cost < bestCost)
+        {
+          bestCost = cost;
+          bestAxis = axis;
+          bestSplit = b;
+        }
+      }
+    }
+
+    // Keep small nodes as leaves when splitting would not pay for the extra traversal step
+    float leafCost = surfaceArea(node.m_min, node.m_max) * count;
+    if (bestAxis < 0 || (count <= c_maxLeafSize && bestCost >= leafCost))
+    {
+      return;
+    }
+
+    float scale = c_numBins / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+    uint32_t* begin = &m_primitives[first];
+    uint32_t* middle = std::partition(begin, begin + count, [&](uint32_t primitive)
+    {
+      uint32_t b = std::min((uint32_t)((centroids[primitive][bestAxis] - centroidMin[bestAxis]) * scale), c_numBins - 1);
+      return b < bestSplit;
+    });
+
+    uint32_t numLeft = (uint32_t)(middle - begin);
+    if (numLeft == 0 || numLeft == count)
+    {
+      return;
+    }
+
+    uint32_t leftIndex = m_numNodes;
+    m_numNodes += 2;
+    m_nodes[leftIndex].m_leftOrFirst = first;
+    m_nodes[leftIndex].m_count = numLeft;
+    m_nodes[leftIndex + 1].m_leftOrFirst = first + numLeft;
+    m_nodes[leftIndex + 1].m_count = count - numLeft;
+    node.m_leftOrFirst = leftIndex;
+    node.m_count = 0;
+
+    updateNodeBounds(leftIndex, boundsMin, boundsMax);
+    updateNodeBounds(leftIndex + 1, boundsMin, boundsMax);
+    subdivide(leftIndex, depth + 1, boundsMin, boundsMax, centroids);
+    subdivide(leftIndex + 1, depth + 1, boundsMin, boundsMax, centroids);
+  }
+}
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include <xmmintrin.h>
+
+#include <glm/glm.hpp>
+
+using glm::vec3;
+using glm::vec4;
+
+using std::vector;
+
+namespace Bonny
+{
+  // Bounding volume hierarchy over a set of primitive boxes, built with the
+  // binned surface area heuristic and stored as a flat node array. The two
+  // children of an interior node are adjacent and always come after their
+  // parent, so the tree can be refit with one reverse pass.
+  class Bvh
+  {
+  public:
+    // Nodes at this depth become leaves. A traversal holds at most one pending child
+    // per level above the current node plus the two children it pushes.
+    static const uint32_t c_maxDepth = 60;
+    static const uint32_t c_stackSize = 64;
+
+    struct Node
+    {
+      vec3      m_min;
+      uint32_t  m_leftOrFirst;
+      vec3      m_max;
+      uint32_t  m_count;
+    };
+
+    // Four rays traced together, one SSE lane each
+    struct RayPacket
+    {
+      __m128    m_originX;
+      __m128    m_originY;
+      __m128    m_originZ;
+      __m128    m_directionX;
+      __m128    m_directionY;
+      __m128    m_directionZ;
+      __m128    m_inverseX;
+      __m128    m_inverseY;
+      __m128    m_inverseZ;
+      __m128    m_maxDistance;
+    };
+
+    Bvh();
+    ~Bvh();
+
+    void            build(const vec3* boundsMin, const vec3* boundsMax, uint32_t numPrimitives);
+    void            refit(const vec3* boundsMin, const vec3* boundsMax);
+    void            clear();
+
+    size_t          numNodes();
+    uint32_t        numPrimitives();
+    const Node&     getNode(uint32_t index);
+    uint32_t        getPrimitive(uint32_t index);
+    float           getSahCost();
+
+    // Calls primitiveTest(primitive, maxDistance) for every primitive whose box the ray
+    // enters before maxDistance. The test shortens maxDistance when it finds a closer hit
+    // and returns true, returning true from an any hit query stops the traversal early.
+    template <typename PrimitiveTest>
+    bool            intersectRay(const vec3& origin, const vec3& direction, float& maxDistance, PrimitiveTest primitiveTest, bool anyHit = false);
+
+    // Calls visit(primitive, inside) for every primitive whose box is not fully outside
+    // the planes, inside is true when the box of a whole subtree is within all of them.
+    template <typename Visitor>
+    void            intersectFrustum(const vec4 planes[6], Visitor visit);
+
+    // Packet traversal for coherent rays. Calls primitiveTest(primitive, mask) with the lanes
+    // whose ray reaches the primitive's leaf, the test shortens m_maxDistance for lanes it hits.
+    template <typename PrimitiveTest>
+    void            intersectPacket(RayPacket& packet, int activeMask, PrimitiveTest primitiveTest);
+
+    static void     setPacketRay(RayPacket& packet, int lane, const vec3& origin, const vec3& direction, float maxDistance);
+
+  private:
+    void            subdivide(uint32_t nodeIndex, uint32_t depth, const vec3* boundsMin, const vec3* boundsMax, const vector<vec3>& centroids);
+    void            updateNodeBounds(uint32_t nodeIndex, const vec3* boundsMin, const vec3* boundsMax);
+    bool            intersectsBox(const vec3& origin, const vec3& inverseDirection, const Node& node, float maxDistance, float& distance);
+    int             intersectsBox(const RayPacket& packet, const Node& node);
+
+    vector<Node>      m_nodes;
+    vector<uint32_t>  m_primitives;
+    uint32_t          m_numNodes;
+  };
+
+  static_assert(Bvh::c_stackSize >= Bvh::c_maxDepth + 2, "Traversal stacks have to fit the deepest tree the build makes");
+
+  inline bool Bvh::intersectsBox(const vec3& origin, const vec3& inverseDirection, const Node& node, float maxDistance, float& distance)
+  {
+    float tx1 = (node.m_min.x - origin.x) * inverseDirection.x;
+    float tx2 = (node.m_max.x - origin.x) * inverseDirection.x;
+    float tmin = tx1 < tx2 ? tx1 : tx2;
+    float tmax = tx1 < tx2 ? tx2 : tx1;
+    float ty1 = (node.m_min.y - origin.y) * inverseDirection.y;
+    float ty2 = (node.m_max.y - origin.y) * inverseDirection.y;
+    tmin = std::max(tmin, ty1 < ty2 ? ty1 : ty2);
+    tmax = std::min(tmax, ty1 < ty2 ? ty2 : ty1);
+    float tz1 = (node.m_min.z - origin.z) * inverseDirection.z;
+    float tz2 = (node.m_max.z - origin.z) * inverseDirection.z;
+    tmin = std::max(tmin, tz1 < tz2 ? tz1 : tz2);
+    tmax = std::min(tmax, tz1 < tz2 ? tz2 : tz1);
+    distance = tmin;
+    return tmax >= tmin && tmax >= 0.0f && tmin < maxDistance;
+  }
+
+  template <typename PrimitiveTest>
+  bool Bvh::intersectRay(const vec3& origin, const vec3& direction, float& maxDistance, PrimitiveTest primitiveTest, bool anyHit)
+  {
+    if (m_numNodes == 0)
+    {
+      return false;
+    }
+
+    vec3 inverseDirection(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+    float distance;
+    if (!intersectsBox(origin, inverseDirection, m_nodes[0], maxDistance, distance))
+    {
+      return false;
+    }
+
+    // Nearer child first, the far one is skipped when a hit was found in front of it
+    uint32_t stack[c_stackSize];
+    uint32_t stackSize = 0;
+    uint32_t nodeIndex = 0;
+    bool hit = false;
+    while (true)
+    {
+      const Node& node = m_nodes[nodeIndex];
+      if (node.m_count > 0)
+      {
+        for (uint32_t i = 0; i < node.m_count; i++)
+        {
+          if (primitiveTest(m_primitives[node.m_leftOrFirst + i], maxDistance))
+          {
+            hit = true;
+            if (anyHit)
+            {
+              return true;
+            }
+          }
+        }
+      }
+      else
+      {
+        float leftDistance;
+        float rightDistance;
+        bool left = intersectsBox(origin, inverseDirection, m_nodes[node.m_leftOrFirst], maxDistance, leftDistance);
+        bool right = intersectsBox(origin, inverseDirection, m_nodes[node.m_leftOrFirst + 1], maxDistance, rightDistance);
+        if (left && right)
+        {
+          uint32_t nearChild = leftDistance <= rightDistance ? node.m_leftOrFirst : node.m_leftOrFirst + 1;
+          stack[stackSize++] = nearChild == node.m_leftOrFirst ? node.m_leftOrFirst + 1 : node.m_leftOrFirst;
+          nodeIndex = nearChild;
+          continue;
+        }
+        if (left || right)
+        {
+          nodeIndex = left ? node.m_leftOrFirst : node.m_leftOrFirst + 1;
+          continue;
+        }
+      }
+
+      // Pop the next subtree that is still in front of the closest hit
+      bool found = false;
+      while (stackSize > 0 && !found)
+      {
+        nodeIndex = stack[--stackSize];
+        found = intersectsBox(origin, inverseDirection, m_nodes[nodeIndex], maxDistance, distance);
+      }
+      if (!found)
+      {
+        return hit;
+      }
+    }
+  }
+
+  inline void Bvh::setPacketRay(RayPacket& packet, int lane, const vec3& origin, const vec3& direction, float maxDistance)
+  {
+    ((float*)&packet.m_originX)[lane] = origin.x;
+    ((float*)&packet.m_originY)[lane] = origin.y;
+    ((float*)&packet.m_originZ)[lane] = origin.z;
+    ((float*)&packet.m_directionX)[lane] = direction.x;
+    ((float*)&packet.m_directionY)[lane] = direction.y;
+    ((float*)&packet.m_directionZ)[lane] = direction.z;
+    ((float*)&packet.m_inverseX)[lane] = 1.0f / direction.x;
+    ((float*)&packet.m_inverseY)[lane] = 1.0f / direction.y;
+    ((float*)&packet.m_inverseZ)[lane] = 1.0f / direction.z;
+    ((float*)&packet.m_maxDistance)[lane] = maxDistance;
+  }
+
+  inline int Bvh::intersectsBox(const RayPacket& packet, const Node& node)
+  {
+    __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.m_min.x), packet.m_originX), packet.m_inverseX);
+    __m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.m_max.x), packet.m_originX), packet.m_inverseX);
+    __m128 tmin = _mm_min_ps(tx1, tx2);
+    __m128 tmax = _mm_max_ps(tx1, tx2);
+    __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.m_min.y), packet.m_originY), packet.m_inverseY);
+    __m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.m_max.y), packet.m_originY), packet.m_inverseY);
+    tmin = _mm_max_ps(tmin, _mm_min_ps(ty1, ty2));
+    tmax = _mm_min_ps(tmax, _mm_max_ps(ty1, ty2));
+    __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.m_min.z), packet.m_originZ), packet.m_inverseZ);
+    __m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.m_max.z), packet.m_originZ), packet.m_inverseZ);
+    tmin = _mm_max_ps(tmin, _mm_min_ps(tz1, tz2));
+    tmax = _mm_min_ps(tmax, _mm_max_ps(tz1, tz2));
+
+    __m128 hit = _mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmpge_ps(tmax, _mm_setzero_ps()));
+    hit = _mm_and_ps(hit, _mm_cmplt_ps(tmin, packet.m_maxDistance));
+    return _mm_movemask_ps(hit);
+  }
+
+  template <typename PrimitiveTest>
+  void Bvh::intersectPacket(RayPacket& packet, int activeMask, PrimitiveTest primitiveTest)
+  {
+    if (m_numNodes == 0 || activeMask == 0)
+    {
+      return;
+    }
+
+    // A node is entered while any lane still reaches it
+    uint32_t stack[c_stackSize];
+    uint32_t stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+      const Node& node = m_nodes[stack[--stackSize]];
+      int mask = intersectsBox(packet, node) & activeMask;
+      if (mask == 0)
+      {
+        continue;
+      }
+
+      if (node.m_count > 0)
+      {
+        for (uint32_t i = 0; i < node.m_count; i++)
+        {
+          primitiveTest(m_primitives[node.m_leftOrFirst + i], mask);
+        }
+      }
+      else
+      {
+        stack[stackSize++] = node.m_leftOrFirst + 1;
+        stack[stackSize++] = node.m_leftOrFirst;
+      }
+    }
+  }
+
+  template <typename Visitor>
+  void Bvh::intersectFrustum(const vec4 planes[6], Visitor visit)
+  {
+    if (m_numNodes == 0)
+    {
+      return;
+    }
+
+    uint32_t stack[c_stackSize];
+    bool insideStack[c_stackSize];
+    uint32_t stackSize = 0;
+    stack[stackSize] = 0;
+    insideStack[stackSize++] = false;
+    while (stackSize > 0)
+    {
+      stackSize--;
+      const Node& node = m_nodes[stack[stackSize]];
+      bool inside = insideStack[stackSize];
+      if (!inside)
+      {
+        // Box center and half size against each plane, fully inside once no plane cuts it
+        vec3 center = (node.m_min + node.m_max) * 0.5f;
+        vec3 extent = (node.m_max - node.m_min) * 0.5f;
+        bool outside = false;
+        inside = true;
+        for (int i = 0; i < 6 && !outside; i++)
+        {
+          float d = planes[i].x * center.x + planes[i].y * center.y + planes[i].z * center.z + planes[i].w;
+          float r = fabs(planes[i].x) * extent.x + fabs(planes[i].y) * extent.y + fabs(planes[i].z) * extent.z;
+          outside = d + r < 0.0f;
+          inside = inside && d - r >= 0.0f;
+        }
+        if (outside)
+        {
+          continue;
+        }
+      }
+
+      if (node.m_count > 0)
+      {
+        for (uint32_t i = 0; i < node.m_count; i++)
+        {
+          visit(m_primitives[node.m_leftOrFirst + i], inside);
+        }
+      }
+      else
+      {
+        stack[stackSize] = node.m_leftOrFirst + 1;
+        insideStack[stackSize++] = inside;
+        stack[stackSize] = node.m_leftOrFirst;
+        insideStack[stackSize++] = inside;
+      }
+    }
+  }
+}
@@ -0,0 +1,480 @@
+#include "stdafx.h"
+#include "CookedScene.h"
+
+#include <fstream>
+#include <map>
+#include <set>
+#include <cstring>
+#include <algorithm>
+
+using std::map;
+using std::set;
+using std::make_shared;
+using std::static_pointer_cast;
+
+namespace Bonny
+{
+  // Tables gathered by a depth first walk before the file is laid out
+  struct CookContext
+  {
+    vector<CookedScene::EntityRecord>     m_entities;
+    vector<CookedScene::MeshRecord>       m_meshRecords;
+    vector<shared_ptr<Mesh>>              m_meshes;
+    vector<CookedScene::MaterialRecord>   m_materials;
+    map<Material*, uint32_t>              m_materialIndices;
+    vector<char>                          m_strings;
+    map<string, uint32_t>                 m_stringOffsets;
+  };
+
+  static uint64_t alignOffset(uint64_t offset)
+  {
+    return (offset + CookedScene::c_alignment - 1) & ~(uint64_t)(CookedScene::c_alignment - 1);
+  }
+
+  static uint32_t addString(CookContext& context, const string& s)
+  {
+    map<string, uint32_t>::iterator it = context.m_stringOffsets.find(s);
+    if (it != context.m_stringOffsets.end())
+    {
+      return it->second;
+    }
+    uint32_t offset = (uint32_t)context.m_strings.size();
+    context.m_strings.insert(context.m_strings.end(), s.begin(), s.end());
+    context.m_strings.push_back('\0');
+    context.m_stringOffsets[s] = offset;
+    return offset;
+  }
+
+  static void getFileStamp(const string& path, uint64_t& size, uint64_t& writeTime)
+  {
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes))
+    {
+      size = 0;
+      writeTime = 0;
+      return;
+    }
+    size = ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+    writeTime = ((uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+  }
+
+  static uint32_t addTexture(CookContext& context, shared_ptr<Texture> texture)
+  {
+    return texture != nullptr ? addString(context, texture->getName()) : CookedScene::c_none;
+  }
+
+  static uint32_t addMaterial(CookContext& context, shared_ptr<Material> material)
+  {
+    if (material == nullptr)
+    {
+      return CookedScene::c_none;
+    }
+    map<Material*, uint32_t>::iterator it = context.m_materialIndices.find(material.get());
+    if (it != context.m_materialIndices.end())
+    {
+      return it->second;
+    }
+
+    CookedScene::MaterialRecord record;
+    memset(&record, 0, sizeof(record));
+    record.m_name = addString(context, material->getName());
+    record.m_type = (uint32_t)material->getMaterialType();
+    vec4 albedoColor;
+    vec3 emissiveColor;
+    material->getAlbedoColor(albedoColor);
+    material->getEmissiveColor(emissiveColor);
+    memcpy(record.m_albedoColor, &albedoColor[0], sizeof(record.m_albedoColor));
+    memcpy(record.m_emissiveColor, &emissiveColor[0], sizeof(record.m_emissiveColor));
+    record.m_metallic = material->getMetallic();
+    record.m_roughness = material->getRoughness();
+    record.m_flags = (material->getTwoSided() ? CookedScene::TWO_SIDED : 0) | (material->getLightingEnable() ? CookedScene::LIGHTING_ENABLE : 0) |
+      (material->getBlendEnable() ? CookedScene::BLEND_ENABLE : 0);
+    for (uint32_t i = 0; i < Material::NUM_TEXTURE_SLOTS; i++)
+    {
+      record.m_textures[i] = addTexture(context, material->getTexture((Material::TextureSlot)i));
+    }
+
+    uint32_t index = (uint32_t)context.m_materials.size();
+    context.m_materials.push_back(record);
+    context.m_materialIndices[material.get()] = index;
+    return index;
+  }
+
+  static bool addMesh(CookContext& context, shared_ptr<Mesh> mesh)
+  {
+    if (mesh->getNumBuffers() > CookedScene::c_maxBuffers)
+    {
+      return false;
+    }
+
+    CookedScene::MeshRecord record;
+    memset(&record, 0, sizeof(record));
+    record.m_name = addString(context, mesh->getName());
+    record.m_material = addMaterial(context, mesh->getMaterial());
+    record.m_primitive = (uint32_t)mesh->getPrimitive();
+    record.m_numVerts = (uint32_t)mesh->getNumVerts();
+    record.m_numBuffers = (uint32_t)mesh->getNumBuffers();
+    for (uint32_t i = 0; i < record.m_numBuffers; i++)
+    {
+      CookedScene::BufferRecord& buffer = record.m_buffers[i];
+      buffer.m_attribute = Mesh::NUM_ATTRIBUTES;
+      for (int attribute = 0; attribute < Mesh::NUM_ATTRIBUTES; attribute++)
+      {
+        if (mesh->getAttributeBuffer((Mesh::Attribute)attribute) == (int)i)
+        {
+          buffer.m_attribute = (uint32_t)attribute;
+        }
+      }
+      if (mesh->getVertexBufferData(i) != nullptr)
+      {
+        buffer.m_size = (uint32_t)mesh->getVertexBufferSize(i);
+        buffer.m_numBytes = (uint64_t)record.m_numVerts * buffer.m_size * sizeof(float);
+      }
+    }
+    record.m_numIndices = mesh->getIndexBuffer() != nullptr ? mesh->getIndexBufferSize() : 0;
+    record.m_numLodIndices = mesh->getLodIndexBufferSize();
+    record.m_numLods = mesh->getNumLods();
+    for (uint32_t i = 0; i < record.m_numLods; i++)
+    {
+      record.m_lods[i] = mesh->getLod(i);
+    }
+
+    context.m_meshRecords.push_back(record);
+    context.m_meshes.push_back(mesh);
+    return true;
+  }
+
+  static bool addEntity(CookContext& context, shared_ptr<Entity> entity, uint32_t parent)
+  {
+    uint32_t index = (uint32_t)context.m_entities.size();
+    CookedScene::EntityRecord record;
+    memset(&record, 0, sizeof(record));
+    mat4 transform;
+    entity->getTransform(transform);
+    memcpy(record.m_transform, glm::value_ptr(transform), sizeof(record.m_transform));
+    record.m_name = addString(context, entity->getName());
+    record.m_parent = parent;
+    record.m_firstMesh = (uint32_t)context.m_meshRecords.size();
+    record.m_castShadow = entity->getCastShadow() ? 1 : 0;
+    context.m_entities.push_back(record);
+
+    // Meshes of every render component on the entity end up in one contiguous range
+    for (unsigned int i = 0; i < entity->numComponents(); i++)
+    {
+      shared_ptr<Component> component = entity->getComponent(i);
+      if (component->getType() != Component::RENDER)
+      {
+        continue;
+      }
+      shared_ptr<RenderComponent> renderComponent = static_pointer_cast<RenderComponent>(component);
+      for (size_t j = 0; j < renderComponent->numMeshes(); j++)
+      {
+        if (!addMesh(context, renderComponent->getMesh(j)))
+        {
+          return false;
+        }
+      }
+    }
+    context.m_entities[index].m_numMeshes = (uint32_t)context.m_meshRecords.size() - context.m_entities[index].m_firstMesh;
+
+    for (unsigned int i = 0; i < entity->numChildren(); i++)
+    {
+      if (!addEntity(context, entity->getChild(i), index))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static void writeAt(std::ofstream& file, uint64_t& position, uint64_t offset, const void* data, size_t numBytes)
+  {
+    static const char zeros[CookedScene::c_alignment] = {};
+    while (position < offset)
+    {
+      size_t numPadding = (size_t)std::min<uint64_t>(offset - position, sizeof(zeros));
+      file.write(zeros, numPadding);
+      position += numPadding;
+    }
+    file.write((const char*)data, numBytes);
+    position += numBytes;
+  }
+
+  bool CookedScene::write(const string& filename, shared_ptr<Entity> root, const vector<string>& dependencies, Stats& stats)
+  {
+    memset(&stats, 0, sizeof(stats));
+    CookContext context;
+    if (root == nullptr || !addEntity(context, root, c_none))
+    {
+      return false;
+    }
+    vector<DependencyRecord> dependencyRecords(dependencies.size());
+    for (size_t i = 0; i < dependencies.size(); i++)
+    {
+      DependencyRecord& record = dependencyRecords[i];
+      memset(&record, 0, sizeof(record));
+      record.m_path = addString(context, dependencies[i]);
+      getFileStamp(dependencies[i], record.m_size, record.m_writeTime);
+    }
+
+    // Tables first, then every stream at its own aligned offset
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.m_magic = c_magic;
+    header.m_version = c_version;
+    header.m_headerSize = sizeof(Header);
+    header.m_numEntities = (uint32_t)context.m_entities.size();
+    header.m_numMeshes = (uint32_t)context.m_meshRecords.size();
+    header.m_numMaterials = (uint32_t)context.m_materials.size();
+    header.m_numDependencies = (uint32_t)dependencyRecords.size();
+    header.m_entityOffset = alignOffset(sizeof(Header));
+    header.m_meshOffset = alignOffset(header.m_entityOffset + context.m_entities.size() * sizeof(EntityRecord));
+    header.m_materialOffset = alignOffset(header.m_meshOffset + context.m_meshRecords.size() * sizeof(MeshRecord));
+    header.m_dependencyOffset = alignOffset(header.m_materialOffset + context.m_materials.size() * sizeof(MaterialRecord));
+    header.m_stringOffset = alignOffset(header.m_dependencyOffset + dependencyRecords.size() * sizeof(DependencyRecord));
+    header.m_stringSize = context.m_strings.size();
+    uint64_t offset = header.m_stringOffset + header.m_stringSize;
+    for (size_t i = 0; i < context.m_meshRecords.size(); i++)
+    {
+      MeshRecord& record = context.m_meshRecords[i];
+      for (uint32_t j = 0; j < record.m_numBuffers; j++)
+      {
+        offset = alignOffset(offset);
+        record.m_buffers[j].m_offset = offset;
+        offset += record.m_buffers[j].m_numBytes;
+      }
+      offset = alignOffset(offset);
+      record.m_indexOffset = offset;
+      offset += record.m_numIndices * sizeof(uint32_t);
+      offset = alignOffset(offset);
+      record.m_lodIndexOffset = offset;
+      offset += record.m_numLodIndices * sizeof(uint32_t);
+    }
+    header.m_fileSize = offset;
+
+    // Written next to the target and renamed over it, so a reader never maps a partly written file
+    string tempName = filename + "." + std::to_string(GetCurrentThreadId()) + ".tmp";
+    std::ofstream file(tempName, std::ios::binary);
+    if (!file)
+    {
+      return false;
+    }
+    uint64_t position = 0;
+    writeAt(file, position, 0, &header, sizeof(header));
+    writeAt(file, position, header.m_entityOffset, context.m_entities.data(), context.m_entities.size() * sizeof(EntityRecord));
+    writeAt(file, position, header.m_meshOffset, context.m_meshRecords.data(), context.m_meshRecords.size() * sizeof(MeshRecord));
+    writeAt(file, position, header.m_materialOffset, context.m_materials.data(), context.m_materials.size() * sizeof(MaterialRecord));
+    writeAt(file, position, header.m_dependencyOffset, dependencyRecords.data(), dependencyRecords.size() * sizeof(DependencyRecord));
+    writeAt(file, position, header.m_stringOffset, context.m_strings.data(), context.m_strings.size());
+    for (size_t i = 0; i < context.m_meshRecords.size(); i++)
+    {
+      const MeshRecord& record = context.m_meshRecords[i];
+      shared_ptr<Mesh> mesh = context.m_meshes[i];
+      for (uint32_t j = 0; j < record.m_numBuffers; j++)
+      {
+        writeAt(file, position, record.m_buffers[j].m_offset, mesh->getVertexBufferData(j), (size_t)record.m_buffers[j].m_numBytes);
+      }
+      writeAt(file, position, record.m_indexOffset, mesh->getIndexBuffer(), (size_t)record.m_numIndices * sizeof(uint32_t));
+      writeAt(file, position, record.m_lodIndexOffset, mesh->getLodIndexBuffer(), (size_t)record.m_numLodIndices * sizeof(uint32_t));
+    }
+    writeAt(file, position, header.m_fileSize, nullptr, 0);
+    file.close();
+    if (!file.good() || !MoveFileExA(tempName.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+      DeleteFileA(tempName.c_str());
+      return false;
+    }
+
+    stats.m_fileSize = header.m_fileSize;
+    stats.m_streamBytes = header.m_fileSize - (header.m_stringOffset + header.m_stringSize);
+    stats.m_numEntities = header.m_numEntities;
+    stats.m_numMeshes = header.m_numMeshes;
+    stats.m_numMaterials = header.m_numMaterials;
+    stats.m_numDependencies = header.m_numDependencies;
+    for (size_t i = 0; i < context.m_materials.size(); i++)
+    {
+      for (uint32_t j = 0; j < Material::NUM_TEXTURE_SLOTS; j++)
+      {
+        stats.m_numTextures += context.m_materials[i].m_textures[j] != c_none ? 1 : 0;
+      }
+    }
+    return true;
+  }
+
+  // A table or stream has to lie inside the file and keep its elements aligned
+  static bool validRange(uint64_t offset, uint64_t numBytes, uint64_t fileSize)
+  {
+    return offset % sizeof(uint32_t) == 0 && offset <= fileSize && numBytes <= fileSize - offset;
+  }
+
+  shared_ptr<Entity> CookedScene::read(const string& filename, TextureRequest requestTexture, Stats& stats)
+  {
+    memset(&stats, 0, sizeof(stats));
+    shared_ptr<MappedFile> file = make_shared<MappedFile>();
+    if (!file->open(filename) || file->getSize() < sizeof(Header))
+    {
+      return nullptr;
+    }
+
+    // Anything written by another version or cut short is rejected as a whole
+    uint8_t* data = file->getData();
+    uint64_t fileSize = file->getSize();
+    const Header* header = (const Header*)data;
+    if (header->m_magic != c_magic || header->m_version != c_version || header->m_headerSize != sizeof(Header) || header->m_fileSize != fileSize ||
+      header->m_numEntities == 0 ||
+      !validRange(header->m_entityOffset, (uint64_t)header->m_numEntities * sizeof(EntityRecord), fileSize) ||
+      !validRange(header->m_meshOffset, (uint64_t)header->m_numMeshes * sizeof(MeshRecord), fileSize) ||
+      !validRange(header->m_materialOffset, (uint64_t)header->m_numMaterials * sizeof(MaterialRecord), fileSize) ||
+      !validRange(header->m_dependencyOffset, (uint64_t)header->m_numDependencies * sizeof(DependencyRecord), fileSize) ||
+      !validRange(header->m_stringOffset, header->m_stringSize, fileSize) || header->m_stringSize == 0 ||
+      data[header->m_stringOffset + header->m_stringSize - 1] != '\0')
+    {
+      return nullptr;
+    }
+    const EntityRecord* entityRecords = (const EntityRecord*)(data + header->m_entityOffset);
+    const MeshRecord* meshRecords = (const MeshRecord*)(data + header->m_meshOffset);
+    const MaterialRecord* materialRecords = (const MaterialRecord*)(data + header->m_materialOffset);
+    const DependencyRecord* dependencyRecords = (const DependencyRecord*)(data + header->m_dependencyOffset);
+    const char* strings = (const char*)(data + header->m_stringOffset);
+    auto getString = [&](uint32_t offset)
+    {
+      return string(offset < header->m_stringSize ? strings + offset : "");
+    };
+
+    // The source is covered by the caller's key, the files it pulled in are checked here
+    for (uint32_t i = 0; i < header->m_numDependencies; i++)
+    {
+      uint64_t size = 0;
+      uint64_t writeTime = 0;
+      getFileStamp(getString(dependencyRecords[i].m_path), size, writeTime);
+      if (size != dependencyRecords[i].m_size || writeTime != dependencyRecords[i].m_writeTime)
+      {
+        return nullptr;
+      }
+    }
+
+    // Materials, their textures are only requested and arrive once the caller loaded them
+    set<uint32_t> textures;
+    vector<shared_ptr<Material>> materials(header->m_numMaterials);
+    for (uint32_t i = 0; i < header->m_numMaterials; i++)
+    {
+      const MaterialRecord& record = materialRecords[i];
+      shared_ptr<Material> material = make_shared<Material>(getString(record.m_name), (Material::Type)record.m_type);
+      vec4 albedoColor(record.m_albedoColor[0], record.m_albedoColor[1], record.m_albedoColor[2], record.m_albedoColor[3]);
+      vec3 emissiveColor(record.m_emissiveColor[0], record.m_emissiveColor[1], record.m_emissiveColor[2]);
+      material->setAlbedoColor(albedoColor);
+      material->setEmissiveColor(emissiveColor);
+      material->setMetallic(record.m_metallic);
+      material->setRoughness(record.m_roughness);
+      material->setTwoSided((record.m_flags & TWO_SIDED) != 0);
+      material->setLightingEnable((record.m_flags & LIGHTING_ENABLE) != 0);
+      material->setBlendEnable((record.m_flags & BLEND_ENABLE) != 0);
+
+      for (uint32_t j = 0; j < Material::NUM_TEXTURE_SLOTS; j++)
+      {
+        uint32_t path = record.m_textures[j];
+        if (path != c_none && path < header->m_stringSize)
+        {
+          requestTexture(getString(path), material, (Material::TextureSlot)j);
+          textures.insert(path);
+        }
+      }
+      materials[i] = material;
+    }
+
+    // Meshes reference their streams in the mapping, which they keep alive
+    vector<shared_ptr<Mesh>> meshes(header->m_numMeshes);
+    for (uint32_t i = 0; i < header->m_numMeshes; i++)
+    {
+      const MeshRecord& record = meshRecords[i];
+      if (record.m_numBuffers > c_maxBuffers || record.m_numLods > Mesh::c_maxLods ||
+        (record.m_material != c_none && record.m_material >= header->m_numMaterials) ||
+        !validRange(record.m_indexOffset, record.m_numIndices * sizeof(uint32_t), fileSize) ||
+        !validRange(record.m_lodIndexOffset, record.m_numLodIndices * sizeof(uint32_t), fileSize))
+      {
+        return nullptr;
+      }
+      for (uint32_t j = 0; j < record.m_numLods; j++)
+      {
+        const Mesh::Lod& lod = record.m_lods[j];
+        if ((uint64_t)lod.m_indexStart + lod.m_numIndices > record.m_numIndices + record.m_numLodIndices)
+        {
+          return nullptr;
+        }
+      }
+
+      shared_ptr<Mesh> mesh = make_shared<Mesh>(getString(record.m_name), (Mesh::Primitive)record.m_primitive, record.m_numVerts, record.m_numBuffers);
+      for (uint32_t j = 0; j < record.m_numBuffers; j++)
+      {
+        const BufferRecord& buffer = record.m_buffers[j];
+        if (buffer.m_numBytes == 0)
+        {
+          continue;
+        }
+        if (!validRange(buffer.m_offset, buffer.m_numBytes, fileSize) || buffer.m_numBytes < (uint64_t)record.m_numVerts * buffer.m_size * sizeof(float))
+        {
+          return nullptr;
+        }
+        mesh->setVertexBufferView(j, (Mesh::Attribute)std::min<uint32_t>(buffer.m_attribute, Mesh::NUM_ATTRIBUTES), buffer.m_size,
+          (size_t)buffer.m_numBytes, (float*)(data + buffer.m_offset));
+        stats.m_streamBytes += buffer.m_numBytes;
+      }
+      if (record.m_numIndices > 0)
+      {
+        mesh->setIndexBufferView((size_t)record.m_numIndices, (unsigned int*)(data + record.m_indexOffset));
+      }
+      if (record.m_numLods > 0)
+      {
+        mesh->setLodView(record.m_lods, record.m_numLods, (const unsigned int*)(data + record.m_lodIndexOffset), (size_t)record.m_numLodIndices);
+      }
+      stats.m_streamBytes += (record.m_numIndices + record.m_numLodIndices) * sizeof(uint32_t);
+      mesh->setExternalStorage(file);
+      if (record.m_material != c_none)
+      {
+        mesh->setMaterial(materials[record.m_material]);
+      }
+      meshes[i] = mesh;
+    }
+
+    // Parents precede their children, so every parent already exists
+    vector<shared_ptr<Entity>> entities(header->m_numEntities);
+    for (uint32_t i = 0; i < header->m_numEntities; i++)
+    {
+      const EntityRecord& record = entityRecords[i];
+      if ((i == 0) != (record.m_parent == c_none) || (i > 0 && record.m_parent >= i) || record.m_firstMesh > header->m_numMeshes ||
+        record.m_numMeshes > header->m_numMeshes - record.m_firstMesh)
+      {
+        return nullptr;
+      }
+
+      shared_ptr<Entity> entity = make_shared<Entity>(getString(record.m_name));
+      if (record.m_numMeshes > 0)
+      {
+        shared_ptr<RenderComponent> renderComponent = make_shared<RenderComponent>(getString(record.m_name));
+        for (uint32_t j = 0; j < record.m_numMeshes; j++)
+        {
+          renderComponent->addMesh(meshes[record.m_firstMesh + j]);
+        }
+        entity->addComponent(renderComponent);
+      }
+      entity->setTransform(glm::make_mat4(record.m_transform));
+      if (record.m_castShadow == 0)
+      {
+        entity->setCastShadow(false);
+      }
+      if (i > 0)
+      {
+        entities[record.m_parent]->addChild(entity);
+      }
+      entities[i] = entity;
+    }
+
+    stats.m_fileSize = fileSize;
+    stats.m_numEntities = header->m_numEntities;
+    stats.m_numMeshes = header->m_numMeshes;
+    stats.m_numMaterials = header->m_numMaterials;
+    stats.m_numTextures = (uint32_t)textures.size();
+    stats.m_numDependencies = header->m_numDependencies;
+    return entities[0];
+  }
+}
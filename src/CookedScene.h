@@ -0,0 +1,143 @@
+#pragma once
+
+#include "Entity.h"
+#include "Mesh.h"
+#include "Material.h"
+#include "Texture.h"
+#include "RenderComponent.h"
+#include "MappedFile.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+using std::function;
+
+namespace Bonny
+{
+  // Binary snapshot of a loaded model: the entity hierarchy, the mesh streams with
+  // their LODs, material parameters and texture paths. The file is read through a
+  // mapping and meshes point straight at their streams in it, so loading is a
+  // handful of table walks with no parsing and no copies of the geometry.
+  //
+  // Layout, little endian, every table and stream 16 byte aligned:
+  //   Header | EntityRecord[] | MeshRecord[] | MaterialRecord[] | DependencyRecord[] | strings | streams
+  // Entities are stored depth first, a parent always comes before its children.
+  // Names and paths are offsets into the zero terminated string table.
+  // Dependencies are the other files the scene was built from, like material
+  // libraries and textures, with their size and write time. A file whose
+  // dependencies changed since is rejected like one of another version.
+  class CookedScene
+  {
+  public:
+    static const uint32_t c_magic = 0x43594e42;   // "BNYC"
+    static const uint32_t c_version = 2;
+    static const uint32_t c_alignment = 16;
+    static const uint32_t c_maxBuffers = 8;
+    static const uint32_t c_none = 0xffffffff;
+
+    enum MaterialFlags
+    {
+      TWO_SIDED = 1,
+      LIGHTING_ENABLE = 2,
+      BLEND_ENABLE = 4
+    };
+
+    struct Header
+    {
+      uint32_t  m_magic;
+      uint32_t  m_version;
+      uint32_t  m_headerSize;
+      uint32_t  m_numEntities;
+      uint32_t  m_numMeshes;
+      uint32_t  m_numMaterials;
+      uint32_t  m_numDependencies;
+      uint32_t  m_pad;
+      uint64_t  m_entityOffset;
+      uint64_t  m_meshOffset;
+      uint64_t  m_materialOffset;
+      uint64_t  m_dependencyOffset;
+      uint64_t  m_stringOffset;
+      uint64_t  m_stringSize;
+      uint64_t  m_fileSize;
+    };
+
+    struct EntityRecord
+    {
+      float     m_transform[16];
+      uint32_t  m_name;
+      uint32_t  m_parent;
+      uint32_t  m_firstMesh;
+      uint32_t  m_numMeshes;
+      uint32_t  m_castShadow;
+      uint32_t  m_pad[3];
+    };
+
+    struct BufferRecord
+    {
+      uint32_t  m_attribute;
+      uint32_t  m_size;
+      uint64_t  m_offset;
+      uint64_t  m_numBytes;
+    };
+
+    struct MeshRecord
+    {
+      uint32_t      m_name;
+      uint32_t      m_material;
+      uint32_t      m_primitive;
+      uint32_t      m_numVerts;
+      uint32_t      m_numBuffers;
+      uint32_t      m_numLods;
+      uint64_t      m_numIndices;
+      uint64_t      m_indexOffset;
+      uint64_t      m_numLodIndices;
+      uint64_t      m_lodIndexOffset;
+      BufferRecord  m_buffers[c_maxBuffers];
+      Mesh::Lod     m_lods[Mesh::c_maxLods];
+    };
+
+    struct MaterialRecord
+    {
+      uint32_t  m_name;
+      uint32_t  m_type;
+      float     m_albedoColor[4];
+      float     m_emissiveColor[3];
+      float     m_metallic;
+      float     m_roughness;
+      uint32_t  m_flags;
+      uint32_t  m_textures[Material::NUM_TEXTURE_SLOTS];
+      uint32_t  m_pad;
+    };
+
+    // Size and write time are zero for a file that didn't exist
+    struct DependencyRecord
+    {
+      uint32_t  m_path;
+      uint32_t  m_pad;
+      uint64_t  m_size;
+      uint64_t  m_writeTime;
+    };
+
+    struct Stats
+    {
+      uint64_t  m_fileSize;
+      uint64_t  m_streamBytes;
+      uint32_t  m_numEntities;
+      uint32_t  m_numMeshes;
+      uint32_t  m_numMaterials;
+      uint32_t  m_numTextures;
+      uint32_t  m_numDependencies;
+    };
+
+    // Called once per texture reference, the material is filled in by the caller
+    typedef function<void(const string& path, shared_ptr<Material> material, Material::TextureSlot slot)> TextureRequest;
+
+    static bool               write(const string& filename, shared_ptr<Entity> root, const vector<string>& dependencies, Stats& stats);
+    static shared_ptr<Entity> read(const string& filename, TextureRequest requestTexture, Stats& stats);
+  };
+}
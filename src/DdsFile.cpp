@@ -0,0 +1,185 @@
+#include "stdafx.h"
+#include "DdsFile.h"
+
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+using std::make_shared;
+
+namespace Bonny
+{
+  static const uint32_t c_ddsMagic = 0x20534444;
+  static const uint32_t c_dx10FourCC = 0x30315844;
+  static const uint32_t c_bonnyTag = 0x594e4e42;
+  static const uint32_t c_ddsHeaderSize = 124;
+
+  static const uint32_t c_ddsdCaps = 0x1;
+  static const uint32_t c_ddsdHeight = 0x2;
+  static const uint32_t c_ddsdWidth = 0x4;
+  static const uint32_t c_ddsdPixelFormat = 0x1000;
+  static const uint32_t c_ddsdMipMapCount = 0x20000;
+  static const uint32_t c_ddsdLinearSize = 0x80000;
+  static const uint32_t c_ddpfFourCC = 0x4;
+  static const uint32_t c_ddsCapsComplex = 0x8;
+  static const uint32_t c_ddsCapsTexture = 0x1000;
+  static const uint32_t c_ddsCapsMipMap = 0x400000;
+  static const uint32_t c_dimensionTexture2D = 3;
+
+  // DXGI_FORMAT values, the second of each pair is the sRGB variant
+  static const uint32_t c_dxgiFormats[Texture::NUM_COMPRESSIONS][2] =
+  {
+    { 28, 29 },
+    { 71, 72 },
+    { 77, 78 },
+    { 83, 83 },
+    { 98, 99 }
+  };
+
+  struct DdsPixelFormat
+  {
+    uint32_t  m_size;
+    uint32_t  m_flags;
+    uint32_t  m_fourCC;
+    uint32_t  m_rgbBitCount;
+    uint32_t  m_masks[4];
+  };
+
+  struct DdsHeader
+  {
+    uint32_t        m_magic;
+    uint32_t        m_size;
+    uint32_t        m_flags;
+    uint32_t        m_height;
+    uint32_t        m_width;
+    uint32_t        m_linearSize;
+    uint32_t        m_depth;
+    uint32_t        m_numMips;
+    uint32_t        m_reserved[11];
+    DdsPixelFormat  m_pixelFormat;
+    uint32_t        m_caps[4];
+    uint32_t        m_reserved2;
+    uint32_t        m_dxgiFormat;
+    uint32_t        m_dimension;
+    uint32_t        m_miscFlags;
+    uint32_t        m_arraySize;
+    uint32_t        m_miscFlags2;
+  };
+
+  static_assert(sizeof(DdsHeader) == sizeof(uint32_t) + c_ddsHeaderSize + 5 * sizeof(uint32_t), "DDS header layout");
+  static_assert(sizeof(DdsHeader) == DdsFile::c_dataOffset, "DDS data offset");
+
+  // Reserved words used for the texture usage and the layout version
+  static const uint32_t c_tagWord = 8;
+  static const uint32_t c_versionWord = 9;
+  static const uint32_t c_usageWord = 10;
+
+  bool DdsFile::write(const string& filename, uint32_t width, uint32_t height, Texture::Usage usage,
+    const TextureProcessor::Result& result, size_t& numBytes)
+  {
+    numBytes = 0;
+    if (result.m_mips.empty())
+    {
+      return false;
+    }
+
+    DdsHeader header;
+    memset(&header, 0, sizeof(header));
+    header.m_magic = c_ddsMagic;
+    header.m_size = c_ddsHeaderSize;
+    header.m_flags = c_ddsdCaps | c_ddsdHeight | c_ddsdWidth | c_ddsdPixelFormat | c_ddsdMipMapCount | c_ddsdLinearSize;
+    header.m_height = height;
+    header.m_width = width;
+    header.m_linearSize = (uint32_t)result.m_mips[0].m_size;
+    header.m_numMips = (uint32_t)result.m_mips.size();
+    header.m_reserved[c_tagWord] = c_bonnyTag;
+    header.m_reserved[c_versionWord] = c_version;
+    header.m_reserved[c_usageWord] = usage;
+    header.m_pixelFormat.m_size = sizeof(DdsPixelFormat);
+    header.m_pixelFormat.m_flags = c_ddpfFourCC;
+    header.m_pixelFormat.m_fourCC = c_dx10FourCC;
+    header.m_caps[0] = c_ddsCapsTexture | (result.m_mips.size() > 1 ? c_ddsCapsComplex | c_ddsCapsMipMap : 0);
+    header.m_dxgiFormat = c_dxgiFormats[result.m_compression][usage == Texture::USAGE_COLOR ? 1 : 0];
+    header.m_dimension = c_dimensionTexture2D;
+    header.m_arraySize = 1;
+
+    // Written next to the target and renamed over it, so a reader never maps a partly written file
+    string tempName = filename + "." + std::to_string(GetCurrentThreadId()) + ".tmp";
+    std::ofstream file(tempName, std::ios::binary);
+    if (!file.is_open())
+    {
+      return false;
+    }
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)result.m_data.data(), result.m_data.size());
+    file.close();
+    if (!file.good() || !MoveFileExA(tempName.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+      DeleteFileA(tempName.c_str());
+      return false;
+    }
+    numBytes = sizeof(header) + result.m_data.size();
+    return true;
+  }
+
+  shared_ptr<Texture> DdsFile::read(const string& filename, const string& name, int format, size_t& numBytes)
+  {
+    numBytes = 0;
+    shared_ptr<MappedFile> file = make_shared<MappedFile>();
+    if (!file->open(filename) || file->getSize() < sizeof(DdsHeader))
+    {
+      return nullptr;
+    }
+
+    // Only files this class wrote are accepted, anything else is treated as a miss
+    DdsHeader header;
+    memcpy(&header, file->getData(), sizeof(header));
+    if (header.m_magic != c_ddsMagic || header.m_pixelFormat.m_fourCC != c_dx10FourCC || header.m_reserved[c_tagWord] != c_bonnyTag ||
+        header.m_reserved[c_versionWord] != c_version || header.m_reserved[c_usageWord] > Texture::USAGE_DATA ||
+        header.m_width == 0 || header.m_height == 0 || header.m_numMips == 0 || header.m_numMips > 32)
+    {
+      return nullptr;
+    }
+
+    Texture::Usage usage = (Texture::Usage)header.m_reserved[c_usageWord];
+    Texture::Compression compression = Texture::NUM_COMPRESSIONS;
+    for (uint32_t i = 0; i < Texture::NUM_COMPRESSIONS; i++)
+    {
+      if (c_dxgiFormats[i][usage == Texture::USAGE_COLOR ? 1 : 0] == header.m_dxgiFormat)
+      {
+        compression = (Texture::Compression)i;
+      }
+    }
+    if (compression == Texture::NUM_COMPRESSIONS)
+    {
+      return nullptr;
+    }
+
+    vector<Texture::Mip> mips;
+    uint32_t width = header.m_width;
+    uint32_t height = header.m_height;
+    size_t offset = 0;
+    for (uint32_t level = 0; level < header.m_numMips; level++)
+    {
+      Texture::Mip mip;
+      mip.m_width = width;
+      mip.m_height = height;
+      mip.m_offset = offset;
+      mip.m_size = TextureProcessor::getLevelSize(compression, width, height);
+      offset += mip.m_size;
+      mips.push_back(mip);
+      width = std::max(width / 2, 1u);
+      height = std::max(height / 2, 1u);
+    }
+    if (sizeof(DdsHeader) + offset > file->getSize())
+    {
+      return nullptr;
+    }
+
+    shared_ptr<Texture> texture = make_shared<Texture>(name, header.m_width, header.m_height, 1, 4, (size_t)header.m_width * header.m_height * 4, format);
+    texture->setUsage(usage);
+    texture->setMipSource(compression, mips, file, sizeof(DdsHeader));
+    numBytes = sizeof(DdsHeader) + offset;
+    return texture;
+  }
+}
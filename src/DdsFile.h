@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Texture.h"
+#include "TextureProcessor.h"
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+using std::string;
+using std::shared_ptr;
+
+namespace Bonny
+{
+  // Processed textures as DDS files with the DX10 header extension, every mip
+  // level stored back to back. The texture usage is kept in reserved header
+  // words so uncompressed normal and data maps can be told apart. Reading maps
+  // the file and leaves every level on disk, the mapping becomes the texture's
+  // stream source and levels are copied in as the residency manager asks.
+  // The mip data of a file starts at c_dataOffset.
+  class DdsFile
+  {
+  public:
+    static const uint32_t   c_version = 1;
+    static const size_t     c_dataOffset = 148;
+
+    static bool               write(const string& filename, uint32_t width, uint32_t height, Texture::Usage usage,
+                                const TextureProcessor::Result& result, size_t& numBytes);
+    static shared_ptr<Texture> read(const string& filename, const string& name, int format, size_t& numBytes);
+  };
+}
@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include "Entity.h"
 #include "LightComponent.h"
+#include "TransformHierarchy.h"
 
 using std::static_pointer_cast;
 
@@ -8,12 +9,23 @@ namespace Bonny
 {
   Entity::Entity(string name) : 
     m_name(name),
-    m_castShadow(true)
+    m_castShadow(true),
+    m_transformHierarchy(nullptr),
+    m_transformIndex(0)
   {
   }
 
   Entity::~Entity()
   {
+    if (m_transformHierarchy != nullptr)
+    {
+      m_transformHierarchy->clear();
+    }
+  }
+
+  const string& Entity::getName()
+  {
+    return m_name;
   }
 
   void Entity::setCastShadow(bool castShadow)
@@ -63,10 +75,18 @@ namespace Bonny
   void Entity::addChild(shared_ptr<Entity> entity)
   {
     m_children.push_back(entity);
+    if (m_transformHierarchy != nullptr)
+    {
+      m_transformHierarchy->clear();
+    }
   }
 
   void Entity::removeChild(shared_ptr<Entity> entity)
   {
+    if (m_transformHierarchy != nullptr)
+    {
+      m_transformHierarchy->clear();
+    }
     for (vector<shared_ptr<Entity>>::iterator it = m_children.begin(); it != m_children.end(); ++it)
     {
       if (*it == entity)
@@ -89,7 +109,14 @@ namespace Bonny
 
   void Entity::setTransform(const mat4& transform)
   {
-    m_transform = transform;
+    if (m_transformHierarchy != nullptr)
+    {
+      m_transformHierarchy->setLocalTransform(m_transformIndex, transform);
+    }
+    else
+    {
+      m_transform = transform;
+    }
     for (size_t i = 0; i < m_components.size(); ++i)
     {
       if (m_components[i]->getType() == Component::LIGHT)
@@ -101,16 +128,64 @@ namespace Bonny
 
   void Entity::getTransform(mat4& transform)
   {
-    transform = m_transform;
+    if (m_transformHierarchy != nullptr)
+    {
+      transform = m_transformHierarchy->getLocalTransform(m_transformIndex);
+    }
+    else
+    {
+      transform = m_transform;
+    }
   }
 
   void Entity::getCompositeTransform(mat4& transform)
   {
-    transform = m_compositeTransform;
+    if (m_transformHierarchy != nullptr)
+    {
+      transform = m_transformHierarchy->getWorldTransform(m_transformIndex);
+    }
+    else
+    {
+      transform = m_compositeTransform;
+    }
   }
 
   void Entity::updateCompositeTransform(mat4& parent)
   {
-    m_compositeTransform = parent * m_transform;
+    if (m_transformHierarchy != nullptr)
+    {
+      m_transformHierarchy->setWorldTransform(m_transformIndex, parent * m_transformHierarchy->getLocalTransform(m_transformIndex));
+    }
+    else
+    {
+      m_compositeTransform = parent * m_transform;
+    }
+  }
+
+  uint32_t Entity::getTransformVersion()
+  {
+    // Zero means unknown, entities outside the hierarchy are treated as always moving
+    if (m_transformHierarchy != nullptr)
+    {
+      return m_transformHierarchy->getVersion(m_transformIndex);
+    }
+    return 0;
+  }
+
+  void Entity::attachTransform(TransformHierarchy* transformHierarchy, uint32_t index)
+  {
+    m_transformHierarchy = transformHierarchy;
+    m_transformIndex = index;
+  }
+
+  void Entity::detachTransform()
+  {
+    if (m_transformHierarchy != nullptr)
+    {
+      m_transform = m_transformHierarchy->getLocalTransform(m_transformIndex);
+      m_compositeTransform = m_transformHierarchy->getWorldTransform(m_transformIndex);
+      m_transformHierarchy = nullptr;
+      m_transformIndex = 0;
+    }
   }
 }
@@ -21,6 +21,7 @@ using std::enable_shared_from_this;
 namespace Bonny
 {
   class Component;
+  class TransformHierarchy;
 
   class Entity: public enable_shared_from_this<Entity>
   {
@@ -28,6 +29,7 @@ namespace Bonny
     Entity(string name);
     ~Entity();
 
+    const string&           getName();
     void                    setCastShadow(bool castShadow);
     bool                    getCastShadow();
     void                    addComponent(shared_ptr<Component> component);
@@ -46,6 +48,11 @@ namespace Bonny
 
     void                    updateCompositeTransform(mat4& parent);
 
+    uint32_t                getTransformVersion();
+
+    void                    attachTransform(TransformHierarchy* transformHierarchy, uint32_t index);
+    void                    detachTransform();
+
   private:
     string                          m_name;
     bool                            m_castShadow;
@@ -55,6 +62,10 @@ namespace Bonny
 
     mat4                            m_transform;
     mat4                            m_compositeTransform; 
+
+    // When attached the transforms live in the hierarchy instead of the members above
+    TransformHierarchy*             m_transformHierarchy;
+    uint32_t                        m_transformIndex;
   };
 }
 
@@ -142,8 +142,6 @@ namespace Bonny
   void FirstPersonProcessor::printLog(string s)
   {
     string st = s + "\n";
-    TCHAR name[256];
-    _tcscpy_s(name, CA2T(st.c_str()));
-    OutputDebugString(name);
+    OutputDebugString(CA2T(st.c_str()));
   }
 }
@@ -0,0 +1,551 @@
+#include "stdafx.h"
+#include "GeometryPacker.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using std::memset;
+
+namespace Bonny
+{
+  // Floats per vertex of the full position, normal, texcoord and tangent layout
+  static const uint32_t c_fullLayoutFloats = 11;
+
+  // Interleaves one mesh's vertices, the attribute set is fixed at compile time so
+  // each layout gets its own loop without per vertex branches. Sources are the
+  // position, normal, texcoord and tangent buffers with their strides in floats.
+  // Full precision copies are exact, the range and report are only used by the
+  // quantizing kernels that share the signature.
+  template <bool HasNormal, bool HasTexCoord, bool HasTangent>
+  static void copyVertices(const float* const* sources, const size_t* strides, size_t numVerts, const GeometryPacker::MeshRange& /*range*/,
+    uint8_t* destinationBytes, GeometryPacker::MeshReport& /*report*/)
+  {
+    const float* positions = sources[0];
+    const float* normals = sources[1];
+    const float* texCoords = sources[2];
+    const float* tangents = sources[3];
+    float* destination = (float*)destinationBytes;
+    for (size_t k = 0; k < numVerts; ++k)
+    {
+      *destination++ = positions[k * strides[0] + 0];
+      *destination++ = positions[k * strides[0] + 1];
+      *destination++ = positions[k * strides[0] + 2];
+      if (HasNormal)
+      {
+        *destination++ = normals[k * strides[1] + 0];
+        *destination++ = normals[k * strides[1] + 1];
+        *destination++ = normals[k * strides[1] + 2];
+      }
+      if (HasTexCoord)
+      {
+        *destination++ = texCoords[k * strides[2] + 0];
+        *destination++ = texCoords[k * strides[2] + 1];
+      }
+      if (HasTangent)
+      {
+        *destination++ = tangents[k * strides[3] + 0];
+        *destination++ = tangents[k * strides[3] + 1];
+        *destination++ = tangents[k * strides[3] + 2];
+      }
+    }
+  }
+
+  static uint16_t floatToHalf(float value)
+  {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t floatExponent = (bits >> 23) & 0xff;
+    uint32_t mantissa = bits & 0x7fffff;
+    int32_t exponent = (int32_t)floatExponent - 127 + 15;
+    if (floatExponent == 0xff)
+    {
+      return (uint16_t)(sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0));
+    }
+    if (exponent >= 31)
+    {
+      return (uint16_t)(sign | 0x7c00);
+    }
+
+    // Round to nearest even, a carry out of the mantissa correctly bumps the exponent
+    uint32_t half;
+    uint32_t rest;
+    uint32_t halfway;
+    if (exponent <= 0)
+    {
+      if (exponent < -10)
+      {
+        return (uint16_t)sign;
+      }
+      uint32_t shift = (uint32_t)(14 - exponent);
+      mantissa |= 0x800000;
+      half = mantissa >> shift;
+      rest = mantissa & ((1u << shift) - 1);
+      halfway = 1u << (shift - 1);
+    }
+    else
+    {
+      half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+      rest = mantissa & 0x1fff;
+      halfway = 0x1000;
+    }
+    if (rest > halfway || (rest == halfway && (half & 1)))
+    {
+      half++;
+    }
+    return (uint16_t)(sign | half);
+  }
+
+  static float halfToFloat(uint16_t half)
+  {
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    if (exponent == 0)
+    {
+      float value = (float)mantissa * (1.0f / 16777216.0f);
+      return sign ? -value : value;
+    }
+
+    uint32_t bits = sign | (exponent == 31 ? 0x7f800000 : (exponent + 112) << 23) | (mantissa << 13);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+  static int16_t quantizeSnorm16(float value)
+  {
+    value = std::min(std::max(value, -1.0f), 1.0f);
+    return (int16_t)(value >= 0.0f ? value * 32767.0f + 0.5f : value * 32767.0f - 0.5f);
+  }
+
+  static uint16_t quantizeUnorm16(float value)
+  {
+    value = std::min(std::max(value, 0.0f), 1.0f);
+    return (uint16_t)(value * 65535.0f + 0.5f);
+  }
+
+  // Unit vector folded onto the octahedron and flattened to two components
+  static void encodeOctahedral(const vec3& direction, int16_t* destination)
+  {
+    float sum = fabs(direction.x) + fabs(direction.y) + fabs(direction.z);
+    float x = sum > 0.0f ? direction.x / sum : 0.0f;
+    float y = sum > 0.0f ? direction.y / sum : 0.0f;
+    if (direction.z < 0.0f)
+    {
+      float foldedX = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+      float foldedY = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+      x = foldedX;
+      y = foldedY;
+    }
+    destination[0] = quantizeSnorm16(x);
+    destination[1] = quantizeSnorm16(y);
+  }
+
+  static vec3 decodeOctahedral(const int16_t* source)
+  {
+    float x = std::max(source[0] / 32767.0f, -1.0f);
+    float y = std::max(source[1] / 32767.0f, -1.0f);
+    float z = 1.0f - fabs(x) - fabs(y);
+    if (z < 0.0f)
+    {
+      float unfoldedX = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+      float unfoldedY = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+      x = unfoldedX;
+      y = unfoldedY;
+    }
+    return glm::normalize(vec3(x, y, z));
+  }
+
+  // Angle in degrees between a source direction and its decoded octahedral encoding
+  static float octahedralError(const vec3& direction, const int16_t* encoded)
+  {
+    float length = glm::length(direction);
+    if (length <= 0.0f)
+    {
+      return 0.0f;
+    }
+    // atan2 keeps its precision for the tiny angles acos of a float dot product loses
+    vec3 decoded = decodeOctahedral(encoded);
+    return atan2(glm::length(glm::cross(direction, decoded)), glm::dot(direction, decoded)) * 57.2957795f;
+  }
+
+  // Quantizing counterpart of copyVertices, every attribute is decoded again to
+  // measure the error the mesh ends up with
+  template <bool HasNormal, bool HasTexCoord, bool HasTangent>
+  static void quantizeVertices(const float* const* sources, const size_t* strides, size_t numVerts, const GeometryPacker::MeshRange& range,
+    uint8_t* destinationBytes, GeometryPacker::MeshReport& report)
+  {
+    const float* positions = sources[0];
+    const float* normals = sources[1];
+    const float* texCoords = sources[2];
+    const float* tangents = sources[3];
+    const vec3& offset = range.m_positionOffset;
+    const vec3& scale = range.m_positionScale;
+    vec3 inverseScale(scale.x > 0.0f ? 1.0f / scale.x : 0.0f, scale.y > 0.0f ? 1.0f / scale.y : 0.0f, scale.z > 0.0f ? 1.0f / scale.z : 0.0f);
+    uint16_t* destination = (uint16_t*)destinationBytes;
+    for (size_t k = 0; k < numVerts; ++k)
+    {
+      vec3 position(positions[k * strides[0] + 0], positions[k * strides[0] + 1], positions[k * strides[0] + 2]);
+      destination[0] = quantizeUnorm16((position.x - offset.x) * inverseScale.x);
+      destination[1] = quantizeUnorm16((position.y - offset.y) * inverseScale.y);
+      destination[2] = quantizeUnorm16((position.z - offset.z) * inverseScale.z);
+      destination[3] = 0;
+      vec3 decoded = offset + vec3(destination[0], destination[1], destination[2]) * (1.0f / 65535.0f) * scale;
+      report.m_maxPositionError = std::max(report.m_maxPositionError, glm::length(decoded - position));
+      destination += 4;
+
+      if (HasNormal)
+      {
+        vec3 normal(normals[k * strides[1] + 0], normals[k * strides[1] + 1], normals[k * strides[1] + 2]);
+        encodeOctahedral(normal, (int16_t*)destination);
+        report.m_maxNormalError = std::max(report.m_maxNormalError, octahedralError(normal, (int16_t*)destination));
+        destination += 2;
+      }
+      if (HasTexCoord)
+      {
+        float u = texCoords[k * strides[2] + 0];
+        float v = texCoords[k * strides[2] + 1];
+        destination[0] = floatToHalf(u);
+        destination[1] = floatToHalf(v);
+        float error = std::max(fabs(halfToFloat(destination[0]) - u), fabs(halfToFloat(destination[1]) - v));
+        report.m_maxTexCoordError = std::max(report.m_maxTexCoordError, error);
+        destination += 2;
+      }
+      if (HasTangent)
+      {
+        vec3 tangent(tangents[k * strides[3] + 0], tangents[k * strides[3] + 1], tangents[k * strides[3] + 2]);
+        encodeOctahedral(tangent, (int16_t*)destination);
+        report.m_maxTangentError = std::max(report.m_maxTangentError, octahedralError(tangent, (int16_t*)destination));
+        destination += 2;
+      }
+    }
+  }
+
+  typedef void (*PackVerticesKernel)(const float* const* sources, const size_t* strides, size_t numVerts, const GeometryPacker::MeshRange& range,
+    uint8_t* destination, GeometryPacker::MeshReport& report);
+
+  // Indexed by vertex format
+  static const PackVerticesKernel c_packVerticesKernels[GeometryPacker::NUM_VERTEX_FORMATS] =
+  {
+    copyVertices<false, false, false>,
+    copyVertices<true, false, false>,
+    copyVertices<false, true, false>,
+    copyVertices<true, true, false>,
+    copyVertices<false, false, true>,
+    copyVertices<true, false, true>,
+    copyVertices<false, true, true>,
+    copyVertices<true, true, true>,
+    quantizeVertices<false, false, false>,
+    quantizeVertices<true, false, false>,
+    quantizeVertices<false, true, false>,
+    quantizeVertices<true, true, false>,
+    quantizeVertices<false, false, true>,
+    quantizeVertices<true, false, true>,
+    quantizeVertices<false, true, true>,
+    quantizeVertices<true, true, true>
+  };
+
+  GeometryPacker::GeometryPacker() :
+    m_numVertices(0),
+    m_quantizeVertices(false)
+  {
+    memset(&m_stats, 0, sizeof(m_stats));
+  }
+
+
+  GeometryPacker::~GeometryPacker()
+  {
+  }
+
+  void GeometryPacker::build(vector<shared_ptr<RenderComponent>>& renderComponents)
+  {
+    clear();
+    append(renderComponents);
+  }
+
+  size_t GeometryPacker::append(vector<shared_ptr<RenderComponent>>& renderComponents)
+  {
+    // First pass sizes the new ranges behind the packed ones, 32 bit index ranges may need 2 bytes of padding in front.
+    // A mesh shared by several components, or already packed by an earlier call, keeps its one range.
+    size_t firstMesh = m_meshes.size();
+    size_t vertexBytes = m_vertexData.size();
+    size_t indexBytes = m_indexData.size();
+    for (size_t i = 0; i < renderComponents.size(); ++i)
+    {
+      for (size_t j = 0; j < renderComponents[i]->numMeshes(); ++j)
+      {
+        shared_ptr<Mesh> mesh = renderComponents[i]->getMesh(j);
+        if (m_meshIndices.find(mesh.get()) != m_meshIndices.end())
+        {
+          continue;
+        }
+        MeshRange range;
+        range.m_vertexStart = m_numVertices;
+        range.m_numVertices = (uint32_t)mesh->getNumVerts();
+        range.m_vertexFormat = selectVertexFormat(mesh) | (m_quantizeVertices ? VERTEX_QUANTIZED : 0);
+        range.m_positionOffset = vec3(0.0f);
+        range.m_positionScale = vec3(0.0f);
+        if (mesh->hasBounds())
+        {
+          vec3 boundsMin, boundsMax;
+          mesh->getLocalBounds(boundsMin, boundsMax);
+          range.m_positionOffset = boundsMin;
+          range.m_positionScale = boundsMax - boundsMin;
+        }
+        range.m_vertexStride = getVertexStride(range.m_vertexFormat);
+        range.m_vertexOffset = (uint32_t)vertexBytes;
+        vertexBytes += range.m_numVertices * range.m_vertexStride;
+        range.m_numIndices = (uint32_t)mesh->getIndexBufferSize();
+        range.m_numLodIndices = (uint32_t)mesh->getLodIndexBufferSize();
+        range.m_indexSize = selectIndexSize(range.m_numVertices);
+        indexBytes = (indexBytes + range.m_indexSize - 1) & ~(size_t)(range.m_indexSize - 1);
+        range.m_indexOffset = (uint32_t)indexBytes;
+        range.m_indexStart = range.m_indexOffset / range.m_indexSize;
+        indexBytes += (range.m_numIndices + range.m_numLodIndices) * range.m_indexSize;
+
+        m_meshIndices[mesh.get()] = m_meshes.size();
+        m_meshes.push_back(mesh);
+        m_ranges.push_back(range);
+        m_numVertices += range.m_numVertices;
+      }
+    }
+
+    m_vertexData.resize(vertexBytes);
+    m_indexData.resize(indexBytes, 0);
+    m_reports.resize(m_meshes.size());
+    for (size_t i = firstMesh; i < m_meshes.size(); ++i)
+    {
+      packIndices(i);
+      packVertices(i);
+    }
+
+    m_stats.m_numMeshes = (uint32_t)m_meshes.size();
+    m_stats.m_numVertices = m_numVertices;
+    m_stats.m_indexBytes = m_indexData.size();
+    m_stats.m_vertexBytes = m_vertexData.size();
+    m_stats.m_vertexBytesFullLayout = (uint64_t)m_numVertices * c_fullLayoutFloats * sizeof(float);
+    for (size_t i = firstMesh; i < m_ranges.size(); ++i)
+    {
+      const MeshReport& report = m_reports[i];
+      if (report.m_indexSize == sizeof(uint16_t))
+      {
+        m_stats.m_num16BitMeshes++;
+      }
+      else
+      {
+        m_stats.m_num32BitMeshes++;
+      }
+      if (report.m_numInvalidIndices > 0)
+      {
+        m_stats.m_numInvalidMeshes++;
+      }
+      m_stats.m_numIndices += report.m_numIndices;
+      m_stats.m_numLodIndices += m_ranges[i].m_numLodIndices;
+      m_stats.m_numMeshesPerFormat[m_ranges[i].m_vertexFormat]++;
+    }
+    m_stats.m_indexBytesAll32Bit = (m_stats.m_numIndices + m_stats.m_numLodIndices) * sizeof(uint32_t);
+    return firstMesh;
+  }
+
+  void GeometryPacker::packVertices(size_t meshIndex)
+  {
+    shared_ptr<Mesh> mesh = m_meshes[meshIndex];
+    const MeshRange& range = m_ranges[meshIndex];
+    if (range.m_numVertices == 0)
+    {
+      return;
+    }
+
+    // Only buffers that are part of the format are read
+    const float* sources[4] = { mesh->getVertexBufferData(0), nullptr, nullptr, nullptr };
+    size_t strides[4] = { mesh->getVertexBufferSize(0), 0, 0, 0 };
+    if (sources[0] == nullptr || strides[0] < 3)
+    {
+      memset(&m_vertexData[range.m_vertexOffset], 0, range.m_numVertices * range.m_vertexStride);
+      return;
+    }
+    const Mesh::Attribute attributes[3] = { Mesh::NORMAL, Mesh::TEXCOORD, Mesh::TANGENT };
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+      if (range.m_vertexFormat & (1 << i))
+      {
+        size_t buffer = (size_t)mesh->getAttributeBuffer(attributes[i]);
+        sources[i + 1] = mesh->getVertexBufferData(buffer);
+        strides[i + 1] = mesh->getVertexBufferSize(buffer);
+      }
+    }
+
+    uint8_t* destination = &m_vertexData[range.m_vertexOffset];
+    c_packVerticesKernels[range.m_vertexFormat](sources, strides, range.m_numVertices, range, destination, m_reports[meshIndex]);
+  }
+
+  void GeometryPacker::packIndices(size_t meshIndex)
+  {
+    shared_ptr<Mesh> mesh = m_meshes[meshIndex];
+    const MeshRange& range = m_ranges[meshIndex];
+    const unsigned int* meshIndexData = mesh->getIndexBuffer();
+    const unsigned int* lodIndexData = mesh->getLodIndexBuffer();
+
+    MeshReport& report = m_reports[meshIndex];
+    report.m_name = mesh->getName();
+    report.m_numVertices = range.m_numVertices;
+    report.m_numIndices = range.m_numIndices;
+    report.m_maxIndex = 0;
+    report.m_indexSize = range.m_indexSize;
+    report.m_numInvalidIndices = 0;
+    report.m_maxPositionError = 0.0f;
+    report.m_maxNormalError = 0.0f;
+    report.m_maxTexCoordError = 0.0f;
+    report.m_maxTangentError = 0.0f;
+    uint32_t numIndices = range.m_numIndices + range.m_numLodIndices;
+    if (numIndices == 0)
+    {
+      return;
+    }
+
+    // Out of range indices would read another mesh's vertices, point them at the first vertex
+    uint8_t* destination = &m_indexData[range.m_indexOffset];
+    for (uint32_t k = 0; k < numIndices; ++k)
+    {
+      uint32_t index = k < range.m_numIndices ? meshIndexData[k] : lodIndexData[k - range.m_numIndices];
+      report.m_maxIndex = std::max(report.m_maxIndex, index);
+      if (index >= range.m_numVertices)
+      {
+        report.m_numInvalidIndices++;
+        index = 0;
+      }
+
+      if (range.m_indexSize == sizeof(uint16_t))
+      {
+        ((uint16_t*)destination)[k] = (uint16_t)index;
+      }
+      else
+      {
+        ((uint32_t*)destination)[k] = index;
+      }
+    }
+  }
+
+  void GeometryPacker::setQuantizeVertices(bool quantize)
+  {
+    m_quantizeVertices = quantize;
+  }
+
+  bool GeometryPacker::getQuantizeVertices()
+  {
+    return m_quantizeVertices;
+  }
+
+  void GeometryPacker::clear()
+  {
+    m_meshes.clear();
+    m_meshIndices.clear();
+    m_ranges.clear();
+    m_reports.clear();
+    m_vertexData.clear();
+    m_indexData.clear();
+    m_numVertices = 0;
+    memset(&m_stats, 0, sizeof(m_stats));
+  }
+
+  size_t GeometryPacker::numMeshes()
+  {
+    return m_meshes.size();
+  }
+
+  shared_ptr<Mesh> GeometryPacker::getMesh(size_t index)
+  {
+    return m_meshes[index];
+  }
+
+  const GeometryPacker::MeshRange& GeometryPacker::getMeshRange(size_t index)
+  {
+    return m_ranges[index];
+  }
+
+  const GeometryPacker::MeshReport& GeometryPacker::getMeshReport(size_t index)
+  {
+    return m_reports[index];
+  }
+
+  uint32_t GeometryPacker::getNumVertices()
+  {
+    return m_numVertices;
+  }
+
+  const vector<uint8_t>& GeometryPacker::getVertexData()
+  {
+    return m_vertexData;
+  }
+
+  const vector<uint8_t>& GeometryPacker::getIndexData()
+  {
+    return m_indexData;
+  }
+
+  void GeometryPacker::decodePosition(size_t meshIndex, uint32_t vertex, vec3& position)
+  {
+    const MeshRange& range = m_ranges[meshIndex];
+    const uint8_t* source = &m_vertexData[range.m_vertexOffset + (size_t)vertex * range.m_vertexStride];
+    if (range.m_vertexFormat & VERTEX_QUANTIZED)
+    {
+      uint16_t quantized[3];
+      memcpy(quantized, source, sizeof(quantized));
+      position = range.m_positionOffset + vec3(quantized[0], quantized[1], quantized[2]) * (1.0f / 65535.0f) * range.m_positionScale;
+      return;
+    }
+
+    float values[3];
+    memcpy(values, source, sizeof(values));
+    position = vec3(values[0], values[1], values[2]);
+  }
+
+  void GeometryPacker::getStats(Stats& stats)
+  {
+    stats = m_stats;
+  }
+
+  uint32_t GeometryPacker::selectIndexSize(uint32_t numVertices)
+  {
+    // 0xffff stays free, it is the strip cut value of 16 bit index buffers
+    return numVertices <= 0xffff ? sizeof(uint16_t) : sizeof(uint32_t);
+  }
+
+  uint32_t GeometryPacker::selectVertexFormat(shared_ptr<Mesh> mesh)
+  {
+    uint32_t vertexFormat = VERTEX_POSITION;
+    if (mesh->hasAttribute(Mesh::NORMAL) && mesh->getVertexBufferSize(mesh->getAttributeBuffer(Mesh::NORMAL)) >= 3)
+    {
+      vertexFormat |= VERTEX_NORMAL;
+    }
+    if (mesh->hasAttribute(Mesh::TEXCOORD) && mesh->getVertexBufferSize(mesh->getAttributeBuffer(Mesh::TEXCOORD)) >= 2)
+    {
+      vertexFormat |= VERTEX_TEXCOORD;
+    }
+    if (mesh->hasAttribute(Mesh::TANGENT) && mesh->getVertexBufferSize(mesh->getAttributeBuffer(Mesh::TANGENT)) >= 3)
+    {
+      vertexFormat |= VERTEX_TANGENT;
+    }
+    return vertexFormat;
+  }
+
+  uint32_t GeometryPacker::getVertexStride(uint32_t vertexFormat)
+  {
+    if (vertexFormat & VERTEX_QUANTIZED)
+    {
+      uint32_t numBytes = 4 * sizeof(uint16_t);
+      numBytes += (vertexFormat & VERTEX_NORMAL) ? 2 * sizeof(uint16_t) : 0;
+      numBytes += (vertexFormat & VERTEX_TEXCOORD) ? 2 * sizeof(uint16_t) : 0;
+      numBytes += (vertexFormat & VERTEX_TANGENT) ? 2 * sizeof(uint16_t) : 0;
+      return numBytes;
+    }
+
+    uint32_t numFloats = 3;
+    numFloats += (vertexFormat & VERTEX_NORMAL) ? 3 : 0;
+    numFloats += (vertexFormat & VERTEX_TEXCOORD) ? 2 : 0;
+    numFloats += (vertexFormat & VERTEX_TANGENT) ? 3 : 0;
+    return numFloats * sizeof(float);
+  }
+}
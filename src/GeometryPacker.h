@@ -0,0 +1,137 @@
+#pragma once
+#include "Mesh.h"
+#include "RenderComponent.h"
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <map>
+
+using std::string;
+using std::shared_ptr;
+using std::vector;
+using std::map;
+
+namespace Bonny
+{
+  // CPU side packing of the meshes of a scene into the shared vertex and index
+  // buffers the backends upload. Every mesh gets 16 bit indices when all of its
+  // vertices can be addressed with them and 32 bit indices otherwise, 32 bit
+  // ranges start on a 4 byte boundary so each mesh can be bound with its own
+  // index format. Vertices are interleaved with only the attributes the mesh has,
+  // optionally quantized.
+  class GeometryPacker
+  {
+  public:
+    // Attributes of a packed vertex. The position always comes first, the others
+    // follow in this order when present, all as 32 bit floats. Quantized vertices
+    // store the position as unorm16 x4 within the mesh bounds, normals and tangents
+    // as octahedral snorm16 x2 and texcoords as half x2.
+    enum VertexFormat
+    {
+      VERTEX_POSITION = 0,
+      VERTEX_NORMAL = 1,
+      VERTEX_TEXCOORD = 2,
+      VERTEX_TANGENT = 4,
+      VERTEX_QUANTIZED = 8,
+      NUM_VERTEX_FORMATS = 16
+    };
+
+    // Where a mesh ended up in the packed buffers. Indices are relative to the
+    // first vertex of the mesh, the index start is counted in the mesh's own index size.
+    // The indices of the lower LODs follow the full resolution ones, so LOD ranges
+    // are offsets from the index start. Quantized positions decode as offset + position * scale.
+    struct MeshRange
+    {
+      uint32_t  m_vertexStart;
+      uint32_t  m_numVertices;
+      uint32_t  m_vertexFormat;
+      uint32_t  m_vertexStride;
+      uint32_t  m_vertexOffset;
+      vec3      m_positionOffset;
+      vec3      m_positionScale;
+      uint32_t  m_indexStart;
+      uint32_t  m_numIndices;
+      uint32_t  m_numLodIndices;
+      uint32_t  m_indexSize;
+      uint32_t  m_indexOffset;
+    };
+
+    // Validation result of one mesh, invalid indices point past the mesh's vertices
+    // and are replaced with 0 in the packed buffer. The errors are the largest
+    // quantization errors, in mesh units for positions and degrees for directions.
+    struct MeshReport
+    {
+      string    m_name;
+      uint32_t  m_numVertices;
+      uint32_t  m_numIndices;
+      uint32_t  m_maxIndex;
+      uint32_t  m_indexSize;
+      uint32_t  m_numInvalidIndices;
+      float     m_maxPositionError;
+      float     m_maxNormalError;
+      float     m_maxTexCoordError;
+      float     m_maxTangentError;
+    };
+
+    struct Stats
+    {
+      uint32_t  m_numMeshes;
+      uint32_t  m_num16BitMeshes;
+      uint32_t  m_num32BitMeshes;
+      uint32_t  m_numInvalidMeshes;
+      uint64_t  m_numVertices;
+      uint64_t  m_numIndices;
+      uint64_t  m_numLodIndices;
+      uint64_t  m_indexBytes;
+      uint64_t  m_indexBytesAll32Bit;
+      uint64_t  m_vertexBytes;
+      uint64_t  m_vertexBytesFullLayout;
+      uint32_t  m_numMeshesPerFormat[NUM_VERTEX_FORMATS];
+    };
+
+    GeometryPacker();
+    ~GeometryPacker();
+
+    void                  build(vector<shared_ptr<RenderComponent>>& renderComponents);
+
+    // Packs the meshes of more components behind the ones already packed, which keep their
+    // ranges, and returns the index of the first new mesh. Only the data from the sizes
+    // before the call on is new. Meshes are packed once however many components reference them.
+    size_t                append(vector<shared_ptr<RenderComponent>>& renderComponents);
+    void                  clear();
+    void                  setQuantizeVertices(bool quantize);
+    bool                  getQuantizeVertices();
+
+    size_t                numMeshes();
+    shared_ptr<Mesh>      getMesh(size_t index);
+    const MeshRange&      getMeshRange(size_t index);
+    const MeshReport&     getMeshReport(size_t index);
+    uint32_t              getNumVertices();
+
+    // Position of a packed vertex the way the vertex stage reads it, quantized
+    // positions are decoded with the mesh's offset and scale
+    void                  decodePosition(size_t meshIndex, uint32_t vertex, vec3& position);
+    const vector<uint8_t>&  getVertexData();
+    const vector<uint8_t>&  getIndexData();
+    void                  getStats(Stats& stats);
+
+    static uint32_t       selectIndexSize(uint32_t numVertices);
+    static uint32_t       selectVertexFormat(shared_ptr<Mesh> mesh);
+    static uint32_t       getVertexStride(uint32_t vertexFormat);
+
+  private:
+    void                  packVertices(size_t meshIndex);
+    void                  packIndices(size_t meshIndex);
+
+    vector<shared_ptr<Mesh>>  m_meshes;
+    map<Mesh*, size_t>        m_meshIndices;
+    vector<MeshRange>         m_ranges;
+    vector<MeshReport>        m_reports;
+    vector<uint8_t>           m_vertexData;
+    vector<uint8_t>           m_indexData;
+    uint32_t                  m_numVertices;
+    bool                      m_quantizeVertices;
+    Stats                     m_stats;
+  };
+}
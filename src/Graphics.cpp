@@ -1,5 +1,7 @@
 #include "stdafx.h"
 #include "Graphics.h"
+#include "RayTracer.h"
+#include "GeometryPacker.h"
 
 namespace Bonny
 {
@@ -8,6 +10,8 @@ namespace Bonny
     m_hinstance(hinstance),
     m_window(window)
   {
+    // CPU side vertex and index packing shared by the backends
+    m_geometryPacker = std::make_shared<GeometryPacker>();
   }
 
 
@@ -31,10 +35,18 @@ namespace Bonny
   {
   }
 
+  void Graphics::appendBuffers(vector<shared_ptr<RenderComponent>>& renderComponents)
+  {
+  }
+
   void Graphics::createPipeline(shared_ptr<Pipeline>, shared_ptr<Mesh>, shared_ptr<Material>)
   {
   }
 
+  void Graphics::updateTexture(shared_ptr<Texture> texture)
+  {
+  }
+
   void Graphics::beginCommands(shared_ptr<View> view, uint32_t frameIndex)
   {
   }
@@ -47,12 +59,21 @@ namespace Bonny
   {
   }
 
+  void Graphics::drawRange(shared_ptr<View> view, shared_ptr<Mesh>, shared_ptr<Material>, uint32_t indexStart, uint32_t numIndices, uint32_t frameIndex)
+  {
+  }
+
   void Graphics::compute(shared_ptr<View> view)
   {
   }
 
   void Graphics::trace(shared_ptr<View> view)
   {
+    // Without ray tracing hardware the view is traced on the CPU
+    if (m_rayTracer != nullptr)
+    {
+      m_rayTracer->render(view);
+    }
   }
 
   void Graphics::endCommands(shared_ptr<View> view, uint32_t frameIndex)
@@ -66,4 +87,14 @@ namespace Bonny
   void Graphics::present(shared_ptr<View> view, uint32_t frameIndex)
   {
   }
+
+  void Graphics::setRayTracer(shared_ptr<RayTracer> rayTracer)
+  {
+    m_rayTracer = rayTracer;
+  }
+
+  shared_ptr<GeometryPacker> Graphics::getGeometryPacker()
+  {
+    return m_geometryPacker;
+  }
 }
\ No newline at end of file
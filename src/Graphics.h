@@ -19,6 +19,8 @@ namespace Bonny
   class RenderTechnique;
   class Pipeline;
   class RenderComponent;
+  class RayTracer;
+  class GeometryPacker;
 
   class Graphics
   {
@@ -32,23 +34,33 @@ namespace Bonny
     virtual void                resize(uint32_t width, uint32_t height);
 
     virtual void                buildBuffers(vector<shared_ptr<RenderComponent>>& renderComponents);
+
+    // Adds the geometry of components created after the last build, what is already in the buffers stays
+    virtual void                appendBuffers(vector<shared_ptr<RenderComponent>>& renderComponents);
     virtual void                createPipeline(shared_ptr<Pipeline>, shared_ptr<Mesh>, shared_ptr<Material>);
+    virtual void                updateTexture(shared_ptr<Texture> texture);
 
     virtual void                beginCommands(shared_ptr<View> view, uint32_t frameIndex);
     virtual void                bindPipeline(shared_ptr<View> view, shared_ptr<Pipeline> pipeline, uint32_t frameIndex);
     virtual void                draw(shared_ptr<View> view, shared_ptr<Mesh>, shared_ptr<Material>, uint32_t frameIndex);
+    virtual void                drawRange(shared_ptr<View> view, shared_ptr<Mesh>, shared_ptr<Material>, uint32_t indexStart, uint32_t numIndices,
+                                  uint32_t frameIndex);
     virtual void                compute(shared_ptr<View> view);
     virtual void                trace(shared_ptr<View> view);
     virtual void                endCommands(shared_ptr<View> view, uint32_t frameIndex);
     virtual void                executeCommands(shared_ptr<View> view, uint32_t frameIndex);
     virtual void                present(shared_ptr<View> view, uint32_t frameIndex);
 
+    void                        setRayTracer(shared_ptr<RayTracer> rayTracer);
+    shared_ptr<GeometryPacker>  getGeometryPacker();
 
   protected:
     HINSTANCE                     m_hinstance;
     HWND                          m_window;
     uint32_t                      m_width;
     uint32_t                      m_height;
+    shared_ptr<RayTracer>         m_rayTracer;
+    shared_ptr<GeometryPacker>    m_geometryPacker;
 
   private:
     string                        m_name;
@@ -5,6 +5,8 @@
 #include "d3dx12.h"
 
 #include <atlstr.h>
+#include <algorithm>
+#include <cstring>
 
 #pragma comment(lib, "d3dcompiler.lib")
 #pragma comment(lib, "D3D12.lib")
@@ -16,7 +18,9 @@ namespace Bonny
     m_frameIndex(0),
     m_hinstance(hinstance),
     m_window(window),
-    m_currentGraphicsFence(0)
+    m_currentGraphicsFence(0),
+    m_vertexBufferCapacity(0),
+    m_indexBufferCapacity(0)
   {
     m_vertexComps[0] = 0;
     m_vertexComps[1] = 0;
@@ -407,12 +411,19 @@ namespace Bonny
   {
   }
 
+  void GraphicsDX12::drawRange(shared_ptr<View> view, shared_ptr<Mesh> mesh, shared_ptr<Material> material, uint32_t indexStart, uint32_t numIndices,
+    uint32_t frameIndex)
+  {
+  }
+
   void GraphicsDX12::compute(shared_ptr<View> view)
   {
   }
 
   void GraphicsDX12::trace(shared_ptr<View> view)
   {
+    // No hardware ray tracing path yet, fall back to the CPU reference tracer
+    Graphics::trace(view);
   }
 
   void GraphicsDX12::endCommands(shared_ptr<View> view, uint32_t frameIndex)
@@ -470,101 +481,175 @@ namespace Bonny
   void GraphicsDX12::buildBuffers(vector<shared_ptr<RenderComponent>>& renderComponents)
   {
     HRESULT hr = S_OK;
-    uint32_t totalIndices = 0;
-    uint32_t totalVerts = 0;
 
-    for (size_t i = 0; i < renderComponents.size(); ++i)
-    {
-      for (size_t j = 0; j < renderComponents[i]->numMeshes(); ++j)
-      {
-        shared_ptr<Mesh> mesh = renderComponents[i]->getMesh(j);
-        totalVerts += mesh->getNumVerts();
-        totalIndices += mesh->getIndexBufferSize();
-      }
-    }
-
-    void* vertexData = malloc(totalVerts * sizeof(Vertex4));
-    uint16_t* indexData = (uint16_t*)malloc(totalIndices * sizeof(uint16_t));
-
-    float* meshVertexData[5];
-    uint32_t* meshIndexData;
+    // Vertices are interleaved with only the attributes each mesh has, indices are packed
+    // per mesh at 16 or 32 bit, whichever addresses all of its vertices
+    m_geometryPacker->build(renderComponents);
+    const vector<uint8_t>& vertexData = m_geometryPacker->getVertexData();
+    const vector<uint8_t>& indexData = m_geometryPacker->getIndexData();
+    reportGeometry(0);
+    updateMeshData(0);
 
-    Vertex4* v4ptr = (Vertex4*)vertexData;
-    uint16_t* iptr = indexData;
-    uint32_t vertexStart = 0;
-    uint32_t indexStart = 0;
-
-    for (size_t i = 0; i < renderComponents.size(); ++i)
-    {
-      for (size_t j = 0; j < renderComponents[i]->numMeshes(); ++j)
-      {
-        shared_ptr<Mesh> mesh = renderComponents[i]->getMesh(j);
-        Dx12MeshData* meshData = new Dx12MeshData();
-
-        size_t numBuffers = mesh->getNumBuffers();
-        for (size_t k = 0; k < numBuffers; ++k)
-        {
-          meshVertexData[k] = mesh->getVertexBufferData(k);
-        }
-        meshIndexData = mesh->getIndexBuffer();
-
-        size_t numVerts = mesh->getNumVerts();
-        for (size_t k = 0; k < numVerts; ++k)
-        {
-          v4ptr->position.x = meshVertexData[0][k * 3 + 0];
-          v4ptr->position.y = meshVertexData[0][k * 3 + 1];
-          v4ptr->position.z = meshVertexData[0][k * 3 + 2];
-          v4ptr->normal.x = meshVertexData[1][k * 3 + 0];
-          v4ptr->normal.y = meshVertexData[1][k * 3 + 1];
-          v4ptr->normal.z = meshVertexData[1][k * 3 + 2];
-          v4ptr->texCoord.x = meshVertexData[2][k * 2 + 0];
-          v4ptr->texCoord.y = meshVertexData[2][k * 2 + 1];
-          v4ptr->tangent.x = meshVertexData[3][k * 3 + 0];
-          v4ptr->tangent.y = meshVertexData[3][k * 3 + 1];
-          v4ptr->tangent.z = meshVertexData[3][k * 3 + 2];
-          v4ptr++;
-        }
-
-        size_t numIndeces = mesh->getIndexBufferSize();
-        for (size_t k = 0; k < numIndeces; ++k)
-        {
-          *iptr = (uint16_t)meshIndexData[k];
-          iptr++;
-        }
-
-        meshData->m_numIndeces = numIndeces;
-        meshData->m_numVertices = numVerts;
-        meshData->m_vertexStart = vertexStart;
-        meshData->m_indexStart = indexStart;
-        mesh->setGraphicsData(meshData);
-        mesh->setDirty(false);
-
-        vertexStart += numVerts;
-        indexStart += numIndeces;
-
-        buildMaterial(mesh->getMaterial());
-      }    
-    }
+    // A full rebuild replaces the buffers, frames in flight may still read the old ones
+    flushCommandQueue();
+    m_retiredResources.clear();
 
     hr = m_resourceCommandList->Reset(m_resourceCommandAllocator.Get(), nullptr);
     if (!SUCCEEDED(hr))
     {
       printLog("ERROR: unable to reset resource command list.");
       return;
-    }
+    }
 
     ComPtr<ID3D12Resource> vUploadBuffer;
     ComPtr<ID3D12Resource> iUploadBuffer;
 
-    m_vertexBuffer = createAndUploadBuffer(totalVerts * sizeof(Vertex4), vertexData, D3D12_HEAP_TYPE_DEFAULT, vUploadBuffer);
-    m_indexBuffer = createAndUploadBuffer(totalIndices * sizeof(uint16_t), indexData, D3D12_HEAP_TYPE_DEFAULT, iUploadBuffer);
+    m_vertexBuffer = createAndUploadBuffer((uint32_t)vertexData.size(), (void*)vertexData.data(), D3D12_HEAP_TYPE_DEFAULT, vUploadBuffer);
+    m_indexBuffer = createAndUploadBuffer((uint32_t)indexData.size(), (void*)indexData.data(), D3D12_HEAP_TYPE_DEFAULT, iUploadBuffer);
+    m_vertexBufferCapacity = vertexData.size();
+    m_indexBufferCapacity = indexData.size();
 
     m_resourceCommandList->Close();
-    ID3D12CommandList* cmdsLists[] = { m_resourceCommandList.Get() };
+    ID3D12CommandList* cmdsLists[] = { m_resourceCommandList.Get() };
     m_graphicsCommandQueue->ExecuteCommandLists(1, cmdsLists);
     flushCommandQueue();
   }
 
+  void GraphicsDX12::appendBuffers(vector<shared_ptr<RenderComponent>>& renderComponents)
+  {
+    HRESULT hr = S_OK;
+
+    // Only the new meshes are packed and copied in behind the existing ones, nothing waits for the GPU.
+    // The copies go on the graphics queue, so they land after the frames in flight are done reading.
+    size_t vertexBytes = m_geometryPacker->getVertexData().size();
+    size_t indexBytes = m_geometryPacker->getIndexData().size();
+    size_t firstMesh = m_geometryPacker->append(renderComponents);
+    reportGeometry(firstMesh);
+    updateMeshData(firstMesh);
+    releaseRetiredResources();
+
+    hr = m_resourceCommandList->Reset(m_resourceCommandAllocator.Get(), nullptr);
+    if (!SUCCEEDED(hr))
+    {
+      printLog("ERROR: unable to reset resource command list.");
+      return;
+    }
+    appendToBuffer(m_vertexBuffer, m_vertexBufferCapacity, vertexBytes, m_geometryPacker->getVertexData());
+    appendToBuffer(m_indexBuffer, m_indexBufferCapacity, indexBytes, m_geometryPacker->getIndexData());
+    m_resourceCommandList->Close();
+    ID3D12CommandList* cmdsLists[] = { m_resourceCommandList.Get() };
+    m_graphicsCommandQueue->ExecuteCommandLists(1, cmdsLists);
+
+    // Upload buffers and outgrown buffers go once the GPU passed this point
+    m_graphicsCommandQueue->Signal(m_graphicsFence.Get(), ++m_currentGraphicsFence);
+    for (size_t i = m_retiredResources.size(); i > 0 && m_retiredResources[i - 1].m_fence == 0; --i)
+    {
+      m_retiredResources[i - 1].m_fence = m_currentGraphicsFence;
+    }
+  }
+
+  void GraphicsDX12::appendToBuffer(ComPtr<ID3D12Resource>& buffer, size_t& capacity, size_t oldSize, const vector<uint8_t>& data)
+  {
+    HRESULT hr = S_OK;
+    size_t numBytes = data.size() - oldSize;
+    if (numBytes == 0)
+    {
+      return;
+    }
+
+    ComPtr<ID3D12Resource> uploadBuffer;
+    hr = m_device->CreateCommittedResource(&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD), D3D12_HEAP_FLAG_NONE,
+      &CD3DX12_RESOURCE_DESC::Buffer(numBytes), D3D12_RESOURCE_STATE_GENERIC_READ, nullptr, IID_PPV_ARGS(uploadBuffer.GetAddressOf()));
+    void* mapped = nullptr;
+    if (!SUCCEEDED(hr) || !SUCCEEDED(uploadBuffer->Map(0, &CD3DX12_RANGE(0, 0), &mapped)))
+    {
+      printLog("ERROR: unable to create committed resource for upload.");
+      return;
+    }
+    memcpy(mapped, data.data() + oldSize, numBytes);
+    uploadBuffer->Unmap(0, nullptr);
+
+    // Outgrown buffers are replaced by one twice the size, the old contents are copied over on the GPU
+    if (buffer == nullptr || data.size() > capacity)
+    {
+      size_t newCapacity = std::max(data.size(), capacity * 2);
+      ComPtr<ID3D12Resource> newBuffer;
+      hr = m_device->CreateCommittedResource(&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT), D3D12_HEAP_FLAG_NONE,
+        &CD3DX12_RESOURCE_DESC::Buffer(newCapacity), D3D12_RESOURCE_STATE_COPY_DEST, nullptr, IID_PPV_ARGS(newBuffer.GetAddressOf()));
+      if (!SUCCEEDED(hr))
+      {
+        printLog("ERROR: unable to create committed resource.");
+        return;
+      }
+      if (buffer != nullptr && oldSize > 0)
+      {
+        m_resourceCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(buffer.Get(),
+          D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_COPY_SOURCE));
+        m_resourceCommandList->CopyBufferRegion(newBuffer.Get(), 0, buffer.Get(), 0, oldSize);
+      }
+      if (buffer != nullptr)
+      {
+        m_retiredResources.push_back({ buffer, 0 });
+      }
+      buffer = newBuffer;
+      capacity = newCapacity;
+    }
+    else
+    {
+      m_resourceCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(buffer.Get(),
+        D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_COPY_DEST));
+    }
+
+    m_resourceCommandList->CopyBufferRegion(buffer.Get(), oldSize, uploadBuffer.Get(), 0, numBytes);
+    m_resourceCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(buffer.Get(),
+      D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_GENERIC_READ));
+    m_retiredResources.push_back({ uploadBuffer, 0 });
+  }
+
+  void GraphicsDX12::releaseRetiredResources()
+  {
+    uint64_t completedFence = m_graphicsFence->GetCompletedValue();
+    size_t numKept = 0;
+    for (size_t i = 0; i < m_retiredResources.size(); ++i)
+    {
+      if (m_retiredResources[i].m_fence == 0 || m_retiredResources[i].m_fence > completedFence)
+      {
+        m_retiredResources[numKept++] = m_retiredResources[i];
+      }
+    }
+    m_retiredResources.resize(numKept);
+  }
+
+  void GraphicsDX12::updateMeshData(size_t firstMesh)
+  {
+    for (size_t i = firstMesh; i < m_geometryPacker->numMeshes(); ++i)
+    {
+      shared_ptr<Mesh> mesh = m_geometryPacker->getMesh(i);
+      const GeometryPacker::MeshRange& range = m_geometryPacker->getMeshRange(i);
+      Dx12MeshData* meshData = (Dx12MeshData*)mesh->getGraphicsData();
+      if (meshData == nullptr)
+      {
+        meshData = new Dx12MeshData();
+      }
+
+      meshData->m_vertexFormat = range.m_vertexFormat;
+      meshData->m_vertexStride = range.m_vertexStride;
+      meshData->m_vertexOffset = range.m_vertexOffset;
+      meshData->m_positionOffset = DirectX::XMFLOAT3(range.m_positionOffset.x, range.m_positionOffset.y, range.m_positionOffset.z);
+      meshData->m_positionScale = DirectX::XMFLOAT3(range.m_positionScale.x, range.m_positionScale.y, range.m_positionScale.z);
+      meshData->m_numIndeces = range.m_numIndices;
+      meshData->m_numVertices = range.m_numVertices;
+      meshData->m_vertexStart = range.m_vertexStart;
+      meshData->m_indexStart = range.m_indexStart;
+      meshData->m_indexSize = range.m_indexSize;
+      meshData->m_indexOffset = range.m_indexOffset;
+      mesh->setGraphicsData(meshData);
+      mesh->setDirty(false);
+
+      buildMaterial(mesh->getMaterial());
+    }
+  }
+
   ComPtr<ID3D12Resource> GraphicsDX12::createAndUploadBuffer(uint32_t size, void* data, D3D12_HEAP_TYPE heapFlags, ComPtr<ID3D12Resource>& uploadBuffer)
   {
     HRESULT hr = S_OK;
@@ -810,11 +895,37 @@ namespace Bonny
     m_frameIndex = 0;
   }
 
+  void GraphicsDX12::reportGeometry(size_t firstMesh)
+  {
+    // Meshes that left the compact 16 bit path, or whose indices had to be repaired
+    for (size_t i = firstMesh; i < m_geometryPacker->numMeshes(); ++i)
+    {
+      const GeometryPacker::MeshReport& report = m_geometryPacker->getMeshReport(i);
+      if (report.m_indexSize == sizeof(uint32_t) || report.m_numInvalidIndices > 0)
+      {
+        printLog("Mesh " + report.m_name.substr(0, 64) + ": " + std::to_string(report.m_numVertices) + " verts, " +
+          std::to_string(report.m_indexSize * 8) + " bit indices, " + std::to_string(report.m_numInvalidIndices) + " invalid");
+      }
+      if (m_geometryPacker->getQuantizeVertices())
+      {
+        printLog("Mesh " + report.m_name.substr(0, 64) + " quantization error: position " + std::to_string(report.m_maxPositionError) +
+          ", normal " + std::to_string(report.m_maxNormalError) + " deg, texcoord " + std::to_string(report.m_maxTexCoordError) +
+          ", tangent " + std::to_string(report.m_maxTangentError) + " deg");
+      }
+    }
+
+    GeometryPacker::Stats stats;
+    m_geometryPacker->getStats(stats);
+    printLog("Vertex Buffer: " + std::to_string(stats.m_vertexBytes) + " bytes (" + std::to_string(stats.m_vertexBytesFullLayout) +
+      " with the full layout), " + std::to_string(stats.m_numMeshesPerFormat[GeometryPacker::VERTEX_POSITION]) + " position only meshes");
+    printLog("Index Buffer: " + std::to_string(stats.m_num16BitMeshes) + " meshes 16 bit, " + std::to_string(stats.m_num32BitMeshes) +
+      " meshes 32 bit, " + std::to_string(stats.m_numInvalidMeshes) + " invalid, " + std::to_string(stats.m_indexBytes) + " bytes (" +
+      std::to_string(stats.m_indexBytesAll32Bit) + " all 32 bit), " + std::to_string(stats.m_numLodIndices) + " LOD indices");
+  }
+
   void GraphicsDX12::printLog(string s)
   {
     string st = s + "\n";
-    TCHAR name[256];
-    _tcscpy_s(name, CA2T(st.c_str()));
-    OutputDebugString(name);
+    OutputDebugString(CA2T(st.c_str()));
   }
 }
@@ -3,6 +3,7 @@
 #include "Graphics.h"
 #include "Mesh.h"
 #include "Material.h"
+#include "GeometryPacker.h"
 
 #include <string>
 #include <memory>
@@ -52,12 +53,14 @@ namespace Bonny
     void                resize(uint32_t width, uint32_t height);
 
     void                buildBuffers(vector<shared_ptr<RenderComponent>>& renderComponents);
+    void                appendBuffers(vector<shared_ptr<RenderComponent>>& renderComponents);
     void                buildMaterial(shared_ptr<Material>);
     void                createPipeline(shared_ptr<Pipeline>, shared_ptr<Mesh>, shared_ptr<Material>);
 
     void                beginCommands(shared_ptr<View> view, uint32_t frameIndex);
     void                bindPipeline(shared_ptr<View> view, shared_ptr<Pipeline> pipeline, uint32_t frameIndex);
     void                draw(shared_ptr<View> view, shared_ptr<Mesh>, shared_ptr<Material>, uint32_t frameIndex);
+    void                drawRange(shared_ptr<View> view, shared_ptr<Mesh>, shared_ptr<Material>, uint32_t indexStart, uint32_t numIndices, uint32_t frameIndex);
     void                compute(shared_ptr<View> view);
     void                trace(shared_ptr<View> view);
     void                endCommands(shared_ptr<View> view, uint32_t frameIndex);
@@ -73,41 +76,30 @@ namespace Bonny
     HRESULT             createSwapchain(uint32_t numFrames);
 
     ComPtr<ID3D12Resource>  createAndUploadBuffer(uint32_t size, void* data, D3D12_HEAP_TYPE heapFlags, ComPtr<ID3D12Resource>& uploadBuffer);
+    void                appendToBuffer(ComPtr<ID3D12Resource>& buffer, size_t& capacity, size_t oldSize, const vector<uint8_t>& data);
+    void                releaseRetiredResources();
+    void                updateMeshData(size_t firstMesh);
     ComPtr<ID3DBlob>    loadShader(const std::wstring& filename, const D3D_SHADER_MACRO* defines, const std::string& entrypoint,
       const std::string& target);
     
     void                printLog(string s);
+    void                reportGeometry(size_t firstMesh);
     void                update(shared_ptr<View> view, shared_ptr<Material>);
 
-    // Vertex Structures
-    struct Vertex4
+    // Per mesh graphics data, the vertex layout is one of the packer's vertex formats
+    struct Dx12MeshData
     {
-      DirectX::XMFLOAT3 position;
-      DirectX::XMFLOAT3 normal;
-      DirectX::XMFLOAT2 texCoord;
-      DirectX::XMFLOAT3 tangent;
-    };
-
-    struct Vertex3
-    {
-      DirectX::XMFLOAT3 position;
-      DirectX::XMFLOAT3 normal;
-      DirectX::XMFLOAT2 texCoord;
-    };
-
-    struct Vertex2
-    {
-      DirectX::XMFLOAT3 position;
-      DirectX::XMFLOAT3 normal;
-    };
-
-    // Per mesh graphics data
-    struct Dx12MeshData
-    {
-      uint32_t m_vertexStart;
-      uint32_t m_numVertices;
-      uint32_t m_indexStart;
-      uint32_t m_numIndeces;
+      uint32_t m_vertexStart;
+      uint32_t m_numVertices;
+      uint32_t m_vertexFormat;
+      uint32_t m_vertexStride;
+      uint32_t m_vertexOffset;
+      DirectX::XMFLOAT3 m_positionOffset;
+      DirectX::XMFLOAT3 m_positionScale;
+      uint32_t m_indexStart;
+      uint32_t m_numIndeces;
+      uint32_t m_indexSize;
+      uint32_t m_indexOffset;
     };
 
     // Per texture graphics data
@@ -153,6 +145,13 @@ namespace Bonny
       uint64_t                            m_currentFence;
     };
 
+    // Kept alive until the graphics fence passes the value, 0 while the commands using it aren't submitted yet
+    struct RetiredResource
+    {
+      ComPtr<ID3D12Resource>              m_resource;
+      uint64_t                            m_fence;
+    };
+
     uint32_t  m_frameIndex;
     HINSTANCE m_hinstance;
     HWND      m_window;
@@ -192,6 +191,9 @@ namespace Bonny
 
     ComPtr<ID3D12Resource>              m_vertexBuffer;
     ComPtr<ID3D12Resource>              m_indexBuffer;
+    size_t                              m_vertexBufferCapacity;
+    size_t                              m_indexBufferCapacity;
+    vector<RetiredResource>             m_retiredResources;
 
     map<std::wstring, ComPtr<ID3DBlob>>  m_vsMap;
     map<std::wstring, ComPtr<ID3DBlob>>  m_psMap;
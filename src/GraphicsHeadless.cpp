@@ -0,0 +1,232 @@
+#include "stdafx.h"
+#include "GraphicsHeadless.h"
+#include "RenderComponent.h"
+
+#include <cstring>
+
+using std::memset;
+
+namespace Bonny
+{
+  GraphicsHeadless::GraphicsHeadless(string name) : Graphics(name, nullptr, nullptr),
+    m_numFrames(0),
+    m_frameIndex(0),
+    m_currentPipeline(nullptr),
+    m_currentMaterial(nullptr),
+    m_pipelineBound(false)
+  {
+    m_width = 800;
+    m_height = 600;
+    resetStats();
+  }
+
+
+  GraphicsHeadless::~GraphicsHeadless()
+  {
+  }
+
+  void GraphicsHeadless::createDevice(uint32_t numFrames)
+  {
+    m_numFrames = numFrames;
+    m_frameIndex = 0;
+  }
+
+  void GraphicsHeadless::createView(shared_ptr<View> view)
+  {
+  }
+
+  void GraphicsHeadless::resize(uint32_t width, uint32_t height)
+  {
+    m_width = width;
+    m_height = height;
+    m_frameIndex = 0;
+  }
+
+  void GraphicsHeadless::buildBuffers(vector<shared_ptr<RenderComponent>>& renderComponents)
+  {
+    // Same vertex layouts and per mesh 16/32 bit index packing as the DX12 backend, the packer owns the data
+    m_geometryPacker->build(renderComponents);
+    updateMeshData(0);
+
+    uint64_t bytesUploaded = m_geometryPacker->getVertexData().size() + m_geometryPacker->getIndexData().size();
+    m_frameStats.m_bytesUploaded += bytesUploaded;
+    m_totalStats.m_bytesUploaded += bytesUploaded;
+  }
+
+  void GraphicsHeadless::appendBuffers(vector<shared_ptr<RenderComponent>>& renderComponents)
+  {
+    // Only what the new meshes added to the packed buffers counts as uploaded
+    size_t vertexBytes = m_geometryPacker->getVertexData().size();
+    size_t indexBytes = m_geometryPacker->getIndexData().size();
+    updateMeshData(m_geometryPacker->append(renderComponents));
+
+    uint64_t bytesUploaded = (m_geometryPacker->getVertexData().size() - vertexBytes) + (m_geometryPacker->getIndexData().size() - indexBytes);
+    m_frameStats.m_bytesUploaded += bytesUploaded;
+    m_totalStats.m_bytesUploaded += bytesUploaded;
+  }
+
+  void GraphicsHeadless::updateMeshData(size_t firstMesh)
+  {
+    for (size_t i = firstMesh; i < m_geometryPacker->numMeshes(); ++i)
+    {
+      shared_ptr<Mesh> mesh = m_geometryPacker->getMesh(i);
+      const GeometryPacker::MeshRange& range = m_geometryPacker->getMeshRange(i);
+      HeadlessMeshData* meshData = (HeadlessMeshData*)mesh->getGraphicsData();
+      if (meshData == nullptr)
+      {
+        meshData = new HeadlessMeshData();
+      }
+
+      meshData->m_vertexFormat = range.m_vertexFormat;
+      meshData->m_vertexStride = range.m_vertexStride;
+      meshData->m_vertexOffset = range.m_vertexOffset;
+      meshData->m_numIndeces = range.m_numIndices;
+      meshData->m_numVertices = range.m_numVertices;
+      meshData->m_vertexStart = range.m_vertexStart;
+      meshData->m_indexStart = range.m_indexStart;
+      meshData->m_indexSize = range.m_indexSize;
+      meshData->m_indexOffset = range.m_indexOffset;
+      mesh->setGraphicsData(meshData);
+      mesh->setDirty(false);
+    }
+  }
+
+  void GraphicsHeadless::createPipeline(shared_ptr<Pipeline>, shared_ptr<Mesh>, shared_ptr<Material>)
+  {
+  }
+
+  void GraphicsHeadless::updateTexture(shared_ptr<Texture> texture)
+  {
+    // A device would get the resident levels again
+    uint64_t bytesUploaded = texture->getResidentBytes();
+    m_frameStats.m_bytesUploaded += bytesUploaded;
+    m_totalStats.m_bytesUploaded += bytesUploaded;
+  }
+
+  void GraphicsHeadless::beginCommands(shared_ptr<View> view, uint32_t frameIndex)
+  {
+    m_commands.clear();
+    m_currentPipeline = nullptr;
+    m_currentMaterial = nullptr;
+    m_pipelineBound = false;
+    recordCommand(BEGIN_COMMANDS, nullptr, nullptr, 0, 0, frameIndex);
+  }
+
+  void GraphicsHeadless::bindPipeline(shared_ptr<View> view, shared_ptr<Pipeline> pipeline, uint32_t frameIndex)
+  {
+    if (!m_pipelineBound || pipeline.get() != m_currentPipeline)
+    {
+      m_currentPipeline = pipeline.get();
+      m_pipelineBound = true;
+      m_frameStats.m_numStateChanges++;
+      m_totalStats.m_numStateChanges++;
+    }
+    recordCommand(BIND_PIPELINE, nullptr, nullptr, 0, 0, frameIndex);
+  }
+
+  void GraphicsHeadless::draw(shared_ptr<View> view, shared_ptr<Mesh> mesh, shared_ptr<Material> material, uint32_t frameIndex)
+  {
+    HeadlessMeshData* meshData = (HeadlessMeshData*)mesh->getGraphicsData();
+    uint32_t indexCount = meshData != nullptr ? meshData->m_numIndeces : (uint32_t)mesh->getIndexBufferSize();
+    drawRange(view, mesh, material, 0, indexCount, frameIndex);
+  }
+
+  void GraphicsHeadless::drawRange(shared_ptr<View> view, shared_ptr<Mesh> mesh, shared_ptr<Material> material, uint32_t indexStart, uint32_t numIndices,
+    uint32_t frameIndex)
+  {
+    // Ranges are relative to the mesh, recorded relative to the packed index buffer
+    HeadlessMeshData* meshData = (HeadlessMeshData*)mesh->getGraphicsData();
+    uint32_t indexCount = numIndices;
+    if (meshData != nullptr)
+    {
+      indexStart += meshData->m_indexStart;
+    }
+
+    if (material.get() != m_currentMaterial)
+    {
+      m_currentMaterial = material.get();
+      m_frameStats.m_numStateChanges++;
+      m_totalStats.m_numStateChanges++;
+    }
+
+    m_frameStats.m_numDraws++;
+    m_totalStats.m_numDraws++;
+    m_frameStats.m_numIndices += indexCount;
+    m_totalStats.m_numIndices += indexCount;
+    recordCommand(DRAW, mesh.get(), material.get(), indexStart, indexCount, frameIndex);
+  }
+
+  void GraphicsHeadless::compute(shared_ptr<View> view)
+  {
+    recordCommand(COMPUTE, nullptr, nullptr, 0, 0, m_frameIndex);
+  }
+
+  void GraphicsHeadless::trace(shared_ptr<View> view)
+  {
+    recordCommand(TRACE, nullptr, nullptr, 0, 0, m_frameIndex);
+    Graphics::trace(view);
+  }
+
+  void GraphicsHeadless::endCommands(shared_ptr<View> view, uint32_t frameIndex)
+  {
+    recordCommand(END_COMMANDS, nullptr, nullptr, 0, 0, frameIndex);
+  }
+
+  void GraphicsHeadless::executeCommands(shared_ptr<View> view, uint32_t frameIndex)
+  {
+    recordCommand(EXECUTE_COMMANDS, nullptr, nullptr, 0, 0, frameIndex);
+  }
+
+  void GraphicsHeadless::present(shared_ptr<View> view, uint32_t frameIndex)
+  {
+    recordCommand(PRESENT, nullptr, nullptr, 0, 0, frameIndex);
+
+    m_frameStats.m_numFrames++;
+    m_totalStats.m_numFrames++;
+    m_lastFrameStats = m_frameStats;
+    memset(&m_frameStats, 0, sizeof(m_frameStats));
+
+    m_frameIndex++;
+    if (m_frameIndex == m_numFrames)
+    {
+      m_frameIndex = 0;
+    }
+  }
+
+  const vector<GraphicsHeadless::Command>& GraphicsHeadless::getCommands()
+  {
+    return m_commands;
+  }
+
+  void GraphicsHeadless::getFrameStats(Stats& stats)
+  {
+    stats = m_lastFrameStats;
+  }
+
+  void GraphicsHeadless::getTotalStats(Stats& stats)
+  {
+    stats = m_totalStats;
+  }
+
+  void GraphicsHeadless::resetStats()
+  {
+    memset(&m_frameStats, 0, sizeof(m_frameStats));
+    memset(&m_lastFrameStats, 0, sizeof(m_lastFrameStats));
+    memset(&m_totalStats, 0, sizeof(m_totalStats));
+  }
+
+  void GraphicsHeadless::recordCommand(CommandType type, Mesh* mesh, Material* material, uint32_t indexStart, uint32_t indexCount, uint32_t frameIndex)
+  {
+    Command command;
+    command.m_type = type;
+    command.m_mesh = mesh;
+    command.m_material = material;
+    command.m_indexStart = indexStart;
+    command.m_indexCount = indexCount;
+    command.m_frameIndex = frameIndex;
+    m_commands.push_back(command);
+
+    m_frameStats.m_numCommands++;
+    m_totalStats.m_numCommands++;
+  }
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include "Graphics.h"
+#include "Mesh.h"
+#include "Material.h"
+#include "GeometryPacker.h"
+
+#include <string>
+#include <memory>
+#include <vector>
+
+using std::string;
+using std::shared_ptr;
+using std::vector;
+
+namespace Bonny
+{
+  // Graphics backend without a device or window. Commands are recorded into an
+  // in-memory stream and counted so the CPU side of the frame can be profiled
+  // on machines without a GPU.
+  class GraphicsHeadless :
+    public Graphics
+  {
+  public:
+    enum CommandType
+    {
+      BEGIN_COMMANDS,
+      BIND_PIPELINE,
+      DRAW,
+      COMPUTE,
+      TRACE,
+      END_COMMANDS,
+      EXECUTE_COMMANDS,
+      PRESENT
+    };
+
+    struct Command
+    {
+      CommandType   m_type;
+      Mesh*         m_mesh;
+      Material*     m_material;
+      uint32_t      m_indexStart;
+      uint32_t      m_indexCount;
+      uint32_t      m_frameIndex;
+    };
+
+    struct Stats
+    {
+      uint64_t      m_numFrames;
+      uint64_t      m_numCommands;
+      uint64_t      m_numDraws;
+      uint64_t      m_numIndices;
+      uint64_t      m_numStateChanges;
+      uint64_t      m_bytesUploaded;
+    };
+
+    GraphicsHeadless(string name);
+    ~GraphicsHeadless();
+
+    void                createDevice(uint32_t numFrames);
+
+    void                createView(shared_ptr<View> view);
+    void                resize(uint32_t width, uint32_t height);
+
+    void                buildBuffers(vector<shared_ptr<RenderComponent>>& renderComponents);
+    void                appendBuffers(vector<shared_ptr<RenderComponent>>& renderComponents);
+    void                createPipeline(shared_ptr<Pipeline>, shared_ptr<Mesh>, shared_ptr<Material>);
+    void                updateTexture(shared_ptr<Texture> texture);
+
+    void                beginCommands(shared_ptr<View> view, uint32_t frameIndex);
+    void                bindPipeline(shared_ptr<View> view, shared_ptr<Pipeline> pipeline, uint32_t frameIndex);
+    void                draw(shared_ptr<View> view, shared_ptr<Mesh>, shared_ptr<Material>, uint32_t frameIndex);
+    void                drawRange(shared_ptr<View> view, shared_ptr<Mesh>, shared_ptr<Material>, uint32_t indexStart, uint32_t numIndices, uint32_t frameIndex);
+    void                compute(shared_ptr<View> view);
+    void                trace(shared_ptr<View> view);
+    void                endCommands(shared_ptr<View> view, uint32_t frameIndex);
+    void                executeCommands(shared_ptr<View> view, uint32_t frameIndex);
+    void                present(shared_ptr<View> view, uint32_t frameIndex);
+
+    const vector<Command>&  getCommands();
+    void                getFrameStats(Stats& stats);
+    void                getTotalStats(Stats& stats);
+    void                resetStats();
+
+  private:
+    void                recordCommand(CommandType type, Mesh* mesh, Material* material, uint32_t indexStart, uint32_t indexCount, uint32_t frameIndex);
+    void                updateMeshData(size_t firstMesh);
+
+    // Per mesh graphics data
+    struct HeadlessMeshData
+    {
+      uint32_t m_vertexStart;
+      uint32_t m_numVertices;
+      uint32_t m_vertexFormat;
+      uint32_t m_vertexStride;
+      uint32_t m_vertexOffset;
+      uint32_t m_indexStart;
+      uint32_t m_numIndeces;
+      uint32_t m_indexSize;
+      uint32_t m_indexOffset;
+    };
+
+    uint32_t            m_numFrames;
+    uint32_t            m_frameIndex;
+    vector<Command>     m_commands;
+    Pipeline*           m_currentPipeline;
+    Material*           m_currentMaterial;
+    bool                m_pipelineBound;
+    Stats               m_frameStats;
+    Stats               m_lastFrameStats;
+    Stats               m_totalStats;
+  };
+}
+
@@ -2,6 +2,8 @@
 #include "GraphicsOpenGL.h"
 #include "LightComponent.h"
 
+#include <algorithm>
+
 namespace Bonny
 {
   GraphicsOpenGL::GraphicsOpenGL(string name, HINSTANCE hinstance, HWND window) : Graphics(name, hinstance, window),
@@ -75,6 +77,12 @@ namespace Bonny
   }
 
   void GraphicsOpenGL::draw(shared_ptr<View> view, shared_ptr<Mesh> mesh, shared_ptr<Material> material, uint32_t frameIndex)
+  {
+    drawRange(view, mesh, material, 0, (uint32_t)mesh->getIndexBufferSize(), frameIndex);
+  }
+
+  void GraphicsOpenGL::drawRange(shared_ptr<View> view, shared_ptr<Mesh> mesh, shared_ptr<Material> material, uint32_t indexStart, uint32_t numIndices,
+    uint32_t frameIndex)
   {
     update(view, material);
 
@@ -103,9 +111,15 @@ namespace Bonny
       glDisableVertexAttribArray(i);
     }
 
-    if (mesh->getIndexBufferSize() != 0)
+    // Ranges past the full resolution indices address the LOD indices
+    size_t numFullIndices = mesh->getIndexBufferSize();
+    if (numFullIndices != 0 && indexStart >= numFullIndices)
     {
-      glDrawElements(GL_TRIANGLES, (GLsizei)mesh->getIndexBufferSize(), GL_UNSIGNED_INT, mesh->getIndexBuffer());
+      glDrawElements(GL_TRIANGLES, (GLsizei)numIndices, GL_UNSIGNED_INT, mesh->getLodIndexBuffer() + (indexStart - numFullIndices));
+    }
+    else if (numFullIndices != 0)
+    {
+      glDrawElements(GL_TRIANGLES, (GLsizei)numIndices, GL_UNSIGNED_INT, mesh->getIndexBuffer() + indexStart);
     }
     else
     {
@@ -119,6 +133,8 @@ namespace Bonny
 
   void GraphicsOpenGL::trace(shared_ptr<View> view)
   {
+    // No hardware ray tracing path yet, fall back to the CPU reference tracer
+    Graphics::trace(view);
   }
 
   void GraphicsOpenGL::endCommands(shared_ptr<View> view, uint32_t frameIndex)
@@ -190,6 +206,12 @@ namespace Bonny
     }
   }
 
+  void GraphicsOpenGL::appendBuffers(vector<shared_ptr<RenderComponent>>& renderComponents)
+  {
+    // Every mesh has its own buffers here, so appending is building just the new ones
+    buildBuffers(renderComponents);
+  }
+
   void GraphicsOpenGL::createMesh(shared_ptr<Mesh> mesh)
   {
     glMeshData* meshData = (glMeshData*)mesh->getGraphicsData();
@@ -211,14 +233,21 @@ namespace Bonny
         glGenVertexArrays(1, &meshData->m_vertexArrayID);
       }
 
-      for (unsigned int i = 0; i < numBuffers; i++)
+      // Attribute locations follow the mesh attributes, so a missing normal does not shift the texcoords
+      for (unsigned int attribute = 0; attribute < Mesh::NUM_ATTRIBUTES; attribute++)
       {
+        if (!mesh->hasAttribute((Mesh::Attribute)attribute))
+        {
+          continue;
+        }
+
+        unsigned int i = (unsigned int)mesh->getAttributeBuffer((Mesh::Attribute)attribute);
         glBindVertexArray(meshData->m_vertexArrayID);
-        glEnableVertexAttribArray(i);
+        glEnableVertexAttribArray(attribute);
         glGenBuffers(1, &meshData->m_vertexArrayBufferIDs[i]);
         glBindBuffer(GL_ARRAY_BUFFER, meshData->m_vertexArrayBufferIDs[i]);
         glBufferData(GL_ARRAY_BUFFER, mesh->getVertexBufferNumBytes(i), mesh->getVertexBufferData(i), GL_STATIC_DRAW);
-        glVertexAttribPointer(i, (GLint)mesh->getVertexBufferSize(i), GL_FLOAT, GL_FALSE, 0, 0);
+        glVertexAttribPointer(attribute, (GLint)mesh->getVertexBufferSize(i), GL_FLOAT, GL_FALSE, 0, 0);
       }
     }
   }
@@ -289,6 +318,7 @@ namespace Bonny
   void GraphicsOpenGL::loadTexture(shared_ptr<Texture> texture)
   {
     glTextureData* textureData = new glTextureData();
+    textureData->m_uploadedMip = texture->getNumMips();
     texture->setGraphicsData(textureData);
 
     size_t width = texture->getWidth();
@@ -297,9 +327,78 @@ namespace Bonny
     glGenTextures(1, &textureData->m_diffuseTextureID);
     glBindTexture(GL_TEXTURE_2D, textureData->m_diffuseTextureID);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexImage2D(GL_TEXTURE_2D, 0, (GLint)texture->getBitsPerPixel(), (GLint)width, (GLint)height,
-      0, texture->getFormat(), GL_UNSIGNED_BYTE, texture->getData());
+    if (texture->getNumMips() == 0)
+    {
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexImage2D(GL_TEXTURE_2D, 0, (GLint)texture->getBitsPerPixel(), (GLint)width, (GLint)height,
+        0, texture->getFormat(), GL_UNSIGNED_BYTE, texture->getData());
+      return;
+    }
+
+    uploadMips(texture);
+  }
+
+  void GraphicsOpenGL::updateTexture(shared_ptr<Texture> texture)
+  {
+    glTextureData* textureData = (glTextureData*)texture->getGraphicsData();
+    if (textureData == nullptr || texture->getNumMips() == 0)
+    {
+      return;
+    }
+    glBindTexture(GL_TEXTURE_2D, textureData->m_diffuseTextureID);
+    uploadMips(texture);
+  }
+
+  void GraphicsOpenGL::uploadMips(shared_ptr<Texture> texture)
+  {
+    // Processed textures upload their resident levels, compressed levels as they are. The base level
+    // clamps sampling to them, levels streamed out keep their old contents but are never read.
+    // Level data does not change while streaming, so only levels finer than any uploaded before go up.
+    glTextureData* textureData = (glTextureData*)texture->getGraphicsData();
+    bool srgb = (texture->getUsage() == Texture::USAGE_COLOR);
+    GLenum internalFormat = 0;
+    switch (texture->getCompression())
+    {
+    case Texture::COMPRESSION_BC1:
+      internalFormat = srgb ? GL_COMPRESSED_SRGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+      break;
+    case Texture::COMPRESSION_BC3:
+      internalFormat = srgb ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+      break;
+    case Texture::COMPRESSION_BC5:
+      internalFormat = GL_COMPRESSED_RG_RGTC2;
+      break;
+    case Texture::COMPRESSION_BC7:
+      internalFormat = srgb ? GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM : GL_COMPRESSED_RGBA_BPTC_UNORM;
+      break;
+    default:
+      internalFormat = srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+      break;
+    }
+
+    uint32_t numMips = texture->getNumMips();
+    uint32_t residentMip = std::min(texture->getResidentMip(), numMips - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, numMips > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, (GLint)residentMip);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)numMips - 1);
+    uint32_t uploadedMip = std::min(textureData->m_uploadedMip, numMips);
+    uint32_t level = residentMip;
+    for (; level < uploadedMip && texture->getMipData(level) != nullptr; level++)
+    {
+      const Texture::Mip& mip = texture->getMip(level);
+      if (texture->getCompression() == Texture::COMPRESSION_NONE)
+      {
+        glTexImage2D(GL_TEXTURE_2D, level, internalFormat, mip.m_width, mip.m_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, texture->getMipData(level));
+      }
+      else
+      {
+        glCompressedTexImage2D(GL_TEXTURE_2D, level, internalFormat, mip.m_width, mip.m_height, 0, (GLsizei)mip.m_size, texture->getMipData(level));
+      }
+    }
+    if (level >= uploadedMip)
+    {
+      textureData->m_uploadedMip = std::min(uploadedMip, residentMip);
+    }
   }
 
   void GraphicsOpenGL::createView(shared_ptr<View> view)
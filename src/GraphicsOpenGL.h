@@ -42,11 +42,14 @@ namespace Bonny
     void                resize(uint32_t width, uint32_t height);
 
     void                buildBuffers(vector<shared_ptr<RenderComponent>>& renderComponents);
+    void                appendBuffers(vector<shared_ptr<RenderComponent>>& renderComponents);
     void                createPipeline(shared_ptr<Pipeline>, shared_ptr<Mesh>, shared_ptr<Material>);
+    void                updateTexture(shared_ptr<Texture> texture);
 
     void                beginCommands(shared_ptr<View> view, uint32_t frameIndex);
     void                bindPipeline(shared_ptr<View> view, shared_ptr<Pipeline> pipeline, uint32_t frameIndex);
     void                draw(shared_ptr<View> view, shared_ptr<Mesh>, shared_ptr<Material>, uint32_t frameIndex);
+    void                drawRange(shared_ptr<View> view, shared_ptr<Mesh>, shared_ptr<Material>, uint32_t indexStart, uint32_t numIndices, uint32_t frameIndex);
     void                compute(shared_ptr<View> view);
     void                trace(shared_ptr<View> view);
     void                endCommands(shared_ptr<View> view, uint32_t frameIndex);
@@ -69,8 +72,11 @@ namespace Bonny
     // Per texture graphics data
     struct glTextureData
     {
-      GLuint m_diffuseTextureID;
-      GLuint m_diffuseTextureLocation;
+      GLuint    m_diffuseTextureID;
+      GLuint    m_diffuseTextureLocation;
+
+      // Finest level with contents on the GPU, the number of mips before the first upload
+      uint32_t  m_uploadedMip;
     };
 
     // Per material graphics data
@@ -134,6 +140,7 @@ namespace Bonny
     };
 
     void          loadTexture(shared_ptr<Texture> texture);
+    void          uploadMips(shared_ptr<Texture> texture);
     vector<char>  readFile(const string& filename);
     void          render(shared_ptr<Material> material);
 
@@ -0,0 +1,298 @@
+#include "stdafx.h"
+#include "JobSystem.h"
+
+#include <algorithm>
+
+namespace Bonny
+{
+  // Queue of the worker running on this thread, external threads share the last queue
+  static thread_local JobSystem*  t_jobSystem = nullptr;
+  static thread_local uint32_t    t_queueIndex = 0;
+
+  JobSystem::JobSystem(uint32_t numThreads) :
+    m_numThreads(numThreads),
+    m_numQueued(0),
+    m_shutdown(false)
+  {
+    for (uint32_t i = 0; i < m_numThreads + 1; ++i)
+    {
+      m_queues.push_back(new WorkQueue());
+    }
+
+    for (uint32_t i = 0; i < m_numThreads; ++i)
+    {
+      m_threads.push_back(thread(&JobSystem::workerLoop, this, i));
+    }
+  }
+
+
+  JobSystem::~JobSystem()
+  {
+    {
+      std::lock_guard<mutex> lock(m_wakeMutex);
+      m_shutdown = true;
+    }
+    m_wakeCondition.notify_all();
+
+    for (size_t i = 0; i < m_threads.size(); ++i)
+    {
+      m_threads[i].join();
+    }
+
+    for (size_t i = 0; i < m_queues.size(); ++i)
+    {
+      delete m_queues[i];
+    }
+  }
+
+  uint32_t JobSystem::defaultNumThreads()
+  {
+    uint32_t hardwareThreads = thread::hardware_concurrency();
+    return hardwareThreads > 1 ? hardwareThreads - 1 : 0;
+  }
+
+  uint32_t JobSystem::numThreads()
+  {
+    return m_numThreads;
+  }
+
+  bool JobSystem::isSingleThreaded()
+  {
+    return m_numThreads == 0;
+  }
+
+  JobSystem::JobHandle JobSystem::schedule(JobFunction function, const vector<JobHandle>& dependencies)
+  {
+    JobHandle job = createJob(function, nullptr);
+    addDependencies(job, dependencies);
+    return job;
+  }
+
+  JobSystem::JobHandle JobSystem::parallelFor(uint32_t count, uint32_t grainSize, RangeFunction function, const vector<JobHandle>& dependencies)
+  {
+    if (grainSize == 0)
+    {
+      grainSize = 1;
+    }
+
+    uint32_t numChildren = (count + grainSize - 1) / grainSize;
+    if (numChildren <= 1)
+    {
+      return schedule([function, count]() { if (count > 0) function(0, count); }, dependencies);
+    }
+
+    // The group job has no work of its own, it finishes when the last range does
+    JobHandle group = createJob(nullptr, nullptr);
+    group->m_pendingDependencies = 0;
+    group->m_unfinished = numChildren;
+
+    for (uint32_t i = 0; i < numChildren; ++i)
+    {
+      uint32_t begin = i * grainSize;
+      uint32_t end = std::min(begin + grainSize, count);
+      JobHandle child = createJob([function, begin, end]() { function(begin, end); }, group);
+      addDependencies(child, dependencies);
+    }
+    return group;
+  }
+
+  void JobSystem::wait(JobHandle job)
+  {
+    if (job == nullptr)
+    {
+      return;
+    }
+
+    // Help out with queued work instead of blocking
+    uint32_t queueIndex = currentQueueIndex();
+    while (!job->m_finished)
+    {
+      if (!runOneJob(queueIndex))
+      {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  bool JobSystem::isFinished(JobHandle job)
+  {
+    return job == nullptr || job->m_finished;
+  }
+
+  JobSystem::JobHandle JobSystem::createJob(JobFunction function, JobHandle parent)
+  {
+    JobHandle job = std::make_shared<Job>();
+    job->m_function = function;
+    job->m_pendingDependencies = 1;
+    job->m_unfinished = 1;
+    job->m_finished = false;
+    job->m_parent = parent;
+    return job;
+  }
+
+  void JobSystem::addDependencies(JobHandle job, const vector<JobHandle>& dependencies)
+  {
+    for (size_t i = 0; i < dependencies.size(); ++i)
+    {
+      JobHandle dependency = dependencies[i];
+      if (dependency == nullptr)
+      {
+        continue;
+      }
+
+      std::lock_guard<mutex> lock(dependency->m_dependentsMutex);
+      if (!dependency->m_finished)
+      {
+        job->m_pendingDependencies++;
+        dependency->m_dependents.push_back(job);
+      }
+    }
+
+    // Drop the reference held while the dependencies were registered
+    release(job);
+  }
+
+  void JobSystem::release(JobHandle job)
+  {
+    if (job->m_pendingDependencies.fetch_sub(1) == 1)
+    {
+      submit(job);
+    }
+  }
+
+  void JobSystem::submit(JobHandle job)
+  {
+    if (m_numThreads == 0)
+    {
+      execute(job);
+      return;
+    }
+
+    WorkQueue* queue = m_queues[currentQueueIndex()];
+    {
+      std::lock_guard<mutex> lock(queue->m_mutex);
+      queue->m_jobs.push_back(job);
+    }
+
+    {
+      std::lock_guard<mutex> lock(m_wakeMutex);
+      m_numQueued++;
+    }
+    m_wakeCondition.notify_one();
+  }
+
+  void JobSystem::execute(JobHandle job)
+  {
+    if (job->m_function)
+    {
+      job->m_function();
+    }
+    finish(job);
+  }
+
+  void JobSystem::finish(JobHandle job)
+  {
+    if (job->m_unfinished.fetch_sub(1) != 1)
+    {
+      return;
+    }
+
+    vector<JobHandle> dependents;
+    {
+      std::lock_guard<mutex> lock(job->m_dependentsMutex);
+      job->m_finished = true;
+      dependents.swap(job->m_dependents);
+    }
+
+    for (size_t i = 0; i < dependents.size(); ++i)
+    {
+      release(dependents[i]);
+    }
+
+    if (job->m_parent != nullptr)
+    {
+      JobHandle parent = job->m_parent;
+      job->m_parent = nullptr;
+      finish(parent);
+    }
+  }
+
+  bool JobSystem::runOneJob(uint32_t queueIndex)
+  {
+    JobHandle job = popJob(queueIndex);
+    if (job == nullptr)
+    {
+      job = stealJob(queueIndex);
+    }
+
+    if (job == nullptr)
+    {
+      return false;
+    }
+
+    m_numQueued--;
+    execute(job);
+    return true;
+  }
+
+  JobSystem::JobHandle JobSystem::popJob(uint32_t queueIndex)
+  {
+    WorkQueue* queue = m_queues[queueIndex];
+    std::lock_guard<mutex> lock(queue->m_mutex);
+    if (queue->m_jobs.empty())
+    {
+      return nullptr;
+    }
+
+    JobHandle job = queue->m_jobs.back();
+    queue->m_jobs.pop_back();
+    return job;
+  }
+
+  JobSystem::JobHandle JobSystem::stealJob(uint32_t queueIndex)
+  {
+    uint32_t numQueues = (uint32_t)m_queues.size();
+    for (uint32_t i = 1; i < numQueues; ++i)
+    {
+      WorkQueue* queue = m_queues[(queueIndex + i) % numQueues];
+      std::lock_guard<mutex> lock(queue->m_mutex);
+      if (!queue->m_jobs.empty())
+      {
+        JobHandle job = queue->m_jobs.front();
+        queue->m_jobs.pop_front();
+        return job;
+      }
+    }
+    return nullptr;
+  }
+
+  uint32_t JobSystem::currentQueueIndex()
+  {
+    if (t_jobSystem == this)
+    {
+      return t_queueIndex;
+    }
+    return m_numThreads;
+  }
+
+  void JobSystem::workerLoop(uint32_t workerIndex)
+  {
+    t_jobSystem = this;
+    t_queueIndex = workerIndex;
+
+    while (true)
+    {
+      if (runOneJob(workerIndex))
+      {
+        continue;
+      }
+
+      std::unique_lock<mutex> lock(m_wakeMutex);
+      m_wakeCondition.wait(lock, [this]() { return m_shutdown || m_numQueued > 0; });
+      if (m_shutdown)
+      {
+        return;
+      }
+    }
+  }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+using std::vector;
+using std::deque;
+using std::shared_ptr;
+using std::function;
+using std::atomic;
+using std::mutex;
+using std::condition_variable;
+using std::thread;
+
+namespace Bonny
+{
+  // Work stealing job scheduler. Every worker owns a queue it pushes to and pops
+  // from at the back, idle workers steal from the front of the other queues.
+  // Jobs run once all of their dependencies have finished. With zero worker
+  // threads every job runs inline on the scheduling thread in submission order,
+  // which gives a deterministic single thread mode for debugging.
+  class JobSystem
+  {
+  public:
+    typedef function<void()>                          JobFunction;
+    typedef function<void(uint32_t, uint32_t)>       RangeFunction;
+
+    struct Job
+    {
+      JobFunction           m_function;
+      atomic<int32_t>       m_pendingDependencies;
+      atomic<int32_t>       m_unfinished;
+      atomic<bool>          m_finished;
+      shared_ptr<Job>       m_parent;
+      mutex                 m_dependentsMutex;
+      vector<shared_ptr<Job>> m_dependents;
+    };
+
+    typedef shared_ptr<Job>  JobHandle;
+
+    JobSystem(uint32_t numThreads);
+    ~JobSystem();
+
+    uint32_t        numThreads();
+    bool            isSingleThreaded();
+
+    JobHandle       schedule(JobFunction function, const vector<JobHandle>& dependencies);
+    JobHandle       parallelFor(uint32_t count, uint32_t grainSize, RangeFunction function, const vector<JobHandle>& dependencies);
+    void            wait(JobHandle job);
+    bool            isFinished(JobHandle job);
+
+    static uint32_t defaultNumThreads();
+
+  private:
+    struct WorkQueue
+    {
+      mutex             m_mutex;
+      deque<JobHandle>  m_jobs;
+    };
+
+    JobHandle       createJob(JobFunction function, JobHandle parent);
+    void            addDependencies(JobHandle job, const vector<JobHandle>& dependencies);
+    void            release(JobHandle job);
+    void            submit(JobHandle job);
+    void            execute(JobHandle job);
+    void            finish(JobHandle job);
+    bool            runOneJob(uint32_t queueIndex);
+    JobHandle       popJob(uint32_t queueIndex);
+    JobHandle       stealJob(uint32_t queueIndex);
+    uint32_t        currentQueueIndex();
+    void            workerLoop(uint32_t workerIndex);
+
+    uint32_t                  m_numThreads;
+    vector<thread>            m_threads;
+    vector<WorkQueue*>        m_queues;
+    atomic<int32_t>           m_numQueued;
+    atomic<bool>              m_shutdown;
+    mutex                     m_wakeMutex;
+    condition_variable        m_wakeCondition;
+  };
+}
+
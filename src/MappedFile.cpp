@@ -0,0 +1,88 @@
+#include "stdafx.h"
+#include "MappedFile.h"
+
+namespace Bonny
+{
+  MappedFile::MappedFile() :
+    m_file(INVALID_HANDLE_VALUE),
+    m_mapping(nullptr),
+    m_data(nullptr),
+    m_size(0)
+  {
+  }
+
+
+  MappedFile::~MappedFile()
+  {
+    close();
+  }
+
+  bool MappedFile::open(const string& filename)
+  {
+    close();
+
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+      return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+    {
+      close();
+      return false;
+    }
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    if (m_mapping == nullptr)
+    {
+      close();
+      return false;
+    }
+
+    m_data = (uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_COPY, 0, 0, 0);
+    if (m_data == nullptr)
+    {
+      close();
+      return false;
+    }
+    m_size = (size_t)size.QuadPart;
+    return true;
+  }
+
+  void MappedFile::close()
+  {
+    if (m_data != nullptr)
+    {
+      UnmapViewOfFile(m_data);
+      m_data = nullptr;
+    }
+    if (m_mapping != nullptr)
+    {
+      CloseHandle(m_mapping);
+      m_mapping = nullptr;
+    }
+    if (m_file != INVALID_HANDLE_VALUE)
+    {
+      CloseHandle(m_file);
+      m_file = INVALID_HANDLE_VALUE;
+    }
+    m_size = 0;
+  }
+
+  bool MappedFile::isOpen()
+  {
+    return m_data != nullptr;
+  }
+
+  uint8_t* MappedFile::getData()
+  {
+    return m_data;
+  }
+
+  size_t MappedFile::getSize()
+  {
+    return m_size;
+  }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+using std::string;
+
+namespace Bonny
+{
+  // A whole file mapped into memory. Pages are copy on write, so the data can be
+  // patched in place without touching the file and only the touched pages cost
+  // private memory.
+  class MappedFile
+  {
+  public:
+    MappedFile();
+    ~MappedFile();
+
+    bool            open(const string& filename);
+    void            close();
+    bool            isOpen();
+    uint8_t*        getData();
+    size_t          getSize();
+
+  private:
+    // Win32 handles, held as void* so including this header doesn't need windows.h
+    void*           m_file;
+    void*           m_mapping;
+    uint8_t*        m_data;
+    size_t          m_size;
+  };
+}
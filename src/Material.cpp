@@ -29,6 +29,11 @@ namespace Bonny
   {
   }
 
+  const string& Material::getName()
+  {
+    return m_name;
+  }
+
   Material::Type Material::getMaterialType()
   {
     return m_materialType;
@@ -89,6 +94,49 @@ namespace Bonny
     return m_occlusionTexture;
   }
 
+  void Material::setTexture(TextureSlot slot, shared_ptr<Texture> texture)
+  {
+    switch (slot)
+    {
+    case ALBEDO_TEXTURE:
+      setAlbedoTexture(texture);
+      break;
+    case NORMAL_TEXTURE:
+      setNormalTexture(texture);
+      break;
+    case METALLIC_ROUGHNESS_TEXTURE:
+      setMetallicRoughnessTexture(texture);
+      break;
+    case OCCLUSION_TEXTURE:
+      setOcclusionTexture(texture);
+      break;
+    case EMISSIVE_TEXTURE:
+      setEmissiveTexture(texture);
+      break;
+    default:
+      break;
+    }
+  }
+
+  shared_ptr<Texture> Material::getTexture(TextureSlot slot)
+  {
+    switch (slot)
+    {
+    case ALBEDO_TEXTURE:
+      return m_albedoTexture;
+    case NORMAL_TEXTURE:
+      return m_normalTexture;
+    case METALLIC_ROUGHNESS_TEXTURE:
+      return m_metallicRoughnessTexture;
+    case OCCLUSION_TEXTURE:
+      return m_occlusionTexture;
+    case EMISSIVE_TEXTURE:
+      return m_emissiveTexture;
+    default:
+      return nullptr;
+    }
+  }
+
   bool Material::hasNoTexture()
   {
     return m_noTexture;
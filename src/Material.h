@@ -36,9 +36,21 @@ namespace Bonny
 	    DEPTH_PREPASS
     };
 
+    // Texture inputs by role, for code that fills them generically
+    enum TextureSlot
+    {
+      ALBEDO_TEXTURE = 0,
+      NORMAL_TEXTURE,
+      METALLIC_ROUGHNESS_TEXTURE,
+      OCCLUSION_TEXTURE,
+      EMISSIVE_TEXTURE,
+      NUM_TEXTURE_SLOTS
+    };
+
     Material(string name, Type type);
     ~Material();
 
+    const string& getName();
     Type          getMaterialType();
 
     // Texture Data (Takes precedence over scalar values
@@ -52,6 +64,8 @@ namespace Bonny
     shared_ptr<Texture> getOcclusionTexture();
     void                setEmissiveTexture(shared_ptr<Texture> texture);
     shared_ptr<Texture> getEmissiveTexture();
+    void                setTexture(TextureSlot slot, shared_ptr<Texture> texture);
+    shared_ptr<Texture> getTexture(TextureSlot slot);
     bool                hasNoTexture();
 
     void          setAlbedoColor(vec4& albedoColor);
@@ -1,24 +1,56 @@
 #include "stdafx.h"
 #include "Mesh.h"
+#include "BufferStats.h"
 
 #include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+using std::vector;
+using std::make_shared;
 
 using std::memcpy;
+using std::memset;
 
 namespace Bonny
 {
+  // Largest ACMR increase allowed when clusters are split for overdraw ordering
+  static const float c_overdrawThreshold = 1.05f;
+
+  // A level has to drop at least this share of the previous level's triangles to be kept
+  static const float c_minLodReduction = 0.1f;
+  static const size_t c_minLodTriangles = 16;
+
+  // Coarsest error any LOD may reach, relative to the diagonal of the mesh bounds
+  static const float c_maxLodError = 0.02f;
+
   Mesh::Mesh(string name, Primitive primitive, size_t numVerts, size_t numVertexArrayBuffers):
     m_name(name),
     m_primitive(primitive),
     m_numVerts(numVerts),
     m_numVertexArrayBuffers(numVertexArrayBuffers),
+    m_indexBuffer(nullptr),
+    m_indexBufferSize(0),
+    m_ownsIndexBuffer(false),
+    m_validIndices(true),
+    m_lodIndexBuffer(nullptr),
+    m_lodIndexBufferSize(0),
     m_graphicsData(nullptr),
-    m_dirty(true)
+    m_dirty(true),
+    m_hasBounds(false),
+    m_sphereRadius(0.0f),
+    m_uvDensity(-1.0f)
   {
     m_vertexData = new struct vertexData[numVertexArrayBuffers];
     for (size_t i = 0; i < numVertexArrayBuffers; i++)
     {
       m_vertexData[i].data = nullptr;
+      m_vertexData[i].owned = false;
+    }
+    for (int i = 0; i < NUM_ATTRIBUTES; i++)
+    {
+      m_attributeBuffers[i] = -1;
     }
   }
 
@@ -27,12 +59,21 @@ namespace Bonny
   {
     for (size_t i = 0; i < m_numVertexArrayBuffers; i++)
     {
-      if (m_vertexData[i].data != nullptr)
+      if (m_vertexData[i].data != nullptr && m_vertexData[i].owned)
       { 
-        delete m_vertexData[i].data;
+        delete[] m_vertexData[i].data;
       }
     }
-    delete m_vertexData;
+    delete[] m_vertexData;
+    if (m_ownsIndexBuffer)
+    {
+      delete[] m_indexBuffer;
+    }
+  }
+
+  const string& Mesh::getName()
+  {
+    return m_name;
   }
 
   Mesh::Primitive Mesh::getPrimitive()
@@ -50,34 +91,121 @@ namespace Bonny
     return m_renderComponent;
   }
 
-  void Mesh::addVertexBuffer(unsigned int index, size_t size, size_t numBytes, float* data)
+  void Mesh::addVertexBuffer(unsigned int index, size_t size, size_t numBytes, const float* data)
   {
-    unsigned int dindex = 0;
+    addVertexBuffer(index, index < NUM_ATTRIBUTES ? (Attribute)index : NUM_ATTRIBUTES, size, numBytes, data);
+  }
 
+  void Mesh::addVertexBuffer(unsigned int index, Attribute attribute, size_t size, size_t numBytes, const float* data)
+  {
+    float* copy = new float[m_numVerts * size];
+    memcpy(copy, data, numBytes);
+    BufferStats::recordCopy(numBytes);
+    setVertexBuffer(index, attribute, size, numBytes, copy, true);
+  }
+
+  void Mesh::addVertexBuffer(unsigned int index, Attribute attribute, size_t size, unique_ptr<float[]> data)
+  {
+    // The mesh takes the caller's array as it is, it has to hold m_numVerts * size floats
+    size_t numBytes = m_numVerts * size * sizeof(float);
+    BufferStats::recordAdopt(numBytes);
+    setVertexBuffer(index, attribute, size, numBytes, data.release(), true);
+  }
+
+  void Mesh::setVertexBuffer(unsigned int index, Attribute attribute, size_t size, size_t numBytes, float* data, bool owned)
+  {
+    if (attribute < NUM_ATTRIBUTES)
+    {
+      m_attributeBuffers[attribute] = (int)index;
+    }
+
+    if (m_vertexData[index].data != nullptr && m_vertexData[index].owned)
+    {
+      delete[] m_vertexData[index].data;
+    }
     m_vertexData[index].size = size;
     m_vertexData[index].numBytes = numBytes;
-    m_vertexData[index].data = new float[m_numVerts*size * sizeof(float)];
-    memcpy(m_vertexData[index].data, data, numBytes);
+    m_vertexData[index].data = data;
+    m_vertexData[index].owned = owned;
     m_dirty = true;
-    //for (unsigned int i = 0; i<m_numVerts; i++)
-    //{
-    //  for (unsigned int j = 0; j<size; j++)
-    //  {
-    //    m_vertexData[index].data[dindex] = data[dindex++];
-    //  }
-    //}
+    m_uvDensity = -1.0f;
+    if (index == 0)
+    {
+      computeBounds();
+    }
+  }
+
+  void Mesh::addIndexBuffer(size_t size, const unsigned int* data)
+  {
+    unsigned int* copy = new unsigned int[size];
+    memcpy(copy, data, size * sizeof(unsigned int));
+    BufferStats::recordCopy(size * sizeof(unsigned int));
+    setIndexBuffer(size, copy, true);
+  }
+
+  void Mesh::addIndexBuffer(size_t size, unique_ptr<unsigned int[]> data)
+  {
+    BufferStats::recordAdopt(size * sizeof(unsigned int));
+    setIndexBuffer(size, data.release(), true);
   }
 
-  void Mesh::addIndexBuffer(size_t size, unsigned int* data)
+  void Mesh::setIndexBuffer(size_t size, unsigned int* data, bool owned)
   {
+    // Only buffers the mesh allocated or adopted are freed, views point into someone else's storage
+    if (m_ownsIndexBuffer)
+    {
+      delete[] m_indexBuffer;
+    }
     m_indexBufferSize = size;
-    m_indexBuffer = new unsigned int[size];
-    memcpy(m_indexBuffer, data, size*sizeof(unsigned int));
+    m_indexBuffer = data;
+    m_ownsIndexBuffer = owned;
     m_dirty = true;
-    //for (unsigned int i = 0; i<size; i++)
-    //{
-    //  m_indexBuffer[i] = data[i];
-    //}
+    m_uvDensity = -1.0f;
+
+    // Checked once here, everything reading vertices through the indices skips meshes with indices past the vertices.
+    // Hierarchies and meshlets of the old indices would point at the wrong triangles.
+    m_validIndices = true;
+    for (size_t i = 0; i < size && m_validIndices; i++)
+    {
+      m_validIndices = data[i] < m_numVerts;
+    }
+    m_bvh = nullptr;
+    m_meshlets = nullptr;
+  }
+
+  void Mesh::setVertexBufferView(unsigned int index, Attribute attribute, size_t size, size_t numBytes, float* data)
+  {
+    setVertexBuffer(index, attribute, size, numBytes, data, false);
+  }
+
+  void Mesh::setIndexBufferView(size_t size, unsigned int* data)
+  {
+    setIndexBuffer(size, data, false);
+  }
+
+  void Mesh::setLodView(const Lod* lods, uint32_t numLods, const unsigned int* lodIndices, size_t numLodIndices)
+  {
+    m_lods.assign(lods, lods + numLods);
+    m_lodIndices.clear();
+    m_lodIndexBuffer = lodIndices;
+    m_lodIndexBufferSize = numLodIndices;
+    m_dirty = true;
+  }
+
+  void Mesh::setExternalStorage(shared_ptr<MappedFile> storage)
+  {
+    m_externalStorage = storage;
+  }
+
+  int Mesh::getAttributeBuffer(Attribute attribute)
+  {
+    return m_attributeBuffers[attribute];
+  }
+
+  bool Mesh::hasAttribute(Attribute attribute)
+  {
+    int index = m_attributeBuffers[attribute];
+    return index >= 0 && m_vertexData[index].data != nullptr;
   }
 
   size_t Mesh::getVertexBufferSize(size_t index)
@@ -144,4 +272,423 @@ namespace Bonny
   {
     return m_dirty;
   }
+
+  bool Mesh::hasBounds()
+  {
+    return m_hasBounds;
+  }
+
+  void Mesh::getLocalBounds(vec3& boundsMin, vec3& boundsMax)
+  {
+    boundsMin = m_boundsMin;
+    boundsMax = m_boundsMax;
+  }
+
+  void Mesh::getBoundingSphere(vec3& center, float& radius)
+  {
+    center = m_sphereCenter;
+    radius = m_sphereRadius;
+  }
+
+  float Mesh::getUvDensity()
+  {
+    if (m_uvDensity < 0.0f)
+    {
+      computeUvDensity();
+    }
+    return m_uvDensity;
+  }
+
+  void Mesh::buildBvh()
+  {
+    if (m_primitive != TRIANGLES || !m_hasBounds || m_indexBufferSize < 3 || !m_validIndices)
+    {
+      return;
+    }
+
+    // Triangle bounds in mesh space
+    size_t stride = m_vertexData[0].size;
+    float* positions = m_vertexData[0].data;
+    uint32_t numTriangles = (uint32_t)(m_indexBufferSize / 3);
+    vector<vec3> boundsMin(numTriangles);
+    vector<vec3> boundsMax(numTriangles);
+    for (uint32_t i = 0; i < numTriangles; i++)
+    {
+      float* p0 = &positions[m_indexBuffer[i * 3] * stride];
+      float* p1 = &positions[m_indexBuffer[i * 3 + 1] * stride];
+      float* p2 = &positions[m_indexBuffer[i * 3 + 2] * stride];
+      boundsMin[i] = glm::min(glm::min(vec3(p0[0], p0[1], p0[2]), vec3(p1[0], p1[1], p1[2])), vec3(p2[0], p2[1], p2[2]));
+      boundsMax[i] = glm::max(glm::max(vec3(p0[0], p0[1], p0[2]), vec3(p1[0], p1[1], p1[2])), vec3(p2[0], p2[1], p2[2]));
+    }
+
+    m_bvh = make_shared<Bvh>();
+    m_bvh->build(boundsMin.data(), boundsMax.data(), numTriangles);
+  }
+
+  void Mesh::optimize(uint32_t cacheSize, MeshOptimizer::Report& report)
+  {
+    memset(&report, 0, sizeof(report));
+    report.m_numVertices = (uint32_t)m_numVerts;
+    report.m_numTriangles = (uint32_t)(m_indexBufferSize / 3);
+    if (m_primitive != TRIANGLES || m_indexBuffer == nullptr || m_indexBufferSize < 3 || m_indexBufferSize % 3 != 0 || !m_validIndices)
+    {
+      return;
+    }
+    for (size_t i = 0; i < m_numVertexArrayBuffers; i++)
+    {
+      if (m_vertexData[i].data != nullptr && m_vertexData[i].numBytes < m_numVerts * m_vertexData[i].size * sizeof(float))
+      {
+        return;
+      }
+    }
+
+    report.m_numVertices = MeshOptimizer::countReferencedVertices(m_indexBuffer, m_indexBufferSize, m_numVerts);
+    report.m_acmrBefore = MeshOptimizer::computeAcmr(m_indexBuffer, m_indexBufferSize, m_numVerts, cacheSize);
+    report.m_atvrBefore = MeshOptimizer::computeAtvr(m_indexBuffer, m_indexBufferSize, m_numVerts, cacheSize);
+
+    vector<uint32_t> clusters;
+    vector<uint32_t> cacheOrder(m_indexBufferSize);
+    MeshOptimizer::optimizeVertexCache(m_indexBuffer, m_indexBufferSize, m_numVerts, cacheSize, cacheOrder.data(), clusters);
+    if (m_hasBounds)
+    {
+      MeshOptimizer::optimizeOverdraw(cacheOrder.data(), m_indexBufferSize, m_vertexData[0].data, m_vertexData[0].size, cacheSize,
+        c_overdrawThreshold, clusters, m_indexBuffer);
+    }
+    else
+    {
+      memcpy(m_indexBuffer, cacheOrder.data(), m_indexBufferSize * sizeof(unsigned int));
+    }
+
+    // Move every vertex buffer to the new vertex order
+    vector<uint32_t> remap;
+    MeshOptimizer::optimizeVertexFetch(m_indexBuffer, m_indexBufferSize, m_numVerts, remap);
+    vector<float> reordered;
+    for (size_t i = 0; i < m_numVertexArrayBuffers; i++)
+    {
+      float* data = m_vertexData[i].data;
+      size_t size = m_vertexData[i].size;
+      if (data == nullptr)
+      {
+        continue;
+      }
+      reordered.resize(m_numVerts * size);
+      for (size_t v = 0; v < m_numVerts; v++)
+      {
+        memcpy(&reordered[remap[v] * size], &data[v * size], size * sizeof(float));
+      }
+      memcpy(data, reordered.data(), m_numVerts * size * sizeof(float));
+    }
+
+    report.m_numClusters = (uint32_t)clusters.size();
+    report.m_acmrAfter = MeshOptimizer::computeAcmr(m_indexBuffer, m_indexBufferSize, m_numVerts, cacheSize);
+    report.m_atvrAfter = MeshOptimizer::computeAtvr(m_indexBuffer, m_indexBufferSize, m_numVerts, cacheSize);
+    report.m_optimized = true;
+
+    // Triangle numbers changed, the BVH, meshlets and LODs have to be built again
+    m_bvh = nullptr;
+    m_meshlets = nullptr;
+    m_lods.clear();
+    m_lodIndices.clear();
+    m_lodIndexBuffer = nullptr;
+    m_lodIndexBufferSize = 0;
+    m_dirty = true;
+  }
+
+  shared_ptr<Bvh> Mesh::getBvh()
+  {
+    return m_bvh;
+  }
+
+  void Mesh::buildMeshlets()
+  {
+    if (m_primitive != TRIANGLES || !m_hasBounds || m_indexBufferSize < 3 || !m_validIndices)
+    {
+      return;
+    }
+
+    m_meshlets = make_shared<Meshlets>();
+    m_meshlets->build(m_indexBuffer, m_indexBufferSize, m_vertexData[0].data, m_vertexData[0].size, m_numVerts);
+  }
+
+  shared_ptr<Meshlets> Mesh::getMeshlets()
+  {
+    return m_meshlets;
+  }
+
+  void Mesh::buildLods(uint32_t maxLods, float reduction)
+  {
+    m_lods.clear();
+    m_lodIndices.clear();
+    m_lodIndexBuffer = nullptr;
+    m_lodIndexBufferSize = 0;
+    if (m_primitive != TRIANGLES || !m_hasBounds || m_indexBufferSize < 3 || !m_validIndices)
+    {
+      return;
+    }
+
+    Lod full = { 0, (uint32_t)m_indexBufferSize, 0.0f };
+    m_lods.push_back(full);
+
+    // Every level simplifies the one before it, its error bounded by the sum of the errors along the chain
+    vector<uint32_t> current(m_indexBuffer, m_indexBuffer + (m_indexBufferSize / 3) * 3);
+    vector<uint32_t> simplified;
+    vector<uint32_t> cacheOrder;
+    vector<uint32_t> clusters;
+    float error = 0.0f;
+    float maxError = glm::length(m_boundsMax - m_boundsMin) * c_maxLodError;
+    maxLods = std::min(maxLods, c_maxLods);
+    for (uint32_t level = 1; level < maxLods; level++)
+    {
+      size_t targetIndexCount = (size_t)(current.size() / 3 * reduction) * 3;
+      if (targetIndexCount < c_minLodTriangles * 3)
+      {
+        break;
+      }
+      float levelError = MeshSimplifier::simplify(current.data(), current.size(), m_vertexData[0].data, m_vertexData[0].size, m_numVerts,
+        targetIndexCount, maxError - error, simplified);
+      if (simplified.empty() || (float)simplified.size() > (float)current.size() * (1.0f - c_minLodReduction))
+      {
+        break;
+      }
+      error += levelError;
+
+      cacheOrder.resize(simplified.size());
+      MeshOptimizer::optimizeVertexCache(simplified.data(), simplified.size(), m_numVerts, MeshOptimizer::c_defaultCacheSize, cacheOrder.data(),
+        clusters);
+      Lod lod = { (uint32_t)(m_indexBufferSize + m_lodIndices.size()), (uint32_t)cacheOrder.size(), error };
+      m_lods.push_back(lod);
+      m_lodIndices.insert(m_lodIndices.end(), cacheOrder.begin(), cacheOrder.end());
+      current.swap(cacheOrder);
+    }
+    m_lodIndexBuffer = m_lodIndices.data();
+    m_lodIndexBufferSize = m_lodIndices.size();
+    m_dirty = true;
+  }
+
+  uint32_t Mesh::getNumLods()
+  {
+    return (uint32_t)m_lods.size();
+  }
+
+  const Mesh::Lod& Mesh::getLod(uint32_t level)
+  {
+    return m_lods[level];
+  }
+
+  const unsigned int* Mesh::getLodIndexBuffer()
+  {
+    return m_lodIndexBuffer;
+  }
+
+  size_t Mesh::getLodIndexBufferSize()
+  {
+    return m_lodIndexBufferSize;
+  }
+
+  bool Mesh::intersectRay(const vec3& origin, const vec3& direction, float& distance, uint32_t& triangle, float& u, float& v, bool anyHit)
+  {
+    if (m_bvh == nullptr || !m_validIndices)
+    {
+      return false;
+    }
+
+    size_t stride = m_vertexData[0].size;
+    float* positions = m_vertexData[0].data;
+    unsigned int* indices = m_indexBuffer;
+
+    // Moller-Trumbore against the triangles of every leaf the ray reaches
+    return m_bvh->intersectRay(origin, direction, distance, [&](uint32_t primitive, float& maxDistance)
+    {
+      float* p0 = &positions[indices[primitive * 3] * stride];
+      float* p1 = &positions[indices[primitive * 3 + 1] * stride];
+      float* p2 = &positions[indices[primitive * 3 + 2] * stride];
+      vec3 v0(p0[0], p0[1], p0[2]);
+      vec3 edge1 = vec3(p1[0], p1[1], p1[2]) - v0;
+      vec3 edge2 = vec3(p2[0], p2[1], p2[2]) - v0;
+
+      vec3 p = glm::cross(direction, edge2);
+      float determinant = glm::dot(edge1, p);
+      if (fabs(determinant) < 1e-12f)
+      {
+        return false;
+      }
+
+      float inverseDeterminant = 1.0f / determinant;
+      vec3 s = origin - v0;
+      float hitU = glm::dot(s, p) * inverseDeterminant;
+      if (hitU < 0.0f || hitU > 1.0f)
+      {
+        return false;
+      }
+
+      vec3 q = glm::cross(s, edge1);
+      float hitV = glm::dot(direction, q) * inverseDeterminant;
+      if (hitV < 0.0f || hitU + hitV > 1.0f)
+      {
+        return false;
+      }
+
+      float t = glm::dot(edge2, q) * inverseDeterminant;
+      if (t <= 0.0f || t >= maxDistance)
+      {
+        return false;
+      }
+
+      maxDistance = t;
+      triangle = primitive;
+      u = hitU;
+      v = hitV;
+      return true;
+    }, anyHit);
+  }
+
+  int Mesh::intersectRayPacket(Bvh::RayPacket& packet, int activeMask, uint32_t triangles[4], float u[4], float v[4])
+  {
+    if (m_bvh == nullptr || !m_validIndices)
+    {
+      return 0;
+    }
+
+    size_t stride = m_vertexData[0].size;
+    float* positions = m_vertexData[0].data;
+    unsigned int* indices = m_indexBuffer;
+    int hitMask = 0;
+
+    // Moller-Trumbore with the four rays of the packet against one triangle at a time
+    m_bvh->intersectPacket(packet, activeMask, [&](uint32_t primitive, int mask)
+    {
+      float* p0 = &positions[indices[primitive * 3] * stride];
+      float* p1 = &positions[indices[primitive * 3 + 1] * stride];
+      float* p2 = &positions[indices[primitive * 3 + 2] * stride];
+      __m128 edge1X = _mm_set1_ps(p1[0] - p0[0]);
+      __m128 edge1Y = _mm_set1_ps(p1[1] - p0[1]);
+      __m128 edge1Z = _mm_set1_ps(p1[2] - p0[2]);
+      __m128 edge2X = _mm_set1_ps(p2[0] - p0[0]);
+      __m128 edge2Y = _mm_set1_ps(p2[1] - p0[1]);
+      __m128 edge2Z = _mm_set1_ps(p2[2] - p0[2]);
+
+      // p = direction x edge2
+      __m128 pX = _mm_sub_ps(_mm_mul_ps(packet.m_directionY, edge2Z), _mm_mul_ps(packet.m_directionZ, edge2Y));
+      __m128 pY = _mm_sub_ps(_mm_mul_ps(packet.m_directionZ, edge2X), _mm_mul_ps(packet.m_directionX, edge2Z));
+      __m128 pZ = _mm_sub_ps(_mm_mul_ps(packet.m_directionX, edge2Y), _mm_mul_ps(packet.m_directionY, edge2X));
+      __m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge1X, pX), _mm_mul_ps(edge1Y, pY)), _mm_mul_ps(edge1Z, pZ));
+      __m128 absDeterminant = _mm_andnot_ps(_mm_set1_ps(-0.0f), determinant);
+      __m128 valid = _mm_cmpge_ps(absDeterminant, _mm_set1_ps(1e-12f));
+      __m128 inverseDeterminant = _mm_div_ps(_mm_set1_ps(1.0f), determinant);
+
+      __m128 sX = _mm_sub_ps(packet.m_originX, _mm_set1_ps(p0[0]));
+      __m128 sY = _mm_sub_ps(packet.m_originY, _mm_set1_ps(p0[1]));
+      __m128 sZ = _mm_sub_ps(packet.m_originZ, _mm_set1_ps(p0[2]));
+      __m128 hitU = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sX, pX), _mm_mul_ps(sY, pY)), _mm_mul_ps(sZ, pZ)), inverseDeterminant);
+
+      // q = s x edge1
+      __m128 qX = _mm_sub_ps(_mm_mul_ps(sY, edge1Z), _mm_mul_ps(sZ, edge1Y));
+      __m128 qY = _mm_sub_ps(_mm_mul_ps(sZ, edge1X), _mm_mul_ps(sX, edge1Z));
+      __m128 qZ = _mm_sub_ps(_mm_mul_ps(sX, edge1Y), _mm_mul_ps(sY, edge1X));
+      __m128 hitV = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(packet.m_directionX, qX), _mm_mul_ps(packet.m_directionY, qY)), _mm_mul_ps(packet.m_directionZ, qZ)), inverseDeterminant);
+      __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(edge2X, qX), _mm_mul_ps(edge2Y, qY)), _mm_mul_ps(edge2Z, qZ)), inverseDeterminant);
+
+      __m128 zero = _mm_setzero_ps();
+      __m128 one = _mm_set1_ps(1.0f);
+      valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(hitU, zero), _mm_cmple_ps(hitU, one)));
+      valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(hitV, zero), _mm_cmple_ps(_mm_add_ps(hitU, hitV), one)));
+      valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, packet.m_maxDistance)));
+      int laneMask = _mm_movemask_ps(valid) & mask;
+      if (laneMask == 0)
+      {
+        return;
+      }
+
+      for (int i = 0; laneMask != 0; i++, laneMask >>= 1)
+      {
+        if (laneMask & 1)
+        {
+          ((float*)&packet.m_maxDistance)[i] = ((float*)&t)[i];
+          triangles[i] = primitive;
+          u[i] = ((float*)&hitU)[i];
+          v[i] = ((float*)&hitV)[i];
+          hitMask |= 1 << i;
+        }
+      }
+    });
+    return hitMask;
+  }
+
+  void Mesh::getTriangleNormal(uint32_t triangle, vec3& normal)
+  {
+    size_t stride = m_vertexData[0].size;
+    float* p0 = &m_vertexData[0].data[m_indexBuffer[triangle * 3] * stride];
+    float* p1 = &m_vertexData[0].data[m_indexBuffer[triangle * 3 + 1] * stride];
+    float* p2 = &m_vertexData[0].data[m_indexBuffer[triangle * 3 + 2] * stride];
+    vec3 v0(p0[0], p0[1], p0[2]);
+    normal = glm::cross(vec3(p1[0], p1[1], p1[2]) - v0, vec3(p2[0], p2[1], p2[2]) - v0);
+  }
+
+  void Mesh::computeBounds()
+  {
+    // Buffer 0 holds the positions
+    size_t stride = m_vertexData[0].size;
+    float* positions = m_vertexData[0].data;
+    m_hasBounds = stride >= 3 && m_numVerts > 0;
+    if (!m_hasBounds)
+    {
+      return;
+    }
+
+    m_boundsMin = vec3(positions[0], positions[1], positions[2]);
+    m_boundsMax = m_boundsMin;
+    for (size_t i = 1; i < m_numVerts; i++)
+    {
+      vec3 position(positions[i * stride], positions[i * stride + 1], positions[i * stride + 2]);
+      m_boundsMin = glm::min(m_boundsMin, position);
+      m_boundsMax = glm::max(m_boundsMax, position);
+    }
+
+    // Centered on the box, tighter than the box's own bounding sphere
+    m_sphereCenter = (m_boundsMin + m_boundsMax) * 0.5f;
+    float radiusSquared = 0.0f;
+    for (size_t i = 0; i < m_numVerts; i++)
+    {
+      vec3 offset = vec3(positions[i * stride], positions[i * stride + 1], positions[i * stride + 2]) - m_sphereCenter;
+      radiusSquared = std::max(radiusSquared, glm::dot(offset, offset));
+    }
+    m_sphereRadius = sqrt(radiusSquared);
+  }
+
+  void Mesh::computeUvDensity()
+  {
+    // Square root of the texture area over the surface area, the average UV distance per mesh unit.
+    // Meshes without texture coordinates sample no texels and get 0.
+    m_uvDensity = 0.0f;
+    int texcoordBuffer = m_attributeBuffers[TEXCOORD];
+    if (m_primitive != TRIANGLES || !m_hasBounds || texcoordBuffer < 0 || m_vertexData[texcoordBuffer].data == nullptr ||
+        m_vertexData[texcoordBuffer].size < 2 || m_indexBufferSize < 3 || !m_validIndices)
+    {
+      return;
+    }
+
+    size_t stride = m_vertexData[0].size;
+    size_t texcoordStride = m_vertexData[texcoordBuffer].size;
+    const float* positions = m_vertexData[0].data;
+    const float* texcoords = m_vertexData[texcoordBuffer].data;
+    double surfaceArea = 0.0;
+    double texcoordArea = 0.0;
+    for (size_t i = 0; i + 2 < m_indexBufferSize; i += 3)
+    {
+      const float* p0 = &positions[m_indexBuffer[i] * stride];
+      const float* p1 = &positions[m_indexBuffer[i + 1] * stride];
+      const float* p2 = &positions[m_indexBuffer[i + 2] * stride];
+      vec3 v0(p0[0], p0[1], p0[2]);
+      surfaceArea += glm::length(glm::cross(vec3(p1[0], p1[1], p1[2]) - v0, vec3(p2[0], p2[1], p2[2]) - v0));
+
+      const float* t0 = &texcoords[m_indexBuffer[i] * texcoordStride];
+      const float* t1 = &texcoords[m_indexBuffer[i + 1] * texcoordStride];
+      const float* t2 = &texcoords[m_indexBuffer[i + 2] * texcoordStride];
+      texcoordArea += fabs((t1[0] - t0[0]) * (t2[1] - t0[1]) - (t2[0] - t0[0]) * (t1[1] - t0[1]));
+    }
+    if (surfaceArea > 0.0)
+    {
+      m_uvDensity = (float)sqrt(texcoordArea / surfaceArea);
+    }
+  }
 }
\ No newline at end of file
@@ -1,12 +1,20 @@
 #pragma once
 #include "Material.h"
 #include "RenderComponent.h"
+#include "Bvh.h"
+#include "MeshOptimizer.h"
+#include "Meshlets.h"
+#include "MeshSimplifier.h"
+#include "MappedFile.h"
 
 #include <string>
 #include <memory>
+#include <vector>
 
 using std::string;
 using std::shared_ptr;
+using std::unique_ptr;
+using std::vector;
 
 namespace Bonny
 {
@@ -20,12 +28,44 @@ namespace Bonny
       LINES
     };
 
+    // What a vertex buffer holds, buffers added without one map their index
+    // to the attribute of the same value
+    enum Attribute {
+      POSITION,
+      NORMAL,
+      TEXCOORD,
+      TANGENT,
+      BITANGENT,
+      NUM_ATTRIBUTES
+    };
+
+    // One level of detail, a range of the mesh's indices when the LOD indices are
+    // appended to the full resolution ones. The error is in mesh units.
+    struct Lod
+    {
+      uint32_t  m_indexStart;
+      uint32_t  m_numIndices;
+      float     m_error;
+    };
+
+    static const uint32_t c_maxLods = 8;
+
     Mesh(string name, Primitive primitive, size_t numVerts, size_t numVertexArrayBuffers);
     ~Mesh();
 
+    const string&         getName();
     Primitive             getPrimitive();
-    void                  addVertexBuffer(unsigned int index, size_t size, size_t numBytes, float* data);
-    void                  addIndexBuffer(size_t size, unsigned int* data);
+    void                  addVertexBuffer(unsigned int index, size_t size, size_t numBytes, const float* data);
+    void                  addVertexBuffer(unsigned int index, Attribute attribute, size_t size, size_t numBytes, const float* data);
+    void                  addVertexBuffer(unsigned int index, Attribute attribute, size_t size, unique_ptr<float[]> data);
+    int                   getAttributeBuffer(Attribute attribute);
+    bool                  hasAttribute(Attribute attribute);
+    void                  addIndexBuffer(size_t size, const unsigned int* data);
+    void                  addIndexBuffer(size_t size, unique_ptr<unsigned int[]> data);
+    void                  setVertexBufferView(unsigned int index, Attribute attribute, size_t size, size_t numBytes, float* data);
+    void                  setIndexBufferView(size_t size, unsigned int* data);
+    void                  setLodView(const Lod* lods, uint32_t numLods, const unsigned int* lodIndices, size_t numLodIndices);
+    void                  setExternalStorage(shared_ptr<MappedFile> storage);
     size_t                getVertexBufferSize(size_t index);
     size_t                getVertexBufferNumBytes(size_t index);
     float*				        getVertexBufferData(size_t index);
@@ -41,6 +81,23 @@ namespace Bonny
     bool                  isDirty();
     void                  setGraphicsData(void * graphicsData);
     void*                 getGraphicsData();
+    bool                  hasBounds();
+    void                  getLocalBounds(vec3& boundsMin, vec3& boundsMax);
+    void                  getBoundingSphere(vec3& center, float& radius);
+    float                 getUvDensity();
+    void                  buildBvh();
+    shared_ptr<Bvh>       getBvh();
+    void                  buildMeshlets();
+    shared_ptr<Meshlets>  getMeshlets();
+    bool                  intersectRay(const vec3& origin, const vec3& direction, float& distance, uint32_t& triangle, float& u, float& v, bool anyHit);
+    int                   intersectRayPacket(Bvh::RayPacket& packet, int activeMask, uint32_t triangles[4], float u[4], float v[4]);
+    void                  getTriangleNormal(uint32_t triangle, vec3& normal);
+    void                  optimize(uint32_t cacheSize, MeshOptimizer::Report& report);
+    void                  buildLods(uint32_t maxLods, float reduction);
+    uint32_t              getNumLods();
+    const Lod&            getLod(uint32_t level);
+    const unsigned int*   getLodIndexBuffer();
+    size_t                getLodIndexBufferSize();
 
   private:
     struct vertexData
@@ -48,6 +105,7 @@ namespace Bonny
       size_t  size;
       size_t  numBytes;
       float*  data;
+      bool    owned;
     };
  
     string                m_name;
@@ -55,12 +113,35 @@ namespace Bonny
     size_t                m_numVerts;
     size_t                m_numVertexArrayBuffers;
     struct vertexData*    m_vertexData;
+    int                   m_attributeBuffers[NUM_ATTRIBUTES];
     unsigned int*         m_indexBuffer;
     size_t                m_indexBufferSize;
+    bool                  m_ownsIndexBuffer;
+    bool                  m_validIndices;
     shared_ptr<Material>  m_material;
     shared_ptr<RenderComponent>  m_renderComponent;
     bool                  m_dirty;
     void*                 m_graphicsData;
+    bool                  m_hasBounds;
+    vec3                  m_boundsMin;
+    vec3                  m_boundsMax;
+    vec3                  m_sphereCenter;
+    float                 m_sphereRadius;
+    float                 m_uvDensity;
+    shared_ptr<Bvh>       m_bvh;
+    shared_ptr<Meshlets>  m_meshlets;
+    vector<Lod>           m_lods;
+    vector<unsigned int>  m_lodIndices;
+    const unsigned int*   m_lodIndexBuffer;
+    size_t                m_lodIndexBufferSize;
+
+    // Views keep pointing into this storage instead of owning copies
+    shared_ptr<MappedFile> m_externalStorage;
+
+    void                  setVertexBuffer(unsigned int index, Attribute attribute, size_t size, size_t numBytes, float* data, bool owned);
+    void                  setIndexBuffer(size_t size, unsigned int* data, bool owned);
+    void                  computeBounds();
+    void                  computeUvDensity();
   };
 }
 
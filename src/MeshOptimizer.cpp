@@ -0,0 +1,330 @@
+#include "stdafx.h"
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace Bonny
+{
+  // FIFO cache simulated with timestamps, a vertex is cached while fewer than
+  // cacheSize misses happened since it was last loaded
+  struct CacheSimulation
+  {
+    vector<uint32_t>  m_cacheTime;
+    uint32_t          m_time;
+    uint32_t          m_cacheSize;
+
+    CacheSimulation(size_t numVertices, uint32_t cacheSize) :
+      m_cacheTime(numVertices, 0),
+      m_time(cacheSize + 1),
+      m_cacheSize(cacheSize)
+    {
+    }
+
+    uint32_t access(uint32_t vertex)
+    {
+      if (m_time - m_cacheTime[vertex] > m_cacheSize)
+      {
+        m_cacheTime[vertex] = m_time++;
+        return 1;
+      }
+      return 0;
+    }
+
+    // Ages every entry out of the cache
+    void flush()
+    {
+      m_time += m_cacheSize + 1;
+    }
+  };
+
+  // Next vertex with triangles left when the fan ran into a dead end, recently
+  // emitted vertices first and the input order after that
+  static int64_t skipDeadEnd(const vector<uint32_t>& liveTriangles, vector<uint32_t>& deadEnd, size_t& cursor)
+  {
+    while (!deadEnd.empty())
+    {
+      uint32_t vertex = deadEnd.back();
+      deadEnd.pop_back();
+      if (liveTriangles[vertex] > 0)
+      {
+        return vertex;
+      }
+    }
+    while (cursor < liveTriangles.size())
+    {
+      if (liveTriangles[cursor] > 0)
+      {
+        return (int64_t)cursor;
+      }
+      cursor++;
+    }
+    return -1;
+  }
+
+  void MeshOptimizer::optimizeVertexCache(const uint32_t* indices, size_t numIndices, size_t numVertices, uint32_t cacheSize,
+    uint32_t* destination, vector<uint32_t>& clusters)
+  {
+    size_t numTriangles = numIndices / 3;
+    clusters.clear();
+
+    // Triangles around every vertex
+    vector<uint32_t> liveTriangles(numVertices, 0);
+    for (size_t i = 0; i < numTriangles * 3; ++i)
+    {
+      liveTriangles[indices[i]]++;
+    }
+    vector<uint32_t> adjacencyOffsets(numVertices + 1, 0);
+    for (size_t v = 0; v < numVertices; ++v)
+    {
+      adjacencyOffsets[v + 1] = adjacencyOffsets[v] + liveTriangles[v];
+    }
+    vector<uint32_t> adjacency(numTriangles * 3);
+    vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+    for (size_t t = 0; t < numTriangles; ++t)
+    {
+      for (size_t k = 0; k < 3; ++k)
+      {
+        adjacency[fill[indices[t * 3 + k]]++] = (uint32_t)t;
+      }
+    }
+
+    // Tipsify, fan around the current vertex and move on to the neighbour that
+    // will stay in the cache the longest while it still has triangles to emit
+    vector<uint32_t> cacheTime(numVertices, 0);
+    vector<bool> emitted(numTriangles, false);
+    vector<uint32_t> deadEnd;
+    vector<uint32_t> candidates;
+    deadEnd.reserve(numTriangles * 3);
+    uint32_t time = cacheSize + 1;
+    size_t cursor = 0;
+    size_t numEmitted = 0;
+    bool newCluster = true;
+
+    int64_t fanning = skipDeadEnd(liveTriangles, deadEnd, cursor);
+    while (fanning >= 0)
+    {
+      candidates.clear();
+      for (uint32_t k = adjacencyOffsets[fanning]; k < adjacencyOffsets[fanning + 1]; ++k)
+      {
+        uint32_t triangle = adjacency[k];
+        if (emitted[triangle])
+        {
+          continue;
+        }
+        if (newCluster)
+        {
+          clusters.push_back((uint32_t)numEmitted);
+          newCluster = false;
+        }
+        for (size_t j = 0; j < 3; ++j)
+        {
+          uint32_t vertex = indices[triangle * 3 + j];
+          destination[numEmitted * 3 + j] = vertex;
+          deadEnd.push_back(vertex);
+          candidates.push_back(vertex);
+          liveTriangles[vertex]--;
+          if (time - cacheTime[vertex] > cacheSize)
+          {
+            cacheTime[vertex] = time++;
+          }
+        }
+        emitted[triangle] = true;
+        numEmitted++;
+      }
+
+      int64_t next = -1;
+      int64_t bestPriority = -1;
+      for (size_t k = 0; k < candidates.size(); ++k)
+      {
+        uint32_t vertex = candidates[k];
+        if (liveTriangles[vertex] == 0)
+        {
+          continue;
+        }
+        int64_t priority = 0;
+        if (time - cacheTime[vertex] + 2 * liveTriangles[vertex] <= cacheSize)
+        {
+          priority = time - cacheTime[vertex];
+        }
+        if (priority > bestPriority)
+        {
+          bestPriority = priority;
+          next = vertex;
+        }
+      }
+
+      // Jumping elsewhere ends the cluster
+      if (next < 0)
+      {
+        next = skipDeadEnd(liveTriangles, deadEnd, cursor);
+        newCluster = true;
+      }
+      fanning = next;
+    }
+  }
+
+  void MeshOptimizer::optimizeOverdraw(const uint32_t* indices, size_t numIndices, const float* positions, size_t positionStride,
+    uint32_t cacheSize, float threshold, vector<uint32_t>& clusters, uint32_t* destination)
+  {
+    uint32_t numTriangles = (uint32_t)(numIndices / 3);
+    uint32_t maxIndex = 0;
+    for (size_t i = 0; i < numTriangles * 3; ++i)
+    {
+      maxIndex = std::max(maxIndex, indices[i]);
+    }
+
+    // Split the clusters further wherever the cache is doing well enough that
+    // restarting it costs at most threshold times the cluster's own ACMR
+    CacheSimulation cache(numTriangles > 0 ? maxIndex + 1 : 0, cacheSize);
+    vector<uint32_t> splitClusters;
+    for (size_t c = 0; c < clusters.size(); ++c)
+    {
+      uint32_t start = clusters[c];
+      uint32_t end = c + 1 < clusters.size() ? clusters[c + 1] : numTriangles;
+
+      cache.flush();
+      uint32_t clusterMisses = 0;
+      for (uint32_t t = start; t < end; ++t)
+      {
+        clusterMisses += cache.access(indices[t * 3 + 0]) + cache.access(indices[t * 3 + 1]) + cache.access(indices[t * 3 + 2]);
+      }
+      float limit = threshold * (float)clusterMisses / (float)(end - start);
+
+      cache.flush();
+      uint32_t runStart = start;
+      uint32_t runMisses = 0;
+      splitClusters.push_back(start);
+      for (uint32_t t = start; t + 1 < end; ++t)
+      {
+        runMisses += cache.access(indices[t * 3 + 0]) + cache.access(indices[t * 3 + 1]) + cache.access(indices[t * 3 + 2]);
+        if ((float)runMisses <= limit * (float)(t + 1 - runStart))
+        {
+          splitClusters.push_back(t + 1);
+          runStart = t + 1;
+          runMisses = 0;
+          cache.flush();
+        }
+      }
+    }
+
+    // Area weighted centroid and normal of every cluster
+    size_t numClusters = splitClusters.size();
+    vector<vec3> centroids(numClusters, vec3(0.0f));
+    vector<vec3> normals(numClusters, vec3(0.0f));
+    vector<float> areas(numClusters, 0.0f);
+    vec3 meshCentroid(0.0f);
+    float meshArea = 0.0f;
+    for (size_t c = 0; c < numClusters; ++c)
+    {
+      uint32_t start = splitClusters[c];
+      uint32_t end = c + 1 < numClusters ? splitClusters[c + 1] : numTriangles;
+      for (uint32_t t = start; t < end; ++t)
+      {
+        const float* p0 = &positions[indices[t * 3 + 0] * positionStride];
+        const float* p1 = &positions[indices[t * 3 + 1] * positionStride];
+        const float* p2 = &positions[indices[t * 3 + 2] * positionStride];
+        vec3 v0(p0[0], p0[1], p0[2]);
+        vec3 v1(p1[0], p1[1], p1[2]);
+        vec3 v2(p2[0], p2[1], p2[2]);
+        vec3 normal = glm::cross(v1 - v0, v2 - v0);
+        float area = glm::length(normal);
+        centroids[c] += (v0 + v1 + v2) * (area / 3.0f);
+        normals[c] += normal;
+        areas[c] += area;
+      }
+      meshCentroid += centroids[c];
+      meshArea += areas[c];
+      centroids[c] = areas[c] > 0.0f ? centroids[c] / areas[c] : centroids[c];
+    }
+    meshCentroid = meshArea > 0.0f ? meshCentroid / meshArea : meshCentroid;
+
+    // Clusters far out along their own normal tend to occlude the rest, draw them first
+    vector<float> sortKeys(numClusters, 0.0f);
+    vector<uint32_t> order(numClusters);
+    for (size_t c = 0; c < numClusters; ++c)
+    {
+      float length = glm::length(normals[c]);
+      sortKeys[c] = length > 0.0f ? glm::dot(centroids[c] - meshCentroid, normals[c] / length) : 0.0f;
+      order[c] = (uint32_t)c;
+    }
+    std::stable_sort(order.begin(), order.end(), [&sortKeys](uint32_t a, uint32_t b) { return sortKeys[a] > sortKeys[b]; });
+
+    clusters.clear();
+    size_t numWritten = 0;
+    for (size_t i = 0; i < numClusters; ++i)
+    {
+      uint32_t c = order[i];
+      uint32_t start = splitClusters[c];
+      uint32_t end = c + 1 < numClusters ? splitClusters[c + 1] : numTriangles;
+      clusters.push_back((uint32_t)(numWritten / 3));
+      for (uint32_t k = start * 3; k < end * 3; ++k)
+      {
+        destination[numWritten++] = indices[k];
+      }
+    }
+  }
+
+  size_t MeshOptimizer::optimizeVertexFetch(uint32_t* indices, size_t numIndices, size_t numVertices, vector<uint32_t>& remap)
+  {
+    // Vertices are numbered in the order the indices first use them, unused ones keep their order at the end
+    const uint32_t unassigned = 0xffffffff;
+    remap.assign(numVertices, unassigned);
+    uint32_t next = 0;
+    for (size_t i = 0; i < numIndices; ++i)
+    {
+      if (remap[indices[i]] == unassigned)
+      {
+        remap[indices[i]] = next++;
+      }
+      indices[i] = remap[indices[i]];
+    }
+    size_t numReferenced = next;
+    for (size_t v = 0; v < numVertices; ++v)
+    {
+      if (remap[v] == unassigned)
+      {
+        remap[v] = next++;
+      }
+    }
+    return numReferenced;
+  }
+
+  uint32_t MeshOptimizer::countCacheMisses(const uint32_t* indices, size_t numIndices, size_t numVertices, uint32_t cacheSize)
+  {
+    CacheSimulation cache(numVertices, cacheSize);
+    uint32_t misses = 0;
+    for (size_t i = 0; i < numIndices; ++i)
+    {
+      misses += cache.access(indices[i]);
+    }
+    return misses;
+  }
+
+  uint32_t MeshOptimizer::countReferencedVertices(const uint32_t* indices, size_t numIndices, size_t numVertices)
+  {
+    vector<bool> referenced(numVertices, false);
+    uint32_t count = 0;
+    for (size_t i = 0; i < numIndices; ++i)
+    {
+      if (!referenced[indices[i]])
+      {
+        referenced[indices[i]] = true;
+        count++;
+      }
+    }
+    return count;
+  }
+
+  float MeshOptimizer::computeAcmr(const uint32_t* indices, size_t numIndices, size_t numVertices, uint32_t cacheSize)
+  {
+    size_t numTriangles = numIndices / 3;
+    return numTriangles > 0 ? (float)countCacheMisses(indices, numIndices, numVertices, cacheSize) / (float)numTriangles : 0.0f;
+  }
+
+  float MeshOptimizer::computeAtvr(const uint32_t* indices, size_t numIndices, size_t numVertices, uint32_t cacheSize)
+  {
+    uint32_t numReferenced = countReferencedVertices(indices, numIndices, numVertices);
+    return numReferenced > 0 ? (float)countCacheMisses(indices, numIndices, numVertices, cacheSize) / (float)numReferenced : 0.0f;
+  }
+}
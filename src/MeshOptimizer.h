@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+using glm::vec3;
+
+using std::vector;
+
+namespace Bonny
+{
+  // Index and vertex reordering for triangle lists, run once on imported meshes
+  // ahead of buffer building. Triangles are reordered for the post transform
+  // vertex cache with Tipsify, the resulting clusters are sorted so outward
+  // facing geometry is drawn first to cut overdraw, and vertices are renumbered
+  // in first use order for linear vertex fetch. Every step is deterministic.
+  class MeshOptimizer
+  {
+  public:
+    // Cache metrics use a FIFO cache, ACMR is cache misses per triangle and
+    // ATVR cache misses per referenced vertex, 1.0 being the ideal. The vertex
+    // count is the number of vertices the indices reference.
+    struct Report
+    {
+      uint32_t  m_numTriangles;
+      uint32_t  m_numVertices;
+      uint32_t  m_numClusters;
+      float     m_acmrBefore;
+      float     m_acmrAfter;
+      float     m_atvrBefore;
+      float     m_atvrAfter;
+      bool      m_optimized;
+    };
+
+    static const uint32_t   c_defaultCacheSize = 16;
+
+    static void     optimizeVertexCache(const uint32_t* indices, size_t numIndices, size_t numVertices, uint32_t cacheSize,
+                      uint32_t* destination, vector<uint32_t>& clusters);
+    static void     optimizeOverdraw(const uint32_t* indices, size_t numIndices, const float* positions, size_t positionStride,
+                      uint32_t cacheSize, float threshold, vector<uint32_t>& clusters, uint32_t* destination);
+    static size_t   optimizeVertexFetch(uint32_t* indices, size_t numIndices, size_t numVertices, vector<uint32_t>& remap);
+
+    static uint32_t countCacheMisses(const uint32_t* indices, size_t numIndices, size_t numVertices, uint32_t cacheSize);
+    static uint32_t countReferencedVertices(const uint32_t* indices, size_t numIndices, size_t numVertices);
+    static float    computeAcmr(const uint32_t* indices, size_t numIndices, size_t numVertices, uint32_t cacheSize);
+    static float    computeAtvr(const uint32_t* indices, size_t numIndices, size_t numVertices, uint32_t cacheSize);
+  };
+}
@@ -0,0 +1,345 @@
+#include "stdafx.h"
+#include "MeshSimplifier.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace Bonny
+{
+  // Surviving triangles may turn by at most about 75 degrees in a single collapse
+  static const double c_minNormalCosine = 0.25;
+
+  // Area weighted sum of squared distances to a set of planes, p^T A p + 2 b.p + c
+  // with A symmetric. Dividing by the total weight gives the mean squared distance.
+  struct Quadric
+  {
+    double  m_a00, m_a01, m_a02, m_a11, m_a12, m_a22;
+    double  m_b0, m_b1, m_b2;
+    double  m_c;
+    double  m_weight;
+
+    void addPlane(double nx, double ny, double nz, double d, double weight)
+    {
+      m_a00 += weight * nx * nx;
+      m_a01 += weight * nx * ny;
+      m_a02 += weight * nx * nz;
+      m_a11 += weight * ny * ny;
+      m_a12 += weight * ny * nz;
+      m_a22 += weight * nz * nz;
+      m_b0 += weight * nx * d;
+      m_b1 += weight * ny * d;
+      m_b2 += weight * nz * d;
+      m_c += weight * d * d;
+      m_weight += weight;
+    }
+
+    void add(const Quadric& q)
+    {
+      m_a00 += q.m_a00;
+      m_a01 += q.m_a01;
+      m_a02 += q.m_a02;
+      m_a11 += q.m_a11;
+      m_a12 += q.m_a12;
+      m_a22 += q.m_a22;
+      m_b0 += q.m_b0;
+      m_b1 += q.m_b1;
+      m_b2 += q.m_b2;
+      m_c += q.m_c;
+      m_weight += q.m_weight;
+    }
+
+    double evaluate(const float* p) const
+    {
+      double x = p[0];
+      double y = p[1];
+      double z = p[2];
+      double value = m_a00 * x * x + m_a11 * y * y + m_a22 * z * z + 2.0 * (m_a01 * x * y + m_a02 * x * z + m_a12 * y * z) +
+        2.0 * (m_b0 * x + m_b1 * y + m_b2 * z) + m_c;
+      return value > 0.0 && m_weight > 0.0 ? value / m_weight : 0.0;
+    }
+  };
+
+  struct Collapse
+  {
+    uint32_t  m_source;
+    uint32_t  m_target;
+    double    m_cost;
+  };
+
+  static void triangleNormal(const float* p0, const float* p1, const float* p2, double normal[3])
+  {
+    double e1[3] = { (double)p1[0] - p0[0], (double)p1[1] - p0[1], (double)p1[2] - p0[2] };
+    double e2[3] = { (double)p2[0] - p0[0], (double)p2[1] - p0[1], (double)p2[2] - p0[2] };
+    normal[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    normal[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    normal[2] = e1[0] * e2[1] - e1[1] * e2[0];
+  }
+
+  float MeshSimplifier::simplify(const uint32_t* indices, size_t numIndices, const float* positions, size_t positionStride, size_t numVertices,
+    size_t targetIndexCount, float targetError, vector<uint32_t>& destination)
+  {
+    destination.assign(indices, indices + (numIndices / 3) * 3);
+    if (destination.size() <= targetIndexCount)
+    {
+      return 0.0f;
+    }
+
+    // Vertices sharing a position are welded, a position with several vertices is an attribute seam
+    vector<uint32_t> sorted(numVertices);
+    for (uint32_t v = 0; v < numVertices; v++)
+    {
+      sorted[v] = v;
+    }
+    auto positionLess = [&](uint32_t a, uint32_t b)
+    {
+      const float* pa = &positions[a * positionStride];
+      const float* pb = &positions[b * positionStride];
+      return memcmp(pa, pb, 3 * sizeof(float)) < 0 || (memcmp(pa, pb, 3 * sizeof(float)) == 0 && a < b);
+    };
+    std::sort(sorted.begin(), sorted.end(), positionLess);
+    vector<uint32_t> welded(numVertices);
+    vector<bool> locked(numVertices, false);
+    for (size_t i = 0; i < numVertices;)
+    {
+      size_t j = i + 1;
+      while (j < numVertices && memcmp(&positions[sorted[i] * positionStride], &positions[sorted[j] * positionStride], 3 * sizeof(float)) == 0)
+      {
+        j++;
+      }
+      for (size_t k = i; k < j; k++)
+      {
+        welded[sorted[k]] = sorted[i];
+        locked[sorted[k]] = j - i > 1;
+      }
+      i = j;
+    }
+
+    // Welded edges used by anything but two triangles are open borders or non manifold
+    vector<uint64_t> edges;
+    edges.reserve(destination.size());
+    for (size_t t = 0; t < destination.size(); t += 3)
+    {
+      for (size_t k = 0; k < 3; k++)
+      {
+        uint32_t a = welded[destination[t + k]];
+        uint32_t b = welded[destination[t + (k + 1) % 3]];
+        edges.push_back(((uint64_t)std::min(a, b) << 32) | std::max(a, b));
+      }
+    }
+    std::sort(edges.begin(), edges.end());
+    for (size_t i = 0; i < edges.size();)
+    {
+      size_t j = i + 1;
+      while (j < edges.size() && edges[j] == edges[i])
+      {
+        j++;
+      }
+      if (j - i != 2)
+      {
+        locked[(uint32_t)(edges[i] >> 32)] = true;
+        locked[(uint32_t)(edges[i] & 0xffffffff)] = true;
+      }
+      i = j;
+    }
+    for (uint32_t v = 0; v < numVertices; v++)
+    {
+      locked[v] = locked[v] || locked[welded[v]];
+    }
+
+    // Plane quadrics gathered on the welded vertices
+    vector<Quadric> quadrics(numVertices);
+    memset(quadrics.data(), 0, numVertices * sizeof(Quadric));
+    for (size_t t = 0; t < destination.size(); t += 3)
+    {
+      const float* p0 = &positions[destination[t] * positionStride];
+      double normal[3];
+      triangleNormal(p0, &positions[destination[t + 1] * positionStride], &positions[destination[t + 2] * positionStride], normal);
+      double length = sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+      if (length <= 0.0)
+      {
+        continue;
+      }
+      normal[0] /= length;
+      normal[1] /= length;
+      normal[2] /= length;
+      double d = -(normal[0] * p0[0] + normal[1] * p0[1] + normal[2] * p0[2]);
+      for (size_t k = 0; k < 3; k++)
+      {
+        quadrics[welded[destination[t + k]]].addPlane(normal[0], normal[1], normal[2], d, length * 0.5);
+      }
+    }
+
+    // Passes of independent collapses, cheapest first, until the target is reached or nothing can move
+    double maxCost = 0.0;
+    double costLimit = (double)targetError * targetError;
+    vector<uint32_t> remap(numVertices);
+    vector<bool> touched(numVertices);
+    vector<uint32_t> linkStamps(numVertices, 0);
+    uint32_t linkStamp = 0;
+    vector<Collapse> collapses;
+    vector<uint32_t> adjacencyOffsets(numVertices + 1);
+    vector<uint32_t> adjacency;
+    while (destination.size() > targetIndexCount)
+    {
+      collapses.clear();
+      for (size_t t = 0; t < destination.size(); t += 3)
+      {
+        for (size_t k = 0; k < 3; k++)
+        {
+          uint32_t source = destination[t + k];
+          uint32_t target = destination[t + (k + 1) % 3];
+          if (locked[source] || welded[source] == welded[target])
+          {
+            continue;
+          }
+          Quadric quadric = quadrics[welded[source]];
+          quadric.add(quadrics[welded[target]]);
+          Collapse collapse = { source, target, quadric.evaluate(&positions[target * positionStride]) };
+          if (collapse.m_cost <= costLimit)
+          {
+            collapses.push_back(collapse);
+          }
+        }
+      }
+      if (collapses.empty())
+      {
+        break;
+      }
+      std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b)
+      {
+        return a.m_cost < b.m_cost || (a.m_cost == b.m_cost && (a.m_source < b.m_source || (a.m_source == b.m_source && a.m_target < b.m_target)));
+      });
+
+      // Triangles around every vertex of the current list
+      std::fill(adjacencyOffsets.begin(), adjacencyOffsets.end(), 0);
+      for (size_t i = 0; i < destination.size(); i++)
+      {
+        adjacencyOffsets[destination[i] + 1]++;
+      }
+      for (size_t v = 0; v < numVertices; v++)
+      {
+        adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+      }
+      adjacency.resize(destination.size());
+      vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+      for (size_t i = 0; i < destination.size(); i++)
+      {
+        adjacency[fill[destination[i]]++] = (uint32_t)(i / 3);
+      }
+
+      // Every collapse removes about two triangles, stop the pass once that reaches the target
+      size_t budget = (destination.size() - targetIndexCount) / 6 + 1;
+      size_t numCollapsed = 0;
+      for (uint32_t v = 0; v < numVertices; v++)
+      {
+        remap[v] = v;
+      }
+      std::fill(touched.begin(), touched.end(), false);
+      for (size_t c = 0; c < collapses.size() && numCollapsed < budget; c++)
+      {
+        uint32_t source = collapses[c].m_source;
+        uint32_t target = collapses[c].m_target;
+        if (touched[source] || touched[target])
+        {
+          continue;
+        }
+
+        // Link condition, the edge's endpoints may only share the vertices opposite the edge,
+        // anything else would pinch the surface into a non manifold fold
+        linkStamp++;
+        uint32_t numEdgeTriangles = 0;
+        for (uint32_t k = adjacencyOffsets[target]; k < adjacencyOffsets[target + 1]; k++)
+        {
+          const uint32_t* triangle = &destination[adjacency[k] * 3];
+          linkStamps[triangle[0]] = linkStamps[triangle[1]] = linkStamps[triangle[2]] = linkStamp;
+          if (triangle[0] == source || triangle[1] == source || triangle[2] == source)
+          {
+            numEdgeTriangles++;
+          }
+        }
+        uint32_t numShared = 0;
+        linkStamps[source] = linkStamps[target] = 0;
+        for (uint32_t k = adjacencyOffsets[source]; k < adjacencyOffsets[source + 1]; k++)
+        {
+          const uint32_t* triangle = &destination[adjacency[k] * 3];
+          for (size_t j = 0; j < 3; j++)
+          {
+            if (linkStamps[triangle[j]] == linkStamp)
+            {
+              linkStamps[triangle[j]] = 0;
+              numShared++;
+            }
+          }
+        }
+        if (numShared != numEdgeTriangles)
+        {
+          continue;
+        }
+
+        // Moving the source must not flip any of the triangles that survive the collapse
+        bool flips = false;
+        for (uint32_t k = adjacencyOffsets[source]; k < adjacencyOffsets[source + 1] && !flips; k++)
+        {
+          const uint32_t* triangle = &destination[adjacency[k] * 3];
+          if (triangle[0] == target || triangle[1] == target || triangle[2] == target)
+          {
+            continue;
+          }
+          const float* before[3];
+          const float* after[3];
+          for (size_t j = 0; j < 3; j++)
+          {
+            before[j] = &positions[triangle[j] * positionStride];
+            after[j] = triangle[j] == source ? &positions[target * positionStride] : before[j];
+          }
+          double normalBefore[3];
+          double normalAfter[3];
+          triangleNormal(before[0], before[1], before[2], normalBefore);
+          triangleNormal(after[0], after[1], after[2], normalAfter);
+          double lengthBefore = sqrt(normalBefore[0] * normalBefore[0] + normalBefore[1] * normalBefore[1] + normalBefore[2] * normalBefore[2]);
+          double lengthAfter = sqrt(normalAfter[0] * normalAfter[0] + normalAfter[1] * normalAfter[1] + normalAfter[2] * normalAfter[2]);
+          double cosine = normalBefore[0] * normalAfter[0] + normalBefore[1] * normalAfter[1] + normalBefore[2] * normalAfter[2];
+          flips = cosine <= c_minNormalCosine * lengthBefore * lengthAfter;
+        }
+        if (flips)
+        {
+          continue;
+        }
+
+        // Neighbours stay fixed for the rest of the pass so every accepted collapse sees current geometry
+        for (uint32_t k = adjacencyOffsets[source]; k < adjacencyOffsets[source + 1]; k++)
+        {
+          const uint32_t* triangle = &destination[adjacency[k] * 3];
+          touched[triangle[0]] = touched[triangle[1]] = touched[triangle[2]] = true;
+        }
+        remap[source] = target;
+        quadrics[welded[target]].add(quadrics[welded[source]]);
+        maxCost = std::max(maxCost, collapses[c].m_cost);
+        numCollapsed++;
+      }
+      if (numCollapsed == 0)
+      {
+        break;
+      }
+
+      // Drop the triangles that lost an edge
+      size_t numWritten = 0;
+      for (size_t t = 0; t < destination.size(); t += 3)
+      {
+        uint32_t a = remap[destination[t]];
+        uint32_t b = remap[destination[t + 1]];
+        uint32_t c = remap[destination[t + 2]];
+        if (a != b && b != c && a != c)
+        {
+          destination[numWritten++] = a;
+          destination[numWritten++] = b;
+          destination[numWritten++] = c;
+        }
+      }
+      destination.resize(numWritten);
+    }
+
+    return (float)sqrt(maxCost);
+  }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+using std::vector;
+
+namespace Bonny
+{
+  // Quadric error simplification of triangle lists by half edge collapses. A
+  // vertex only ever moves onto one of its neighbours, so the simplified
+  // indices keep referencing the original vertex buffers and every level of a
+  // LOD chain can share them. Vertices on open borders and attribute seams are
+  // locked to keep silhouettes and texture mapping intact.
+  class MeshSimplifier
+  {
+  public:
+    // Stops at the target index count or before any collapse would exceed the
+    // target error, returns the error of the result in mesh units
+    static float    simplify(const uint32_t* indices, size_t numIndices, const float* positions, size_t positionStride, size_t numVertices,
+                      size_t targetIndexCount, float targetError, vector<uint32_t>& destination);
+  };
+}
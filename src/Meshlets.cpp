@@ -0,0 +1,287 @@
+#include "stdafx.h"
+#include "Meshlets.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace Bonny
+{
+  // Cones wider than this are left unculled, the test would hardly ever succeed
+  static const float c_minConeSpread = 0.1f;
+
+  Meshlets::Meshlets()
+  {
+  }
+
+
+  Meshlets::~Meshlets()
+  {
+  }
+
+  void Meshlets::build(const uint32_t* indices, size_t numIndices, const float* positions, size_t positionStride, size_t numVertices)
+  {
+    clear();
+    uint32_t numTriangles = (uint32_t)(numIndices / 3);
+    m_triangles.resize(numTriangles * 3);
+
+    // Local index of every vertex in the meshlet being filled, -1 when it is not part of it
+    vector<int32_t> localIndices(numVertices, -1);
+    Meshlet meshlet = {};
+    for (uint32_t t = 0; t < numTriangles; t++)
+    {
+      const uint32_t* triangle = &indices[t * 3];
+      uint32_t numNew = 0;
+      for (uint32_t k = 0; k < 3; k++)
+      {
+        bool repeated = (k > 0 && triangle[k] == triangle[0]) || (k > 1 && triangle[k] == triangle[1]);
+        if (localIndices[triangle[k]] < 0 && !repeated)
+        {
+          numNew++;
+        }
+      }
+
+      if (meshlet.m_numVertices + numNew > c_maxVertices || meshlet.m_numTriangles == c_maxTriangles)
+      {
+        for (uint32_t v = 0; v < meshlet.m_numVertices; v++)
+        {
+          localIndices[m_vertices[meshlet.m_vertexOffset + v]] = -1;
+        }
+        finishMeshlet(meshlet, indices, positions, positionStride);
+        meshlet = {};
+        meshlet.m_vertexOffset = (uint32_t)m_vertices.size();
+        meshlet.m_triangleStart = t;
+      }
+
+      for (uint32_t k = 0; k < 3; k++)
+      {
+        if (localIndices[triangle[k]] < 0)
+        {
+          localIndices[triangle[k]] = (int32_t)meshlet.m_numVertices++;
+          m_vertices.push_back(triangle[k]);
+        }
+        m_triangles[t * 3 + k] = (uint8_t)localIndices[triangle[k]];
+      }
+      meshlet.m_numTriangles++;
+    }
+    if (meshlet.m_numTriangles > 0)
+    {
+      finishMeshlet(meshlet, indices, positions, positionStride);
+    }
+
+    size_t numPadded = (m_meshlets.size() + 3) & ~3;
+    m_centerX.assign(numPadded, 0.0f);
+    m_centerY.assign(numPadded, 0.0f);
+    m_centerZ.assign(numPadded, 0.0f);
+    m_radius.assign(numPadded, 0.0f);
+    m_apexX.assign(numPadded, 0.0f);
+    m_apexY.assign(numPadded, 0.0f);
+    m_apexZ.assign(numPadded, 0.0f);
+    m_axisX.assign(numPadded, 0.0f);
+    m_axisY.assign(numPadded, 0.0f);
+    m_axisZ.assign(numPadded, 0.0f);
+    m_cutoff.assign(numPadded, 2.0f);
+    for (size_t i = 0; i < m_meshlets.size(); i++)
+    {
+      const Meshlet& m = m_meshlets[i];
+      m_centerX[i] = m.m_center.x;
+      m_centerY[i] = m.m_center.y;
+      m_centerZ[i] = m.m_center.z;
+      m_radius[i] = m.m_radius;
+      m_apexX[i] = m.m_coneApex.x;
+      m_apexY[i] = m.m_coneApex.y;
+      m_apexZ[i] = m.m_coneApex.z;
+      m_axisX[i] = m.m_coneAxis.x;
+      m_axisY[i] = m.m_coneAxis.y;
+      m_axisZ[i] = m.m_coneAxis.z;
+      m_cutoff[i] = m.m_coneCutoff;
+    }
+  }
+
+  void Meshlets::finishMeshlet(Meshlet& meshlet, const uint32_t* indices, const float* positions, size_t positionStride)
+  {
+    // Sphere around the box of the vertices
+    vec3 boundsMin(1e30f);
+    vec3 boundsMax(-1e30f);
+    for (uint32_t v = 0; v < meshlet.m_numVertices; v++)
+    {
+      const float* p = &positions[m_vertices[meshlet.m_vertexOffset + v] * positionStride];
+      boundsMin = vec3(std::min(boundsMin.x, p[0]), std::min(boundsMin.y, p[1]), std::min(boundsMin.z, p[2]));
+      boundsMax = vec3(std::max(boundsMax.x, p[0]), std::max(boundsMax.y, p[1]), std::max(boundsMax.z, p[2]));
+    }
+    meshlet.m_center = (boundsMin + boundsMax) * 0.5f;
+    meshlet.m_radius = 0.0f;
+    for (uint32_t v = 0; v < meshlet.m_numVertices; v++)
+    {
+      const float* p = &positions[m_vertices[meshlet.m_vertexOffset + v] * positionStride];
+      meshlet.m_radius = std::max(meshlet.m_radius, glm::length(vec3(p[0], p[1], p[2]) - meshlet.m_center));
+    }
+
+    // Cone around the unit normals, degenerate triangles do not constrain it
+    vec3 normals[c_maxTriangles];
+    vec3 corners[c_maxTriangles];
+    uint32_t numNormals = 0;
+    vec3 axis(0.0f);
+    for (uint32_t t = meshlet.m_triangleStart; t < meshlet.m_triangleStart + meshlet.m_numTriangles; t++)
+    {
+      const float* p0 = &positions[indices[t * 3 + 0] * positionStride];
+      const float* p1 = &positions[indices[t * 3 + 1] * positionStride];
+      const float* p2 = &positions[indices[t * 3 + 2] * positionStride];
+      vec3 v0(p0[0], p0[1], p0[2]);
+      vec3 normal = glm::cross(vec3(p1[0], p1[1], p1[2]) - v0, vec3(p2[0], p2[1], p2[2]) - v0);
+      float length = glm::length(normal);
+      if (length <= 0.0f)
+      {
+        continue;
+      }
+      normals[numNormals] = normal / length;
+      corners[numNormals] = v0;
+      axis += normals[numNormals];
+      numNormals++;
+    }
+
+    meshlet.m_coneApex = meshlet.m_center;
+    meshlet.m_coneAxis = vec3(0.0f, 0.0f, 1.0f);
+    meshlet.m_coneCutoff = 2.0f;
+    float axisLength = glm::length(axis);
+    if (numNormals > 0 && axisLength > 0.0f)
+    {
+      axis /= axisLength;
+      float minDot = 1.0f;
+      for (uint32_t i = 0; i < numNormals; i++)
+      {
+        minDot = std::min(minDot, glm::dot(axis, normals[i]));
+      }
+
+      if (minDot > c_minConeSpread)
+      {
+        // Move the apex back along the axis until it lies behind every triangle plane
+        float maxT = 0.0f;
+        for (uint32_t i = 0; i < numNormals; i++)
+        {
+          float t = glm::dot(meshlet.m_center - corners[i], normals[i]) / glm::dot(axis, normals[i]);
+          maxT = std::max(maxT, t);
+        }
+        meshlet.m_coneApex = meshlet.m_center - axis * maxT;
+        meshlet.m_coneAxis = axis;
+        meshlet.m_coneCutoff = sqrt(1.0f - minDot * minDot);
+      }
+    }
+
+    m_meshlets.push_back(meshlet);
+  }
+
+  void Meshlets::cull(const vec4 planes[6], const vec3& cameraPosition, bool backfaceCulling, vector<IndexRange>& ranges, CullCounts& counts)
+  {
+    // Planes may come from a scaled transform, the sphere radius is scaled by the normal length instead
+    __m128 planeLengths[6];
+    for (int i = 0; i < 6; i++)
+    {
+      planeLengths[i] = _mm_set1_ps(glm::length(vec3(planes[i])));
+    }
+
+    ranges.clear();
+    counts.m_numMeshlets = (uint32_t)m_meshlets.size();
+    counts.m_numVisible = 0;
+    counts.m_numFrustumCulled = 0;
+    counts.m_numBackfaceCulled = 0;
+
+    // Four spheres and cones per iteration
+    const __m128 zero = _mm_setzero_ps();
+    uint32_t numMeshlets = (uint32_t)m_meshlets.size();
+    for (uint32_t m = 0; m < numMeshlets; m += 4)
+    {
+      __m128 centerX = _mm_loadu_ps(&m_centerX[m]);
+      __m128 centerY = _mm_loadu_ps(&m_centerY[m]);
+      __m128 centerZ = _mm_loadu_ps(&m_centerZ[m]);
+      __m128 radius = _mm_loadu_ps(&m_radius[m]);
+
+      int inside = 0xf;
+      for (int i = 0; i < 6 && inside != 0; i++)
+      {
+        __m128 d = _mm_add_ps(_mm_mul_ps(centerX, _mm_set1_ps(planes[i].x)), _mm_mul_ps(centerY, _mm_set1_ps(planes[i].y)));
+        d = _mm_add_ps(_mm_add_ps(d, _mm_mul_ps(centerZ, _mm_set1_ps(planes[i].z))), _mm_set1_ps(planes[i].w));
+        inside &= _mm_movemask_ps(_mm_cmpge_ps(_mm_add_ps(d, _mm_mul_ps(radius, planeLengths[i])), zero));
+      }
+
+      int frontFacing = inside;
+      if (backfaceCulling && inside != 0)
+      {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(&m_apexX[m]), _mm_set1_ps(cameraPosition.x));
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(&m_apexY[m]), _mm_set1_ps(cameraPosition.y));
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(&m_apexZ[m]), _mm_set1_ps(cameraPosition.z));
+        __m128 distance = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+        __m128 d = _mm_add_ps(_mm_mul_ps(dx, _mm_loadu_ps(&m_axisX[m])), _mm_mul_ps(dy, _mm_loadu_ps(&m_axisY[m])));
+        d = _mm_add_ps(d, _mm_mul_ps(dz, _mm_loadu_ps(&m_axisZ[m])));
+        int backFacing = _mm_movemask_ps(_mm_cmpge_ps(d, _mm_mul_ps(_mm_loadu_ps(&m_cutoff[m]), distance)));
+        frontFacing = inside & ~backFacing;
+      }
+
+      uint32_t numLanes = std::min(numMeshlets - m, 4u);
+      for (uint32_t i = 0; i < numLanes; i++)
+      {
+        const Meshlet& meshlet = m_meshlets[m + i];
+        if (!(inside & (1 << i)))
+        {
+          counts.m_numFrustumCulled++;
+          continue;
+        }
+        if (!(frontFacing & (1 << i)))
+        {
+          counts.m_numBackfaceCulled++;
+          continue;
+        }
+
+        // Neighbouring meshlets are neighbouring index ranges, merge them into one draw
+        counts.m_numVisible++;
+        uint32_t indexStart = meshlet.m_triangleStart * 3;
+        if (!ranges.empty() && ranges.back().m_indexStart + ranges.back().m_numIndices == indexStart)
+        {
+          ranges.back().m_numIndices += meshlet.m_numTriangles * 3;
+        }
+        else
+        {
+          IndexRange range = { indexStart, meshlet.m_numTriangles * 3 };
+          ranges.push_back(range);
+        }
+      }
+    }
+  }
+
+  void Meshlets::clear()
+  {
+    m_meshlets.clear();
+    m_vertices.clear();
+    m_triangles.clear();
+    m_centerX.clear();
+    m_centerY.clear();
+    m_centerZ.clear();
+    m_radius.clear();
+    m_apexX.clear();
+    m_apexY.clear();
+    m_apexZ.clear();
+    m_axisX.clear();
+    m_axisY.clear();
+    m_axisZ.clear();
+    m_cutoff.clear();
+  }
+
+  size_t Meshlets::numMeshlets()
+  {
+    return m_meshlets.size();
+  }
+
+  const Meshlets::Meshlet& Meshlets::getMeshlet(size_t index)
+  {
+    return m_meshlets[index];
+  }
+
+  const vector<uint32_t>& Meshlets::getVertices()
+  {
+    return m_vertices;
+  }
+
+  const vector<uint8_t>& Meshlets::getTriangles()
+  {
+    return m_triangles;
+  }
+}
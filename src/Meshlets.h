@@ -0,0 +1,91 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <xmmintrin.h>
+
+#include <glm/glm.hpp>
+
+using glm::vec3;
+using glm::vec4;
+
+using std::vector;
+
+namespace Bonny
+{
+  // Splits a triangle list into meshlets of at most c_maxVertices vertices and
+  // c_maxTriangles triangles. Triangles are taken in index buffer order, so every
+  // meshlet is also a contiguous range of the mesh's indices and surviving
+  // meshlets can be drawn as index ranges without mesh shaders. Each meshlet
+  // carries its unique vertices, 8 bit local triangles, a bounding sphere and a
+  // normal cone, all in mesh space.
+  class Meshlets
+  {
+  public:
+    static const uint32_t c_maxVertices = 64;
+    static const uint32_t c_maxTriangles = 124;
+
+    // The cone is the apex, axis and cutoff of the triangle normals, the meshlet
+    // faces away from every camera position p with
+    // dot(normalize(apex - p), axis) >= cutoff. A cutoff above 1 disables the test.
+    struct Meshlet
+    {
+      uint32_t  m_vertexOffset;
+      uint32_t  m_numVertices;
+      uint32_t  m_triangleStart;
+      uint32_t  m_numTriangles;
+      vec3      m_center;
+      float     m_radius;
+      vec3      m_coneApex;
+      vec3      m_coneAxis;
+      float     m_coneCutoff;
+    };
+
+    struct IndexRange
+    {
+      uint32_t  m_indexStart;
+      uint32_t  m_numIndices;
+    };
+
+    struct CullCounts
+    {
+      uint32_t  m_numMeshlets;
+      uint32_t  m_numVisible;
+      uint32_t  m_numFrustumCulled;
+      uint32_t  m_numBackfaceCulled;
+    };
+
+    Meshlets();
+    ~Meshlets();
+
+    void            build(const uint32_t* indices, size_t numIndices, const float* positions, size_t positionStride, size_t numVertices);
+    void            clear();
+    void            cull(const vec4 planes[6], const vec3& cameraPosition, bool backfaceCulling, vector<IndexRange>& ranges, CullCounts& counts);
+
+    size_t          numMeshlets();
+    const Meshlet&  getMeshlet(size_t index);
+    const vector<uint32_t>& getVertices();
+    const vector<uint8_t>&  getTriangles();
+
+  private:
+    void            finishMeshlet(Meshlet& meshlet, const uint32_t* indices, const float* positions, size_t positionStride);
+
+    vector<Meshlet>   m_meshlets;
+    vector<uint32_t>  m_vertices;
+    vector<uint8_t>   m_triangles;
+
+    // Culling data as arrays of one component, padded to whole SIMD groups
+    vector<float>     m_centerX;
+    vector<float>     m_centerY;
+    vector<float>     m_centerZ;
+    vector<float>     m_radius;
+    vector<float>     m_apexX;
+    vector<float>     m_apexY;
+    vector<float>     m_apexZ;
+    vector<float>     m_axisX;
+    vector<float>     m_axisY;
+    vector<float>     m_axisZ;
+    vector<float>     m_cutoff;
+  };
+}
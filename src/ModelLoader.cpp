@@ -1,15 +1,24 @@
 #include "stdafx.h"
 #include "ModelLoader.h"
+#include "CpuTimer.h"
+#include "TextureDecoder.h"
+#include "TextureProcessor.h"
+
+#include <psapi.h>
 
 #include <assimp/material.h>
 #include <assimp/matrix4x4.h>
 #include <assimp/vector3.h>
 #include <assimp/quaternion.h>
+#include <assimp/DefaultIOSystem.h>
 
 #include <IL\il.h>
 #include <atlstr.h>
 
+#pragma comment(lib, "psapi.lib")
+
 using std::make_shared;
+using std::unique_ptr;
 using std::static_pointer_cast;
 
 using glm::mat4;
@@ -18,8 +27,58 @@ using glm::dquat;
 
 namespace Bonny
 {
-  ModelLoader::ModelLoader()
+  // Fraction of the triangles every LOD level keeps from the previous one
+  static const float c_lodReduction = 0.5f;
+
+  // One source file of decodeTextures, the jobs fill in everything after the cache paths
+  struct TextureFile
+  {
+    string                    m_path;
+    Texture::Usage            m_usage;
+    string                    m_cachePrefix;
+    string                    m_cachePath;
+    shared_ptr<Texture>       m_cached;
+    TextureDecoder::Image     m_image;
+    TextureProcessor::Result  m_result;
+    size_t                    m_bytesRead;
+    size_t                    m_bytesWritten;
+    uint32_t                  m_numStaleRemoved;
+    shared_ptr<MappedFile>    m_streamSource;
+  };
+
+  // Remembers every file the importer opens, like the material library of an OBJ, even ones that don't exist yet
+  class RecordingIOSystem :
+    public Assimp::DefaultIOSystem
+  {
+  public:
+    Assimp::IOStream* Open(const char* file, const char* mode) override
+    {
+      m_files.push_back(file);
+      return Assimp::DefaultIOSystem::Open(file, mode);
+    }
+
+    vector<string>  m_files;
+  };
+
+  ModelLoader::ModelLoader() :
+    m_optimizeMeshes(true),
+    m_numLodLevels(4),
+    m_importCache(true),
+    m_importCacheDirectory("cache"),
+    m_textureCache(true)
   {
+    m_assimpFlags = aiProcessPreset_TargetRealtime_MaxQuality |
+      aiProcess_OptimizeGraph |
+      aiProcess_CalcTangentSpace |
+      //aiProcess_FlipUVs |
+      // aiProcess_FixInfacingNormals | // causes incorrect facing normals for crytek-sponza
+      0;
+    //m_assimpFlags &= ~(aiProcess_CalcTangentSpace);
+
+    memset(&m_loadStats, 0, sizeof(m_loadStats));
+    memset(&m_importCacheStats, 0, sizeof(m_importCacheStats));
+    memset(&m_textureCacheStats, 0, sizeof(m_textureCacheStats));
+    TextureProcessor::getDefaultSettings(m_textureSettings);
     ilInit();
   }
 
@@ -28,13 +87,65 @@ namespace Bonny
   {
   }
 
-  shared_ptr<Entity> ModelLoader::loadAssimpModel(string filename)
+  shared_ptr<Entity> ModelLoader::loadAssimpModel(string filename, JobSystem* jobSystem)
   {
+    uint64_t key = 0;
+    CpuTimer timer;
+    timer.start();
+    if (!m_importCache || !computeImportKey(filename, key))
+    {
+      return importAssimpModel(filename, jobSystem);
+    }
+    m_importCacheStats.m_hashTime += timer.elapsedMilli();
+
+    char keyString[24];
+    snprintf(keyString, sizeof(keyString), "%016llx", (unsigned long long)key);
+    string prefix = getImportCachePrefix(filename, computeImportSettingsKey());
+    string cachePath = prefix + keyString + ".cooked";
+
+    // A changed source or changed settings give a new key, the old entry is simply never found again.
+    // Entries for other settings have their own prefix and stay valid.
+    shared_ptr<Entity> rootEntity = loadCookedModel(cachePath, jobSystem);
+    if (rootEntity != nullptr)
+    {
+      m_importCacheStats.m_numHits++;
+      m_importCacheStats.m_hitTime += timer.elapsedMilli();
+      printLog("Import Cache Hit: " + filename);
+      reportImportCache();
+      return rootEntity;
+    }
+
+    m_importCacheStats.m_numMisses++;
+    rootEntity = importAssimpModel(filename, jobSystem);
+    if (rootEntity != nullptr)
+    {
+      CreateDirectoryA(m_importCacheDirectory.c_str(), nullptr);
+      m_importCacheStats.m_numStaleRemoved += removeStaleEntries(prefix, "cooked", cachePath);
+      if (writeCookedModel(cachePath, rootEntity, m_importDependencies))
+      {
+        m_importCacheStats.m_numWrites++;
+      }
+    }
+    m_importCacheStats.m_missTime += timer.elapsedMilli();
+    printLog("Import Cache Miss: " + filename);
+    reportImportCache();
+    return rootEntity;
+  }
+
+  shared_ptr<Entity> ModelLoader::importAssimpModel(string filename, JobSystem* jobSystem)
+  {
+    CpuTimer timer;
+    timer.start();
+    BufferStats::Counts buffers;
+    BufferStats::getCounts(buffers);
     Assimp::Importer importer;
     shared_ptr<Entity> rootEntity = NULL;
     shared_ptr<Mesh> rlMesh;
     shared_ptr<Material> rlMaterial;
     shared_ptr<RenderComponent> renderComponent;
+    RecordingIOSystem* ioSystem = new RecordingIOSystem();
+    importer.SetIOHandler(ioSystem);
+    m_importDependencies.clear();
 
     //const aiScene* scene = importer.ReadFile(filename.c_str(),
     //  aiProcess_CalcTangentSpace |
@@ -43,15 +154,7 @@ namespace Bonny
     //  aiProcess_SortByPType |
     //  aiProcess_GenSmoothNormals);
 
-    uint32_t AssimpFlags = aiProcessPreset_TargetRealtime_MaxQuality |
-      aiProcess_OptimizeGraph |
-      aiProcess_CalcTangentSpace |
-      //aiProcess_FlipUVs |
-      // aiProcess_FixInfacingNormals | // causes incorrect facing normals for crytek-sponza
-      0;
-    //AssimpFlags &= ~(aiProcess_CalcTangentSpace);
-
-    const aiScene* scene = importer.ReadFile(filename.c_str(), AssimpFlags);
+    const aiScene* scene = importer.ReadFile(filename.c_str(), m_assimpFlags);
 
     // If the import failed, report it
     if (!scene)
@@ -59,9 +162,11 @@ namespace Bonny
       const char* error = importer.GetErrorString();
       return NULL;
     }
+    reportProgress(0.3f);
 
     unsigned int numMeshes = scene->mNumMeshes;
     unsigned int numMaterials = scene->mNumMaterials;
+    m_loadedMeshes.clear();
 
     rootEntity = make_shared<Entity>(scene->mRootNode->mName.C_Str());
     if (scene->mRootNode->mNumMeshes > 0)
@@ -118,6 +223,7 @@ namespace Bonny
         populateMeshMaterial(scene, rlMesh, rlMaterial, mesh);
         rlMesh->setMaterial(rlMaterial);
         renderComponent->addMesh(rlMesh);
+        m_loadedMeshes.push_back(rlMesh);
       }
       rootEntity->addComponent(renderComponent);
     }
@@ -129,8 +235,34 @@ namespace Bonny
     {
       processNode(scene, rootEntity, scene->mRootNode->mChildren[i]);
     }
+    reportProgress(0.4f);
+
+    // Everything besides the source the scene was built from, a cooked copy is only good while these are unchanged
+    set<string> dependencies(ioSystem->m_files.begin(), ioSystem->m_files.end());
+    for (size_t i = 0; i < m_textureRequests.size(); i++)
+    {
+      dependencies.insert(m_textureRequests[i].m_path);
+    }
+    dependencies.erase(filename);
+    m_importDependencies.assign(dependencies.begin(), dependencies.end());
+
+    decodeTextures(jobSystem);
+    reportProgress(0.7f);
+    if (m_optimizeMeshes)
+    {
+      optimizeMeshes(jobSystem);
+    }
+    reportProgress(0.8f);
+    if (m_numLodLevels > 1)
+    {
+      buildLods(jobSystem);
+    }
+    reportProgress(0.9f);
+    uint32_t numLoadedMeshes = (uint32_t)m_loadedMeshes.size();
+    m_loadedMeshes.clear();
 
     printLog("Done Loaded Mesh");
+    reportLoad("Assimp", timer, buffers, numLoadedMeshes, false);
 
     return (rootEntity);
   }
@@ -198,6 +330,7 @@ namespace Bonny
         populateMeshMaterial(scene, rlMesh, rlMaterial, mesh);
         rlMesh->setMaterial(rlMaterial);
         renderComponent->addMesh(rlMesh);
+        m_loadedMeshes.push_back(rlMesh);
       }
       entity->addComponent(renderComponent);
     }
@@ -219,7 +352,8 @@ namespace Bonny
     unsigned int numVerts = mesh->mNumVertices;
     unsigned int bufferIndex = 0;
 
-    float* verts = new float[numVerts * 3];
+    // Arrays are filled in place and handed over, the mesh keeps them without another copy
+    unique_ptr<float[]> verts(new float[numVerts * 3]);
     unsigned int vindex = 0;
     for (unsigned int i = 0; i<numVerts; i++)
     {
@@ -227,11 +361,11 @@ namespace Bonny
       verts[vindex++] = mesh->mVertices[i].y;
       verts[vindex++] = mesh->mVertices[i].z;
     }
-    rlMesh->addVertexBuffer(bufferIndex++, 3, sizeof(float)*numVerts * 3, verts);
+    rlMesh->addVertexBuffer(bufferIndex++, Mesh::POSITION, 3, std::move(verts));
 
     if (mesh->HasNormals())
     {
-      float* normals = new float[numVerts * 3];
+      unique_ptr<float[]> normals(new float[numVerts * 3]);
       unsigned int nindex = 0;
       for (unsigned int i = 0; i<numVerts; i++)
       {
@@ -239,25 +373,25 @@ namespace Bonny
         normals[nindex++] = mesh->mNormals[i].y;
         normals[nindex++] = mesh->mNormals[i].z;
       }
-      rlMesh->addVertexBuffer(bufferIndex++, 3, sizeof(float)*numVerts * 3, normals);
+      rlMesh->addVertexBuffer(bufferIndex++, Mesh::NORMAL, 3, std::move(normals));
     }
 
     if (mesh->HasTextureCoords(0))
     {
-      float* texCoords = new float[numVerts * 2];
+      unique_ptr<float[]> texCoords(new float[numVerts * 2]);
       unsigned int tindex = 0;
       for (unsigned int i = 0; i<numVerts; i++)
       {
         texCoords[tindex++] = mesh->mTextureCoords[0][i].x;
         texCoords[tindex++] = mesh->mTextureCoords[0][i].y;
       }
-      rlMesh->addVertexBuffer(bufferIndex++, 2, sizeof(float)*numVerts * 2, texCoords);
+      rlMesh->addVertexBuffer(bufferIndex++, Mesh::TEXCOORD, 2, std::move(texCoords));
     }
 
     if (mesh->HasTangentsAndBitangents())
     {
-      float* tangents = new float[numVerts * 3];
-      float* bitangents = new float[numVerts * 3];
+      unique_ptr<float[]> tangents(new float[numVerts * 3]);
+      unique_ptr<float[]> bitangents(new float[numVerts * 3]);
       unsigned int tbindex = 0;
       for (unsigned int i = 0; i<numVerts; i++)
       {
@@ -268,11 +402,11 @@ namespace Bonny
         tangents[tbindex] = mesh->mTangents[i].z;
         bitangents[tbindex++] = mesh->mBitangents[i].z;
       }
-      rlMesh->addVertexBuffer(bufferIndex++, 3, sizeof(float)*numVerts * 3, tangents);
-      rlMesh->addVertexBuffer(bufferIndex++, 3, sizeof(float)*numVerts * 3, bitangents);
+      rlMesh->addVertexBuffer(bufferIndex++, Mesh::TANGENT, 3, std::move(tangents));
+      rlMesh->addVertexBuffer(bufferIndex++, Mesh::BITANGENT, 3, std::move(bitangents));
     }
 
-    unsigned int* indexBuffer = new unsigned int[numFaces * 3];
+    unique_ptr<unsigned int[]> indexBuffer(new unsigned int[numFaces * 3]);
     unsigned int iindex = 0;
     for (unsigned int i = 0; i<numFaces; i++)
     {
@@ -281,7 +415,7 @@ namespace Bonny
       indexBuffer[iindex++] = face->mIndices[1];
       indexBuffer[iindex++] = face->mIndices[2];
     }
-    rlMesh->addIndexBuffer(numFaces * 3, indexBuffer);
+    rlMesh->addIndexBuffer(numFaces * 3, std::move(indexBuffer));
 
     for (unsigned int i = 0; i<material->mNumProperties;)
     {
@@ -327,18 +461,14 @@ namespace Bonny
     aiString texturePath;
     if (material->GetTexture(aiTextureType_DIFFUSE, texIndex, &texturePath) == AI_SUCCESS)
     {
-      shared_ptr<Texture> texture = loadTexture((const char*)texturePath.C_Str());
-      rlMaterial->setAlbedoTexture(texture);
-      printLog("Loaded Texture: " + std::string(texturePath.C_Str()));
+      requestTexture(texturePath.C_Str(), rlMaterial, Material::ALBEDO_TEXTURE);
     }
 
     int normalIndex = 0;
     aiString normalPath;
     if (material->GetTexture(aiTextureType_HEIGHT, normalIndex, &normalPath) == AI_SUCCESS && texturePath != normalPath)
     {
-      shared_ptr<Texture> normalTexture = loadTexture((const char*)normalPath.C_Str());
-      rlMaterial->setNormalTexture(normalTexture);
-      printLog("Loaded Normal Texture: " + std::string(normalPath.C_Str()));
+      requestTexture(normalPath.C_Str(), rlMaterial, Material::NORMAL_TEXTURE);
     }
 
     //int metallicIndex = 0;
@@ -354,54 +484,575 @@ namespace Bonny
     aiString roughnessPath;
     if (material->GetTexture(aiTextureType_SHININESS, roughnessIndex, &roughnessPath) == AI_SUCCESS && texturePath != roughnessPath)
     {
-      shared_ptr<Texture> roughnessTexture = loadTexture((const char*)roughnessPath.C_Str());
-      rlMaterial->setMetallicRoughnessTexture(roughnessTexture);
-      printLog("Loaded Roughness Texture: " + std::string(roughnessPath.C_Str()));
+      requestTexture(roughnessPath.C_Str(), rlMaterial, Material::METALLIC_ROUGHNESS_TEXTURE);
+    }
+  }
+
+  shared_ptr<Entity> ModelLoader::loadCookedModel(string filename, JobSystem* jobSystem)
+  {
+    CpuTimer timer;
+    timer.start();
+    BufferStats::Counts buffers;
+    BufferStats::getCounts(buffers);
+
+    // Streams stay in the mapping, only the texture references are resolved here
+    CookedScene::Stats stats;
+    shared_ptr<Entity> rootEntity = CookedScene::read(filename, [this](const string& path, shared_ptr<Material> material, Material::TextureSlot slot)
+    {
+      requestTexture(path, material, slot);
+    }, stats);
+    if (rootEntity == nullptr)
+    {
+      printLog("Cooked Model " + filename + " missing or out of date");
+      m_textureRequests.clear();
+      return nullptr;
+    }
+    reportProgress(0.3f);
+    decodeTextures(jobSystem);
+    reportProgress(0.9f);
+
+    printLog("Cooked Model: " + std::to_string(stats.m_numEntities) + " entities, " + std::to_string(stats.m_numMeshes) + " meshes, " +
+      std::to_string(stats.m_numMaterials) + " materials, " + std::to_string(stats.m_numTextures) + " textures, " +
+      std::to_string(stats.m_streamBytes) + " mapped stream bytes");
+    reportLoad("Cooked", timer, buffers, stats.m_numMeshes, true);
+    return rootEntity;
+  }
+
+  bool ModelLoader::saveCookedModel(string filename, shared_ptr<Entity> root)
+  {
+    return writeCookedModel(filename, root, vector<string>());
+  }
+
+  bool ModelLoader::writeCookedModel(const string& filename, shared_ptr<Entity> root, const vector<string>& dependencies)
+  {
+    CpuTimer timer;
+    timer.start();
+
+    CookedScene::Stats stats;
+    if (!CookedScene::write(filename, root, dependencies, stats))
+    {
+      printLog("Failed to write cooked model " + filename);
+      return false;
+    }
+    printLog("Wrote Cooked Model: " + std::to_string(stats.m_fileSize) + " bytes, " + std::to_string(stats.m_numMeshes) + " meshes, " +
+      std::to_string(stats.m_numDependencies) + " dependencies, " + std::to_string(timer.elapsedMilli()) + " ms");
+    return true;
+  }
+
+  void ModelLoader::getLoadStats(LoadStats& stats)
+  {
+    stats = m_loadStats;
+  }
+
+  void ModelLoader::setAssimpFlags(uint32_t flags)
+  {
+    m_assimpFlags = flags;
+  }
+
+  uint32_t ModelLoader::getAssimpFlags()
+  {
+    return m_assimpFlags;
+  }
+
+  void ModelLoader::setImportCache(bool enable, string directory)
+  {
+    m_importCache = enable;
+    m_importCacheDirectory = directory;
+  }
+
+  void ModelLoader::getImportCacheStats(ImportCacheStats& stats)
+  {
+    stats = m_importCacheStats;
+  }
+
+  void ModelLoader::setTextureCache(bool enable)
+  {
+    m_textureCache = enable;
+  }
+
+  void ModelLoader::getTextureCacheStats(TextureCacheStats& stats)
+  {
+    stats = m_textureCacheStats;
+  }
+
+  bool ModelLoader::computeImportKey(const string& filename, uint64_t& key)
+  {
+    MappedFile file;
+    if (!file.open(filename))
+    {
+      return false;
+    }
+
+    // 64 bit multiply and rotate over whole words, the tail is folded in bytewise
+    static const uint64_t c_prime = 0x9e3779b97f4a7c15ull;
+    const uint8_t* data = file.getData();
+    size_t size = file.getSize();
+    uint64_t hash = 0xcbf29ce484222325ull ^ size;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+      uint64_t word;
+      memcpy(&word, &data[i], sizeof(word));
+      hash = ((hash ^ word) * c_prime);
+      hash = (hash << 31) | (hash >> 33);
+    }
+    for (; i < size; i++)
+    {
+      hash = (hash ^ data[i]) * c_prime;
+    }
+
+    hash = (hash ^ computeImportSettingsKey()) * c_prime;
+    hash = (hash << 31) | (hash >> 33);
+    key = hash ^ (hash >> 29);
+    return true;
+  }
+
+  uint64_t ModelLoader::computeImportSettingsKey()
+  {
+    // Everything besides the source that changes what ends up in the cooked scene
+    static const uint64_t c_prime = 0x9e3779b97f4a7c15ull;
+    uint64_t settings[] = { m_assimpFlags, m_optimizeMeshes ? 1u : 0u, m_numLodLevels, CookedScene::c_version };
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); i++)
+    {
+      hash = (hash ^ settings[i]) * c_prime;
+      hash = (hash << 31) | (hash >> 33);
+    }
+    return hash ^ (hash >> 29);
+  }
+
+  string ModelLoader::getImportCachePrefix(const string& filename, uint64_t settingsKey)
+  {
+    // Base name for readability plus a hash of the full path, so sources with the same name don't share entries,
+    // and the settings, so entries of one source processed differently are told apart
+    size_t slash = filename.find_last_of("/\\");
+    string name = filename.substr(slash == string::npos ? 0 : slash + 1);
+    name = name.substr(0, name.find_last_of('.'));
+    uint32_t pathHash = 2166136261u;
+    for (size_t i = 0; i < filename.size(); i++)
+    {
+      pathHash = (pathHash ^ (uint8_t)filename[i]) * 16777619u;
+    }
+    char hashString[24];
+    snprintf(hashString, sizeof(hashString), "_%08x_%08x_", pathHash, (uint32_t)(settingsKey ^ (settingsKey >> 32)));
+    return m_importCacheDirectory + "/" + name + hashString;
+  }
+
+  uint32_t ModelLoader::removeStaleEntries(const string& prefix, const char* extension, const string& current)
+  {
+    // Older entries of the same source and settings can never be hit again. Only names of exactly the prefix,
+    // a key and the extension match, the wildcard alone would also take longer names sharing the prefix.
+    string directory = prefix.substr(0, prefix.find_last_of('/') + 1);
+    size_t nameLength = prefix.size() - directory.size() + 16 + 1 + strlen(extension);
+    WIN32_FIND_DATAA findData;
+    HANDLE find = FindFirstFileA((prefix + "*." + extension).c_str(), &findData);
+    if (find == INVALID_HANDLE_VALUE)
+    {
+      return 0;
+    }
+    uint32_t numRemoved = 0;
+    do
+    {
+      string path = directory + findData.cFileName;
+      if (strlen(findData.cFileName) == nameLength && path != current && DeleteFileA(path.c_str()))
+      {
+        numRemoved++;
+      }
+    } while (FindNextFileA(find, &findData));
+    FindClose(find);
+    return numRemoved;
+  }
+
+  bool ModelLoader::computeTextureKey(const string& filename, Texture::Usage usage, uint64_t& key)
+  {
+    // Size and write time stand in for the content, hashing every image would cost as much as decoding it
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &attributes))
+    {
+      return false;
     }
+
+    static const uint64_t c_prime = 0x9e3779b97f4a7c15ull;
+    uint64_t values[] = {
+      ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow,
+      ((uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime,
+      computeTextureSettingsKey(usage)
+    };
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+      hash = (hash ^ values[i]) * c_prime;
+      hash = (hash << 31) | (hash >> 33);
+    }
+    key = hash ^ (hash >> 29);
+    return true;
+  }
+
+  uint64_t ModelLoader::computeTextureSettingsKey(Texture::Usage usage)
+  {
+    // The usage and processing settings a cached texture was made with
+    static const uint64_t c_prime = 0x9e3779b97f4a7c15ull;
+    uint64_t values[] = {
+      (uint64_t)usage,
+      m_textureSettings.m_generateMips ? 1u : 0u,
+      m_textureSettings.m_compress ? 1u : 0u,
+      m_textureSettings.m_useBc7 ? 1u : 0u,
+      (uint64_t)m_textureSettings.m_filter,
+      DdsFile::c_version
+    };
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+      hash = (hash ^ values[i]) * c_prime;
+      hash = (hash << 31) | (hash >> 33);
+    }
+    return hash ^ (hash >> 29);
+  }
+
+  void ModelLoader::reportImportCache()
+  {
+    const ImportCacheStats& stats = m_importCacheStats;
+    printLog("Import Cache: " + std::to_string(stats.m_numHits) + " hits, " + std::to_string(stats.m_numMisses) + " misses, " +
+      std::to_string(stats.m_numWrites) + " writes, " + std::to_string(stats.m_numStaleRemoved) + " stale removed, hashing " +
+      std::to_string(stats.m_hashTime) + " ms, hits " + std::to_string(stats.m_hitTime) + " ms, misses " + std::to_string(stats.m_missTime) + " ms");
+  }
+
+  void ModelLoader::reportTextureCache()
+  {
+    const TextureCacheStats& stats = m_textureCacheStats;
+    uint32_t numLookups = stats.m_numHits + stats.m_numMisses;
+    uint32_t hitRate = numLookups > 0 ? stats.m_numHits * 100 / numLookups : 0;
+    printLog("Texture Cache: " + std::to_string(stats.m_numHits) + " hits, " + std::to_string(stats.m_numMisses) + " misses (" + std::to_string(hitRate) +
+      "% hit rate), " + std::to_string(stats.m_numWrites) + " writes, " + std::to_string(stats.m_numStaleRemoved) + " stale removed, " +
+      std::to_string(stats.m_bytesRead) + " bytes read, " + std::to_string(stats.m_bytesWritten) + " bytes written");
+  }
+
+  void ModelLoader::reportLoad(const char* path, CpuTimer& timer, const BufferStats::Counts& buffers, uint32_t numMeshes, bool cooked)
+  {
+    PROCESS_MEMORY_COUNTERS counters;
+    memset(&counters, 0, sizeof(counters));
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+
+    m_loadStats.m_time = timer.elapsedMilli();
+    m_loadStats.m_peakWorkingSet = counters.PeakWorkingSetSize;
+    m_loadStats.m_numMeshes = numMeshes;
+    m_loadStats.m_cooked = cooked;
+    printLog(string(path) + " Load: " + std::to_string(m_loadStats.m_time) + " ms, " + std::to_string(numMeshes) + " meshes, peak working set " +
+      std::to_string(m_loadStats.m_peakWorkingSet / (1024 * 1024)) + " MB");
+
+    // Counts are process wide, buffers other threads created meanwhile are included
+    BufferStats::Counts counts;
+    BufferStats::getCounts(counts);
+    m_loadStats.m_buffers.m_numCopies = counts.m_numCopies - buffers.m_numCopies;
+    m_loadStats.m_buffers.m_bytesCopied = counts.m_bytesCopied - buffers.m_bytesCopied;
+    m_loadStats.m_buffers.m_numAdopted = counts.m_numAdopted - buffers.m_numAdopted;
+    m_loadStats.m_buffers.m_bytesAdopted = counts.m_bytesAdopted - buffers.m_bytesAdopted;
+    printLog(string(path) + " Load Buffers: " + std::to_string(m_loadStats.m_buffers.m_numCopies) + " copied (" +
+      std::to_string(m_loadStats.m_buffers.m_bytesCopied) + " bytes), " + std::to_string(m_loadStats.m_buffers.m_numAdopted) + " adopted (" +
+      std::to_string(m_loadStats.m_buffers.m_bytesAdopted) + " bytes)");
+  }
+
+  void ModelLoader::setOptimizeMeshes(bool optimize)
+  {
+    m_optimizeMeshes = optimize;
+  }
+
+  bool ModelLoader::getOptimizeMeshes()
+  {
+    return m_optimizeMeshes;
+  }
+
+  void ModelLoader::setNumLodLevels(uint32_t numLevels)
+  {
+    m_numLodLevels = std::min(numLevels, Mesh::c_maxLods);
+  }
+
+  uint32_t ModelLoader::getNumLodLevels()
+  {
+    return m_numLodLevels;
+  }
+
+  void ModelLoader::setProgressFunction(ProgressFunction progressFunction)
+  {
+    m_progressFunction = progressFunction;
+  }
+
+  void ModelLoader::reportProgress(float progress)
+  {
+    if (m_progressFunction)
+    {
+      m_progressFunction(progress);
+    }
+  }
+
+  void ModelLoader::optimizeMeshes(JobSystem* jobSystem)
+  {
+    CpuTimer timer;
+    timer.start();
+
+    // Meshes only touch their own buffers, optimize them in parallel
+    vector<MeshOptimizer::Report> reports(m_loadedMeshes.size());
+    JobSystem::JobHandle optimizeJob = jobSystem->parallelFor((uint32_t)m_loadedMeshes.size(), 1, [this, &reports](uint32_t begin, uint32_t end)
+    {
+      for (uint32_t i = begin; i < end; i++)
+      {
+        m_loadedMeshes[i]->optimize(MeshOptimizer::c_defaultCacheSize, reports[i]);
+      }
+    }, {});
+    jobSystem->wait(optimizeJob);
+
+    // Triangle and vertex weighted averages over the optimized meshes
+    uint32_t numOptimized = 0;
+    double numTriangles = 0.0;
+    double numVertices = 0.0;
+    double missesBefore = 0.0;
+    double missesAfter = 0.0;
+    uint64_t numClusters = 0;
+    for (size_t i = 0; i < reports.size(); i++)
+    {
+      const MeshOptimizer::Report& report = reports[i];
+      if (!report.m_optimized)
+      {
+        continue;
+      }
+      numOptimized++;
+      numTriangles += report.m_numTriangles;
+      numVertices += report.m_numVertices;
+      missesBefore += report.m_acmrBefore * report.m_numTriangles;
+      missesAfter += report.m_acmrAfter * report.m_numTriangles;
+      numClusters += report.m_numClusters;
+    }
+    double acmrBefore = numTriangles > 0.0 ? missesBefore / numTriangles : 0.0;
+    double acmrAfter = numTriangles > 0.0 ? missesAfter / numTriangles : 0.0;
+    double atvrBefore = numVertices > 0.0 ? missesBefore / numVertices : 0.0;
+    double atvrAfter = numVertices > 0.0 ? missesAfter / numVertices : 0.0;
+    printLog("Mesh Optimization: " + std::to_string(numOptimized) + "/" + std::to_string(reports.size()) + " meshes, ACMR " +
+      std::to_string(acmrBefore) + " -> " + std::to_string(acmrAfter) + ", ATVR " + std::to_string(atvrBefore) + " -> " +
+      std::to_string(atvrAfter) + ", " + std::to_string(numClusters) + " clusters, " + std::to_string(timer.elapsedMilli()) + " ms");
+  }
+
+  void ModelLoader::buildLods(JobSystem* jobSystem)
+  {
+    CpuTimer timer;
+    timer.start();
+
+    // Each level keeps about half the triangles of the one before it
+    JobSystem::JobHandle lodJob = jobSystem->parallelFor((uint32_t)m_loadedMeshes.size(), 1, [this](uint32_t begin, uint32_t end)
+    {
+      for (uint32_t i = begin; i < end; i++)
+      {
+        m_loadedMeshes[i]->buildLods(m_numLodLevels, c_lodReduction);
+      }
+    }, {});
+    jobSystem->wait(lodJob);
+
+    uint32_t numLevels = 0;
+    uint64_t numFullIndices = 0;
+    uint64_t numLodIndices = 0;
+    for (size_t i = 0; i < m_loadedMeshes.size(); i++)
+    {
+      if (m_loadedMeshes[i]->getNumLods() > 1)
+      {
+        numLevels += m_loadedMeshes[i]->getNumLods() - 1;
+        numFullIndices += m_loadedMeshes[i]->getIndexBufferSize();
+        numLodIndices += m_loadedMeshes[i]->getLodIndexBufferSize();
+      }
+    }
+    printLog("Mesh LODs: " + std::to_string(numLevels) + " levels, " + std::to_string(numFullIndices / 3) + " full triangles, " +
+      std::to_string(numLodIndices / 3) + " LOD triangles, " + std::to_string(timer.elapsedMilli()) + " ms");
   }
 
-  shared_ptr<Texture> ModelLoader::loadTexture(const char* filename)
+  void ModelLoader::requestTexture(const string& path, shared_ptr<Material> material, Material::TextureSlot slot)
   {
-    ILuint ilDiffuseID;
-    ILboolean success;
-    shared_ptr<Texture> texture = nullptr;
+    TextureRequest request;
+    request.m_path = path;
+    request.m_material = material;
+    request.m_slot = slot;
+    m_textureRequests.push_back(request);
+  }
 
-    map<string, shared_ptr<Texture>>::iterator it = m_textureMap.find(filename);
-    if (it != m_textureMap.end())
+  void ModelLoader::decodeTextures(JobSystem* jobSystem)
+  {
+    CpuTimer timer;
+    timer.start();
+
+    // Each file is decoded once however many slots reference it, and not at all when an earlier load still uses it
+    // or failed to decode it. The first slot referencing a file decides how it is processed.
+    vector<TextureFile> files;
+    map<string, uint32_t> pathIndices;
+    for (size_t i = 0; i < m_textureRequests.size(); i++)
     {
-      //element found;
-      return it->second;
+      const string& path = m_textureRequests[i].m_path;
+      auto loaded = m_textureMap.find(path);
+      if ((loaded == m_textureMap.end() || loaded->second.expired()) && m_failedTextures.find(path) == m_failedTextures.end() &&
+          pathIndices.find(path) == pathIndices.end())
+      {
+        pathIndices[path] = (uint32_t)files.size();
+        TextureFile file;
+        file.m_path = path;
+        file.m_usage = getSlotUsage(m_textureRequests[i].m_slot);
+        file.m_bytesRead = 0;
+        file.m_bytesWritten = 0;
+        file.m_numStaleRemoved = 0;
+        file.m_image.m_decoder = TextureDecoder::DECODER_NONE;
+        uint64_t key = 0;
+        if (m_textureCache && computeTextureKey(path, file.m_usage, key))
+        {
+          char keyString[24];
+          snprintf(keyString, sizeof(keyString), "%016llx", (unsigned long long)key);
+          file.m_cachePrefix = getImportCachePrefix(path, computeTextureSettingsKey(file.m_usage));
+          file.m_cachePath = file.m_cachePrefix + keyString + ".dds";
+        }
+        files.push_back(file);
+      }
+    }
+    if (m_textureCache && !files.empty())
+    {
+      CreateDirectoryA(m_importCacheDirectory.c_str(), nullptr);
+    }
+
+    // Cached files are only mapped, their levels are streamed in by the residency manager. Otherwise mips and
+    // block compression run in the same job as the decode, the RGBA image is dropped right after and the result
+    // is cached. The written file is mapped as well so evicted levels can be brought back from it.
+    if (!files.empty())
+    {
+      const TextureProcessor::Settings& settings = m_textureSettings;
+      JobSystem::JobHandle decodeJob = jobSystem->parallelFor((uint32_t)files.size(), 1, [this, &files, &settings](uint32_t begin, uint32_t end)
+      {
+        for (uint32_t i = begin; i < end; i++)
+        {
+          TextureFile& file = files[i];
+          if (!file.m_cachePath.empty())
+          {
+            file.m_cached = DdsFile::read(file.m_cachePath, file.m_path, IL_RGBA, file.m_bytesRead);
+            if (file.m_cached != nullptr)
+            {
+              continue;
+            }
+          }
+
+          TextureDecoder::Image& image = file.m_image;
+          if (TextureDecoder::decode(file.m_path, image))
+          {
+            TextureProcessor::process(image.m_data.data(), image.m_width, image.m_height, file.m_usage, settings, file.m_result);
+            vector<uint8_t>().swap(image.m_data);
+            if (!file.m_cachePath.empty() && DdsFile::write(file.m_cachePath, image.m_width, image.m_height, file.m_usage, file.m_result, file.m_bytesWritten))
+            {
+              file.m_numStaleRemoved = removeStaleEntries(file.m_cachePrefix, "dds", file.m_cachePath);
+              shared_ptr<MappedFile> mapping = make_shared<MappedFile>();
+              if (mapping->open(file.m_cachePath))
+              {
+                file.m_streamSource = mapping;
+              }
+            }
+          }
+        }
+      }, {});
+      jobSystem->wait(decodeJob);
     }
 
-    /* generate DevIL Image IDs */
-    ilGenImages(1, &ilDiffuseID);
-    ilBindImage(ilDiffuseID); /* Binding of DevIL image name */
-    success = ilLoadImage((const char*)filename);
-    //ilConvertImage(IL_RGBA, IL_UNSIGNED_BYTE);
+    // Materials are only touched here, on the loading thread
+    uint32_t numDecoded[3] = { 0, 0, 0 };
+    uint32_t numCompressed[Texture::NUM_COMPRESSIONS] = {};
+    size_t numBytes = 0;
+    size_t numProcessedBytes = 0;
+    uint32_t numMips = 0;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+      TextureFile& file = files[i];
+      shared_ptr<Texture> texture = file.m_cached;
+      if (!file.m_cachePath.empty())
+      {
+        m_textureCacheStats.m_numHits += (texture != nullptr) ? 1 : 0;
+        m_textureCacheStats.m_numMisses += (texture == nullptr) ? 1 : 0;
+        m_textureCacheStats.m_numWrites += (file.m_bytesWritten > 0) ? 1 : 0;
+        m_textureCacheStats.m_numStaleRemoved += file.m_numStaleRemoved;
+        m_textureCacheStats.m_bytesRead += file.m_bytesRead;
+        m_textureCacheStats.m_bytesWritten += file.m_bytesWritten;
+      }
+
+      if (texture == nullptr)
+      {
+        TextureDecoder::Image& image = file.m_image;
+        numDecoded[image.m_decoder]++;
+        if (image.m_decoder == TextureDecoder::DECODER_NONE)
+        {
+          printLog("Failed to load texture " + file.m_path);
+          m_failedTextures.insert(file.m_path);
+          continue;
+        }
 
-    if (success) /* If no error occured: */
+        texture = make_shared<Texture>(file.m_path, image.m_width, image.m_height, 1, 4, (size_t)image.m_width * image.m_height * 4, image.m_format);
+        texture->setUsage(file.m_usage);
+        numBytes += texture->getSize();
+        texture->setMips(file.m_result.m_compression, file.m_result.m_mips, file.m_result.m_data);
+        if (file.m_streamSource != nullptr)
+        {
+          texture->setStreamSource(file.m_streamSource, DdsFile::c_dataOffset);
+        }
+        file.m_cached = texture;
+      }
+      else
+      {
+        numBytes += texture->getWidth() * texture->getHeight() * 4;
+      }
+      numProcessedBytes += texture->getMipDataSize();
+      numMips += texture->getNumMips();
+      numCompressed[texture->getCompression()]++;
+      m_textureMap[file.m_path] = texture;
+    }
+
+    for (size_t i = 0; i < m_textureRequests.size(); i++)
     {
-      success = ilConvertImage(IL_RGBA, IL_UNSIGNED_BYTE);
-      if (!success)
+      TextureRequest& request = m_textureRequests[i];
+      shared_ptr<Texture> texture = m_textureMap[request.m_path].lock();
+      if (texture != nullptr)
       {
-        return NULL;
+        request.m_material->setTexture(request.m_slot, texture);
       }
+    }
 
-      texture = make_shared<Texture>(filename, ilGetInteger(IL_IMAGE_WIDTH), ilGetInteger(IL_IMAGE_HEIGHT), ilGetInteger(IL_IMAGE_DEPTH),
-        ilGetInteger(IL_IMAGE_BYTES_PER_PIXEL), ilGetInteger(IL_IMAGE_SIZE_OF_DATA), ilGetInteger(IL_IMAGE_FORMAT));
-      texture->setData(ilGetData());
+    printLog("Texture Decode: " + std::to_string(m_textureRequests.size()) + " requests, " + std::to_string(files.size()) + " files (" +
+      std::to_string(numDecoded[TextureDecoder::DECODER_TGA]) + " tga, " + std::to_string(numDecoded[TextureDecoder::DECODER_DEVIL]) + " devil, " +
+      std::to_string(numDecoded[TextureDecoder::DECODER_NONE]) + " failed), " + std::to_string(numBytes) + " bytes, " + std::to_string(timer.elapsedMilli()) + " ms");
+    printLog("Texture Processing: " + std::to_string(numMips) + " mips, " + std::to_string(numProcessedBytes) + " bytes for " + std::to_string(numBytes) +
+      " RGBA base bytes, BC1 " + std::to_string(numCompressed[Texture::COMPRESSION_BC1]) + ", BC3 " + std::to_string(numCompressed[Texture::COMPRESSION_BC3]) +
+      ", BC5 " + std::to_string(numCompressed[Texture::COMPRESSION_BC5]) + ", BC7 " + std::to_string(numCompressed[Texture::COMPRESSION_BC7]) +
+      ", uncompressed " + std::to_string(numCompressed[Texture::COMPRESSION_NONE]));
+    if (m_textureCache && !files.empty())
+    {
+      reportTextureCache();
+    }
+    m_textureRequests.clear();
+  }
 
-      m_textureMap[filename] = texture;
+  Texture::Usage ModelLoader::getSlotUsage(Material::TextureSlot slot)
+  {
+    switch (slot)
+    {
+    case Material::ALBEDO_TEXTURE:
+    case Material::EMISSIVE_TEXTURE:
+      return Texture::USAGE_COLOR;
+    case Material::NORMAL_TEXTURE:
+      return Texture::USAGE_NORMAL;
+    default:
+      return Texture::USAGE_DATA;
     }
+  }
+
+  void ModelLoader::setTextureSettings(const TextureProcessor::Settings& settings)
+  {
+    m_textureSettings = settings;
+  }
 
-    return texture;
+  void ModelLoader::getTextureSettings(TextureProcessor::Settings& settings)
+  {
+    settings = m_textureSettings;
   }
 
   void ModelLoader::printLog(string s)
   {
     string st = s + "\n";
-    TCHAR name[256];
-    _tcscpy_s(name, CA2T(st.c_str()));
-    OutputDebugString(name);
+    OutputDebugString(CA2T(st.c_str()));
   }
 }
@@ -5,11 +5,19 @@
 #include "Material.h"
 #include "Texture.h"
 #include "View.h"
+#include "JobSystem.h"
+#include "CpuTimer.h"
+#include "CookedScene.h"
+#include "TextureProcessor.h"
+#include "DdsFile.h"
+#include "BufferStats.h"
 
 #include <string>
 #include <vector>
 #include <memory>
 #include <map>
+#include <set>
+#include <functional>
 
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h> 
@@ -19,25 +27,128 @@
 using std::string;
 using std::vector;
 using std::shared_ptr;
+using std::weak_ptr;
 using std::map;
+using std::set;
+using std::function;
 
 namespace Bonny
 {
 	class ModelLoader
 	{
 	public:
+    // Cost of the last load, the peak working set is the process peak once the
+    // load finished, so cold starts of the two paths can be compared. The buffer
+    // counts are what meshes and textures copied or adopted during the load.
+    struct LoadStats
+    {
+      unsigned long long  m_time;
+      size_t              m_peakWorkingSet;
+      uint32_t            m_numMeshes;
+      bool                m_cooked;
+      BufferStats::Counts m_buffers;
+    };
+
+    // On disk import cache, entries are cooked scenes keyed by the source's content
+    // hash, the Assimp flags and the mesh processing settings. An entry is only used
+    // while the material libraries and textures the source pulled in are unchanged.
+    // Stale entries are those of the same source and settings with an older key.
+    struct ImportCacheStats
+    {
+      uint32_t            m_numHits;
+      uint32_t            m_numMisses;
+      uint32_t            m_numWrites;
+      uint32_t            m_numStaleRemoved;
+      unsigned long long  m_hashTime;
+      unsigned long long  m_hitTime;
+      unsigned long long  m_missTime;
+    };
+
+    // Processed textures cached as DDS files next to the import cache, keyed by the
+    // source path, size and write time, the usage and the processing settings. Stale
+    // entries are those of the same source, usage and settings with an older key.
+    struct TextureCacheStats
+    {
+      uint32_t            m_numHits;
+      uint32_t            m_numMisses;
+      uint32_t            m_numWrites;
+      uint32_t            m_numStaleRemoved;
+      uint64_t            m_bytesRead;
+      uint64_t            m_bytesWritten;
+    };
+
+    // Called from the loading thread with the fraction of the load done so far
+    typedef function<void(float progress)> ProgressFunction;
+
 		ModelLoader();
 		~ModelLoader();
 
-    shared_ptr<Entity>  loadAssimpModel(string filename);
+    shared_ptr<Entity>  loadAssimpModel(string filename, JobSystem* jobSystem);
+    shared_ptr<Entity>  loadCookedModel(string filename, JobSystem* jobSystem);
+    bool                saveCookedModel(string filename, shared_ptr<Entity> root);
+    void                getLoadStats(LoadStats& stats);
+    void                setAssimpFlags(uint32_t flags);
+    uint32_t            getAssimpFlags();
+    void                setImportCache(bool enable, string directory);
+    void                getImportCacheStats(ImportCacheStats& stats);
+    void                setTextureCache(bool enable);
+    void                getTextureCacheStats(TextureCacheStats& stats);
+    void                setOptimizeMeshes(bool optimize);
+    bool                getOptimizeMeshes();
+    void                setNumLodLevels(uint32_t numLevels);
+    uint32_t            getNumLodLevels();
+    void                setProgressFunction(ProgressFunction progressFunction);
+    void                setTextureSettings(const TextureProcessor::Settings& settings);
+    void                getTextureSettings(TextureProcessor::Settings& settings);
 
   private:
+    // A texture a material slot waits for, resolved once the whole scene has been walked
+    struct TextureRequest
+    {
+      string                m_path;
+      shared_ptr<Material>  m_material;
+      Material::TextureSlot m_slot;
+    };
+
+    shared_ptr<Entity> importAssimpModel(string filename, JobSystem* jobSystem);
+    bool writeCookedModel(const string& filename, shared_ptr<Entity> root, const vector<string>& dependencies);
+    bool computeImportKey(const string& filename, uint64_t& key);
+    uint64_t computeImportSettingsKey();
+    string getImportCachePrefix(const string& filename, uint64_t settingsKey);
+    uint32_t removeStaleEntries(const string& prefix, const char* extension, const string& current);
+    bool computeTextureKey(const string& filename, Texture::Usage usage, uint64_t& key);
+    uint64_t computeTextureSettingsKey(Texture::Usage usage);
     void processNode(const aiScene* scene, shared_ptr<Entity> parent, aiNode* node);
     void populateMeshMaterial(const aiScene* scene, shared_ptr<Mesh> rlMesh, shared_ptr<Material> rlMaterial, aiMesh* mesh);
-    shared_ptr<Texture> loadTexture(const char* filename);
+    void requestTexture(const string& path, shared_ptr<Material> material, Material::TextureSlot slot);
+    void decodeTextures(JobSystem* jobSystem);
+    static Texture::Usage getSlotUsage(Material::TextureSlot slot);
+    void optimizeMeshes(JobSystem* jobSystem);
+    void buildLods(JobSystem* jobSystem);
+
+    void reportLoad(const char* path, CpuTimer& timer, const BufferStats::Counts& buffers, uint32_t numMeshes, bool cooked);
+    void reportImportCache();
+    void reportTextureCache();
+    void reportProgress(float progress);
 
     void printLog(string s);
-    map<string, shared_ptr<Texture>>          m_textureMap;
+    // Materials own their textures, the map only shares them between loads while something still uses them
+    map<string, weak_ptr<Texture>>            m_textureMap;
+    set<string>                               m_failedTextures;
+    vector<TextureRequest>                    m_textureRequests;
+    vector<string>                            m_importDependencies;
+    vector<shared_ptr<Mesh>>                  m_loadedMeshes;
+    bool                                      m_optimizeMeshes;
+    uint32_t                                  m_numLodLevels;
+    LoadStats                                 m_loadStats;
+    uint32_t                                  m_assimpFlags;
+    bool                                      m_importCache;
+    string                                    m_importCacheDirectory;
+    ImportCacheStats                          m_importCacheStats;
+    ProgressFunction                          m_progressFunction;
+    TextureProcessor::Settings                m_textureSettings;
+    bool                                      m_textureCache;
+    TextureCacheStats                         m_textureCacheStats;
 	};
 }
 
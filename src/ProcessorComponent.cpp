@@ -5,7 +5,8 @@ namespace Bonny
 {
   ProcessorComponent::ProcessorComponent(string name, bool sendKeyboardEvents, bool sendMouseEvents): Component(name, Component::PROCESS),
     m_sendKeyboardEvents(sendKeyboardEvents),
-    m_sendMouseEvents(sendMouseEvents)
+    m_sendMouseEvents(sendMouseEvents),
+    m_independent(false)
   {
   }
 
@@ -24,6 +25,16 @@ namespace Bonny
     return m_sendMouseEvents;
   }
 
+  void ProcessorComponent::setIndependent(bool independent)
+  {
+    m_independent = independent;
+  }
+
+  bool ProcessorComponent::isIndependent()
+  {
+    return m_independent;
+  }
+
   void ProcessorComponent::handleKeyboard(MSG* event)
   {
 
@@ -8,6 +8,10 @@ using std::string;
 
 namespace Bonny
 {
+  // Processors run on the job system. By default they run one after another, as
+  // they may read and write entity and view state other processors touch too. A
+  // processor that only mutates state no other processor reads or writes can be
+  // marked independent and then runs in parallel with everything else.
   class ProcessorComponent: public Component
   {
   public:
@@ -16,6 +20,8 @@ namespace Bonny
 
     bool sendKeyboardEvents();
     bool sendMouseEvents();
+    void setIndependent(bool independent);
+    bool isIndependent();
 
     virtual void handleKeyboard(MSG* event);
     virtual void handleMouse(MSG* event);
@@ -24,5 +30,6 @@ namespace Bonny
   private:
     bool m_sendKeyboardEvents;
     bool m_sendMouseEvents;
+    bool m_independent;
   };
 }
@@ -0,0 +1,373 @@
+#include "stdafx.h"
+#include "RayTracer.h"
+#include "WorldManager.h"
+#include "LightComponent.h"
+#include "Material.h"
+#include "CpuTimer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+namespace Bonny
+{
+  // Pixels per tile side, tiles are the unit of work handed to the job system
+  static const uint32_t c_tileSize = 16;
+
+  // Secondary rays start this far off the surface, scaled by the distance from the origin
+  static const float c_rayOffset = 1e-4f;
+
+  static uint32_t hashSeed(uint32_t value)
+  {
+    value = (value ^ 61) ^ (value >> 16);
+    value *= 9;
+    value = value ^ (value >> 4);
+    value *= 0x27d4eb2d;
+    value = value ^ (value >> 15);
+    return value;
+  }
+
+  static float randomFloat(uint32_t& seed)
+  {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return (seed >> 8) * (1.0f / 16777216.0f);
+  }
+
+  static vec3 offsetRayOrigin(const vec3& position, const vec3& normal)
+  {
+    float scale = std::max(std::max(fabs(position.x), fabs(position.y)), std::max(fabs(position.z), 1.0f));
+    return position + normal * (c_rayOffset * scale);
+  }
+
+  RayTracer::RayTracer(string name, WorldManager* worldManager, RenderTechnique* renderTechnique) :
+    m_name(name),
+    m_worldManager(worldManager),
+    m_renderTechnique(renderTechnique),
+    m_width(0),
+    m_height(0),
+    m_samplesPerPixel(1),
+    m_maxBounces(1),
+    m_backgroundColor(0.0f, 0.0f, 0.0f),
+    m_maxDistance(0.0f),
+    m_tanHalfFov(0.0f),
+    m_aspect(1.0f),
+    m_numPrimaryRays(0),
+    m_numShadowRays(0),
+    m_numBounceRays(0)
+  {
+    memset(&m_stats, 0, sizeof(m_stats));
+  }
+
+
+  RayTracer::~RayTracer()
+  {
+  }
+
+  void RayTracer::render(shared_ptr<View> view)
+  {
+    CpuTimer timer;
+    timer.start();
+
+    // The image follows the view's viewport size
+    vec2 viewportSize;
+    view->getViewportSize(viewportSize);
+    m_width = std::max((uint32_t)viewportSize.x, 1u);
+    m_height = std::max((uint32_t)viewportSize.y, 1u);
+    m_image.assign(m_width * m_height, vec4(m_backgroundColor, 1.0f));
+
+    mat4 viewTransform;
+    view->getViewTransform(viewTransform);
+    m_invViewTransform = glm::inverse(viewTransform);
+    m_tanHalfFov = tan(view->getFieldOfView() * 0.5f * (float)M_PI / 180.0f);
+    m_aspect = (float)m_width / (float)m_height;
+    m_maxDistance = view->getFarClip();
+    gatherLights();
+
+    m_numPrimaryRays = 0;
+    m_numShadowRays = 0;
+    m_numBounceRays = 0;
+
+    // Tiles are independent, every pixel writes only its own entry of the image
+    uint32_t numTilesX = (m_width + c_tileSize - 1) / c_tileSize;
+    uint32_t numTilesY = (m_height + c_tileSize - 1) / c_tileSize;
+    shared_ptr<JobSystem> jobSystem = m_worldManager->getJobSystem();
+    JobSystem::JobHandle traceJob = jobSystem->parallelFor(numTilesX * numTilesY, 1, [this, numTilesX](uint32_t begin, uint32_t end)
+    {
+      RayCounts counts = {};
+      for (uint32_t tile = begin; tile < end; tile++)
+      {
+        renderTile(tile % numTilesX, tile / numTilesX, counts);
+      }
+      m_numPrimaryRays += counts.m_numPrimaryRays;
+      m_numShadowRays += counts.m_numShadowRays;
+      m_numBounceRays += counts.m_numBounceRays;
+    }, {});
+    jobSystem->wait(traceJob);
+
+    m_stats.m_numPrimaryRays = m_numPrimaryRays;
+    m_stats.m_numShadowRays = m_numShadowRays;
+    m_stats.m_numBounceRays = m_numBounceRays;
+    m_stats.m_time = timer.elapsedMicro();
+    uint64_t numRays = m_stats.m_numPrimaryRays + m_stats.m_numShadowRays + m_stats.m_numBounceRays;
+    m_stats.m_megaRaysPerSecond = m_stats.m_time > 0 ? (double)numRays / (double)m_stats.m_time : 0.0;
+  }
+
+  void RayTracer::gatherLights()
+  {
+    // Point lights in world space, the other light types are not traced yet
+    m_lights.clear();
+    for (uint32_t i = 0; i < m_renderTechnique->getNumLightComponents(); i++)
+    {
+      shared_ptr<LightComponent> lightComponent = m_renderTechnique->getLightComponent(i);
+      if (lightComponent->getLightType() != LightComponent::POINT)
+      {
+        continue;
+      }
+
+      Light light;
+      vec3 position;
+      mat4 transform;
+      lightComponent->getPosition(position);
+      lightComponent->getEntity(0)->getCompositeTransform(transform);
+      light.m_position = vec3(transform * vec4(position, 1.0f));
+      lightComponent->getDiffuse(light.m_color);
+      lightComponent->getAttenuation(light.m_attenuation);
+      m_lights.push_back(light);
+    }
+  }
+
+  void RayTracer::getCameraRay(float x, float y, vec3& origin, vec3& direction)
+  {
+    // Same camera model as picking, x and y are in pixels from the top left corner
+    float ndcX = 2.0f * x / (float)m_width - 1.0f;
+    float ndcY = 1.0f - 2.0f * y / (float)m_height;
+    origin = vec3(m_invViewTransform[3]);
+    direction = glm::normalize(vec3(m_invViewTransform * vec4(ndcX * m_tanHalfFov * m_aspect, ndcY * m_tanHalfFov, -1.0f, 0.0f)));
+  }
+
+  void RayTracer::renderTile(uint32_t tileX, uint32_t tileY, RayCounts& counts)
+  {
+    uint32_t beginX = tileX * c_tileSize;
+    uint32_t beginY = tileY * c_tileSize;
+    uint32_t endX = std::min(beginX + c_tileSize, m_width);
+    uint32_t endY = std::min(beginY + c_tileSize, m_height);
+    float sampleWeight = 1.0f / (float)m_samplesPerPixel;
+
+    // 2x2 pixel quads share one packet, lanes past the image edge are traced but not stored
+    for (uint32_t y = beginY; y < endY; y += 2)
+    {
+      for (uint32_t x = beginX; x < endX; x += 2)
+      {
+        uint32_t pixelX[4] = { x, x + 1, x, x + 1 };
+        uint32_t pixelY[4] = { y, y, y + 1, y + 1 };
+        uint32_t seeds[4];
+        vec3 colors[4];
+        int laneMask = 0;
+        for (int i = 0; i < 4; i++)
+        {
+          seeds[i] = hashSeed(pixelY[i] * m_width + pixelX[i]) | 1;
+          colors[i] = vec3(0.0f);
+          if (pixelX[i] < endX && pixelY[i] < endY)
+          {
+            laneMask |= 1 << i;
+          }
+        }
+
+        for (uint32_t sample = 0; sample < m_samplesPerPixel; sample++)
+        {
+          vec3 origins[4];
+          vec3 directions[4];
+          for (int i = 0; i < 4; i++)
+          {
+            float jitterX = m_samplesPerPixel > 1 ? randomFloat(seeds[i]) : 0.5f;
+            float jitterY = m_samplesPerPixel > 1 ? randomFloat(seeds[i]) : 0.5f;
+            getCameraRay(pixelX[i] + jitterX, pixelY[i] + jitterY, origins[i], directions[i]);
+          }
+
+          RenderTechnique::RayHit hits[4];
+          int hitMask = m_renderTechnique->intersectRayPacket(origins, directions, m_maxDistance, hits);
+          for (int i = 0; i < 4; i++)
+          {
+            if ((laneMask & (1 << i)) == 0)
+            {
+              continue;
+            }
+
+            counts.m_numPrimaryRays++;
+            if (hitMask & (1 << i))
+            {
+              colors[i] += shade(hits[i], directions[i], seeds[i], 0, counts);
+            }
+            else
+            {
+              colors[i] += m_backgroundColor;
+            }
+          }
+        }
+
+        for (int i = 0; i < 4; i++)
+        {
+          if (laneMask & (1 << i))
+          {
+            m_image[pixelY[i] * m_width + pixelX[i]] = vec4(colors[i] * sampleWeight, 1.0f);
+          }
+        }
+      }
+    }
+  }
+
+  vec3 RayTracer::shade(const RenderTechnique::RayHit& hit, const vec3& direction, uint32_t& seed, uint32_t depth, RayCounts& counts)
+  {
+    vec4 albedo(0.8f, 0.8f, 0.8f, 1.0f);
+    vec3 emissive(0.0f);
+    float metallic = 0.0f;
+    float roughness = 1.0f;
+    shared_ptr<Material> material = hit.m_mesh->getMaterial();
+    if (material != nullptr)
+    {
+      material->getAlbedoColor(albedo);
+      material->getEmissiveColor(emissive);
+      metallic = material->getMetallic();
+      roughness = material->getRoughness();
+    }
+
+    // Shade the side the ray arrived from
+    vec3 normal = glm::dot(hit.m_normal, direction) > 0.0f ? -hit.m_normal : hit.m_normal;
+    vec3 origin = offsetRayOrigin(hit.m_position, normal);
+    vec3 diffuse = vec3(albedo) * (1.0f - metallic);
+    vec3 lambert = diffuse * (1.0f / (float)M_PI);
+    vec3 specular = vec3(0.04f) * (1.0f - metallic) + vec3(albedo) * metallic;
+
+    // Normalized Blinn-Phong lobe with the exponent matched to the GGX roughness
+    float alpha = std::max(roughness * roughness, 0.01f);
+    float shininess = std::max(2.0f / (alpha * alpha) - 2.0f, 1.0f);
+    float specularNormalization = (shininess + 8.0f) / (8.0f * (float)M_PI);
+
+    vec3 color = emissive;
+    for (size_t i = 0; i < m_lights.size(); i++)
+    {
+      const Light& light = m_lights[i];
+      vec3 toLight = light.m_position - hit.m_position;
+      float distance = glm::length(toLight);
+      if (distance <= 0.0f)
+      {
+        continue;
+      }
+
+      vec3 lightDirection = toLight / distance;
+      float nDotL = glm::dot(normal, lightDirection);
+      if (nDotL <= 0.0f)
+      {
+        continue;
+      }
+
+      counts.m_numShadowRays++;
+      if (m_renderTechnique->isOccluded(origin, lightDirection, glm::length(light.m_position - origin)))
+      {
+        continue;
+      }
+
+      vec3 halfVector = glm::normalize(lightDirection - direction);
+      float nDotH = std::max(glm::dot(normal, halfVector), 0.0f);
+      float attenuation = light.m_attenuation.x + light.m_attenuation.y * distance + light.m_attenuation.z * distance * distance;
+      vec3 brdf = lambert + specular * (specularNormalization * pow(nDotH, shininess));
+      color += light.m_color * brdf * (nDotL / std::max(attenuation, 1e-4f));
+    }
+
+    // One cosine weighted diffuse bounce per level, the Lambert BRDF's cosine and 1/pi cancel
+    // against the pdf so the bounce is weighted by the albedo alone
+    if (depth < m_maxBounces && (diffuse.x > 0.0f || diffuse.y > 0.0f || diffuse.z > 0.0f))
+    {
+      vec3 tangent = fabs(normal.x) > 0.9f ? vec3(0.0f, 1.0f, 0.0f) : vec3(1.0f, 0.0f, 0.0f);
+      tangent = glm::normalize(glm::cross(tangent, normal));
+      vec3 bitangent = glm::cross(normal, tangent);
+      float phi = 2.0f * (float)M_PI * randomFloat(seed);
+      float radiusSquared = randomFloat(seed);
+      float radius = sqrt(radiusSquared);
+      vec3 bounceDirection = glm::normalize(tangent * (radius * cos(phi)) + bitangent * (radius * sin(phi)) + normal * sqrt(std::max(1.0f - radiusSquared, 0.0f)));
+
+      counts.m_numBounceRays++;
+      RenderTechnique::RayHit bounceHit;
+      if (m_renderTechnique->intersectRay(origin, bounceDirection, m_maxDistance, bounceHit))
+      {
+        color += diffuse * shade(bounceHit, bounceDirection, seed, depth + 1, counts);
+      }
+      else
+      {
+        color += diffuse * m_backgroundColor;
+      }
+    }
+    return color;
+  }
+
+  void RayTracer::setSamplesPerPixel(uint32_t samplesPerPixel)
+  {
+    m_samplesPerPixel = std::max(samplesPerPixel, 1u);
+  }
+
+  uint32_t RayTracer::getSamplesPerPixel()
+  {
+    return m_samplesPerPixel;
+  }
+
+  void RayTracer::setMaxBounces(uint32_t maxBounces)
+  {
+    m_maxBounces = maxBounces;
+  }
+
+  uint32_t RayTracer::getMaxBounces()
+  {
+    return m_maxBounces;
+  }
+
+  void RayTracer::setBackgroundColor(vec3& color)
+  {
+    m_backgroundColor = color;
+  }
+
+  void RayTracer::getBackgroundColor(vec3& color)
+  {
+    color = m_backgroundColor;
+  }
+
+  const vector<vec4>& RayTracer::getImage()
+  {
+    return m_image;
+  }
+
+  bool RayTracer::saveImage(string filename)
+  {
+    // Binary PPM with a plain gamma 2.2 curve, enough to diff reference images
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+    {
+      return false;
+    }
+
+    file << "P6\n" << m_width << " " << m_height << "\n255\n";
+    vector<uint8_t> row(m_width * 3);
+    for (uint32_t y = 0; y < m_height; y++)
+    {
+      for (uint32_t x = 0; x < m_width; x++)
+      {
+        const vec4& color = m_image[y * m_width + x];
+        for (int c = 0; c < 3; c++)
+        {
+          float value = pow(std::min(std::max(color[c], 0.0f), 1.0f), 1.0f / 2.2f);
+          row[x * 3 + c] = (uint8_t)(value * 255.0f + 0.5f);
+        }
+      }
+      file.write((const char*)row.data(), row.size());
+    }
+    return file.good();
+  }
+
+  void RayTracer::getStats(Stats& stats)
+  {
+    stats = m_stats;
+  }
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include "View.h"
+#include "RenderTechnique.h"
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <atomic>
+
+#include <glm/glm.hpp>
+
+using glm::vec3;
+using glm::vec4;
+using glm::mat4;
+
+using std::string;
+using std::shared_ptr;
+using std::vector;
+using std::atomic;
+
+namespace Bonny
+{
+  class WorldManager;
+  class RenderTechnique;
+
+  // Multithreaded CPU ray tracer that renders a view of the current scene into
+  // an image the size of its viewport. Primary rays are traced as 2x2
+  // packets through the scene BVH, surfaces are lit by the point lights with
+  // shadow rays plus cosine weighted diffuse bounces. Every pixel seeds its own
+  // random sequence so the image does not depend on the number of threads.
+  class RayTracer
+  {
+  public:
+    struct Stats
+    {
+      uint64_t      m_numPrimaryRays;
+      uint64_t      m_numShadowRays;
+      uint64_t      m_numBounceRays;
+      uint64_t      m_time;
+      double        m_megaRaysPerSecond;
+    };
+
+    RayTracer(string name, WorldManager* worldManager, RenderTechnique* renderTechnique);
+    ~RayTracer();
+
+    void                render(shared_ptr<View> view);
+    void                setSamplesPerPixel(uint32_t samplesPerPixel);
+    uint32_t            getSamplesPerPixel();
+    void                setMaxBounces(uint32_t maxBounces);
+    uint32_t            getMaxBounces();
+    void                setBackgroundColor(vec3& color);
+    void                getBackgroundColor(vec3& color);
+
+    const vector<vec4>& getImage();
+    bool                saveImage(string filename);
+    void                getStats(Stats& stats);
+
+  private:
+    struct Light
+    {
+      vec3      m_position;
+      vec3      m_color;
+      vec3      m_attenuation;
+    };
+
+    struct RayCounts
+    {
+      uint64_t  m_numPrimaryRays;
+      uint64_t  m_numShadowRays;
+      uint64_t  m_numBounceRays;
+    };
+
+    void                gatherLights();
+    void                renderTile(uint32_t tileX, uint32_t tileY, RayCounts& counts);
+    vec3                shade(const RenderTechnique::RayHit& hit, const vec3& direction, uint32_t& seed, uint32_t depth, RayCounts& counts);
+    void                getCameraRay(float x, float y, vec3& origin, vec3& direction);
+
+    string                    m_name;
+    WorldManager*             m_worldManager;
+    RenderTechnique*          m_renderTechnique;
+    vector<vec4>              m_image;
+    vector<Light>             m_lights;
+    uint32_t                  m_width;
+    uint32_t                  m_height;
+    uint32_t                  m_samplesPerPixel;
+    uint32_t                  m_maxBounces;
+    vec3                      m_backgroundColor;
+    float                     m_maxDistance;
+
+    // Camera of the view being rendered
+    mat4                      m_invViewTransform;
+    float                     m_tanHalfFov;
+    float                     m_aspect;
+
+    atomic<uint64_t>          m_numPrimaryRays;
+    atomic<uint64_t>          m_numShadowRays;
+    atomic<uint64_t>          m_numBounceRays;
+    Stats                     m_stats;
+  };
+}
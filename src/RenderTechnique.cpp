@@ -1,8 +1,28 @@
 #include "stdafx.h"
 #include "RenderTechnique.h"
+#include "RayTracer.h"
+#include "GeometryPacker.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <xmmintrin.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 namespace Bonny
 {
+  // Below this many meshes a linear SIMD pass is cheaper than walking the scene BVH
+  static const uint32_t c_bvhCullThreshold = 64;
+
+  // A sphere can pass every cluster plane while lying off a corner of the cluster. Lights listed by the grid
+  // stay within this many radii of the cluster's box, at fields of view up to 60 degrees and 2:1 viewports.
+  static const float c_lightGridSlack = 4.0f;
+
+  // Points per edge of the lattice spread over a cluster when looking for lights the grid missed
+  static const uint32_t c_clusterLatticeSize = 5;
+
   RenderTechnique::RenderTechnique(string name, WorldManager* worldManager, HINSTANCE hinstance, HWND window, shared_ptr<Graphics> graphics):
     m_name(name),
     m_worldManager(worldManager),
@@ -12,39 +32,72 @@ namespace Bonny
     m_currentLight(0),
     m_depthPrepass(false),
     m_clusterData(nullptr),
+    m_numLightPositions(0),
+    m_lightRadius(25.0f),
+    m_lightIndexSize(sizeof(uint16_t)),
+    m_numLightIndices(0),
+    m_clusterTileWidth(64),
+    m_clusterTileHeight(64),
+    m_numDepthSlices(16),
+    m_clusterNearDepth(1.0f),
+    m_frustumCulling(true),
+    m_meshletCulling(true),
+    m_lodPixelError(1.0f),
+    m_cullDataDirty(true),
+    m_sceneBvhBuildCost(0.0f),
+    m_sceneBvhDirty(true),
     m_freezeClusterEntity(false),
+    m_textureDensityStreaming(true),
     m_frameIndex(0)
   {
+    memset(&m_clusterStats, 0, sizeof(m_clusterStats));
+    memset(&m_cullStats, 0, sizeof(m_cullStats));
+    memset(&m_lodStats, 0, sizeof(m_lodStats));
+
+    // Reference images are rendered on the CPU for backends without ray tracing hardware
+    m_rayTracer = make_shared<RayTracer>("Reference Ray Tracer", worldManager, this);
+    m_graphics->setRayTracer(m_rayTracer);
+
+    m_textureResidency = make_shared<TextureResidency>();
   }
 
 
   RenderTechnique::~RenderTechnique()
   {
+    destroyClusterData();
   }
 
   void RenderTechnique::addRenderComponent(shared_ptr<RenderComponent> renderComponent, shared_ptr<Entity> entity)
   {
     m_renderComponents.push_back(renderComponent);
+    m_unbufferedComponents.push_back(renderComponent);
     m_renderEntities.push_back(entity);
-  }
+    m_cullDataDirty = true;
 
-  void RenderTechnique::removeRenderComponent(shared_ptr<RenderComponent> renderComponent, shared_ptr<Entity> entity)
-  {
-    for (vector<shared_ptr<RenderComponent>>::iterator it = m_renderComponents.begin(); it != m_renderComponents.end(); ++it)
+    // Registering brings the mip tails in before the backend creates the textures
+    for (size_t i = 0; i < renderComponent->numMeshes(); i++)
     {
-      if (*it == renderComponent)
+      shared_ptr<Material> material = renderComponent->getMesh(i)->getMaterial();
+      if (material != nullptr)
       {
-        m_renderComponents.erase(it);
-        return;
+        m_textureResidency->addMaterial(material);
       }
     }
+  }
+
+  void RenderTechnique::removeRenderComponent(shared_ptr<RenderComponent> renderComponent, shared_ptr<Entity> entity)
+  {
+    m_cullDataDirty = true;
+    m_unbufferedComponents.erase(std::remove(m_unbufferedComponents.begin(), m_unbufferedComponents.end(), renderComponent), m_unbufferedComponents.end());
 
-    for (vector<shared_ptr<Entity>>::iterator it = m_renderEntities.begin(); it != m_renderEntities.end(); ++it)
+    // Components and their entities are kept side by side, both go at the same index
+    for (size_t i = 0; i < m_renderComponents.size(); i++)
     {
-      if (*it == entity)
+      if (m_renderComponents[i] == renderComponent && m_renderEntities[i] == entity)
       {
-        m_renderEntities.erase(it);
-        return;
+        m_renderComponents.erase(m_renderComponents.begin() + i);
+        m_renderEntities.erase(m_renderEntities.begin() + i);
+        break;
       }
     }
   }
@@ -57,21 +110,13 @@ namespace Bonny
 
   void RenderTechnique::removeLightComponent(shared_ptr<LightComponent> lightComponent, shared_ptr<Entity> entity)
   {
-    for (vector<shared_ptr<LightComponent>>::iterator it = m_lightComponents.begin(); it != m_lightComponents.end(); ++it)
-    {
-      if (*it == lightComponent)
-      {
-        m_lightComponents.erase(it);
-        return;
-      }
-    }
-
-    for (vector<shared_ptr<Entity>>::iterator it = m_lightEntities.begin(); it != m_lightEntities.end(); ++it)
+    for (size_t i = 0; i < m_lightComponents.size(); i++)
     {
-      if (*it == entity)
+      if (m_lightComponents[i] == lightComponent && m_lightEntities[i] == entity)
       {
-        m_lightEntities.erase(it);
-        return;
+        m_lightComponents.erase(m_lightComponents.begin() + i);
+        m_lightEntities.erase(m_lightEntities.begin() + i);
+        break;
       }
     }
   }
@@ -111,39 +156,91 @@ namespace Bonny
     m_onscreenView->setViewportPosition(position);
     m_onscreenView->setViewportSize(size);
     m_graphics->resize(width, height);
+
+    // The tile grid depends on the resolution
+    if (m_clusterData != nullptr)
+    {
+      destroyClusterData();
+      buildFrustumLines(m_onscreenView);
+    }
   }
 
-  void RenderTechnique::buildFrustumLines(shared_ptr<View> view)
+  void RenderTechnique::setClusterGrid(uint32_t tileWidth, uint32_t tileHeight, uint32_t numDepthSlices, float nearSliceDepth)
   {
-    m_clusterEntity = make_shared<Entity>("Frustum Lines");
-    shared_ptr<RenderComponent> renderComponent = make_shared<RenderComponent>("Frustum Lines");
-    vec2 viewportSize;
-    view->getViewportSize(viewportSize);
+    m_clusterTileWidth = std::max(tileWidth, 1u);
+    m_clusterTileHeight = std::max(tileHeight, 1u);
+    m_numDepthSlices = std::max(numDepthSlices, 1u);
+    m_clusterNearDepth = nearSliceDepth;
+
+    if (m_clusterData != nullptr)
+    {
+      destroyClusterData();
+      buildFrustumLines(m_onscreenView);
+    }
+  }
 
-    // Determine the number of X and Y tiles
-    uint32_t segmentWidth = 64;
-    uint32_t segmentHeight = 64;
-    uint32_t numXSegments = (uint32_t)viewportSize.x / segmentWidth;
-    uint32_t numYSegments = (uint32_t)viewportSize.y / segmentHeight;
-    uint32_t numZSegments = 10;
+  void RenderTechnique::getClusterStats(ClusterStats& stats)
+  {
+    stats = m_clusterStats;
+  }
 
-    if ((uint32_t)viewportSize.x % segmentWidth != 0)
+  float RenderTechnique::getSliceDepth(uint32_t slice)
+  {
+    // Slices are spaced logarithmically so every slice has about the same depth to width ratio.
+    // With a near slice depth past the near clip the first slice covers everything in front of it.
+    uint32_t numSlices = m_clusterData->m_numZSegments - 1;
+    float nearClip = m_clusterData->m_nearClip;
+    float farClip = m_clusterData->m_farClip;
+    if (slice == 0)
     {
-      numXSegments++;
+      return nearClip;
     }
-    if ((uint32_t)viewportSize.y % segmentHeight != 0)
+
+    uint32_t firstSlice = (numSlices > 1 && m_clusterData->m_sliceNear > nearClip) ? 1 : 0;
+    float sliceNear = firstSlice == 1 ? m_clusterData->m_sliceNear : nearClip;
+    return sliceNear * pow(farClip / sliceNear, (float)(slice - firstSlice) / (numSlices - firstSlice));
+  }
+
+  uint32_t RenderTechnique::getDepthSlice(float viewDepth)
+  {
+    uint32_t numSlices = m_clusterData->m_numZSegments - 1;
+    float nearClip = m_clusterData->m_nearClip;
+    float farClip = m_clusterData->m_farClip;
+    uint32_t firstSlice = (numSlices > 1 && m_clusterData->m_sliceNear > nearClip) ? 1 : 0;
+    float sliceNear = firstSlice == 1 ? m_clusterData->m_sliceNear : nearClip;
+    if (viewDepth <= sliceNear || farClip <= sliceNear)
     {
-      numYSegments++;
+      return 0;
     }
+
+    uint32_t slice = firstSlice + (uint32_t)(log(viewDepth / sliceNear) / log(farClip / sliceNear) * (numSlices - firstSlice));
+    return std::min(slice, numSlices - 1);
+  }
+
+  void RenderTechnique::buildFrustumLines(shared_ptr<View> view)
+  {
+    m_clusterEntity = make_shared<Entity>("Frustum Lines");
+    shared_ptr<RenderComponent> renderComponent = make_shared<RenderComponent>("Frustum Lines");
+    vec2 viewportSize;
+    view->getViewportSize(viewportSize);
+
+    // Determine the number of X and Y tiles, the last row and column may reach past the viewport
+    uint32_t viewportWidth = std::max((uint32_t)viewportSize.x, 1u);
+    uint32_t viewportHeight = std::max((uint32_t)viewportSize.y, 1u);
+    uint32_t segmentWidth = m_clusterTileWidth;
+    uint32_t segmentHeight = m_clusterTileHeight;
+    uint32_t numXSegments = (viewportWidth + segmentWidth - 1) / segmentWidth;
+    uint32_t numYSegments = (viewportHeight + segmentHeight - 1) / segmentHeight;
+    uint32_t numZSegments = m_numDepthSlices + 1;
     uint32_t numVerts = (numXSegments + 1) * (numYSegments + 1) * numZSegments;
     uint32_t numClusters = numXSegments * numYSegments * (numZSegments - 1);
 
     shared_ptr<Mesh> mesh = make_shared<Mesh>("Frustum Lines", Mesh::LINES, numVerts, 2);
 
     float* vertexBuffer = (float*)malloc(numVerts * 3 * sizeof(float));
-    float* normalBuffer = (float*)malloc(numVerts * 3 * sizeof(float));
+    unique_ptr<float[]> normalBuffer(new float[numVerts * 3]);
 
-    uint32_t* indexBuffer = (uint32_t*)malloc(numClusters * 12 * 2 * sizeof(uint32_t));
+    unique_ptr<unsigned int[]> indexBuffer(new unsigned int[numClusters * 12 * 2]);
 
     m_clusterData = (ClusterData*)malloc(sizeof(ClusterData));
     m_clusterData->m_clusters = (Cluster*)malloc(numClusters*sizeof(Cluster));
@@ -152,7 +249,21 @@ namespace Bonny
 	  m_clusterData->m_numXSegments = numXSegments;
 	  m_clusterData->m_numYSegments = numYSegments;
 	  m_clusterData->m_numZSegments = numZSegments;
-    m_clusterData->m_clusterVerts = (vec3*)malloc(numVerts*sizeof(vec3));
+    m_clusterData->m_numClusters = numClusters;
+    m_clusterData->m_fieldOfView = view->getFieldOfView();
+    m_clusterData->m_nearClip = view->getNearClip();
+    m_clusterData->m_farClip = view->getFarClip();
+    m_clusterData->m_viewportWidth = viewportWidth;
+    m_clusterData->m_viewportHeight = viewportHeight;
+
+    // A near slice depth at or past the far clip would leave no depth for the logarithmic slices, the grid
+    // then starts at the near clip like it does without one
+    m_clusterData->m_sliceNear = m_clusterData->m_nearClip;
+    if (m_clusterNearDepth < m_clusterData->m_farClip)
+    {
+      m_clusterData->m_sliceNear = std::max(m_clusterNearDepth, m_clusterData->m_nearClip);
+    }
+    m_lightGridCells.assign(numClusters, LightGridCell());
 
     // Get the eye and direction in world space
     mat4 viewTransform;
@@ -169,33 +280,26 @@ namespace Bonny
     //vec3 worldDirectionZ = vec3(invViewTransform[2]);
     //vec3 worldEye = vec3(invViewTransform[3]);
 
-    float hFov = view->getFieldOfView();
-    float nearClip = view->getNearClip();
-    float farClip = view->getFarClip();
-
-    vec3 nearZ = worldEye + -worldDirectionZ * nearClip;
-    vec3 farZ = worldEye + -worldDirectionZ * farClip;
+    // The field of view is vertical and in degrees, like the projection matrix
+    float tanHalfFov = tan(view->getFieldOfView() * 0.5f * (float)M_PI / 180.0f);
+    float aspect = (float)viewportWidth / viewportHeight;
 
-    float zInc = (farClip - nearClip) / numZSegments;
-    
     uint32_t vindex = 0;
     uint32_t nindex = 0;
 
-    vec3 currentZ = nearZ;
-    float currentZD = nearClip;
-
     for (uint32_t k = 0; k < numZSegments; k++)
     {
-      float farD = tan(hFov*0.5f * (float)M_PI / 180.0f) * currentZD;
-      float currentYD = farD;
-      float xInc = farD * 2.0f / numXSegments;
-      float yInc = -farD * 2.0f / numYSegments;
+      float currentZD = getSliceDepth(k);
+      vec3 currentZ = worldEye + -worldDirectionZ * currentZD;
+      float halfHeight = tanHalfFov * currentZD;
+      float halfWidth = halfHeight * aspect;
 
       for (uint32_t j = 0; j < numYSegments + 1; j++)
       {
-        float currentXD = -farD;
+        float currentYD = halfHeight * (1.0f - 2.0f * (float)(j * segmentHeight) / viewportHeight);
         for (uint32_t i = 0; i < numXSegments + 1; i++)
         {
+          float currentXD = halfWidth * (2.0f * (float)(i * segmentWidth) / viewportWidth - 1.0f);
           vec3 currentPoint = currentZ + worldDirectionX * currentXD + worldDirectionY * currentYD;
           vertexBuffer[vindex++] = currentPoint.x;
           vertexBuffer[vindex++] = currentPoint.y;
@@ -203,12 +307,8 @@ namespace Bonny
           normalBuffer[nindex++] = 0.0f;
           normalBuffer[nindex++] = 0.0f;
           normalBuffer[nindex++] = 1.0f;
-          currentXD += xInc;
         }
-        currentYD += yInc;
       }
-      currentZD += zInc;
-      currentZ = worldEye + -worldDirectionZ * currentZD;
     }
 
     uint32_t iindex = 0;
@@ -274,7 +374,6 @@ namespace Bonny
           m_clusterData->m_clusters[clusterIndex].m_planes[4] = planeEquation(p[1], p[5], p[4]);
           m_clusterData->m_clusters[clusterIndex].m_planes[5] = planeEquation(p[3], p[7], p[6]);
 
-          m_clusterData->m_clusters[clusterIndex].m_lights = new vector<shared_ptr<LightComponent>>;
           vindex++;
           bvindex++;
           clusterIndex++;
@@ -284,21 +383,55 @@ namespace Bonny
       }
     }
 
+    // The vertices stay with the cluster data, the mesh keeps its own copy
     mesh->addVertexBuffer(0, 3, numVerts * 3 * sizeof(float), vertexBuffer);
-    mesh->addVertexBuffer(1, 3, numVerts * 3 * sizeof(float), normalBuffer);
-    mesh->addIndexBuffer(numClusters * 12 * 2, indexBuffer);
+    mesh->addVertexBuffer(1, Mesh::NORMAL, 3, std::move(normalBuffer));
+    mesh->addIndexBuffer(numClusters * 12 * 2, std::move(indexBuffer));
 
     shared_ptr<Material>material = make_shared<Material>("Frustum Lines", Material::LIT);
     material->setAlbedoColor(vec4(1.0f, 1.0f, 1.0f, 1.0f));
     mesh->setMaterial(material);
 
-    free(normalBuffer);
-    free(indexBuffer);
     renderComponent->addMesh(mesh);
     m_clusterEntity->addComponent(renderComponent);
     m_clusterEntity->setTransform(invViewTransform);
     m_clusterEntity->updateCompositeTransform(mat4());
     //addRenderComponent(renderComponent, m_clusterEntity);
+
+    buildClusterPlanes();
+  }
+
+  void RenderTechnique::destroyClusterData()
+  {
+    if (m_clusterData == nullptr)
+    {
+      return;
+    }
+
+    free(m_clusterData->m_clusters);
+    free(m_clusterData->m_localVerts);
+    free(m_clusterData);
+    m_clusterData = nullptr;
+    m_clusterPlanes.clear();
+  }
+
+  void RenderTechnique::buildClusterPlanes()
+  {
+    // The cluster planes only depend on the projection, keep them in view space and
+    // move the lights instead. planeEquation already returns unit normals.
+    m_clusterPlanes.resize(m_clusterData->m_numClusters);
+    for (uint32_t i = 0; i < m_clusterData->m_numClusters; i++)
+    {
+      ClusterPlanes& planes = m_clusterPlanes[i];
+      for (int j = 0; j < 6; j++)
+      {
+        vec4 plane = m_clusterData->m_clusters[i].m_planes[j];
+        planes.m_x[j] = plane.x;
+        planes.m_y[j] = plane.y;
+        planes.m_z[j] = plane.z;
+        planes.m_w[j] = plane.w;
+      }
+    }
   }
 
   void RenderTechnique::setClusterEntityFreeze(bool freeze)
@@ -313,11 +446,52 @@ namespace Bonny
       m_graphics->createView(m_views[i]);
     }
 
-    m_graphics->buildBuffers(m_renderComponents);
+    buildBuffers();
+
+    if (m_onscreenView != nullptr && m_clusterData == nullptr)
+    {
+      buildFrustumLines(m_onscreenView);
+    }
 
     //createCompositeMeshes();
   }
 
+  void RenderTechnique::buildBuffers()
+  {
+    m_graphics->buildBuffers(m_renderComponents);
+    m_unbufferedComponents.clear();
+    m_cullDataDirty = true;
+  }
+
+  void RenderTechnique::setQuantizeVertices(bool quantize)
+  {
+    shared_ptr<GeometryPacker> geometryPacker = m_graphics->getGeometryPacker();
+    if (geometryPacker->getQuantizeVertices() == quantize)
+    {
+      return;
+    }
+
+    // The vertex layouts change, whatever is already in the buffers is packed again
+    geometryPacker->setQuantizeVertices(quantize);
+    if (m_renderComponents.size() > m_unbufferedComponents.size())
+    {
+      buildBuffers();
+    }
+  }
+
+  void RenderTechnique::appendBuffers()
+  {
+    // Render components added after the build are only drawable once their geometry is in the backend's buffers,
+    // the ones already there are neither packed nor uploaded again
+    if (m_unbufferedComponents.empty())
+    {
+      return;
+    }
+    m_graphics->appendBuffers(m_unbufferedComponents);
+    m_unbufferedComponents.clear();
+    m_cullDataDirty = true;
+  }
+
   void RenderTechnique::createCompositeMeshes()
   {
     //shared_ptr<Mesh> mesh = make_shared<Mesh>("Composite Mesh", Mesh::TRIANGLES, 24, 1);
@@ -373,6 +547,22 @@ namespace Bonny
 
   void RenderTechnique::render()
   {
+    if (m_clusterData != nullptr)
+    {
+      vec2 viewportSize;
+      m_onscreenView->getViewportSize(viewportSize);
+      if (m_onscreenView->getFieldOfView() != m_clusterData->m_fieldOfView ||
+          m_onscreenView->getNearClip() != m_clusterData->m_nearClip ||
+          m_onscreenView->getFarClip() != m_clusterData->m_farClip ||
+          std::max((uint32_t)viewportSize.x, 1u) != m_clusterData->m_viewportWidth ||
+          std::max((uint32_t)viewportSize.y, 1u) != m_clusterData->m_viewportHeight)
+      {
+        destroyClusterData();
+        buildFrustumLines(m_onscreenView);
+      }
+      updateClusterData(m_onscreenView, m_frameIndex);
+    }
+
     m_graphics->beginCommands(m_onscreenView, m_frameIndex);
     renderMeshes(m_onscreenView, m_frameIndex);
     m_graphics->endCommands(m_onscreenView, m_frameIndex);
@@ -404,98 +594,335 @@ namespace Bonny
 
     view->getViewTransform(viewTransform);
     invViewTransform = glm::inverse(viewTransform);
+    updateLightPositions(viewTransform);
 
-    uint32_t vindex = 0;
-    for (uint32_t i = 0; i < m_clusterData->m_numClusterVerts; i++)
+    // Every range of clusters fills its own index list, the lists are concatenated afterwards
+    const uint32_t grainSize = 64;
+    uint32_t numClusters = m_clusterData->m_numClusters;
+    uint32_t numRanges = (numClusters + grainSize - 1) / grainSize;
+    if (m_clusterRangeLightIndices.size() < numRanges)
     {
-      vec4 localPoint(0.0f, 0.0f, 0.0f, 1.0f);
-      localPoint.x = m_clusterData->m_localVerts[vindex++];
-      localPoint.y = m_clusterData->m_localVerts[vindex++];
-      localPoint.z = m_clusterData->m_localVerts[vindex++];
-      m_clusterData->m_clusterVerts[i] = vec3(invViewTransform * localPoint);
+      m_clusterRangeLightIndices.resize(numRanges);
     }
 
-    for (size_t i = 0; i < m_lightComponents.size(); ++i)
+    shared_ptr<JobSystem> jobSystem = m_worldManager->getJobSystem();
+    JobSystem::JobHandle clusterJob = jobSystem->parallelFor(numClusters, grainSize, [this, grainSize](uint32_t begin, uint32_t end)
+    {
+      vector<uint32_t>& lightIndices = m_clusterRangeLightIndices[begin / grainSize];
+      lightIndices.clear();
+      for (uint32_t clusterIndex = begin; clusterIndex < end; clusterIndex++)
+      {
+        assignClusterLights(clusterIndex, lightIndices);
+      }
+    }, {});
+    jobSystem->wait(clusterJob);
+
+    buildLightIndexList(grainSize);
+
+    uint32_t maxLights = 0;
+    uint32_t minLights = numClusters > 0 ? UINT32_MAX : 0;
+    uint32_t numEmpty = 0;
+    for (uint32_t clusterIndex = 0; clusterIndex < numClusters; clusterIndex++)
+    {
+      uint32_t numLights = m_lightGridCells[clusterIndex].m_count;
+      if (numLights == 0)
+      {
+        numEmpty++;
+      }
+      maxLights = std::max(maxLights, numLights);
+      minLights = std::min(minLights, numLights);
+    }
+
+    m_clusterStats.m_numClusters = numClusters;
+    m_clusterStats.m_numLights = m_numLightPositions;
+    m_clusterStats.m_numLightIndices = m_numLightIndices;
+    m_clusterStats.m_maxLights = maxLights;
+    m_clusterStats.m_minLights = minLights;
+    m_clusterStats.m_numEmptyClusters = numEmpty;
+    m_clusterStats.m_averageLights = numClusters > 0 ? (float)m_numLightIndices / numClusters : 0.0f;
+    m_clusterStats.m_averageOccupiedLights = numClusters > numEmpty ? (float)m_numLightIndices / (numClusters - numEmpty) : 0.0f;
+
+    if (!m_freezeClusterEntity)
+    {
+      m_clusterEntity->setTransform(invViewTransform);
+      m_clusterEntity->updateCompositeTransform(mat4());
+    }
+  }
+
+  void RenderTechnique::updateLightPositions(mat4& viewTransform)
+  {
+    // Pad to a whole number of SIMD lanes with lights no plane can accept
+    m_numLightPositions = (uint32_t)m_lightComponents.size();
+    size_t numPadded = (m_numLightPositions + 7) & ~7;
+    m_lightPositionX.resize(numPadded);
+    m_lightPositionY.resize(numPadded);
+    m_lightPositionZ.resize(numPadded);
+    m_lightRadii.resize(numPadded);
+    m_packedLights.resize(m_numLightPositions);
+
+    for (uint32_t i = 0; i < m_numLightPositions; ++i)
     {
       vec3 position;
       mat4 transform;
       m_lightComponents[i]->getPosition(position);
       m_lightComponents[i]->getEntity(0)->getCompositeTransform(transform);
-      vec3 lightViewPosition = vec3(transform * vec4(position, 1.0f));
+      vec3 lightViewPosition = vec3(viewTransform * transform * vec4(position, 1.0f));
       m_lightComponents[i]->setViewPosition(lightViewPosition);
+
+      m_lightPositionX[i] = lightViewPosition.x;
+      m_lightPositionY[i] = lightViewPosition.y;
+      m_lightPositionZ[i] = lightViewPosition.z;
+      m_lightRadii[i] = m_lightRadius;
+
+      vec3 diffuse;
+      m_lightComponents[i]->getDiffuse(diffuse);
+      m_packedLights[i].m_positionRadius = vec4(lightViewPosition, m_lightRadius);
+      m_packedLights[i].m_colorType = vec4(diffuse, (float)m_lightComponents[i]->getLightType());
     }
 
-    size_t maxLights = 0;
-    size_t minLights = 100000;
-    size_t numZero = 0;
-    size_t totalLights = 0;
+    for (size_t i = m_numLightPositions; i < numPadded; ++i)
+    {
+      m_lightPositionX[i] = 0.0f;
+      m_lightPositionY[i] = 0.0f;
+      m_lightPositionZ[i] = 0.0f;
+      m_lightRadii[i] = -FLT_MAX;
+    }
+  }
 
-    uint32_t clusterIndex = 0;
-	  for (uint32_t k = 0; k < m_clusterData->m_numZSegments-1; k++)
-	  {
-		  for (uint32_t j = 0; j < m_clusterData->m_numYSegments; j++)
-		  {
-			  for (uint32_t i = 0; i < m_clusterData->m_numXSegments; i++)
-			  {
-          vec3 p1 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[0]];
-          vec3 p2 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[1]];
-          vec3 p3 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[2]];
-          vec3 p4 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[3]];
-          vec3 p5 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[4]];
-          vec3 p6 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[5]];
-          vec3 p7 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[6]];
-          vec3 p8 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[7]];
-
-          //m_clusterData->m_clusters[clusterIndex].m_planes[0].w = updatePlaneD(m_clusterData->m_clusters[clusterIndex].m_planes[0], p1);
-          //m_clusterData->m_clusters[clusterIndex].m_planes[1].w = updatePlaneD(m_clusterData->m_clusters[clusterIndex].m_planes[1], p2);
-          //m_clusterData->m_clusters[clusterIndex].m_planes[2].w = updatePlaneD(m_clusterData->m_clusters[clusterIndex].m_planes[2], p6);
-          //m_clusterData->m_clusters[clusterIndex].m_planes[3].w = updatePlaneD(m_clusterData->m_clusters[clusterIndex].m_planes[3], p5);
-          //m_clusterData->m_clusters[clusterIndex].m_planes[4].w = updatePlaneD(m_clusterData->m_clusters[clusterIndex].m_planes[4], p2);
-          //m_clusterData->m_clusters[clusterIndex].m_planes[5].w = updatePlaneD(m_clusterData->m_clusters[clusterIndex].m_planes[5], p4);
-
-          m_clusterData->m_clusters[clusterIndex].m_planes[0] = planeEquation(p1, p4, p3);
-          m_clusterData->m_clusters[clusterIndex].m_planes[1] = planeEquation(p2, p3, p7);
-          m_clusterData->m_clusters[clusterIndex].m_planes[2] = planeEquation(p6, p7, p8);
-          m_clusterData->m_clusters[clusterIndex].m_planes[3] = planeEquation(p5, p8, p4);
-          m_clusterData->m_clusters[clusterIndex].m_planes[4] = planeEquation(p2, p6, p5);
-          m_clusterData->m_clusters[clusterIndex].m_planes[5] = planeEquation(p4, p8, p7);
-
-          m_clusterData->m_clusters[clusterIndex].m_lights->clear();
-          for (uint32_t l = 0; l < m_lightComponents.size(); l++)
+  void RenderTechnique::assignClusterLights(uint32_t clusterIndex, vector<uint32_t>& lightIndices)
+  {
+    const ClusterPlanes& planes = m_clusterPlanes[clusterIndex];
+    const float* lightX = m_lightPositionX.data();
+    const float* lightY = m_lightPositionY.data();
+    const float* lightZ = m_lightPositionZ.data();
+    const float* lightRadii = m_lightRadii.data();
+    uint32_t numPadded = (uint32_t)m_lightPositionX.size();
+
+    LightGridCell& cell = m_lightGridCells[clusterIndex];
+    cell.m_offset = (uint32_t)lightIndices.size();
+
+    // A light touches the cluster unless its sphere is fully behind one of the planes
+    uint32_t l = 0;
+#ifdef __AVX__
+    const __m256 zero8 = _mm256_setzero_ps();
+    for (; l + 8 <= numPadded; l += 8)
+    {
+      __m256 x = _mm256_loadu_ps(lightX + l);
+      __m256 y = _mm256_loadu_ps(lightY + l);
+      __m256 z = _mm256_loadu_ps(lightZ + l);
+      __m256 radius = _mm256_loadu_ps(lightRadii + l);
+
+      int mask = 0xff;
+      for (int i = 0; i < 6 && mask != 0; i++)
+      {
+        __m256 d = _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(planes.m_x[i])), _mm256_mul_ps(y, _mm256_set1_ps(planes.m_y[i])));
+        d = _mm256_add_ps(d, _mm256_mul_ps(z, _mm256_set1_ps(planes.m_z[i])));
+        d = _mm256_add_ps(_mm256_add_ps(d, _mm256_set1_ps(planes.m_w[i])), radius);
+        mask &= _mm256_movemask_ps(_mm256_cmp_ps(d, zero8, _CMP_GE_OQ));
+      }
+
+      for (uint32_t i = 0; mask != 0; i++, mask >>= 1)
+      {
+        if (mask & 1)
+        {
+          lightIndices.push_back(l + i);
+        }
+      }
+    }
+#endif
+
+    const __m128 zero4 = _mm_setzero_ps();
+    for (; l < numPadded; l += 4)
+    {
+      __m128 x = _mm_loadu_ps(lightX + l);
+      __m128 y = _mm_loadu_ps(lightY + l);
+      __m128 z = _mm_loadu_ps(lightZ + l);
+      __m128 radius = _mm_loadu_ps(lightRadii + l);
+
+      int mask = 0xf;
+      for (int i = 0; i < 6 && mask != 0; i++)
+      {
+        __m128 d = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planes.m_x[i])), _mm_mul_ps(y, _mm_set1_ps(planes.m_y[i])));
+        d = _mm_add_ps(d, _mm_mul_ps(z, _mm_set1_ps(planes.m_z[i])));
+        d = _mm_add_ps(_mm_add_ps(d, _mm_set1_ps(planes.m_w[i])), radius);
+        mask &= _mm_movemask_ps(_mm_cmpge_ps(d, zero4));
+      }
+
+      for (uint32_t i = 0; mask != 0; i++, mask >>= 1)
+      {
+        if (mask & 1)
+        {
+          lightIndices.push_back(l + i);
+        }
+      }
+    }
+
+    cell.m_count = (uint32_t)lightIndices.size() - cell.m_offset;
+  }
+
+  void RenderTechnique::buildLightIndexList(uint32_t grainSize)
+  {
+    uint32_t numClusters = m_clusterData->m_numClusters;
+    uint32_t numRanges = (numClusters + grainSize - 1) / grainSize;
+
+    m_numLightIndices = 0;
+    for (uint32_t i = 0; i < numRanges; i++)
+    {
+      m_numLightIndices += (uint32_t)m_clusterRangeLightIndices[i].size();
+    }
+
+    // The buffer only ever grows, a steady scene does not allocate
+    m_lightIndexSize = m_numLightPositions < 0x10000 ? sizeof(uint16_t) : sizeof(uint32_t);
+    if (m_lightIndexData.size() < m_numLightIndices * m_lightIndexSize)
+    {
+      m_lightIndexData.resize(m_numLightIndices * m_lightIndexSize);
+    }
+
+    uint32_t rangeOffset = 0;
+    for (uint32_t i = 0; i < numRanges; i++)
+    {
+      const vector<uint32_t>& lightIndices = m_clusterRangeLightIndices[i];
+      if (m_lightIndexSize == sizeof(uint16_t))
+      {
+        uint16_t* indices = (uint16_t*)m_lightIndexData.data() + rangeOffset;
+        for (size_t j = 0; j < lightIndices.size(); j++)
+        {
+          indices[j] = (uint16_t)lightIndices[j];
+        }
+      }
+      else if (!lightIndices.empty())
+      {
+        memcpy((uint32_t*)m_lightIndexData.data() + rangeOffset, lightIndices.data(), lightIndices.size() * sizeof(uint32_t));
+      }
+
+      // Cell offsets were written relative to the range
+      uint32_t clusterEnd = std::min((i + 1) * grainSize, numClusters);
+      for (uint32_t clusterIndex = i * grainSize; clusterIndex < clusterEnd; clusterIndex++)
+      {
+        m_lightGridCells[clusterIndex].m_offset += rangeOffset;
+      }
+      rangeOffset += (uint32_t)lightIndices.size();
+    }
+  }
+
+  void RenderTechnique::getLightGrid(LightGrid& lightGrid)
+  {
+    lightGrid.m_cells = m_lightGridCells.data();
+    lightGrid.m_numCells = (uint32_t)m_lightGridCells.size();
+    lightGrid.m_indices = m_lightIndexData.data();
+    lightGrid.m_indexSize = m_lightIndexSize;
+    lightGrid.m_numIndices = m_numLightIndices;
+    lightGrid.m_lights = m_packedLights.data();
+    lightGrid.m_numLights = m_numLightPositions;
+  }
+
+  uint32_t RenderTechnique::validateLightGrid()
+  {
+    if (m_clusterData == nullptr)
+    {
+      return 0;
+    }
+
+    // Brute force reference from the cluster corners alone, the planes are not used. A light has to be listed
+    // when its sphere contains a point of a lattice spread over the corners, every such point is inside the
+    // cluster. It must not be listed when it is further outside the box around the corners than the slack.
+    uint32_t numMismatches = 0;
+    float radiusSquared = m_lightRadius * m_lightRadius;
+    float slack = c_lightGridSlack * m_lightRadius;
+    float latticeStep = 1.0f / (c_clusterLatticeSize - 1);
+    vector<uint8_t> listed(m_numLightPositions);
+    for (uint32_t clusterIndex = 0; clusterIndex < m_clusterData->m_numClusters; clusterIndex++)
+    {
+      vec3 corners[8];
+      vec3 boxMin(FLT_MAX);
+      vec3 boxMax(-FLT_MAX);
+      for (int i = 0; i < 8; i++)
+      {
+        uint32_t vertexIndex = m_clusterData->m_clusters[clusterIndex].m_verts[i] * 3;
+        corners[i] = vec3(m_clusterData->m_localVerts[vertexIndex], m_clusterData->m_localVerts[vertexIndex + 1],
+          m_clusterData->m_localVerts[vertexIndex + 2]);
+        boxMin = glm::min(boxMin, corners[i]);
+        boxMax = glm::max(boxMax, corners[i]);
+      }
+
+      std::fill(listed.begin(), listed.end(), (uint8_t)0);
+      const LightGridCell& cell = m_lightGridCells[clusterIndex];
+      for (uint32_t i = 0; i < cell.m_count; i++)
+      {
+        uint32_t index = cell.m_offset + i;
+        uint32_t lightIndex = m_lightIndexSize == sizeof(uint16_t) ? ((uint16_t*)m_lightIndexData.data())[index] : ((uint32_t*)m_lightIndexData.data())[index];
+        listed[lightIndex] = 1;
+      }
+
+      bool match = true;
+      for (uint32_t l = 0; match && l < m_numLightPositions; l++)
+      {
+        vec3 lightViewPosition;
+        m_lightComponents[l]->getViewPosition(lightViewPosition);
+        if (listed[l])
+        {
+          vec3 outside = glm::max(glm::max(boxMin - lightViewPosition, lightViewPosition - boxMax), vec3(0.0f));
+          match = outside.x <= slack && outside.y <= slack && outside.z <= slack;
+          continue;
+        }
+
+        // Corners 0-3 are the near face, 4-7 the far face, both in the same order
+        for (uint32_t k = 0; match && k < c_clusterLatticeSize; k++)
+        {
+          float w = k * latticeStep;
+          for (uint32_t j = 0; match && j < c_clusterLatticeSize; j++)
           {
-            vec3 lightViewPosition;
-            m_lightComponents[l]->getViewPosition(lightViewPosition);
-            if (intersectsCluster(clusterIndex, lightViewPosition, 25.0f))
+            float v = j * latticeStep;
+            vec3 left = glm::mix(glm::mix(corners[0], corners[3], v), glm::mix(corners[4], corners[7], v), w);
+            vec3 right = glm::mix(glm::mix(corners[1], corners[2], v), glm::mix(corners[5], corners[6], v), w);
+            for (uint32_t i = 0; match && i < c_clusterLatticeSize; i++)
             {
-              m_clusterData->m_clusters[clusterIndex].m_lights->push_back(m_lightComponents[l]);
-              totalLights++;
+              vec3 offset = glm::mix(left, right, i * latticeStep) - lightViewPosition;
+              match = glm::dot(offset, offset) > radiusSquared;
             }
           }
+        }
+      }
 
-          size_t numLights = m_clusterData->m_clusters[clusterIndex].m_lights->size();
-          if (numLights == 0)
-          {
-            numZero++;
-          }
-          if (numLights > maxLights)
-          {
-            maxLights = numLights;
-          }
-          if (numLights < minLights)
-          {
-            minLights = numLights;
-          }
-          clusterIndex++;
-			  }
-		  }
-	  }
+      if (!match)
+      {
+        numMismatches++;
+      }
+    }
+    return numMismatches;
+  }
 
-    m_worldManager->printLog("MaxLights: " + std::to_string(maxLights) + ", totalLights: " + std::to_string(totalLights) + ", zeros: " + std::to_string(numZero));
-    if (!m_freezeClusterEntity)
+  uint32_t RenderTechnique::validateClusterPlanes()
+  {
+    if (m_clusterData == nullptr)
     {
-      m_clusterEntity->setTransform(invViewTransform);
-      m_clusterEntity->updateCompositeTransform(mat4());
+      return 0;
+    }
+
+    // A light sitting at the center of a cluster has to pass all of that cluster's planes,
+    // tested on the same plane arrays the light assignment reads
+    uint32_t numRejected = 0;
+    for (uint32_t clusterIndex = 0; clusterIndex < m_clusterData->m_numClusters; clusterIndex++)
+    {
+      vec3 center(0.0f);
+      for (int i = 0; i < 8; i++)
+      {
+        uint32_t vertexIndex = m_clusterData->m_clusters[clusterIndex].m_verts[i] * 3;
+        center += vec3(m_clusterData->m_localVerts[vertexIndex], m_clusterData->m_localVerts[vertexIndex + 1],
+          m_clusterData->m_localVerts[vertexIndex + 2]) * 0.125f;
+      }
+
+      const ClusterPlanes& planes = m_clusterPlanes[clusterIndex];
+      for (int i = 0; i < 6; i++)
+      {
+        if (planes.m_x[i] * center.x + planes.m_y[i] * center.y + planes.m_z[i] * center.z + planes.m_w[i] < 0.0f)
+        {
+          numRejected++;
+          break;
+        }
+      }
     }
+    return numRejected;
   }
 
   vec4 RenderTechnique::planeEquation(vec3 p1, vec3 p2, vec3 p3)
@@ -508,7 +935,7 @@ namespace Bonny
     plane.x = -normal.x;
     plane.y = -normal.y;
     plane.z = -normal.z;
-    plane.w = -(normal.x * p1.x + normal.y * p1.y + normal.z * p1.z);
+    plane.w = normal.x * p1.x + normal.y * p1.y + normal.z * p1.z;
     return plane;
   }
 
@@ -517,23 +944,6 @@ namespace Bonny
     return -(plane.x * p.x + plane.y * p.y + plane.z * p.z);
   }
 
-  bool RenderTechnique::intersectsCluster(uint32_t clusterIndex, vec3 lightViewPosition, float radius)
-  {
-    bool intersects = true;
-    for (int i = 0; i < 6; i++)
-    {
-      vec4 plane = m_clusterData->m_clusters[clusterIndex].m_planes[i];
-      float denom = 1.0f / sqrt(plane.x * plane.x + plane.y*plane.y + plane.z*plane.z);
-      float d = (plane.x * lightViewPosition.x + plane.y * lightViewPosition.y + plane.z * lightViewPosition.z + plane.w) * denom;
-      if ((d + radius) < 0.0f)
-      {
-        return false;
-      }
-    }
-
-    return intersects;
-  }
-
   void RenderTechnique::updateFrameData(uint32_t frameIndex)
   {
     mat4 transform;
@@ -596,17 +1006,602 @@ namespace Bonny
 
   void RenderTechnique::renderMeshes(shared_ptr<View> view, uint32_t frameIndex)
   {
-    uint32_t currentMeshIndex = 0;
-    for (size_t i = 0; i < m_renderComponents.size(); i++)
+    updateRayQueries();
+    cullMeshes(view);
+    updateTextureResidency(view);
+
+    m_cullStats.m_numMeshlets = 0;
+    m_cullStats.m_numMeshletsVisible = 0;
+    m_cullStats.m_numMeshletsFrustumCulled = 0;
+    m_cullStats.m_numMeshletsBackfaceCulled = 0;
+    m_cullStats.m_numDrawRanges = 0;
+
+    // Pixels covered by one world unit at unit distance from the camera
+    vec2 viewportSize;
+    view->getViewportSize(viewportSize);
+    float projection = viewportSize.y / (2.0f * tan(glm::radians(view->getFieldOfView()) * 0.5f));
+    float nearClip = view->getNearClip();
+    mat4 viewTransform;
+    view->getViewTransform(viewTransform);
+    vec3 cameraPosition = vec3(glm::inverse(viewTransform)[3]);
+    memset(&m_lodStats, 0, sizeof(m_lodStats));
+
+    for (size_t i = 0; i < m_visibleMeshes.size(); i++)
     {
+      uint32_t meshIndex = m_visibleMeshes[i];
+      shared_ptr<Mesh> mesh = m_cullMeshes[meshIndex];
+      uint32_t level = selectLod(meshIndex, cameraPosition, projection, nearClip);
+      m_lodStats.m_numMeshesPerLevel[level]++;
+      m_lodStats.m_numTrianglesFull += mesh->getIndexBufferSize() / 3;
+
+      // Meshlets cover the full resolution indices only, a coarser level is drawn whole
+      if (level > 0)
+      {
+        const Mesh::Lod& lod = mesh->getLod(level);
+        m_lodStats.m_numTrianglesSubmitted += lod.m_numIndices / 3;
+        m_graphics->bindPipeline(view, nullptr, frameIndex);
+        m_graphics->drawRange(view, mesh, mesh->getMaterial(), lod.m_indexStart, lod.m_numIndices, frameIndex);
+        continue;
+      }
 
-      for (size_t j = 0; j < m_renderComponents[i]->numMeshes(); j++, currentMeshIndex++)
+      if (!m_meshletCulling || mesh->getMeshlets() == nullptr)
       {
-        shared_ptr<Mesh> mesh = m_renderComponents[i]->getMesh(j);
         m_graphics->bindPipeline(view, nullptr, frameIndex);
         m_graphics->draw(view, mesh, mesh->getMaterial(), frameIndex);
+        m_lodStats.m_numTrianglesSubmitted += mesh->getIndexBufferSize() / 3;
+        continue;
+      }
+
+      // Only the meshlets that survived are drawn, nothing at all when every one was culled
+      cullMeshlets(view, meshIndex, m_drawRanges);
+      if (m_drawRanges.empty())
+      {
+        continue;
+      }
+      m_graphics->bindPipeline(view, nullptr, frameIndex);
+      for (size_t j = 0; j < m_drawRanges.size(); j++)
+      {
+        m_lodStats.m_numTrianglesSubmitted += m_drawRanges[j].m_numIndices / 3;
+        m_graphics->drawRange(view, mesh, mesh->getMaterial(), m_drawRanges[j].m_indexStart, m_drawRanges[j].m_numIndices, frameIndex);
+      }
+    }
+  }
+
+  void RenderTechnique::cullMeshlets(shared_ptr<View> view, uint32_t meshIndex, vector<Meshlets::IndexRange>& ranges)
+  {
+    shared_ptr<Meshlets> meshlets = m_cullMeshes[meshIndex]->getMeshlets();
+
+    // Meshlet bounds and cones stay in mesh space, the planes and camera move there instead
+    const mat4& transform = m_meshTransforms[meshIndex];
+    vec4 planes[6];
+    view->getFrustumPlanes(planes);
+    for (int i = 0; i < 6; i++)
+    {
+      planes[i] = planes[i] * transform;
+    }
+    mat4 viewTransform;
+    view->getViewTransform(viewTransform);
+    vec3 cameraPosition = vec3(m_inverseTransforms[meshIndex] * glm::inverse(viewTransform)[3]);
+
+    // A mirroring transform flips the winding, the cones would point the wrong way
+    vec3 axisX(transform[0]);
+    vec3 axisY(transform[1]);
+    vec3 axisZ(transform[2]);
+    bool backfaceCulling = glm::dot(glm::cross(axisX, axisY), axisZ) > 0.0f;
+
+    Meshlets::CullCounts counts;
+    meshlets->cull(planes, cameraPosition, backfaceCulling, ranges, counts);
+    m_cullStats.m_numMeshlets += counts.m_numMeshlets;
+    m_cullStats.m_numMeshletsVisible += counts.m_numVisible;
+    m_cullStats.m_numMeshletsFrustumCulled += counts.m_numFrustumCulled;
+    m_cullStats.m_numMeshletsBackfaceCulled += counts.m_numBackfaceCulled;
+    m_cullStats.m_numDrawRanges += (uint32_t)ranges.size();
+  }
+
+  void RenderTechnique::setFrustumCulling(bool enable)
+  {
+    m_frustumCulling = enable;
+  }
+
+  void RenderTechnique::setMeshletCulling(bool enable)
+  {
+    m_meshletCulling = enable;
+  }
+
+  void RenderTechnique::getCullStats(CullStats& stats)
+  {
+    stats = m_cullStats;
+  }
+
+  void RenderTechnique::setLodPixelError(float pixelError)
+  {
+    m_lodPixelError = pixelError;
+  }
+
+  void RenderTechnique::getLodStats(LodStats& stats)
+  {
+    stats = m_lodStats;
+  }
+
+  void RenderTechnique::buildCullData()
+  {
+    m_cullMeshes.clear();
+    m_cullEntities.clear();
+    m_unboundedMeshes.clear();
+    for (size_t i = 0; i < m_renderComponents.size(); i++)
+    {
+      for (size_t j = 0; j < m_renderComponents[i]->numMeshes(); j++)
+      {
+        shared_ptr<Mesh> mesh = m_renderComponents[i]->getMesh(j);
+        if (!mesh->hasBounds())
+        {
+          m_unboundedMeshes.push_back((uint32_t)m_cullMeshes.size());
+        }
+        m_cullMeshes.push_back(mesh);
+        m_cullEntities.push_back(m_renderComponents[i]->getEntity(0));
+      }
+    }
+
+    // Triangle hierarchies and meshlets are built once per mesh, spread over the workers
+    shared_ptr<JobSystem> jobSystem = m_worldManager->getJobSystem();
+    JobSystem::JobHandle bvhJob = jobSystem->parallelFor((uint32_t)m_cullMeshes.size(), 1, [this](uint32_t begin, uint32_t end)
+    {
+      for (uint32_t i = begin; i < end; i++)
+      {
+        if (m_cullMeshes[i]->getBvh() == nullptr)
+        {
+          m_cullMeshes[i]->buildBvh();
+        }
+        if (m_cullMeshes[i]->getMeshlets() == nullptr)
+        {
+          m_cullMeshes[i]->buildMeshlets();
+        }
+      }
+    }, {});
+    jobSystem->wait(bvhJob);
+
+    // Pad to whole SIMD groups, the padding is never reported as visible
+    size_t numPadded = (m_cullMeshes.size() + 3) & ~3;
+    m_cullVersions.assign(m_cullMeshes.size(), 0);
+    m_boundsCenterX.assign(numPadded, 0.0f);
+    m_boundsCenterY.assign(numPadded, 0.0f);
+    m_boundsCenterZ.assign(numPadded, 0.0f);
+    m_boundsExtentX.assign(numPadded, 0.0f);
+    m_boundsExtentY.assign(numPadded, 0.0f);
+    m_boundsExtentZ.assign(numPadded, 0.0f);
+    m_worldBoundsMin.assign(m_cullMeshes.size(), vec3());
+    m_worldBoundsMax.assign(m_cullMeshes.size(), vec3());
+    m_inverseTransforms.assign(m_cullMeshes.size(), mat4());
+    m_meshTransforms.assign(m_cullMeshes.size(), mat4());
+    m_visibleMeshes.reserve(m_cullMeshes.size());
+    m_sceneBvhDirty = true;
+    m_cullDataDirty = false;
+  }
+
+  void RenderTechnique::updateSceneBvh()
+  {
+    if (m_sceneBvhDirty)
+    {
+      m_sceneBvh.build(m_worldBoundsMin.data(), m_worldBoundsMax.data(), (uint32_t)m_cullMeshes.size());
+      m_sceneBvhBuildCost = m_sceneBvh.getSahCost();
+      m_sceneBvhDirty = false;
+      return;
+    }
+
+    // Refitting keeps the topology, rebuild once moving meshes have made it much worse
+    m_sceneBvh.refit(m_worldBoundsMin.data(), m_worldBoundsMax.data());
+    if (m_sceneBvh.getSahCost() > m_sceneBvhBuildCost * 2.0f)
+    {
+      m_sceneBvh.build(m_worldBoundsMin.data(), m_worldBoundsMax.data(), (uint32_t)m_cullMeshes.size());
+      m_sceneBvhBuildCost = m_sceneBvh.getSahCost();
+    }
+  }
+
+  bool RenderTechnique::intersectRay(const vec3& origin, const vec3& direction, float maxDistance, RayHit& hit)
+  {
+    // Rays are moved into mesh space without normalizing, so distances stay in world units
+    hit.m_distance = maxDistance;
+    uint32_t hitMesh = 0;
+    bool found = m_sceneBvh.intersectRay(origin, direction, hit.m_distance, [&](uint32_t meshIndex, float& distance)
+    {
+      const mat4& inverseTransform = m_inverseTransforms[meshIndex];
+      vec3 meshOrigin = vec3(inverseTransform * vec4(origin, 1.0f));
+      vec3 meshDirection = vec3(inverseTransform * vec4(direction, 0.0f));
+      if (m_cullMeshes[meshIndex]->intersectRay(meshOrigin, meshDirection, distance, hit.m_triangle, hit.m_u, hit.m_v, false))
+      {
+        hitMesh = meshIndex;
+        return true;
+      }
+      return false;
+    });
+
+    if (found)
+    {
+      hit.m_position = origin + direction * hit.m_distance;
+      hit.m_meshIndex = hitMesh;
+      hit.m_mesh = m_cullMeshes[hitMesh];
+      hit.m_entity = m_cullEntities[hitMesh];
+      computeHitNormal(hit);
+    }
+    return found;
+  }
+
+  int RenderTechnique::intersectRayPacket(const vec3 origins[4], const vec3 directions[4], float maxDistance, RayHit hits[4])
+  {
+    Bvh::RayPacket packet;
+    for (int i = 0; i < 4; i++)
+    {
+      Bvh::setPacketRay(packet, i, origins[i], directions[i], maxDistance);
+    }
+
+    // Each mesh reached by any lane gets the whole packet in its own space, the closest
+    // distance found so far carries over since the transform keeps world units
+    uint32_t hitMeshes[4];
+    uint32_t triangles[4];
+    float u[4];
+    float v[4];
+    int hitMask = 0;
+    m_sceneBvh.intersectPacket(packet, 0xf, [&](uint32_t meshIndex, int mask)
+    {
+      const mat4& inverseTransform = m_inverseTransforms[meshIndex];
+      Bvh::RayPacket meshPacket;
+      for (int i = 0; i < 4; i++)
+      {
+        vec3 meshOrigin = vec3(inverseTransform * vec4(origins[i], 1.0f));
+        vec3 meshDirection = vec3(inverseTransform * vec4(directions[i], 0.0f));
+        Bvh::setPacketRay(meshPacket, i, meshOrigin, meshDirection, ((float*)&packet.m_maxDistance)[i]);
+      }
+
+      uint32_t meshTriangles[4];
+      float meshU[4];
+      float meshV[4];
+      int meshHitMask = m_cullMeshes[meshIndex]->intersectRayPacket(meshPacket, mask, meshTriangles, meshU, meshV);
+      for (int i = 0; meshHitMask != 0; i++, meshHitMask >>= 1)
+      {
+        if (meshHitMask & 1)
+        {
+          ((float*)&packet.m_maxDistance)[i] = ((float*)&meshPacket.m_maxDistance)[i];
+          hitMeshes[i] = meshIndex;
+          triangles[i] = meshTriangles[i];
+          u[i] = meshU[i];
+          v[i] = meshV[i];
+          hitMask |= 1 << i;
+        }
+      }
+    });
+
+    for (int i = 0; i < 4; i++)
+    {
+      if ((hitMask & (1 << i)) == 0)
+      {
+        continue;
       }
+
+      RayHit& hit = hits[i];
+      hit.m_distance = ((float*)&packet.m_maxDistance)[i];
+      hit.m_position = origins[i] + directions[i] * hit.m_distance;
+      hit.m_meshIndex = hitMeshes[i];
+      hit.m_mesh = m_cullMeshes[hitMeshes[i]];
+      hit.m_entity = m_cullEntities[hitMeshes[i]];
+      hit.m_triangle = triangles[i];
+      hit.m_u = u[i];
+      hit.m_v = v[i];
+      computeHitNormal(hit);
     }
+    return hitMask;
+  }
+
+  void RenderTechnique::computeHitNormal(RayHit& hit)
+  {
+    // Normals go to world space with the inverse transpose of the mesh transform
+    vec3 meshNormal;
+    hit.m_mesh->getTriangleNormal(hit.m_triangle, meshNormal);
+    const mat4& inverseTransform = m_inverseTransforms[hit.m_meshIndex];
+    vec3 normal(
+      inverseTransform[0][0] * meshNormal.x + inverseTransform[0][1] * meshNormal.y + inverseTransform[0][2] * meshNormal.z,
+      inverseTransform[1][0] * meshNormal.x + inverseTransform[1][1] * meshNormal.y + inverseTransform[1][2] * meshNormal.z,
+      inverseTransform[2][0] * meshNormal.x + inverseTransform[2][1] * meshNormal.y + inverseTransform[2][2] * meshNormal.z);
+    float length = glm::length(normal);
+    hit.m_normal = length > 0.0f ? normal / length : vec3(0.0f, 0.0f, 1.0f);
+  }
+
+  bool RenderTechnique::isOccluded(const vec3& origin, const vec3& direction, float maxDistance)
+  {
+    float occluderDistance = maxDistance;
+    return m_sceneBvh.intersectRay(origin, direction, occluderDistance, [&](uint32_t meshIndex, float& distance)
+    {
+      const mat4& inverseTransform = m_inverseTransforms[meshIndex];
+      vec3 meshOrigin = vec3(inverseTransform * vec4(origin, 1.0f));
+      vec3 meshDirection = vec3(inverseTransform * vec4(direction, 0.0f));
+      uint32_t triangle;
+      float u;
+      float v;
+      return m_cullMeshes[meshIndex]->intersectRay(meshOrigin, meshDirection, distance, triangle, u, v, true);
+    }, true);
+  }
+
+  bool RenderTechnique::pick(uint32_t x, uint32_t y, RayHit& hit)
+  {
+    if (m_onscreenView == nullptr)
+    {
+      return false;
+    }
+
+    // Ray through the pixel center, built from the same vertical field of view as the clusters
+    vec2 viewportSize;
+    mat4 viewTransform;
+    m_onscreenView->getViewportSize(viewportSize);
+    m_onscreenView->getViewTransform(viewTransform);
+    mat4 invViewTransform = glm::inverse(viewTransform);
+
+    float tanHalfFov = tan(m_onscreenView->getFieldOfView() * 0.5f * (float)M_PI / 180.0f);
+    float aspect = viewportSize.x / std::max(viewportSize.y, 1.0f);
+    float ndcX = 2.0f * (x + 0.5f) / std::max(viewportSize.x, 1.0f) - 1.0f;
+    float ndcY = 1.0f - 2.0f * (y + 0.5f) / std::max(viewportSize.y, 1.0f);
+    vec3 origin = vec3(invViewTransform[3]);
+    vec3 direction = glm::normalize(vec3(invViewTransform * vec4(ndcX * tanHalfFov * aspect, ndcY * tanHalfFov, -1.0f, 0.0f)));
+    return intersectRay(origin, direction, m_onscreenView->getFarClip(), hit);
+  }
+
+  void RenderTechnique::updateRayQueries()
+  {
+    // Ray queries outside of a frame need the same scene BVH the last cull pass used
+    if (m_cullDataDirty)
+    {
+      buildCullData();
+    }
+    updateWorldBounds();
+  }
+
+  void RenderTechnique::trace()
+  {
+    if (m_onscreenView == nullptr)
+    {
+      return;
+    }
+
+    updateRayQueries();
+    m_graphics->trace(m_onscreenView);
+  }
+
+  shared_ptr<RayTracer> RenderTechnique::getRayTracer()
+  {
+    return m_rayTracer;
+  }
+
+  shared_ptr<TextureResidency> RenderTechnique::getTextureResidency()
+  {
+    return m_textureResidency;
+  }
+
+  void RenderTechnique::setTextureDensityStreaming(bool enable)
+  {
+    m_textureDensityStreaming = enable;
+  }
+
+  void RenderTechnique::updateTextureResidency(shared_ptr<View> view)
+  {
+    // Pixels covered by one world unit at unit distance from the camera
+    vec2 viewportSize;
+    view->getViewportSize(viewportSize);
+    float projection = viewportSize.y / (2.0f * tan(glm::radians(view->getFieldOfView()) * 0.5f));
+    float nearClip = view->getNearClip();
+    mat4 viewTransform;
+    view->getViewTransform(viewTransform);
+    vec3 cameraPosition = vec3(glm::inverse(viewTransform)[3]);
+
+    // Visible materials ask for the level their closest texels project to, or the full resolution without
+    // density streaming. Everything else ages towards eviction.
+    for (size_t i = 0; i < m_visibleMeshes.size(); i++)
+    {
+      uint32_t meshIndex = m_visibleMeshes[i];
+      shared_ptr<Mesh> mesh = m_cullMeshes[meshIndex];
+      shared_ptr<Material> material = mesh->getMaterial();
+      if (material == nullptr)
+      {
+        continue;
+      }
+      if (!m_textureDensityStreaming || !mesh->hasBounds())
+      {
+        m_textureResidency->requestMaterial(material, 0, m_frameIndex);
+        continue;
+      }
+
+      // Closest point of the world box, the largest axis scale gives the densest texels
+      const mat4& transform = m_meshTransforms[meshIndex];
+      float scale = std::max(glm::length(vec3(transform[0])), std::max(glm::length(vec3(transform[1])), glm::length(vec3(transform[2]))));
+      vec3 closest = glm::max(m_worldBoundsMin[meshIndex], glm::min(cameraPosition, m_worldBoundsMax[meshIndex]));
+      float distance = std::max(glm::length(closest - cameraPosition), nearClip);
+      float uvPerPixel = mesh->getUvDensity() / std::max(scale, 1e-6f) * distance / projection;
+      m_textureResidency->requestMaterialDensity(material, uvPerPixel, m_frameIndex);
+    }
+
+    m_changedTextures.clear();
+    m_textureResidency->update(m_frameIndex, m_changedTextures);
+    for (size_t i = 0; i < m_changedTextures.size(); i++)
+    {
+      m_graphics->updateTexture(m_changedTextures[i]);
+    }
+  }
+
+  uint32_t RenderTechnique::selectLod(uint32_t meshIndex, const vec3& cameraPosition, float projection, float nearClip)
+  {
+    shared_ptr<Mesh> mesh = m_cullMeshes[meshIndex];
+    if (mesh->getNumLods() < 2)
+    {
+      return 0;
+    }
+
+    // Each cull slot has its own transform, so instances of one mesh at different distances get their own level.
+    // Distance to the closest point of the bounding sphere, clamped to the near plane.
+    const mat4& transform = m_meshTransforms[meshIndex];
+    float scale = std::max(glm::length(vec3(transform[0])), std::max(glm::length(vec3(transform[1])), glm::length(vec3(transform[2]))));
+    vec3 boundsMin;
+    vec3 boundsMax;
+    mesh->getLocalBounds(boundsMin, boundsMax);
+    vec3 center = vec3(transform * vec4((boundsMin + boundsMax) * 0.5f, 1.0f));
+    float radius = glm::length(boundsMax - boundsMin) * 0.5f * scale;
+    float distance = std::max(glm::length(center - cameraPosition) - radius, nearClip);
+
+    // Coarsest level whose error still projects to at most the allowed pixels
+    for (uint32_t level = mesh->getNumLods() - 1; level > 0; level--)
+    {
+      if (mesh->getLod(level).m_error * scale * projection / distance <= m_lodPixelError)
+      {
+        return level;
+      }
+    }
+    return 0;
+  }
+
+  void RenderTechnique::updateWorldBounds()
+  {
+    // Only boxes whose entity was recomputed by the transform hierarchy are refreshed
+    m_cullStats.m_numBoundsUpdated = 0;
+    for (size_t i = 0; i < m_cullMeshes.size(); i++)
+    {
+      uint32_t version = m_cullEntities[i]->getTransformVersion();
+      if (version != 0 && version == m_cullVersions[i])
+      {
+        continue;
+      }
+      m_cullVersions[i] = version;
+      m_cullStats.m_numBoundsUpdated++;
+
+      mat4 transform;
+      m_cullEntities[i]->getCompositeTransform(transform);
+      m_inverseTransforms[i] = glm::inverse(transform);
+      m_meshTransforms[i] = transform;
+
+      shared_ptr<Mesh> mesh = m_cullMeshes[i];
+      if (!mesh->hasBounds())
+      {
+        // Without positions there is nothing to cull against, keep it always visible
+        m_boundsExtentX[i] = m_boundsExtentY[i] = m_boundsExtentZ[i] = 1e30f;
+        m_worldBoundsMin[i] = m_worldBoundsMax[i] = vec3(transform[3]);
+        continue;
+      }
+
+      vec3 boundsMin;
+      vec3 boundsMax;
+      mesh->getLocalBounds(boundsMin, boundsMax);
+
+      // Transformed box center, extents grow by the absolute rotation and scale
+      vec3 center = vec3(transform * vec4((boundsMin + boundsMax) * 0.5f, 1.0f));
+      vec3 extent = (boundsMax - boundsMin) * 0.5f;
+      m_boundsCenterX[i] = center.x;
+      m_boundsCenterY[i] = center.y;
+      m_boundsCenterZ[i] = center.z;
+      m_boundsExtentX[i] = fabs(transform[0][0]) * extent.x + fabs(transform[1][0]) * extent.y + fabs(transform[2][0]) * extent.z;
+      m_boundsExtentY[i] = fabs(transform[0][1]) * extent.x + fabs(transform[1][1]) * extent.y + fabs(transform[2][1]) * extent.z;
+      m_boundsExtentZ[i] = fabs(transform[0][2]) * extent.x + fabs(transform[1][2]) * extent.y + fabs(transform[2][2]) * extent.z;
+
+      vec3 worldExtent(m_boundsExtentX[i], m_boundsExtentY[i], m_boundsExtentZ[i]);
+      m_worldBoundsMin[i] = center - worldExtent;
+      m_worldBoundsMax[i] = center + worldExtent;
+    }
+
+    if (m_sceneBvhDirty || m_cullStats.m_numBoundsUpdated > 0)
+    {
+      updateSceneBvh();
+    }
+  }
+
+  void RenderTechnique::cullMeshes(shared_ptr<View> view)
+  {
+    uint32_t numMeshes = (uint32_t)m_cullMeshes.size();
+    m_visibleMeshes.clear();
+    if (!m_frustumCulling)
+    {
+      for (uint32_t i = 0; i < numMeshes; i++)
+      {
+        m_visibleMeshes.push_back(i);
+      }
+    }
+    else if (numMeshes >= c_bvhCullThreshold)
+    {
+      vec4 planes[6];
+      view->getFrustumPlanes(planes);
+
+      // Subtrees fully inside the frustum are taken without testing their meshes
+      m_sceneBvh.intersectFrustum(planes, [&](uint32_t meshIndex, bool inside)
+      {
+        if (inside)
+        {
+          m_visibleMeshes.push_back(meshIndex);
+          return;
+        }
+
+        vec3 center(m_boundsCenterX[meshIndex], m_boundsCenterY[meshIndex], m_boundsCenterZ[meshIndex]);
+        vec3 extent(m_boundsExtentX[meshIndex], m_boundsExtentY[meshIndex], m_boundsExtentZ[meshIndex]);
+        for (int i = 0; i < 6; i++)
+        {
+          float d = planes[i].x * center.x + planes[i].y * center.y + planes[i].z * center.z + planes[i].w;
+          float r = fabs(planes[i].x) * extent.x + fabs(planes[i].y) * extent.y + fabs(planes[i].z) * extent.z;
+          if (d + r < 0.0f)
+          {
+            return;
+          }
+        }
+        m_visibleMeshes.push_back(meshIndex);
+      });
+
+      // Meshes without positions sit as points in the tree but are always drawn
+      for (size_t i = 0; i < m_unboundedMeshes.size(); i++)
+      {
+        if (std::find(m_visibleMeshes.begin(), m_visibleMeshes.end(), m_unboundedMeshes[i]) == m_visibleMeshes.end())
+        {
+          m_visibleMeshes.push_back(m_unboundedMeshes[i]);
+        }
+      }
+
+      // Keep the submission order of the render components
+      std::sort(m_visibleMeshes.begin(), m_visibleMeshes.end());
+    }
+    else
+    {
+      vec4 planes[6];
+      vec3 absNormals[6];
+      view->getFrustumPlanes(planes);
+      for (int i = 0; i < 6; i++)
+      {
+        absNormals[i] = vec3(fabs(planes[i].x), fabs(planes[i].y), fabs(planes[i].z));
+      }
+
+      // Four boxes per iteration, a box is outside when it is fully behind any plane
+      const __m128 zero = _mm_setzero_ps();
+      for (uint32_t m = 0; m < numMeshes; m += 4)
+      {
+        __m128 centerX = _mm_loadu_ps(&m_boundsCenterX[m]);
+        __m128 centerY = _mm_loadu_ps(&m_boundsCenterY[m]);
+        __m128 centerZ = _mm_loadu_ps(&m_boundsCenterZ[m]);
+        __m128 extentX = _mm_loadu_ps(&m_boundsExtentX[m]);
+        __m128 extentY = _mm_loadu_ps(&m_boundsExtentY[m]);
+        __m128 extentZ = _mm_loadu_ps(&m_boundsExtentZ[m]);
+
+        int mask = 0xf;
+        for (int i = 0; i < 6 && mask != 0; i++)
+        {
+          __m128 d = _mm_add_ps(_mm_mul_ps(centerX, _mm_set1_ps(planes[i].x)), _mm_mul_ps(centerY, _mm_set1_ps(planes[i].y)));
+          d = _mm_add_ps(_mm_add_ps(d, _mm_mul_ps(centerZ, _mm_set1_ps(planes[i].z))), _mm_set1_ps(planes[i].w));
+          __m128 r = _mm_add_ps(_mm_mul_ps(extentX, _mm_set1_ps(absNormals[i].x)), _mm_mul_ps(extentY, _mm_set1_ps(absNormals[i].y)));
+          r = _mm_add_ps(r, _mm_mul_ps(extentZ, _mm_set1_ps(absNormals[i].z)));
+          mask &= _mm_movemask_ps(_mm_cmpge_ps(_mm_add_ps(d, r), zero));
+        }
+
+        for (uint32_t i = 0; mask != 0 && m + i < numMeshes; i++, mask >>= 1)
+        {
+          if (mask & 1)
+          {
+            m_visibleMeshes.push_back(m + i);
+          }
+        }
+      }
+    }
+
+    m_cullStats.m_numMeshes = numMeshes;
+    m_cullStats.m_numVisible = (uint32_t)m_visibleMeshes.size();
+    m_cullStats.m_numCulled = numMeshes - m_cullStats.m_numVisible;
   }
 
   void RenderTechnique::updateMeshData(shared_ptr<View> view, uint32_t frameIndex)
@@ -8,11 +8,13 @@
 #include "UniformBuffer.h"
 #include "RenderTechnique.h"
 #include "WorldManager.h"
+#include "Bvh.h"
+#include "Meshlets.h"
+#include "TextureResidency.h"
 
 #include <string>
 #include <memory>
 #include <vector>
-#include <atlstr.h>
 #define _USE_MATH_DEFINES
 #include <math.h>
 
@@ -29,10 +31,91 @@ namespace Bonny
   class LightComponent;
   class Mesh;
   class WorldManager;
+  class RayTracer;
 
   class RenderTechnique
   {
   public:
+    // One cluster of the light grid, the range it owns in the light index list
+    struct LightGridCell
+    {
+      uint32_t  m_offset;
+      uint32_t  m_count;
+    };
+
+    // Light attributes as a shader reads them, view space position and radius,
+    // diffuse color and light type
+    struct PackedLight
+    {
+      vec4      m_positionRadius;
+      vec4      m_colorType;
+    };
+
+    // Contiguous light grid built by the cluster assignment. The index list holds
+    // 16 bit indices while there are fewer than 65536 lights, 32 bit otherwise.
+    struct LightGrid
+    {
+      const LightGridCell*  m_cells;
+      uint32_t              m_numCells;
+      const void*           m_indices;
+      uint32_t              m_indexSize;
+      uint32_t              m_numIndices;
+      const PackedLight*    m_lights;
+      uint32_t              m_numLights;
+    };
+
+    // Frustum culling results of the last frame. Meshlets are counted for the
+    // visible meshes only, each surviving run of meshlets is one draw range.
+    struct CullStats
+    {
+      uint32_t  m_numMeshes;
+      uint32_t  m_numVisible;
+      uint32_t  m_numCulled;
+      uint32_t  m_numBoundsUpdated;
+      uint32_t  m_numMeshlets;
+      uint32_t  m_numMeshletsVisible;
+      uint32_t  m_numMeshletsFrustumCulled;
+      uint32_t  m_numMeshletsBackfaceCulled;
+      uint32_t  m_numDrawRanges;
+    };
+
+    // Level of detail picked for the drawn meshes in the last frame, triangles of
+    // the full resolution meshes against the triangles actually submitted
+    struct LodStats
+    {
+      uint32_t  m_numMeshesPerLevel[Mesh::c_maxLods];
+      uint64_t  m_numTrianglesFull;
+      uint64_t  m_numTrianglesSubmitted;
+    };
+
+    // Closest surface found by a ray query, the triangle is in the mesh's index buffer
+    // and the normal is the world space geometric normal of that triangle
+    struct RayHit
+    {
+      float               m_distance;
+      vec3                m_position;
+      vec3                m_normal;
+      shared_ptr<Mesh>    m_mesh;
+      shared_ptr<Entity>  m_entity;
+      uint32_t            m_meshIndex;
+      uint32_t            m_triangle;
+      float               m_u;
+      float               m_v;
+    };
+
+    // Light distribution over the clusters in the last frame
+    struct ClusterStats
+    {
+      uint32_t  m_numClusters;
+      uint32_t  m_numLights;
+      uint32_t  m_numLightIndices;
+      uint32_t  m_maxLights;
+      uint32_t  m_minLights;
+      uint32_t  m_numEmptyClusters;
+      float     m_averageLights;
+      float     m_averageOccupiedLights;
+    };
+
     RenderTechnique(string name, WorldManager* worldManager, HINSTANCE hinstance, HWND window, shared_ptr<Graphics> graphics);
     ~RenderTechnique();
 
@@ -45,8 +128,31 @@ namespace Bonny
     void addView(shared_ptr<View> view);
     void removeView(shared_ptr<View> view);
     void updateWindow(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+    void getLightGrid(LightGrid& lightGrid);
+    uint32_t validateLightGrid();
+    uint32_t validateClusterPlanes();
+    void setClusterGrid(uint32_t tileWidth, uint32_t tileHeight, uint32_t numDepthSlices, float nearSliceDepth);
+    void getClusterStats(ClusterStats& stats);
+    uint32_t getDepthSlice(float viewDepth);
+    void setFrustumCulling(bool enable);
+    void setMeshletCulling(bool enable);
+    void getCullStats(CullStats& stats);
+    void setLodPixelError(float pixelError);
+    void getLodStats(LodStats& stats);
+    bool intersectRay(const vec3& origin, const vec3& direction, float maxDistance, RayHit& hit);
+    int intersectRayPacket(const vec3 origins[4], const vec3 directions[4], float maxDistance, RayHit hits[4]);
+    bool isOccluded(const vec3& origin, const vec3& direction, float maxDistance);
+    bool pick(uint32_t x, uint32_t y, RayHit& hit);
+    void updateRayQueries();
+    void trace();
+    shared_ptr<RayTracer> getRayTracer();
+    shared_ptr<TextureResidency> getTextureResidency();
+    void setTextureDensityStreaming(bool enable);
+    void setQuantizeVertices(bool quantize);
 
     virtual void build();
+    void buildBuffers();
+    void appendBuffers();
     virtual void render();
 
   protected:
@@ -57,6 +163,7 @@ namespace Bonny
 
     WorldManager*                         m_worldManager;
     vector<shared_ptr<RenderComponent>>   m_renderComponents;
+    vector<shared_ptr<RenderComponent>>   m_unbufferedComponents;
     vector<shared_ptr<Entity>>            m_renderEntities;
     vector<shared_ptr<LightComponent>>    m_lightComponents;
     vector<shared_ptr<Entity>>            m_lightEntities;
@@ -69,13 +176,26 @@ namespace Bonny
     void updateClusterData(shared_ptr<View> view, uint32_t frameIndex);
     void updateCurrentLight(uint32_t frameIndex, int lightIndex);
     void renderMeshes(shared_ptr<View> view, uint32_t frameIndex);
+    void buildCullData();
+    void updateWorldBounds();
+    void cullMeshes(shared_ptr<View> view);
+    void cullMeshlets(shared_ptr<View> view, uint32_t meshIndex, vector<Meshlets::IndexRange>& ranges);
+    uint32_t selectLod(uint32_t meshIndex, const vec3& cameraPosition, float projection, float nearClip);
+    void updateSceneBvh();
+    void updateTextureResidency(shared_ptr<View> view);
+    void computeHitNormal(RayHit& hit);
     void updateMeshData(shared_ptr<View> view, uint32_t frameIndex);
     void updateMeshData(shared_ptr<View> view, shared_ptr<Mesh> mesh, shared_ptr<Entity> entity, uint32_t frameIndex, uint32_t meshIndex);
     void createCompositeMeshes();
     void buildFrustumLines(shared_ptr<View> view);
+    void destroyClusterData();
+    float getSliceDepth(uint32_t slice);
+    void buildClusterPlanes();
+    void updateLightPositions(mat4& viewTransform);
+    void assignClusterLights(uint32_t clusterIndex, vector<uint32_t>& lightIndices);
+    void buildLightIndexList(uint32_t grainSize);
     vec4 planeEquation(vec3 p1, vec3 p2, vec3 p3);
     float updatePlaneD(vec4 plane, vec3 p);
-    bool intersectsCluster(uint32_t clusterIndex, vec3 lightViewPosition, float radius);
 
 
     struct Light
@@ -103,16 +223,30 @@ namespace Bonny
     struct Cluster {
       uint32_t                            m_verts[8];
 	    vec4	                              m_planes[6];
-      vector<shared_ptr<LightComponent>>* m_lights;
+    };
+
+    // View space planes of one cluster, one array per component so a plane
+    // can be broadcast against several lights at once
+    struct ClusterPlanes {
+      float     m_x[6];
+      float     m_y[6];
+      float     m_z[6];
+      float     m_w[6];
     };
 
     struct ClusterData {
       uint32_t  m_numClusterVerts;
-      vec3*     m_clusterVerts;
       float*    m_localVerts;
 	    uint32_t  m_numXSegments;
 	    uint32_t  m_numYSegments;
 	    uint32_t  m_numZSegments;
+      uint32_t  m_numClusters;
+      uint32_t  m_viewportWidth;
+      uint32_t  m_viewportHeight;
+      float     m_fieldOfView;
+      float     m_nearClip;
+      float     m_farClip;
+      float     m_sliceNear;
       Cluster*  m_clusters;
     };
 
@@ -126,8 +260,59 @@ namespace Bonny
     int                                   m_currentLight;
     bool                                  m_depthPrepass;
     ClusterData*                          m_clusterData;
+    vector<ClusterPlanes>                 m_clusterPlanes;
+    vector<float>                         m_lightPositionX;
+    vector<float>                         m_lightPositionY;
+    vector<float>                         m_lightPositionZ;
+    vector<float>                         m_lightRadii;
+    uint32_t                              m_numLightPositions;
+    float                                 m_lightRadius;
+    vector<vector<uint32_t>>              m_clusterRangeLightIndices;
+    vector<LightGridCell>                 m_lightGridCells;
+    vector<uint8_t>                       m_lightIndexData;
+    uint32_t                              m_lightIndexSize;
+    uint32_t                              m_numLightIndices;
+    uint32_t                              m_clusterTileWidth;
+    uint32_t                              m_clusterTileHeight;
+    uint32_t                              m_numDepthSlices;
+    float                                 m_clusterNearDepth;
+    ClusterStats                          m_clusterStats;
+
+    // Flattened mesh list with world space boxes as center/extent arrays for the frustum test
+    vector<shared_ptr<Mesh>>              m_cullMeshes;
+    vector<shared_ptr<Entity>>            m_cullEntities;
+    vector<uint32_t>                      m_cullVersions;
+    vector<float>                         m_boundsCenterX;
+    vector<float>                         m_boundsCenterY;
+    vector<float>                         m_boundsCenterZ;
+    vector<float>                         m_boundsExtentX;
+    vector<float>                         m_boundsExtentY;
+    vector<float>                         m_boundsExtentZ;
+    vector<uint32_t>                      m_visibleMeshes;
+    vector<uint32_t>                      m_unboundedMeshes;
+
+    // Meshes by world box for culling and ray queries, mesh space hits use the inverse transforms
+    Bvh                                   m_sceneBvh;
+    vector<vec3>                          m_worldBoundsMin;
+    vector<vec3>                          m_worldBoundsMax;
+    vector<mat4>                          m_inverseTransforms;
+    vector<mat4>                          m_meshTransforms;
+    vector<Meshlets::IndexRange>          m_drawRanges;
+    float                                 m_sceneBvhBuildCost;
+    bool                                  m_sceneBvhDirty;
+    bool                                  m_frustumCulling;
+    bool                                  m_meshletCulling;
+    bool                                  m_cullDataDirty;
+    CullStats                             m_cullStats;
+    float                                 m_lodPixelError;
+    LodStats                              m_lodStats;
+    vector<PackedLight>                   m_packedLights;
     shared_ptr<Entity>                    m_clusterEntity;
     bool                                  m_freezeClusterEntity;
+    shared_ptr<RayTracer>                 m_rayTracer;
+    shared_ptr<TextureResidency>          m_textureResidency;
+    vector<shared_ptr<Texture>>           m_changedTextures;
+    bool                                  m_textureDensityStreaming;
 
     uint32_t                              m_frameIndex;
   };
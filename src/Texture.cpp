@@ -1,5 +1,6 @@
 #include "stdafx.h"
 #include "Texture.h"
+#include "BufferStats.h"
 
 namespace Bonny
 {
@@ -12,7 +13,12 @@ namespace Bonny
     m_size(size),
     m_format(format),
     m_data(nullptr),
-    m_graphicsData(nullptr)
+    m_graphicsData(nullptr),
+    m_usage(USAGE_COLOR),
+    m_compression(COMPRESSION_NONE),
+    m_residentMip(0),
+    m_residentVersion(0),
+    m_streamOffset(0)
   {
   }
 
@@ -21,7 +27,7 @@ namespace Bonny
   {
     if (m_data != nullptr)
     {
-      delete m_data;
+      delete[] m_data;
     }
   }
 
@@ -60,10 +66,26 @@ namespace Bonny
     return m_format;
   }
 
-  void Texture::setData(unsigned char* data)
+  void Texture::setData(const unsigned char* data)
   {
+    if (m_data != nullptr)
+    {
+      delete[] m_data;
+    }
     m_data = new unsigned char[m_size];
     memcpy(m_data, data, m_size);
+    BufferStats::recordCopy(m_size);
+  }
+
+  void Texture::setData(unique_ptr<unsigned char[]> data)
+  {
+    // The texture takes the caller's array as it is, it has to hold m_size bytes
+    if (m_data != nullptr)
+    {
+      delete[] m_data;
+    }
+    m_data = data.release();
+    BufferStats::recordAdopt(m_size);
   }
 
   unsigned char* Texture::getData()
@@ -80,4 +102,148 @@ namespace Bonny
   {
     return m_graphicsData;
   }
+
+  void Texture::setUsage(Usage usage)
+  {
+    m_usage = usage;
+  }
+
+  Texture::Usage Texture::getUsage()
+  {
+    return m_usage;
+  }
+
+  void Texture::setMips(Compression compression, vector<Mip>& mips, vector<uint8_t>& data)
+  {
+    // The chain replaces the single uncompressed level, the size becomes the chain's
+    m_compression = compression;
+    m_mips.swap(mips);
+    m_mipData.swap(data);
+    BufferStats::recordAdopt(m_mipData.size());
+    m_residentMip = 0;
+    m_residentVersion++;
+    m_streamSource = nullptr;
+    m_size = m_mipData.size();
+    if (m_data != nullptr)
+    {
+      delete[] m_data;
+      m_data = nullptr;
+    }
+  }
+
+  void Texture::setMipSource(Compression compression, vector<Mip>& mips, shared_ptr<MappedFile> source, size_t offset)
+  {
+    // Nothing is resident until levels are streamed in
+    m_compression = compression;
+    m_mips.swap(mips);
+    vector<uint8_t>().swap(m_mipData);
+    m_residentMip = (uint32_t)m_mips.size();
+    m_residentVersion++;
+    m_streamSource = source;
+    m_streamOffset = offset;
+    m_size = m_mips.empty() ? 0 : m_mips.back().m_offset + m_mips.back().m_size;
+    if (m_data != nullptr)
+    {
+      delete[] m_data;
+      m_data = nullptr;
+    }
+  }
+
+  void Texture::setStreamSource(shared_ptr<MappedFile> source, size_t offset)
+  {
+    m_streamSource = source;
+    m_streamOffset = offset;
+  }
+
+  bool Texture::canStream()
+  {
+    return m_streamSource != nullptr;
+  }
+
+  Texture::Compression Texture::getCompression()
+  {
+    return m_compression;
+  }
+
+  uint32_t Texture::getNumMips()
+  {
+    return (uint32_t)m_mips.size();
+  }
+
+  const Texture::Mip& Texture::getMip(uint32_t level)
+  {
+    return m_mips[level];
+  }
+
+  const uint8_t* Texture::getMipData(uint32_t level)
+  {
+    if (level < m_residentMip)
+    {
+      return nullptr;
+    }
+    return m_mipData.data() + (m_mips[level].m_offset - m_mips[m_residentMip].m_offset);
+  }
+
+  size_t Texture::getMipDataSize()
+  {
+    return m_mips.empty() ? 0 : m_size;
+  }
+
+  uint32_t Texture::getResidentMip()
+  {
+    return m_residentMip;
+  }
+
+  size_t Texture::getResidentBytes()
+  {
+    // Unprocessed textures keep their base image only
+    if (m_mips.empty())
+    {
+      return (m_data != nullptr) ? m_size : 0;
+    }
+    return m_mipData.size();
+  }
+
+  uint32_t Texture::getResidentVersion()
+  {
+    return m_residentVersion;
+  }
+
+  size_t Texture::streamIn(uint32_t level)
+  {
+    if (level >= m_residentMip || m_streamSource == nullptr)
+    {
+      return 0;
+    }
+
+    // The new levels go in front of the ones already resident
+    size_t start = m_mips[level].m_offset;
+    size_t numBytes = m_size - start - m_mipData.size();
+    vector<uint8_t> data(m_size - start);
+    memcpy(data.data(), m_streamSource->getData() + m_streamOffset + start, numBytes);
+    if (!m_mipData.empty())
+    {
+      memcpy(data.data() + numBytes, m_mipData.data(), m_mipData.size());
+    }
+    m_mipData.swap(data);
+    m_residentMip = level;
+    m_residentVersion++;
+    return numBytes;
+  }
+
+  size_t Texture::streamOut(uint32_t level)
+  {
+    // Without a source the levels could never come back
+    if (level <= m_residentMip || level > m_mips.size() || m_streamSource == nullptr)
+    {
+      return 0;
+    }
+
+    size_t start = (level < m_mips.size()) ? m_mips[level].m_offset : m_size;
+    size_t numBytes = m_mipData.size() - (m_size - start);
+    vector<uint8_t>(m_mipData.begin() + numBytes, m_mipData.end()).swap(m_mipData);
+    m_residentMip = level;
+    m_residentVersion++;
+    return numBytes;
+  }
 }
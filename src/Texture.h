@@ -1,13 +1,49 @@
 #pragma once
+#include "MappedFile.h"
+
 #include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
 
 using std::string;
+using std::vector;
+using std::shared_ptr;
+using std::unique_ptr;
 
 namespace Bonny
 {
   class Texture
   {
   public:
+    // What the texels hold, color is sRGB encoded and filtered in linear space
+    enum Usage
+    {
+      USAGE_COLOR = 0,
+      USAGE_NORMAL,
+      USAGE_DATA
+    };
+
+    // Block compressed formats work on 4x4 texel blocks, 8 bytes for BC1 and 16 for the others
+    enum Compression
+    {
+      COMPRESSION_NONE = 0,
+      COMPRESSION_BC1,
+      COMPRESSION_BC3,
+      COMPRESSION_BC5,
+      COMPRESSION_BC7,
+      NUM_COMPRESSIONS
+    };
+
+    // One level of the processed chain, a range of the mip data
+    struct Mip
+    {
+      uint32_t  m_width;
+      uint32_t  m_height;
+      size_t    m_offset;
+      size_t    m_size;
+    };
+
     Texture(string name, size_t width, size_t height, size_t depth, size_t bitsPerPixel, size_t size, int format);
     ~Texture();
 
@@ -18,10 +54,27 @@ namespace Bonny
     size_t          getBitsPerPixel();
     size_t          getSize();
     int             getFormat();
-    void            setData(unsigned char* data);
+    void            setData(const unsigned char* data);
+    void            setData(unique_ptr<unsigned char[]> data);
     unsigned char * getData();
     void            setGraphicsData(void * graphicsData);
     void*           getGraphicsData();
+    void            setUsage(Usage usage);
+    Usage           getUsage();
+    void            setMips(Compression compression, vector<Mip>& mips, vector<uint8_t>& data);
+    void            setMipSource(Compression compression, vector<Mip>& mips, shared_ptr<MappedFile> source, size_t offset);
+    void            setStreamSource(shared_ptr<MappedFile> source, size_t offset);
+    bool            canStream();
+    Compression     getCompression();
+    uint32_t        getNumMips();
+    const Mip&      getMip(uint32_t level);
+    const uint8_t*  getMipData(uint32_t level);
+    size_t          getMipDataSize();
+    uint32_t        getResidentMip();
+    size_t          getResidentBytes();
+    uint32_t        getResidentVersion();
+    size_t          streamIn(uint32_t level);
+    size_t          streamOut(uint32_t level);
 
   private:
     string          m_name;
@@ -33,6 +86,17 @@ namespace Bonny
     int             m_format;
     unsigned char*  m_data;
     void*           m_graphicsData;
+    Usage           m_usage;
+    Compression     m_compression;
+    vector<Mip>     m_mips;
+
+    // Levels are stored finest first, so the resident ones are always the tail of the
+    // chain from m_residentMip on. Dropped levels are copied back from the stream source.
+    vector<uint8_t> m_mipData;
+    uint32_t        m_residentMip;
+    uint32_t        m_residentVersion;
+    shared_ptr<MappedFile> m_streamSource;
+    size_t          m_streamOffset;
   };
 }
 
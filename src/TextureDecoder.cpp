@@ -0,0 +1,150 @@
+#include "stdafx.h"
+#include "TextureDecoder.h"
+#include "MappedFile.h"
+
+#include <IL\il.h>
+
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+
+using std::mutex;
+
+namespace Bonny
+{
+  static const size_t c_tgaHeaderSize = 18;
+
+  // DevIL decodes into one global bound image, only one thread may use it at a time
+  static mutex s_devilMutex;
+
+  bool TextureDecoder::decode(const string& filename, Image& image)
+  {
+    image.m_width = 0;
+    image.m_height = 0;
+    image.m_data.clear();
+    image.m_decoder = DECODER_NONE;
+
+    string extension = filename.substr(std::min(filename.find_last_of('.'), filename.size()));
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return (char)tolower(c); });
+    if (extension == ".tga")
+    {
+      MappedFile file;
+      if (file.open(filename) && decodeTga(file.getData(), file.getSize(), image))
+      {
+        return true;
+      }
+    }
+    return decodeDevil(filename, image);
+  }
+
+  bool TextureDecoder::decodeTga(const uint8_t* data, size_t size, Image& image)
+  {
+    if (size < c_tgaHeaderSize)
+    {
+      return false;
+    }
+
+    // Color mapped, 16 bit and right to left images are left to DevIL
+    uint32_t idLength = data[0];
+    uint32_t colorMapType = data[1];
+    uint32_t imageType = data[2];
+    uint32_t width = data[12] | (data[13] << 8);
+    uint32_t height = data[14] | (data[15] << 8);
+    uint32_t pixelDepth = data[16];
+    uint32_t descriptor = data[17];
+    bool rle = imageType == 10 || imageType == 11;
+    bool gray = imageType == 3 || imageType == 11;
+    uint32_t bytesPerPixel = pixelDepth / 8;
+    if (colorMapType != 0 || (imageType != 2 && imageType != 3 && imageType != 10 && imageType != 11) || width == 0 || height == 0 ||
+      (descriptor & 0x10) != 0 || (gray && pixelDepth != 8) || (!gray && pixelDepth != 24 && pixelDepth != 32))
+    {
+      return false;
+    }
+
+    size_t numPixels = (size_t)width * height;
+    image.m_data.resize(numPixels * 4);
+    const uint8_t* source = data + c_tgaHeaderSize + idLength;
+    const uint8_t* end = data + size;
+    uint8_t* destination = image.m_data.data();
+    auto writePixel = [&](const uint8_t* pixel)
+    {
+      if (gray)
+      {
+        destination[0] = destination[1] = destination[2] = pixel[0];
+        destination[3] = 255;
+      }
+      else
+      {
+        destination[0] = pixel[2];
+        destination[1] = pixel[1];
+        destination[2] = pixel[0];
+        destination[3] = bytesPerPixel == 4 ? pixel[3] : 255;
+      }
+      destination += 4;
+    };
+
+    size_t numWritten = 0;
+    if (!rle)
+    {
+      if ((size_t)(end - source) < numPixels * bytesPerPixel)
+      {
+        return false;
+      }
+      for (; numWritten < numPixels; numWritten++, source += bytesPerPixel)
+      {
+        writePixel(source);
+      }
+    }
+    else
+    {
+      // Packets of one repeated pixel or of raw pixels, the high bit of the header tells which
+      while (numWritten < numPixels)
+      {
+        if (source >= end)
+        {
+          return false;
+        }
+        uint32_t header = *source++;
+        size_t count = std::min<size_t>((header & 0x7f) + 1, numPixels - numWritten);
+        size_t numBytes = (header & 0x80) ? bytesPerPixel : count * bytesPerPixel;
+        if ((size_t)(end - source) < numBytes)
+        {
+          return false;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+          writePixel((header & 0x80) ? source : source + i * bytesPerPixel);
+        }
+        source += numBytes;
+        numWritten += count;
+      }
+    }
+
+    image.m_width = width;
+    image.m_height = height;
+    image.m_format = IL_RGBA;
+    image.m_decoder = DECODER_TGA;
+    return true;
+  }
+
+  bool TextureDecoder::decodeDevil(const string& filename, Image& image)
+  {
+    std::lock_guard<mutex> lock(s_devilMutex);
+
+    ILuint imageID;
+    ilGenImages(1, &imageID);
+    ilBindImage(imageID);
+    bool success = ilLoadImage(filename.c_str()) && ilConvertImage(IL_RGBA, IL_UNSIGNED_BYTE);
+    if (success)
+    {
+      image.m_width = (uint32_t)ilGetInteger(IL_IMAGE_WIDTH);
+      image.m_height = (uint32_t)ilGetInteger(IL_IMAGE_HEIGHT);
+      image.m_format = ilGetInteger(IL_IMAGE_FORMAT);
+      const ILubyte* data = ilGetData();
+      image.m_data.assign(data, data + ilGetInteger(IL_IMAGE_SIZE_OF_DATA));
+      image.m_decoder = DECODER_DEVIL;
+    }
+    ilDeleteImages(1, &imageID);
+    return success;
+  }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+using std::string;
+using std::vector;
+
+namespace Bonny
+{
+  // Decodes image files to 8 bit RGBA and may be called from several threads at
+  // once. Truecolor and grayscale TGA files, plain or run length encoded, are
+  // decoded here without any shared state. Everything else goes through DevIL,
+  // whose bound image is global, so those decodes are serialized on a mutex.
+  // Rows stay in file order, the same layout DevIL hands out.
+  class TextureDecoder
+  {
+  public:
+    enum Decoder
+    {
+      DECODER_NONE = 0,
+      DECODER_TGA,
+      DECODER_DEVIL
+    };
+
+    struct Image
+    {
+      uint32_t          m_width;
+      uint32_t          m_height;
+      int               m_format;
+      vector<uint8_t>   m_data;
+      Decoder           m_decoder;
+    };
+
+    static bool       decode(const string& filename, Image& image);
+    static bool       decodeTga(const uint8_t* data, size_t size, Image& image);
+
+  private:
+    static bool       decodeDevil(const string& filename, Image& image);
+  };
+}
@@ -0,0 +1,791 @@
+#include "stdafx.h"
+#include "TextureProcessor.h"
+
+#include <xmmintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace Bonny
+{
+  static const uint32_t c_kaiserTaps = 6;
+  static const float    c_kaiserRadius = 3.0f;
+  static const float    c_kaiserAlpha = 4.0f;
+  static const uint32_t c_linearToSrgbSize = 4096;
+  static const uint32_t c_powerIterations = 8;
+
+  // BC7 4 bit index interpolation weights out of 64
+  static const int c_bc7Weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+  struct SrgbTables
+  {
+    float   m_toLinear[256];
+    uint8_t m_toSrgb[c_linearToSrgbSize];
+
+    SrgbTables()
+    {
+      for (uint32_t i = 0; i < 256; i++)
+      {
+        float c = i / 255.0f;
+        m_toLinear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+      }
+      for (uint32_t i = 0; i < c_linearToSrgbSize; i++)
+      {
+        float c = i / (float)(c_linearToSrgbSize - 1);
+        float s = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+        m_toSrgb[i] = (uint8_t)std::min(s * 255.0f + 0.5f, 255.0f);
+      }
+    }
+  };
+
+  static const SrgbTables& getSrgbTables()
+  {
+    static SrgbTables tables;
+    return tables;
+  }
+
+  static float besselI0(float x)
+  {
+    float sum = 1.0f;
+    float term = 1.0f;
+    for (int k = 1; k < 16; k++)
+    {
+      float f = x / (2.0f * k);
+      term *= f * f;
+      sum += term;
+    }
+    return sum;
+  }
+
+  // Half band windowed sinc, taps sit at -2.5 .. 2.5 source texels from the destination center
+  static void getKaiserWeights(float weights[c_kaiserTaps])
+  {
+    const float pi = 3.14159265f;
+    float sum = 0.0f;
+    for (uint32_t i = 0; i < c_kaiserTaps; i++)
+    {
+      float d = (float)i - (c_kaiserTaps - 1) * 0.5f;
+      float x = d * 0.5f;
+      float sinc = sinf(pi * x) / (pi * x);
+      float t = d / c_kaiserRadius;
+      float window = besselI0(c_kaiserAlpha * sqrtf(std::max(1.0f - t * t, 0.0f))) / besselI0(c_kaiserAlpha);
+      weights[i] = sinc * window;
+      sum += weights[i];
+    }
+    for (uint32_t i = 0; i < c_kaiserTaps; i++)
+    {
+      weights[i] /= sum;
+    }
+  }
+
+  static inline uint8_t toUnorm8(float v)
+  {
+    return (uint8_t)(std::min(std::max(v, 0.0f), 1.0f) * 255.0f + 0.5f);
+  }
+
+  // Principal axis fit, the endpoints are the extreme projections of the points onto it
+  static void findEndpoints(const float* points, uint32_t numChannels, float* low, float* high)
+  {
+    float mean[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (uint32_t i = 0; i < 16; i++)
+    {
+      for (uint32_t c = 0; c < numChannels; c++)
+      {
+        mean[c] += points[i * numChannels + c] / 16.0f;
+      }
+    }
+
+    float covariance[4][4] = {};
+    for (uint32_t i = 0; i < 16; i++)
+    {
+      for (uint32_t a = 0; a < numChannels; a++)
+      {
+        for (uint32_t b = 0; b < numChannels; b++)
+        {
+          covariance[a][b] += (points[i * numChannels + a] - mean[a]) * (points[i * numChannels + b] - mean[b]);
+        }
+      }
+    }
+
+    float axis[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    for (uint32_t iteration = 0; iteration < c_powerIterations; iteration++)
+    {
+      float next[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+      float length = 0.0f;
+      for (uint32_t a = 0; a < numChannels; a++)
+      {
+        for (uint32_t b = 0; b < numChannels; b++)
+        {
+          next[a] += covariance[a][b] * axis[b];
+        }
+        length = std::max(length, fabsf(next[a]));
+      }
+      if (length < 1e-6f)
+      {
+        break;
+      }
+      for (uint32_t a = 0; a < numChannels; a++)
+      {
+        axis[a] = next[a] / length;
+      }
+    }
+
+    float axisLength = 0.0f;
+    for (uint32_t c = 0; c < numChannels; c++)
+    {
+      axisLength += axis[c] * axis[c];
+    }
+    axisLength = sqrtf(axisLength);
+    float minProjection = 0.0f;
+    float maxProjection = 0.0f;
+    for (uint32_t i = 0; i < 16; i++)
+    {
+      float projection = 0.0f;
+      for (uint32_t c = 0; c < numChannels; c++)
+      {
+        projection += (points[i * numChannels + c] - mean[c]) * axis[c] / axisLength;
+      }
+      minProjection = std::min(minProjection, projection);
+      maxProjection = std::max(maxProjection, projection);
+    }
+
+    for (uint32_t c = 0; c < numChannels; c++)
+    {
+      low[c] = mean[c] + axis[c] / axisLength * minProjection;
+      high[c] = mean[c] + axis[c] / axisLength * maxProjection;
+    }
+  }
+
+  // Least squares endpoints for fixed interpolation weights, false when the weights are degenerate
+  static bool refitEndpoints(const float* points, uint32_t numChannels, const float weights[16], float* low, float* high)
+  {
+    float aa = 0.0f;
+    float ab = 0.0f;
+    float bb = 0.0f;
+    float ax[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    float bx[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (uint32_t i = 0; i < 16; i++)
+    {
+      float b = weights[i];
+      float a = 1.0f - b;
+      aa += a * a;
+      ab += a * b;
+      bb += b * b;
+      for (uint32_t c = 0; c < numChannels; c++)
+      {
+        ax[c] += a * points[i * numChannels + c];
+        bx[c] += b * points[i * numChannels + c];
+      }
+    }
+
+    float determinant = aa * bb - ab * ab;
+    if (fabsf(determinant) < 1e-6f)
+    {
+      return false;
+    }
+    for (uint32_t c = 0; c < numChannels; c++)
+    {
+      low[c] = std::min(std::max((bb * ax[c] - ab * bx[c]) / determinant, 0.0f), 255.0f);
+      high[c] = std::min(std::max((aa * bx[c] - ab * ax[c]) / determinant, 0.0f), 255.0f);
+    }
+    return true;
+  }
+
+  static inline uint16_t packRgb565(const float* color)
+  {
+    uint32_t r = (uint32_t)(color[0] * 31.0f / 255.0f + 0.5f);
+    uint32_t g = (uint32_t)(color[1] * 63.0f / 255.0f + 0.5f);
+    uint32_t b = (uint32_t)(color[2] * 31.0f / 255.0f + 0.5f);
+    return (uint16_t)((r << 11) | (g << 5) | b);
+  }
+
+  static inline void unpackRgb565(uint16_t packed, float* color)
+  {
+    uint32_t r = (packed >> 11) & 31;
+    uint32_t g = (packed >> 5) & 63;
+    uint32_t b = packed & 31;
+    color[0] = (float)((r << 3) | (r >> 2));
+    color[1] = (float)((g << 2) | (g >> 4));
+    color[2] = (float)((b << 3) | (b >> 2));
+  }
+
+  // Four color mode, returns the squared error and fills the 2 bit indices
+  static float encodeBc1Colors(const float* points, uint16_t color0, uint16_t color1, uint32_t& indices)
+  {
+    float palette[4][3];
+    unpackRgb565(color0, palette[0]);
+    unpackRgb565(color1, palette[1]);
+    for (uint32_t c = 0; c < 3; c++)
+    {
+      palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+      palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+    }
+
+    float error = 0.0f;
+    indices = 0;
+    for (uint32_t i = 0; i < 16; i++)
+    {
+      float best = 1e30f;
+      uint32_t bestIndex = 0;
+      for (uint32_t p = 0; p < 4; p++)
+      {
+        float dr = points[i * 3 + 0] - palette[p][0];
+        float dg = points[i * 3 + 1] - palette[p][1];
+        float db = points[i * 3 + 2] - palette[p][2];
+        float d = dr * dr + dg * dg + db * db;
+        if (d < best)
+        {
+          best = d;
+          bestIndex = p;
+        }
+      }
+      indices |= bestIndex << (2 * i);
+      error += best;
+    }
+    return error;
+  }
+
+  static float fitBc1(const float* points, const float* low, const float* high, uint16_t& color0, uint16_t& color1, uint32_t& indices)
+  {
+    color0 = packRgb565(high);
+    color1 = packRgb565(low);
+    if (color0 < color1)
+    {
+      std::swap(color0, color1);
+    }
+    if (color0 == color1)
+    {
+      // Equal endpoints would select the three color mode, every texel takes color 0 instead
+      indices = 0;
+      float palette[3];
+      unpackRgb565(color0, palette);
+      float error = 0.0f;
+      for (uint32_t i = 0; i < 16; i++)
+      {
+        for (uint32_t c = 0; c < 3; c++)
+        {
+          error += (points[i * 3 + c] - palette[c]) * (points[i * 3 + c] - palette[c]);
+        }
+      }
+      return error;
+    }
+    return encodeBc1Colors(points, color0, color1, indices);
+  }
+
+  static void compressBc1Block(const uint8_t block[64], uint8_t destination[8])
+  {
+    float points[16 * 3];
+    for (uint32_t i = 0; i < 16; i++)
+    {
+      for (uint32_t c = 0; c < 3; c++)
+      {
+        points[i * 3 + c] = block[i * 4 + c];
+      }
+    }
+
+    float low[3];
+    float high[3];
+    findEndpoints(points, 3, low, high);
+    uint16_t color0;
+    uint16_t color1;
+    uint32_t indices;
+    float error = fitBc1(points, low, high, color0, color1, indices);
+
+    // One least squares pass on the chosen indices, kept only when it helps
+    static const float c_bc1Weights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+    float weights[16];
+    for (uint32_t i = 0; i < 16; i++)
+    {
+      weights[i] = c_bc1Weights[(indices >> (2 * i)) & 3];
+    }
+    float color0Value[3];
+    float color1Value[3];
+    if (color0 != color1 && refitEndpoints(points, 3, weights, color0Value, color1Value))
+    {
+      uint16_t refit0;
+      uint16_t refit1;
+      uint32_t refitIndices;
+      float refitError = fitBc1(points, color1Value, color0Value, refit0, refit1, refitIndices);
+      if (refitError < error)
+      {
+        color0 = refit0;
+        color1 = refit1;
+        indices = refitIndices;
+      }
+    }
+
+    destination[0] = (uint8_t)(color0 & 0xff);
+    destination[1] = (uint8_t)(color0 >> 8);
+    destination[2] = (uint8_t)(color1 & 0xff);
+    destination[3] = (uint8_t)(color1 >> 8);
+    memcpy(destination + 4, &indices, 4);
+  }
+
+  // Eight value mode of BC4 on one channel of the block
+  static void compressBc4Block(const uint8_t block[64], uint32_t channel, uint8_t destination[8])
+  {
+    uint8_t maxValue = 0;
+    uint8_t minValue = 255;
+    for (uint32_t i = 0; i < 16; i++)
+    {
+      maxValue = std::max(maxValue, block[i * 4 + channel]);
+      minValue = std::min(minValue, block[i * 4 + channel]);
+    }
+
+    uint64_t bits = 0;
+    if (maxValue != minValue)
+    {
+      int palette[8];
+      palette[0] = maxValue;
+      palette[1] = minValue;
+      for (int p = 2; p < 8; p++)
+      {
+        palette[p] = ((8 - p) * maxValue + (p - 1) * minValue + 3) / 7;
+      }
+      for (uint32_t i = 0; i < 16; i++)
+      {
+        int value = block[i * 4 + channel];
+        int best = 256;
+        uint64_t bestIndex = 0;
+        for (uint32_t p = 0; p < 8; p++)
+        {
+          int d = abs(value - palette[p]);
+          if (d < best)
+          {
+            best = d;
+            bestIndex = p;
+          }
+        }
+        bits |= bestIndex << (3 * i);
+      }
+    }
+
+    destination[0] = maxValue;
+    destination[1] = minValue;
+    for (uint32_t i = 0; i < 6; i++)
+    {
+      destination[2 + i] = (uint8_t)(bits >> (8 * i));
+    }
+  }
+
+  // Quantizes an endpoint to 7 bits per channel plus the shared p bit that fits it best
+  static void quantizeBc7Endpoint(const float* value, uint8_t quantized[4], uint8_t& pbit)
+  {
+    float bestError = 1e30f;
+    for (uint8_t p = 0; p < 2; p++)
+    {
+      uint8_t candidate[4];
+      float error = 0.0f;
+      for (uint32_t c = 0; c < 4; c++)
+      {
+        int q = (int)((value[c] - p) * 0.5f + 0.5f);
+        q = std::min(std::max(q, 0), 127);
+        candidate[c] = (uint8_t)q;
+        float d = value[c] - (float)((q << 1) | p);
+        error += d * d;
+      }
+      if (error < bestError)
+      {
+        bestError = error;
+        memcpy(quantized, candidate, 4);
+        pbit = p;
+      }
+    }
+  }
+
+  static float encodeBc7Indices(const float* points, const uint8_t q0[4], uint8_t p0, const uint8_t q1[4], uint8_t p1, uint8_t indices[16])
+  {
+    int palette[16][4];
+    for (uint32_t c = 0; c < 4; c++)
+    {
+      int e0 = (q0[c] << 1) | p0;
+      int e1 = (q1[c] << 1) | p1;
+      for (uint32_t p = 0; p < 16; p++)
+      {
+        palette[p][c] = ((64 - c_bc7Weights[p]) * e0 + c_bc7Weights[p] * e1 + 32) >> 6;
+      }
+    }
+
+    float error = 0.0f;
+    for (uint32_t i = 0; i < 16; i++)
+    {
+      float best = 1e30f;
+      for (uint8_t p = 0; p < 16; p++)
+      {
+        float d = 0.0f;
+        for (uint32_t c = 0; c < 4; c++)
+        {
+          float delta = points[i * 4 + c] - palette[p][c];
+          d += delta * delta;
+        }
+        if (d < best)
+        {
+          best = d;
+          indices[i] = p;
+        }
+      }
+      error += best;
+    }
+    return error;
+  }
+
+  struct BitWriter
+  {
+    uint8_t*  m_data;
+    uint32_t  m_position;
+
+    void write(uint32_t value, uint32_t numBits)
+    {
+      for (uint32_t i = 0; i < numBits; i++, m_position++)
+      {
+        m_data[m_position >> 3] |= (uint8_t)(((value >> i) & 1) << (m_position & 7));
+      }
+    }
+  };
+
+  // Mode 6 only, one RGBA subset with 7777 endpoints, p bits and 4 bit indices
+  static void compressBc7Block(const uint8_t block[64], uint8_t destination[16])
+  {
+    float points[16 * 4];
+    for (uint32_t i = 0; i < 64; i++)
+    {
+      points[i] = block[i];
+    }
+
+    float low[4];
+    float high[4];
+    findEndpoints(points, 4, low, high);
+    uint8_t q0[4], q1[4];
+    uint8_t p0, p1;
+    uint8_t indices[16];
+    quantizeBc7Endpoint(low, q0, p0);
+    quantizeBc7Endpoint(high, q1, p1);
+    float error = encodeBc7Indices(points, q0, p0, q1, p1, indices);
+
+    float weights[16];
+    for (uint32_t i = 0; i < 16; i++)
+    {
+      weights[i] = c_bc7Weights[indices[i]] / 64.0f;
+    }
+    if (refitEndpoints(points, 4, weights, low, high))
+    {
+      uint8_t r0[4], r1[4];
+      uint8_t rp0, rp1;
+      uint8_t refitIndices[16];
+      quantizeBc7Endpoint(low, r0, rp0);
+      quantizeBc7Endpoint(high, r1, rp1);
+      float refitError = encodeBc7Indices(points, r0, rp0, r1, rp1, refitIndices);
+      if (refitError < error)
+      {
+        memcpy(q0, r0, 4);
+        memcpy(q1, r1, 4);
+        p0 = rp0;
+        p1 = rp1;
+        memcpy(indices, refitIndices, 16);
+      }
+    }
+
+    // The first index drops its top bit, swapping the endpoints makes it zero
+    if (indices[0] & 8)
+    {
+      uint8_t swap[4];
+      memcpy(swap, q0, 4);
+      memcpy(q0, q1, 4);
+      memcpy(q1, swap, 4);
+      std::swap(p0, p1);
+      for (uint32_t i = 0; i < 16; i++)
+      {
+        indices[i] = 15 - indices[i];
+      }
+    }
+
+    memset(destination, 0, 16);
+    BitWriter writer = { destination, 0 };
+    writer.write(1 << 6, 7);
+    for (uint32_t c = 0; c < 4; c++)
+    {
+      writer.write(q0[c], 7);
+      writer.write(q1[c], 7);
+    }
+    writer.write(p0, 1);
+    writer.write(p1, 1);
+    writer.write(indices[0], 3);
+    for (uint32_t i = 1; i < 16; i++)
+    {
+      writer.write(indices[i], 4);
+    }
+  }
+
+  void TextureProcessor::compressBc1(const uint8_t block[64], uint8_t destination[8])
+  {
+    compressBc1Block(block, destination);
+  }
+
+  void TextureProcessor::compressBc3(const uint8_t block[64], uint8_t destination[16])
+  {
+    compressBc4Block(block, 3, destination);
+    compressBc1Block(block, destination + 8);
+  }
+
+  void TextureProcessor::compressBc5(const uint8_t block[64], uint8_t destination[16])
+  {
+    compressBc4Block(block, 0, destination);
+    compressBc4Block(block, 1, destination + 8);
+  }
+
+  void TextureProcessor::compressBc7(const uint8_t block[64], uint8_t destination[16])
+  {
+    compressBc7Block(block, destination);
+  }
+
+  void TextureProcessor::getDefaultSettings(Settings& settings)
+  {
+    settings.m_generateMips = true;
+    settings.m_compress = true;
+    settings.m_useBc7 = true;
+    settings.m_filter = FILTER_KAISER;
+  }
+
+  size_t TextureProcessor::getBlockSize(Texture::Compression compression)
+  {
+    switch (compression)
+    {
+    case Texture::COMPRESSION_BC1:
+      return 8;
+    case Texture::COMPRESSION_BC3:
+    case Texture::COMPRESSION_BC5:
+    case Texture::COMPRESSION_BC7:
+      return 16;
+    default:
+      return 0;
+    }
+  }
+
+  size_t TextureProcessor::getLevelSize(Texture::Compression compression, uint32_t width, uint32_t height)
+  {
+    if (compression == Texture::COMPRESSION_NONE)
+    {
+      return (size_t)width * height * 4;
+    }
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) * getBlockSize(compression);
+  }
+
+  Texture::Compression TextureProcessor::selectCompression(const uint8_t* rgba, uint32_t width, uint32_t height, Texture::Usage usage, const Settings& settings)
+  {
+    if (!settings.m_compress)
+    {
+      return Texture::COMPRESSION_NONE;
+    }
+    if (usage == Texture::USAGE_NORMAL)
+    {
+      return Texture::COMPRESSION_BC5;
+    }
+
+    size_t numTexels = (size_t)width * height;
+    for (size_t i = 0; i < numTexels; i++)
+    {
+      if (rgba[i * 4 + 3] != 255)
+      {
+        return settings.m_useBc7 ? Texture::COMPRESSION_BC7 : Texture::COMPRESSION_BC3;
+      }
+    }
+    return Texture::COMPRESSION_BC1;
+  }
+
+  void TextureProcessor::downsample(const float* source, uint32_t width, uint32_t height, Filter filter, vector<float>& destination)
+  {
+    uint32_t destinationWidth = std::max(width / 2, 1u);
+    uint32_t destinationHeight = std::max(height / 2, 1u);
+    destination.resize((size_t)destinationWidth * destinationHeight * 4);
+
+    if (filter == FILTER_BOX)
+    {
+      const __m128 quarter = _mm_set1_ps(0.25f);
+      for (uint32_t y = 0; y < destinationHeight; y++)
+      {
+        const float* row0 = source + (size_t)std::min(2 * y, height - 1) * width * 4;
+        const float* row1 = source + (size_t)std::min(2 * y + 1, height - 1) * width * 4;
+        for (uint32_t x = 0; x < destinationWidth; x++)
+        {
+          uint32_t x0 = std::min(2 * x, width - 1) * 4;
+          uint32_t x1 = std::min(2 * x + 1, width - 1) * 4;
+          __m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(row0 + x0), _mm_loadu_ps(row0 + x1)),
+            _mm_add_ps(_mm_loadu_ps(row1 + x0), _mm_loadu_ps(row1 + x1)));
+          _mm_storeu_ps(&destination[((size_t)y * destinationWidth + x) * 4], _mm_mul_ps(sum, quarter));
+        }
+      }
+      return;
+    }
+
+    // Separable, rows first into a half width image, then columns. A dimension that is
+    // already one texel is passed through.
+    float weights[c_kaiserTaps];
+    getKaiserWeights(weights);
+    __m128 tapWeights[c_kaiserTaps];
+    for (uint32_t i = 0; i < c_kaiserTaps; i++)
+    {
+      tapWeights[i] = _mm_set1_ps(weights[i]);
+    }
+    int tapOffset = (int)c_kaiserTaps / 2 - 1;
+
+    vector<float> rows((size_t)destinationWidth * height * 4);
+    for (uint32_t y = 0; y < height; y++)
+    {
+      const float* row = source + (size_t)y * width * 4;
+      float* rowDestination = &rows[(size_t)y * destinationWidth * 4];
+      if (width == 1)
+      {
+        memcpy(rowDestination, row, 4 * sizeof(float));
+        continue;
+      }
+      for (uint32_t x = 0; x < destinationWidth; x++)
+      {
+        __m128 sum = _mm_setzero_ps();
+        for (uint32_t i = 0; i < c_kaiserTaps; i++)
+        {
+          int sx = std::min(std::max((int)(2 * x) - tapOffset + (int)i, 0), (int)width - 1);
+          sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(row + sx * 4), tapWeights[i]));
+        }
+        _mm_storeu_ps(rowDestination + x * 4, sum);
+      }
+    }
+
+    // Negative lobes can ring past the unit range, clamp so it does not build up down the chain
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    for (uint32_t y = 0; y < destinationHeight; y++)
+    {
+      float* rowDestination = &destination[(size_t)y * destinationWidth * 4];
+      for (uint32_t x = 0; x < destinationWidth; x++)
+      {
+        __m128 sum = _mm_setzero_ps();
+        if (height == 1)
+        {
+          sum = _mm_loadu_ps(&rows[(size_t)x * 4]);
+        }
+        else
+        {
+          for (uint32_t i = 0; i < c_kaiserTaps; i++)
+          {
+            int sy = std::min(std::max((int)(2 * y) - tapOffset + (int)i, 0), (int)height - 1);
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&rows[((size_t)sy * destinationWidth + x) * 4]), tapWeights[i]));
+          }
+        }
+        _mm_storeu_ps(rowDestination + x * 4, _mm_min_ps(_mm_max_ps(sum, zero), one));
+      }
+    }
+  }
+
+  static void appendLevel(const uint8_t* texels, uint32_t width, uint32_t height, Texture::Compression compression, TextureProcessor::Result& result)
+  {
+    Texture::Mip mip;
+    mip.m_width = width;
+    mip.m_height = height;
+    mip.m_offset = result.m_data.size();
+    mip.m_size = TextureProcessor::getLevelSize(compression, width, height);
+    result.m_data.resize(mip.m_offset + mip.m_size);
+    result.m_mips.push_back(mip);
+
+    uint8_t* destination = &result.m_data[mip.m_offset];
+    if (compression == Texture::COMPRESSION_NONE)
+    {
+      memcpy(destination, texels, mip.m_size);
+      return;
+    }
+
+    // Edge blocks repeat the last row and column
+    size_t blockSize = TextureProcessor::getBlockSize(compression);
+    uint8_t block[64];
+    for (uint32_t by = 0; by < height; by += 4)
+    {
+      for (uint32_t bx = 0; bx < width; bx += 4)
+      {
+        for (uint32_t y = 0; y < 4; y++)
+        {
+          const uint8_t* row = texels + (size_t)std::min(by + y, height - 1) * width * 4;
+          for (uint32_t x = 0; x < 4; x++)
+          {
+            memcpy(block + (y * 4 + x) * 4, row + std::min(bx + x, width - 1) * 4, 4);
+          }
+        }
+
+        switch (compression)
+        {
+        case Texture::COMPRESSION_BC1:
+          TextureProcessor::compressBc1(block, destination);
+          break;
+        case Texture::COMPRESSION_BC3:
+          TextureProcessor::compressBc3(block, destination);
+          break;
+        case Texture::COMPRESSION_BC5:
+          TextureProcessor::compressBc5(block, destination);
+          break;
+        default:
+          TextureProcessor::compressBc7(block, destination);
+          break;
+        }
+        destination += blockSize;
+      }
+    }
+  }
+
+  void TextureProcessor::process(const uint8_t* rgba, uint32_t width, uint32_t height, Texture::Usage usage, const Settings& settings, Result& result)
+  {
+    result.m_compression = selectCompression(rgba, width, height, usage, settings);
+    result.m_mips.clear();
+    result.m_data.clear();
+    appendLevel(rgba, width, height, result.m_compression, result);
+    if (!settings.m_generateMips || (width == 1 && height == 1))
+    {
+      return;
+    }
+
+    const SrgbTables& tables = getSrgbTables();
+    bool srgb = (usage == Texture::USAGE_COLOR);
+    size_t numTexels = (size_t)width * height;
+    vector<float> level(numTexels * 4);
+    for (size_t i = 0; i < numTexels * 4; i++)
+    {
+      level[i] = (srgb && (i & 3) != 3) ? tables.m_toLinear[rgba[i]] : rgba[i] / 255.0f;
+    }
+
+    vector<float> next;
+    vector<uint8_t> texels;
+    while (width > 1 || height > 1)
+    {
+      downsample(level.data(), width, height, settings.m_filter, next);
+      width = std::max(width / 2, 1u);
+      height = std::max(height / 2, 1u);
+      numTexels = (size_t)width * height;
+
+      if (usage == Texture::USAGE_NORMAL)
+      {
+        // Filtered normals shorten, put them back on the unit sphere
+        for (size_t i = 0; i < numTexels; i++)
+        {
+          float* n = &next[i * 4];
+          float x = n[0] * 2.0f - 1.0f;
+          float y = n[1] * 2.0f - 1.0f;
+          float z = n[2] * 2.0f - 1.0f;
+          float length = sqrtf(x * x + y * y + z * z);
+          if (length > 1e-6f)
+          {
+            n[0] = x / length * 0.5f + 0.5f;
+            n[1] = y / length * 0.5f + 0.5f;
+            n[2] = z / length * 0.5f + 0.5f;
+          }
+        }
+      }
+
+      texels.resize(numTexels * 4);
+      for (size_t i = 0; i < numTexels * 4; i++)
+      {
+        float v = std::min(std::max(next[i], 0.0f), 1.0f);
+        texels[i] = (srgb && (i & 3) != 3) ? tables.m_toSrgb[(uint32_t)(v * (c_linearToSrgbSize - 1) + 0.5f)] : toUnorm8(v);
+      }
+      appendLevel(texels.data(), width, height, result.m_compression, result);
+      level.swap(next);
+    }
+  }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "Texture.h"
+
+#include <vector>
+#include <cstdint>
+
+using std::vector;
+
+namespace Bonny
+{
+  // CPU processing of decoded 8 bit RGBA images into a mip chain and block
+  // compressed levels. Mips are filtered in linear float, color textures are
+  // decoded from sRGB first and normal maps are renormalized per level. The
+  // format follows the usage: BC5 for normals (X and Y, Z is rebuilt when
+  // sampling), BC1 for opaque color and data, BC7 or BC3 when alpha is used.
+  class TextureProcessor
+  {
+  public:
+    enum Filter
+    {
+      FILTER_BOX = 0,
+      FILTER_KAISER
+    };
+
+    struct Settings
+    {
+      bool      m_generateMips;
+      bool      m_compress;
+      bool      m_useBc7;
+      Filter    m_filter;
+    };
+
+    struct Result
+    {
+      Texture::Compression    m_compression;
+      vector<Texture::Mip>    m_mips;
+      vector<uint8_t>         m_data;
+    };
+
+    static void     getDefaultSettings(Settings& settings);
+    static void     process(const uint8_t* rgba, uint32_t width, uint32_t height, Texture::Usage usage, const Settings& settings, Result& result);
+    static Texture::Compression selectCompression(const uint8_t* rgba, uint32_t width, uint32_t height, Texture::Usage usage, const Settings& settings);
+    static size_t   getBlockSize(Texture::Compression compression);
+    static size_t   getLevelSize(Texture::Compression compression, uint32_t width, uint32_t height);
+
+    // A level at a time, the source is linear RGBA float
+    static void     downsample(const float* source, uint32_t width, uint32_t height, Filter filter, vector<float>& destination);
+
+    // Blocks are 4x4 RGBA texels in rows
+    static void     compressBc1(const uint8_t block[64], uint8_t destination[8]);
+    static void     compressBc3(const uint8_t block[64], uint8_t destination[16]);
+    static void     compressBc5(const uint8_t block[64], uint8_t destination[16]);
+    static void     compressBc7(const uint8_t block[64], uint8_t destination[16]);
+  };
+}
@@ -0,0 +1,361 @@
+#include "stdafx.h"
+#include "TextureResidency.h"
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+namespace Bonny
+{
+  // Request frame of entries nothing asked for yet
+  static const uint32_t c_neverRequested = 0xffffffff;
+
+  TextureResidency::TextureResidency() :
+    m_budget(c_defaultBudget),
+    m_streamLimit(c_defaultStreamLimit),
+    m_residentBytes(0)
+  {
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_stats.m_budget = m_budget;
+  }
+
+  TextureResidency::~TextureResidency()
+  {
+  }
+
+  void TextureResidency::setBudget(size_t budget)
+  {
+    m_budget = budget;
+  }
+
+  size_t TextureResidency::getBudget()
+  {
+    return m_budget;
+  }
+
+  void TextureResidency::setStreamLimit(size_t streamLimit)
+  {
+    m_streamLimit = streamLimit;
+  }
+
+  size_t TextureResidency::getStreamLimit()
+  {
+    return m_streamLimit;
+  }
+
+  void TextureResidency::addTexture(shared_ptr<Texture> texture)
+  {
+    findEntry(texture);
+  }
+
+  void TextureResidency::addMaterial(shared_ptr<Material> material)
+  {
+    for (uint32_t slot = 0; slot < Material::NUM_TEXTURE_SLOTS; slot++)
+    {
+      shared_ptr<Texture> texture = material->getTexture((Material::TextureSlot)slot);
+      if (texture != nullptr)
+      {
+        findEntry(texture);
+      }
+    }
+  }
+
+  void TextureResidency::request(shared_ptr<Texture> texture, uint32_t level, uint32_t frameIndex)
+  {
+    // The finest level any user asked for this frame wins
+    Entry& entry = m_entries[findEntry(texture)];
+    if (entry.m_requestFrame != frameIndex || level < entry.m_requestedMip)
+    {
+      entry.m_requestedMip = std::min(level, entry.m_tailMip);
+    }
+    entry.m_requestFrame = frameIndex;
+    entry.m_lastUsedFrame = frameIndex;
+  }
+
+  void TextureResidency::requestMaterial(shared_ptr<Material> material, uint32_t level, uint32_t frameIndex)
+  {
+    for (uint32_t slot = 0; slot < Material::NUM_TEXTURE_SLOTS; slot++)
+    {
+      shared_ptr<Texture> texture = material->getTexture((Material::TextureSlot)slot);
+      if (texture != nullptr)
+      {
+        request(texture, level, frameIndex);
+      }
+    }
+  }
+
+  void TextureResidency::requestMaterialDensity(shared_ptr<Material> material, float uvPerPixel, uint32_t frameIndex)
+  {
+    for (uint32_t slot = 0; slot < Material::NUM_TEXTURE_SLOTS; slot++)
+    {
+      shared_ptr<Texture> texture = material->getTexture((Material::TextureSlot)slot);
+      if (texture != nullptr)
+      {
+        request(texture, selectMip(texture, uvPerPixel), frameIndex);
+      }
+    }
+  }
+
+  uint32_t TextureResidency::selectMip(shared_ptr<Texture> texture, float uvPerPixel)
+  {
+    // Each level halves the texels per pixel, rounding down keeps at least one texel per pixel.
+    // Surfaces without texture coordinates only need the tail.
+    uint32_t numMips = texture->getNumMips();
+    if (numMips == 0)
+    {
+      return 0;
+    }
+    float texelsPerPixel = uvPerPixel * (float)std::max(texture->getWidth(), texture->getHeight());
+    if (!(texelsPerPixel > 0.0f))
+    {
+      return numMips - 1;
+    }
+    float level = floor(log2(texelsPerPixel));
+    if (level <= 0.0f)
+    {
+      return 0;
+    }
+    return std::min((uint32_t)level, numMips - 1);
+  }
+
+  void TextureResidency::update(uint32_t frameIndex, vector<shared_ptr<Texture>>& changed)
+  {
+    removeExpired();
+
+    Stats& stats = m_stats;
+    stats.m_budget = m_budget;
+    stats.m_numRequested = 0;
+    stats.m_numMisses = 0;
+    stats.m_numLevelsStreamedIn = 0;
+    stats.m_numEvictions = 0;
+    stats.m_bytesStreamedIn = 0;
+    stats.m_bytesEvicted = 0;
+
+    // Resident sizes are taken from the textures, a loader may have replaced the data since the last frame.
+    // A texture can still be released after removeExpired, its entry is skipped until the next update drops it.
+    vector<uint32_t> missing;
+    m_residentBytes = 0;
+    for (uint32_t i = 0; i < m_entries.size(); i++)
+    {
+      shared_ptr<Texture> texture = m_entries[i].m_texture.lock();
+      if (texture == nullptr)
+      {
+        continue;
+      }
+      m_residentBytes += texture->getResidentBytes();
+      if (m_entries[i].m_requestFrame == frameIndex)
+      {
+        stats.m_numRequested++;
+        if (m_entries[i].m_requestedMip < texture->getResidentMip() && texture->canStream())
+        {
+          missing.push_back(i);
+        }
+      }
+    }
+    stats.m_numMisses = (uint32_t)missing.size();
+
+    // Textures still in use keep their levels when the budget was lowered
+    makeRoom(0, frameIndex);
+
+    // One level per missing texture and pass, so every texture gets its coarser levels before any gets its finest.
+    // The first level of a frame always goes in, later ones only within the stream limit.
+    size_t numStreamed = 0;
+    bool progress = true;
+    while (progress)
+    {
+      progress = false;
+      for (size_t i = 0; i < missing.size(); i++)
+      {
+        Entry& entry = m_entries[missing[i]];
+        shared_ptr<Texture> texture = entry.m_texture.lock();
+        if (texture == nullptr)
+        {
+          continue;
+        }
+        uint32_t residentMip = texture->getResidentMip();
+        if (residentMip <= entry.m_requestedMip)
+        {
+          continue;
+        }
+
+        size_t levelSize = texture->getMip(residentMip - 1).m_size;
+        if (numStreamed > 0 && numStreamed + levelSize > m_streamLimit)
+        {
+          progress = false;
+          break;
+        }
+        if (!makeRoom(levelSize, frameIndex))
+        {
+          continue;
+        }
+
+        size_t numBytes = texture->streamIn(residentMip - 1);
+        m_residentBytes += numBytes;
+        numStreamed += numBytes;
+        stats.m_numLevelsStreamedIn++;
+        stats.m_bytesStreamedIn += numBytes;
+        stats.m_totalBytesStreamedIn += numBytes;
+        progress = true;
+      }
+    }
+
+    stats.m_residentBytes = 0;
+    stats.m_requiredBytes = 0;
+    stats.m_fullBytes = 0;
+    stats.m_numTextures = (uint32_t)m_entries.size();
+    stats.m_numPinned = 0;
+    for (size_t i = 0; i < m_entries.size(); i++)
+    {
+      Entry& entry = m_entries[i];
+      shared_ptr<Texture> texture = entry.m_texture.lock();
+      if (texture == nullptr)
+      {
+        continue;
+      }
+      stats.m_residentBytes += texture->getResidentBytes();
+      stats.m_fullBytes += texture->getMipDataSize();
+      if (entry.m_requestFrame == frameIndex && texture->getNumMips() > 0)
+      {
+        stats.m_requiredBytes += texture->getMipDataSize() - texture->getMip(entry.m_requestedMip).m_offset;
+      }
+      stats.m_numPinned += texture->canStream() ? 0 : 1;
+      if (entry.m_residentVersion != texture->getResidentVersion())
+      {
+        entry.m_residentVersion = texture->getResidentVersion();
+        changed.push_back(texture);
+      }
+    }
+  }
+
+  void TextureResidency::getStats(Stats& stats)
+  {
+    stats = m_stats;
+  }
+
+  uint32_t TextureResidency::findEntry(shared_ptr<Texture> texture)
+  {
+    // An expired entry's address can come back with a new texture, that entry starts over
+    auto found = m_entryIndices.find(texture.get());
+    if (found != m_entryIndices.end() && !m_entries[found->second].m_texture.expired())
+    {
+      return found->second;
+    }
+
+    Entry entry;
+    entry.m_texture = texture;
+    entry.m_tailMip = 0;
+    for (uint32_t level = 0; level < texture->getNumMips(); level++)
+    {
+      const Texture::Mip& mip = texture->getMip(level);
+      entry.m_tailMip = level;
+      if (mip.m_width <= c_tailSize && mip.m_height <= c_tailSize)
+      {
+        break;
+      }
+    }
+    entry.m_requestedMip = entry.m_tailMip;
+    entry.m_requestFrame = c_neverRequested;
+    entry.m_lastUsedFrame = 0;
+    entry.m_residentVersion = texture->getResidentVersion();
+
+    // The tail comes in right away, outside the budget and the stream limit
+    if (texture->getNumMips() > 0 && texture->getResidentMip() > entry.m_tailMip)
+    {
+      m_residentBytes += texture->streamIn(entry.m_tailMip);
+    }
+
+    uint32_t index = 0;
+    if (found != m_entryIndices.end())
+    {
+      index = found->second;
+      m_entries[index] = entry;
+    }
+    else
+    {
+      index = (uint32_t)m_entries.size();
+      m_entries.push_back(entry);
+      m_entryIndices[texture.get()] = index;
+    }
+    return index;
+  }
+
+  void TextureResidency::removeExpired()
+  {
+    size_t numEntries = 0;
+    for (size_t i = 0; i < m_entries.size(); i++)
+    {
+      if (!m_entries[i].m_texture.expired())
+      {
+        m_entries[numEntries++] = m_entries[i];
+      }
+    }
+    if (numEntries == m_entries.size())
+    {
+      return;
+    }
+
+    m_entries.resize(numEntries);
+    m_entryIndices.clear();
+    for (uint32_t i = 0; i < m_entries.size(); i++)
+    {
+      shared_ptr<Texture> texture = m_entries[i].m_texture.lock();
+      if (texture != nullptr)
+      {
+        m_entryIndices[texture.get()] = i;
+      }
+    }
+  }
+
+  bool TextureResidency::makeRoom(size_t numBytes, uint32_t frameIndex)
+  {
+    // Least recently used first, textures requested this frame only give up levels finer than they asked for
+    while (m_residentBytes + numBytes > m_budget)
+    {
+      uint32_t victim = (uint32_t)m_entries.size();
+      bool victimRequested = true;
+      uint32_t victimFrame = 0;
+      for (uint32_t i = 0; i < m_entries.size(); i++)
+      {
+        const Entry& entry = m_entries[i];
+        shared_ptr<Texture> texture = entry.m_texture.lock();
+        if (texture == nullptr || !texture->canStream() || texture->getResidentMip() >= entry.m_tailMip)
+        {
+          continue;
+        }
+
+        bool requested = (entry.m_requestFrame == frameIndex);
+        if (requested && texture->getResidentMip() >= entry.m_requestedMip)
+        {
+          continue;
+        }
+        if (victim == m_entries.size() || (victimRequested && !requested) ||
+            (victimRequested == requested && entry.m_lastUsedFrame < victimFrame))
+        {
+          victim = i;
+          victimRequested = requested;
+          victimFrame = entry.m_lastUsedFrame;
+        }
+      }
+
+      if (victim == m_entries.size())
+      {
+        return false;
+      }
+      evictLevel(victim);
+    }
+    return true;
+  }
+
+  void TextureResidency::evictLevel(uint32_t index)
+  {
+    shared_ptr<Texture> texture = m_entries[index].m_texture.lock();
+    if (texture == nullptr)
+    {
+      return;
+    }
+    size_t numBytes = texture->streamOut(texture->getResidentMip() + 1);
+    m_residentBytes -= numBytes;
+    m_stats.m_numEvictions++;
+    m_stats.m_bytesEvicted += numBytes;
+  }
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "Texture.h"
+#include "Material.h"
+
+#include <vector>
+#include <memory>
+#include <map>
+#include <cstdint>
+
+using std::vector;
+using std::shared_ptr;
+using std::weak_ptr;
+using std::map;
+
+namespace Bonny
+{
+  // Keeps the CPU side mip data of the textures in use within a byte budget.
+  // Every frame the renderer requests a level for the textures of the visible
+  // materials, update then copies missing levels in from the texture's stream
+  // source, coarsest first and up to a per frame limit, and drops the finest
+  // levels of the least recently used textures while over the budget. The mip
+  // tail stays resident so there is always something to sample, textures
+  // without a stream source can't get their levels back and are never evicted.
+  // Requests by density pick the level whose texels are closest to one per
+  // pixel, so distant surfaces never bring in their finest levels.
+  class TextureResidency
+  {
+  public:
+    static const size_t   c_defaultBudget = 256 * 1024 * 1024;
+    static const size_t   c_defaultStreamLimit = 16 * 1024 * 1024;
+
+    // Levels at or below this size in both dimensions form the always resident tail
+    static const uint32_t c_tailSize = 32;
+
+    // Residency at the end of the last update and what it took to get there. The required
+    // bytes are the requested levels of this frame's textures, the full bytes every level
+    // of every texture, the total bytes streamed in count since creation.
+    struct Stats
+    {
+      size_t    m_budget;
+      size_t    m_residentBytes;
+      size_t    m_requiredBytes;
+      size_t    m_fullBytes;
+      uint32_t  m_numTextures;
+      uint32_t  m_numPinned;
+      uint32_t  m_numRequested;
+      uint32_t  m_numMisses;
+      uint32_t  m_numLevelsStreamedIn;
+      uint32_t  m_numEvictions;
+      uint64_t  m_bytesStreamedIn;
+      uint64_t  m_bytesEvicted;
+      uint64_t  m_totalBytesStreamedIn;
+    };
+
+    TextureResidency();
+    ~TextureResidency();
+
+    void      setBudget(size_t budget);
+    size_t    getBudget();
+    void      setStreamLimit(size_t streamLimit);
+    size_t    getStreamLimit();
+
+    void      addTexture(shared_ptr<Texture> texture);
+    void      addMaterial(shared_ptr<Material> material);
+    void      request(shared_ptr<Texture> texture, uint32_t level, uint32_t frameIndex);
+    void      requestMaterial(shared_ptr<Material> material, uint32_t level, uint32_t frameIndex);
+
+    // The density is texture coordinate units per screen pixel of the surface using the material
+    void      requestMaterialDensity(shared_ptr<Material> material, float uvPerPixel, uint32_t frameIndex);
+    static uint32_t selectMip(shared_ptr<Texture> texture, float uvPerPixel);
+
+    // Textures whose resident levels changed are appended so the backend can upload them again
+    void      update(uint32_t frameIndex, vector<shared_ptr<Texture>>& changed);
+    void      getStats(Stats& stats);
+
+  private:
+    struct Entry
+    {
+      weak_ptr<Texture>   m_texture;
+      uint32_t            m_tailMip;
+      uint32_t            m_requestedMip;
+      uint32_t            m_requestFrame;
+      uint32_t            m_lastUsedFrame;
+      uint32_t            m_residentVersion;
+    };
+
+    uint32_t  findEntry(shared_ptr<Texture> texture);
+    void      removeExpired();
+    bool      makeRoom(size_t numBytes, uint32_t frameIndex);
+    void      evictLevel(uint32_t index);
+
+    vector<Entry>               m_entries;
+    map<Texture*, uint32_t>     m_entryIndices;
+    size_t                      m_budget;
+    size_t                      m_streamLimit;
+    size_t                      m_residentBytes;
+    Stats                       m_stats;
+  };
+}
@@ -0,0 +1,275 @@
+#include "stdafx.h"
+#include "TransformHierarchy.h"
+#include "Entity.h"
+
+#include <cstring>
+
+using std::memset;
+
+namespace Bonny
+{
+  TransformHierarchy::TransformHierarchy() :
+    m_firstDirty(0),
+    m_updateBegin(0),
+    m_numUpdated(0),
+    m_updateCount(1),
+    m_valid(false)
+  {
+  }
+
+
+  TransformHierarchy::~TransformHierarchy()
+  {
+    clear();
+  }
+
+  void TransformHierarchy::build(vector<shared_ptr<Entity>>& roots)
+  {
+    clear();
+
+    // Breadth first walk, the entity array doubles as the work queue
+    for (size_t i = 0; i < roots.size(); ++i)
+    {
+      m_entities.push_back(roots[i].get());
+      m_parents.push_back(-1);
+    }
+
+    // Nodes of the same depth are contiguous, each level only depends on the one before it
+    size_t levelEnd = m_entities.size();
+    m_levelOffsets.push_back(0);
+    for (size_t i = 0; i < m_entities.size(); ++i)
+    {
+      if (i == levelEnd)
+      {
+        m_levelOffsets.push_back((uint32_t)i);
+        levelEnd = m_entities.size();
+      }
+
+      Entity* entity = m_entities[i];
+      for (unsigned int j = 0; j < entity->numChildren(); ++j)
+      {
+        m_entities.push_back(entity->getChild(j).get());
+        m_parents.push_back((int32_t)i);
+      }
+    }
+    m_levelOffsets.push_back((uint32_t)m_entities.size());
+
+    m_localTransforms.resize(m_entities.size());
+    m_worldTransforms.resize(m_entities.size());
+    m_dirty.assign(m_entities.size(), 1);
+    m_versions.assign(m_entities.size(), 0);
+    m_firstDirty = 0;
+    for (size_t i = 0; i < m_entities.size(); ++i)
+    {
+      m_entities[i]->getTransform(m_localTransforms[i]);
+      m_entities[i]->getCompositeTransform(m_worldTransforms[i]);
+      m_entities[i]->attachTransform(this, (uint32_t)i);
+    }
+    m_valid = true;
+  }
+
+  void TransformHierarchy::clear()
+  {
+    // Hand the current transforms back to the entities before dropping the storage
+    for (size_t i = 0; i < m_entities.size(); ++i)
+    {
+      m_entities[i]->detachTransform();
+    }
+
+    m_localTransforms.clear();
+    m_worldTransforms.clear();
+    m_parents.clear();
+    m_entities.clear();
+    m_dirty.clear();
+    m_versions.clear();
+    m_levelOffsets.clear();
+    m_firstDirty = 0;
+    m_valid = false;
+  }
+
+  bool TransformHierarchy::isValid()
+  {
+    return m_valid;
+  }
+
+  void TransformHierarchy::update()
+  {
+    beginUpdate();
+    updateRange(m_updateBegin, m_entities.size());
+    endUpdate();
+  }
+
+  JobSystem::JobHandle TransformHierarchy::update(JobSystem* jobSystem)
+  {
+    const uint32_t grainSize = 1024;
+
+    // A static scene doesn't pay for scheduling a job per level
+    if (m_firstDirty >= m_entities.size())
+    {
+      m_numUpdated = 0;
+      return nullptr;
+    }
+
+    // One parallel range per level, chained so parents are always final before their children
+    JobSystem::JobHandle job = jobSystem->schedule([this]() { beginUpdate(); }, {});
+    for (size_t level = 0; level + 1 < m_levelOffsets.size(); ++level)
+    {
+      uint32_t levelBegin = m_levelOffsets[level];
+      uint32_t levelEnd = m_levelOffsets[level + 1];
+      job = jobSystem->parallelFor(levelEnd - levelBegin, grainSize, [this, levelBegin](uint32_t begin, uint32_t end)
+      {
+        updateRange(levelBegin + begin, levelBegin + end);
+      }, { job });
+    }
+    return jobSystem->schedule([this]() { endUpdate(); }, { job });
+  }
+
+  void TransformHierarchy::beginUpdate()
+  {
+    m_numUpdated = 0;
+    m_updateCount++;
+    m_updateBegin = m_firstDirty;
+  }
+
+  void TransformHierarchy::updateRange(size_t begin, size_t end)
+  {
+    // Nothing before the first dirty node can have moved
+    if (begin < m_updateBegin)
+    {
+      begin = m_updateBegin;
+    }
+    if (begin >= end)
+    {
+      return;
+    }
+
+    const int32_t* parents = m_parents.data();
+    const mat4* localTransforms = m_localTransforms.data();
+    mat4* worldTransforms = m_worldTransforms.data();
+    uint8_t* dirty = m_dirty.data();
+    uint32_t* versions = m_versions.data();
+    uint32_t updateCount = m_updateCount;
+    size_t numUpdated = 0;
+
+    // Parents come first, so a node changed this pass if it was dirty or its parent's version is current
+    for (size_t i = begin; i < end; ++i)
+    {
+      int32_t parent = parents[i];
+      if (parent < 0)
+      {
+        if (dirty[i])
+        {
+          worldTransforms[i] = localTransforms[i];
+          versions[i] = updateCount;
+          dirty[i] = 0;
+          numUpdated++;
+        }
+      }
+      else if (dirty[i] || versions[parent] == updateCount)
+      {
+        worldTransforms[i] = worldTransforms[parent] * localTransforms[i];
+        versions[i] = updateCount;
+        dirty[i] = 0;
+        numUpdated++;
+      }
+    }
+    m_numUpdated += numUpdated;
+  }
+
+  void TransformHierarchy::endUpdate()
+  {
+    m_firstDirty = m_entities.size();
+  }
+
+  void TransformHierarchy::updateAll()
+  {
+    size_t numNodes = m_entities.size();
+    const int32_t* parents = m_parents.data();
+    const mat4* localTransforms = m_localTransforms.data();
+    mat4* worldTransforms = m_worldTransforms.data();
+    uint32_t* versions = m_versions.data();
+
+    m_updateCount++;
+    for (size_t i = 0; i < numNodes; ++i)
+    {
+      int32_t parent = parents[i];
+      if (parent < 0)
+      {
+        worldTransforms[i] = localTransforms[i];
+      }
+      else
+      {
+        worldTransforms[i] = worldTransforms[parent] * localTransforms[i];
+      }
+      versions[i] = m_updateCount;
+    }
+    memset(m_dirty.data(), 0, m_dirty.size());
+    m_firstDirty = numNodes;
+    m_numUpdated = numNodes;
+  }
+
+  size_t TransformHierarchy::numNodes()
+  {
+    return m_entities.size();
+  }
+
+  int32_t TransformHierarchy::getParent(uint32_t index)
+  {
+    return m_parents[index];
+  }
+
+  size_t TransformHierarchy::getNumUpdated()
+  {
+    return m_numUpdated;
+  }
+
+  uint32_t TransformHierarchy::getUpdateCount()
+  {
+    return m_updateCount;
+  }
+
+  uint32_t TransformHierarchy::getVersion(uint32_t index)
+  {
+    return m_versions[index];
+  }
+
+  void TransformHierarchy::setLocalTransform(uint32_t index, const mat4& transform)
+  {
+    m_localTransforms[index] = transform;
+    m_dirty[index] = 1;
+
+    // Processors may move entities from several threads at once
+    size_t firstDirty = m_firstDirty;
+    while (index < firstDirty && !m_firstDirty.compare_exchange_weak(firstDirty, index))
+    {
+    }
+  }
+
+  const mat4& TransformHierarchy::getLocalTransform(uint32_t index)
+  {
+    return m_localTransforms[index];
+  }
+
+  void TransformHierarchy::setWorldTransform(uint32_t index, const mat4& transform)
+  {
+    // Written from outside the linear pass, recompute this node and its children on the next update
+    m_worldTransforms[index] = transform;
+    m_dirty[index] = 1;
+
+    // Processors may move entities from several threads at once
+    size_t firstDirty = m_firstDirty;
+    while (index < firstDirty && !m_firstDirty.compare_exchange_weak(firstDirty, index))
+    {
+    }
+  }
+
+  const mat4& TransformHierarchy::getWorldTransform(uint32_t index)
+  {
+    return m_worldTransforms[index];
+  }
+
+  Entity* TransformHierarchy::getEntity(uint32_t index)
+  {
+    return m_entities[index];
+  }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+
+#include "JobSystem.h"
+
+#include <glm/glm.hpp>
+
+using glm::mat4;
+
+using std::vector;
+using std::shared_ptr;
+
+namespace Bonny
+{
+  class Entity;
+
+  // Flat transform storage for an entity tree. Nodes are laid out breadth first
+  // so every parent index is smaller than the index of its children and the
+  // world transforms can be computed in a single linear pass. Only nodes whose
+  // local transform changed, or that sit below such a node, are recomputed.
+  class TransformHierarchy
+  {
+  public:
+    TransformHierarchy();
+    ~TransformHierarchy();
+
+    void            build(vector<shared_ptr<Entity>>& roots);
+    void            clear();
+    bool            isValid();
+    void            update();
+    void            updateAll();
+
+    // Schedules the update of the dirty nodes, or returns no job when nothing is dirty.
+    // Everything that moves nodes has to be finished before this is called.
+    JobSystem::JobHandle  update(JobSystem* jobSystem);
+
+    size_t          numNodes();
+    size_t          getNumUpdated();
+    uint32_t        getUpdateCount();
+    uint32_t        getVersion(uint32_t index);
+    int32_t         getParent(uint32_t index);
+    void            setLocalTransform(uint32_t index, const mat4& transform);
+    const mat4&     getLocalTransform(uint32_t index);
+    void            setWorldTransform(uint32_t index, const mat4& transform);
+    const mat4&     getWorldTransform(uint32_t index);
+    Entity*         getEntity(uint32_t index);
+
+  private:
+    void            beginUpdate();
+    void            updateRange(size_t begin, size_t end);
+    void            endUpdate();
+
+    vector<mat4>      m_localTransforms;
+    vector<mat4>      m_worldTransforms;
+    vector<int32_t>   m_parents;
+    vector<Entity*>   m_entities;
+    vector<uint8_t>   m_dirty;
+    vector<uint32_t>  m_versions;
+    vector<uint32_t>  m_levelOffsets;
+    atomic<size_t>    m_firstDirty;
+    size_t            m_updateBegin;
+    atomic<size_t>    m_numUpdated;
+    uint32_t          m_updateCount;
+    bool              m_valid;
+  };
+}
+
@@ -38,9 +38,34 @@ namespace Bonny
     projectionTransform = m_projectionMatrix;
   }
 
+  void View::getFrustumPlanes(vec4 planes[6])
+  {
+    // World space planes pointing inwards, taken from the rows of the view projection matrix
+    mat4 viewProjection = m_projectionMatrix * m_viewMatrix;
+    vec4 row0(viewProjection[0][0], viewProjection[1][0], viewProjection[2][0], viewProjection[3][0]);
+    vec4 row1(viewProjection[0][1], viewProjection[1][1], viewProjection[2][1], viewProjection[3][1]);
+    vec4 row2(viewProjection[0][2], viewProjection[1][2], viewProjection[2][2], viewProjection[3][2]);
+    vec4 row3(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+
+    planes[0] = row3 + row0;
+    planes[1] = row3 - row0;
+    planes[2] = row3 + row1;
+    planes[3] = row3 - row1;
+    // glm is already included through View.h when the depth define above is seen, so the
+    // projection maps depth to -1..1 and the near plane is row3 + row2 like the others
+    planes[4] = row3 + row2;
+    planes[5] = row3 - row2;
+
+    for (int i = 0; i < 6; i++)
+    {
+      planes[i] /= glm::length(vec3(planes[i]));
+    }
+  }
+
   void View::setFieldOfView(float fieldOfView)
   {
     m_fieldOfView = fieldOfView;
+    computeTransforms();
   }
 
   float View::getFieldOfView()
@@ -51,6 +76,7 @@ namespace Bonny
   void View::setNearClip(float nearClip)
   {
     m_nearClip = nearClip;
+    computeTransforms();
   }
 
   float View::getNearClip()
@@ -61,6 +87,7 @@ namespace Bonny
   void View::setFarClip(float farClip)
   {
     m_farClip = farClip;
+    computeTransforms();
   }
 
   float View::getFarClip()
@@ -81,6 +108,7 @@ namespace Bonny
   void View::setViewportSize(vec2& size)
   {
     m_viewportSize = size;
+    computeTransforms();
   }
 
   void View::getViewportSize(vec2& size)
@@ -90,7 +118,8 @@ namespace Bonny
 
   void View::computeTransforms()
   {
-    m_projectionMatrix = glm::perspective(m_fieldOfView, m_viewportSize.x / m_viewportSize.y, m_nearClip, m_farClip);
+    // The field of view is stored in degrees
+    m_projectionMatrix = glm::perspective(glm::radians(m_fieldOfView), m_viewportSize.x / m_viewportSize.y, m_nearClip, m_farClip);
   }
 
   //void View::addCompositeMesh(shared_ptr<Mesh> mesh)
@@ -31,6 +31,7 @@ namespace Bonny
     void setViewTransform(mat4& viewTransform);
     void getViewTransform(mat4& viewTransform);
     void getProjectionTransform(mat4& projectionTransform);
+    void getFrustumPlanes(vec4 planes[6]);
 
     void  setFieldOfView(float fieldOfView);
     float getFieldOfView();
@@ -6,29 +6,82 @@
 #include "RenderComponent.h"
 #include "GraphicsOpenGL.h"
 #include "GraphicsDX12.h"
+#include "GraphicsHeadless.h"
+#include "RayTracer.h"
+#include "GeometryPacker.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <atlstr.h>
 
 using std::make_shared;
 using std::static_pointer_cast;
 
 namespace Bonny {
+  // Geometry uploaded per frame for models streamed in, a model bigger than this still gets a frame to itself
+  static const size_t c_defaultIntegrationBudget = 32 * 1024 * 1024;
+
   WorldManager::WorldManager(string name, HINSTANCE hinstance, HWND window) :
     m_name(name),
     m_constantDepthBias(3.0f),
     m_slopeDepthBias(0.0f),
     m_clusterEntityFreeze(false)
   {
-    //m_graphics = make_shared<GraphicsOpenGL>("OpenGL Graphics", hinstance, window);
-    m_graphics = make_shared<GraphicsDX12>("DirectX 12 Graphics", hinstance, window);
+    //createRenderer(make_shared<GraphicsOpenGL>("OpenGL Graphics", hinstance, window), hinstance, window);
+    createRenderer(make_shared<GraphicsDX12>("DirectX 12 Graphics", hinstance, window), hinstance, window);
+  }
+
+  WorldManager::WorldManager(string name) :
+    m_name(name),
+    m_constantDepthBias(3.0f),
+    m_slopeDepthBias(0.0f),
+    m_clusterEntityFreeze(false)
+  {
+    // No window, record the frame with the headless backend
+    createRenderer(make_shared<GraphicsHeadless>("Headless Graphics"), nullptr, nullptr);
+  }
+
+  void WorldManager::createRenderer(shared_ptr<Graphics> graphics, HINSTANCE hinstance, HWND window)
+  {
+    m_jobSystem = make_shared<JobSystem>(JobSystem::defaultNumThreads());
+    m_transformHierarchy = make_shared<TransformHierarchy>();
+    m_graphics = graphics;
     m_graphics->createDevice(3);
     m_renderTechnique = make_shared<RenderTechnique>("Default Render Technique", this, hinstance, window, m_graphics);
 
     m_modelLoader = make_shared<ModelLoader>();
+    m_loadShutdown = false;
+    m_numPendingLoads = 0;
+    m_integrationBudget = c_defaultIntegrationBudget;
 
+    m_frameStartTime = 0;
     m_timer.start();
   }
 
   WorldManager::~WorldManager()
   {
+    if (m_loadThread.joinable())
+    {
+      {
+        std::lock_guard<mutex> lock(m_loadMutex);
+        m_loadShutdown = true;
+      }
+      m_loadCondition.notify_one();
+      m_loadThread.join();
+    }
+
+    // The load in progress was finished by the join, nothing that is still waiting will be integrated now.
+    // Anyone holding the future gets nullptr instead of waiting forever.
+    vector<ModelLoadHandle> loads(m_queuedLoads.begin(), m_queuedLoads.end());
+    loads.insert(loads.end(), m_finishedLoads.begin(), m_finishedLoads.end());
+    loads.insert(loads.end(), m_integratingLoads.begin(), m_integratingLoads.end());
+    for (size_t i = 0; i < loads.size(); i++)
+    {
+      loads[i]->m_state = ModelLoad::LOAD_CANCELED;
+      loads[i]->m_promise.set_value(nullptr);
+      m_numPendingLoads--;
+    }
   }
 
   void WorldManager::buildFrame()
@@ -44,12 +97,44 @@ namespace Bonny {
     m_lastFrameStartTime = m_frameStartTime;
     m_frameStartTime = m_timer.elapsedMicro();
 
-    // Run all the processors
+    // Work handed over by other threads, then whatever streamed in models fit this frame
+    executeCommands();
+    integrateLoads();
+
+    if (!m_transformHierarchy->isValid())
+    {
+      m_transformHierarchy->build(m_entities);
+    }
+
+    // Run all the processors, then propagate the transforms they changed. Processors share entity and view
+    // state, only the ones marked independent run in parallel, the rest run in order in a single job.
+    double absoluteTime = (double)m_timer.elapsedMicro();
+    double deltaTime = (double)(m_frameStartTime - m_lastFrameStartTime);
+    m_independentProcessors.clear();
+    m_serialProcessors.clear();
     for (size_t i = 0; i < m_processors.size(); i++)
     {
-      m_processors[i]->execute((double)m_timer.elapsedMicro(), (double)(m_frameStartTime - m_lastFrameStartTime));
+      (m_processors[i]->isIndependent() ? m_independentProcessors : m_serialProcessors).push_back(m_processors[i].get());
     }
-    updateTransforms();
+    JobSystem::JobHandle independentJob = m_jobSystem->parallelFor((uint32_t)m_independentProcessors.size(), 1,
+      [this, absoluteTime, deltaTime](uint32_t begin, uint32_t end)
+    {
+      for (uint32_t i = begin; i < end; i++)
+      {
+        m_independentProcessors[i]->execute(absoluteTime, deltaTime);
+      }
+    }, {});
+    JobSystem::JobHandle serialJob = m_jobSystem->schedule([this, absoluteTime, deltaTime]()
+    {
+      for (size_t i = 0; i < m_serialProcessors.size(); i++)
+      {
+        m_serialProcessors[i]->execute(absoluteTime, deltaTime);
+      }
+    }, {});
+    m_jobSystem->wait(independentJob);
+    m_jobSystem->wait(serialJob);
+    JobSystem::JobHandle transformJob = updateTransforms();
+    m_jobSystem->wait(transformJob);
     currentTime = m_timer.elapsedMicro();
     processTime = currentTime - m_frameStartTime;
 
@@ -61,24 +146,99 @@ namespace Bonny {
     //printLog("ProcessTime: " + std::to_string((double)processTime/1000.0) + ", RenderTime: " + std::to_string((double)renderTime/1000.0) + ", GPUTime: " + std::to_string((double)gpuTime / 1000000.0) + ", " + std::to_string((double)gpuTime2 / 1000000.0));
   }
 
-  void WorldManager::updateTransforms()
+  JobSystem::JobHandle WorldManager::updateTransforms()
   {
-    mat4 identity;
-    for (size_t i = 0; i<m_entities.size(); i++)
+    return m_transformHierarchy->update(m_jobSystem.get());
+  }
+
+  void WorldManager::multiplyTransforms(shared_ptr<Entity> entity, const mat4& parent, vector<mat4>& worldTransforms, vector<Entity*>& entities,
+    size_t& count)
+  {
+    mat4 transform;
+    entity->getTransform(transform);
+    mat4 worldTransform = parent * transform;
+    worldTransforms[count] = worldTransform;
+    entities[count] = entity.get();
+    count++;
+    for (unsigned int i = 0; i<entity->numChildren(); i++)
     {
-      updateTransform(m_entities[i], identity);
+      multiplyTransforms(entity->getChild(i), worldTransform, worldTransforms, entities, count);
     }
   }
 
-  void WorldManager::updateTransform(shared_ptr<Entity> entity, mat4& parent)
+  void WorldManager::benchmarkTransforms(uint32_t iterations, TransformBenchmark& benchmark)
   {
-    entity->updateCompositeTransform(parent);
-    mat4 newParent;
-    entity->getCompositeTransform(newParent);
-    for (unsigned int i = 0; i<entity->numChildren(); i++)
+    CpuTimer timer;
+    mat4 identity;
+
+    if (!m_transformHierarchy->isValid())
+    {
+      m_transformHierarchy->build(m_entities);
+    }
+    size_t numNodes = m_transformHierarchy->numNodes();
+
+    // Plain recursive multiply over the entity tree, it only reads the local transforms and writes
+    // nothing back to the hierarchy
+    vector<mat4> reference(numNodes);
+    vector<Entity*> referenceEntities(numNodes);
+    timer.start();
+    for (uint32_t k = 0; k < iterations; k++)
+    {
+      size_t count = 0;
+      for (size_t i = 0; i < m_entities.size(); i++)
+      {
+        multiplyTransforms(m_entities[i], identity, reference, referenceEntities, count);
+      }
+    }
+    benchmark.m_recursiveTime = timer.elapsedMicro();
+
+    // Linear pass over the flat hierarchy
+    timer.start();
+    for (uint32_t k = 0; k < iterations; k++)
+    {
+      m_transformHierarchy->updateAll();
+    }
+    benchmark.m_linearTime = timer.elapsedMicro();
+
+    // The walk is depth first, the hierarchy's nodes are stored breadth first
+    map<Entity*, uint32_t> nodeIndices;
+    for (uint32_t i = 0; i < numNodes; i++)
+    {
+      nodeIndices[m_transformHierarchy->getEntity(i)] = i;
+    }
+
+    benchmark.m_maxError = 0.0f;
+    for (uint32_t i = 0; i < numNodes; i++)
     {
-      updateTransform(entity->getChild(i), newParent);
+      const mat4& world = m_transformHierarchy->getWorldTransform(nodeIndices[referenceEntities[i]]);
+      for (int c = 0; c < 4; c++)
+      {
+        for (int r = 0; r < 4; r++)
+        {
+          benchmark.m_maxError = std::max(benchmark.m_maxError, fabs(world[c][r] - reference[i][c][r]));
+        }
+      }
     }
+    benchmark.m_numNodes = numNodes;
+    benchmark.m_iterations = iterations;
+
+    printLog("Transforms: " + std::to_string(numNodes) + " nodes, Recursive: " + std::to_string((double)benchmark.m_recursiveTime / 1000.0) +
+      ", Linear: " + std::to_string((double)benchmark.m_linearTime / 1000.0) + ", MaxError: " + std::to_string(benchmark.m_maxError));
+  }
+
+  void WorldManager::setNumJobThreads(uint32_t numThreads)
+  {
+    m_jobSystem = make_shared<JobSystem>(numThreads);
+  }
+
+  shared_ptr<JobSystem> WorldManager::getJobSystem()
+  {
+    return m_jobSystem;
+  }
+
+  size_t WorldManager::getNumTransformsUpdated()
+  {
+    return m_transformHierarchy->getNumUpdated();
   }
 
   void WorldManager::updateWindow(uint32_t x, uint32_t y, uint32_t width, uint32_t height)
@@ -86,20 +246,32 @@ namespace Bonny {
     m_renderTechnique->updateWindow(x, y, width, height);
   }
 
+  shared_ptr<Graphics> WorldManager::getGraphics()
+  {
+    return m_graphics;
+  }
+
+  shared_ptr<RenderTechnique> WorldManager::getRenderTechnique()
+  {
+    return m_renderTechnique;
+  }
+
   void WorldManager::addEntity(shared_ptr<Entity> entity)
   {
+    m_transformHierarchy->clear();
     m_entities.push_back(entity);
     processAddEntity(entity);
   }
 
   void WorldManager::removeEntity(shared_ptr<Entity> entity)
   {
+    m_transformHierarchy->clear();
     for (vector<shared_ptr<Entity>>::iterator it = m_entities.begin(); it != m_entities.end(); ++it)
     {
       if (*it == entity)
       {
         m_entities.erase(it);
-        return;
+        break;
       }
     }
     processRemoveEntity(entity);
@@ -250,6 +422,27 @@ namespace Bonny {
         m_clusterEntityFreeze = !m_clusterEntityFreeze;
         //m_renderTechnique->setClusterEntityFreeze(m_clusterEntityFreeze);
         break;
+      case VK_F2:
+        // Toggle the deterministic single thread mode
+        setNumJobThreads(m_jobSystem->isSingleThreaded() ? JobSystem::defaultNumThreads() : 0);
+        printLog("Job Threads " + std::to_string(m_jobSystem->numThreads()));
+        break;
+      case VK_F3:
+        runChecks();
+        break;
+      case VK_F5:
+        traceReferenceImage("reference.ppm");
+        break;
+      case VK_F6:
+        printLodStats();
+        break;
+      case VK_F7:
+        printTextureStats();
+        break;
+      case VK_F8:
+        setQuantizeVertices(!m_graphics->getGeometryPacker()->getQuantizeVertices());
+        printGeometryStats();
+        break;
       }
     }
 
@@ -273,16 +466,468 @@ namespace Bonny {
     }
   }
 
+  void WorldManager::traceReferenceImage(string filename)
+  {
+    RayTracer::Stats stats;
+    m_renderTechnique->trace();
+    m_renderTechnique->getRayTracer()->getStats(stats);
+    m_renderTechnique->getRayTracer()->saveImage(filename);
+    printLog("Trace: " + std::to_string((double)stats.m_time / 1000.0) + " ms, Primary " + std::to_string(stats.m_numPrimaryRays) +
+      ", Shadow " + std::to_string(stats.m_numShadowRays) + ", Bounce " + std::to_string(stats.m_numBounceRays) +
+      ", " + std::to_string(stats.m_megaRaysPerSecond) + " Mrays/s");
+  }
+
+  void WorldManager::printLodStats()
+  {
+    RenderTechnique::LodStats stats;
+    m_renderTechnique->getLodStats(stats);
+    string levels;
+    for (uint32_t i = 0; i < Mesh::c_maxLods; i++)
+    {
+      levels += (i == 0 ? "" : "/") + std::to_string(stats.m_numMeshesPerLevel[i]);
+    }
+    double ratio = stats.m_numTrianglesFull > 0 ? (double)stats.m_numTrianglesSubmitted / (double)stats.m_numTrianglesFull : 1.0;
+    printLog("LOD: Meshes per level " + levels + ", Triangles " + std::to_string(stats.m_numTrianglesSubmitted) + " of " +
+      std::to_string(stats.m_numTrianglesFull) + " (" + std::to_string(ratio * 100.0) + "%)");
+  }
+
+  void WorldManager::printTextureStats()
+  {
+    TextureResidency::Stats stats;
+    m_renderTechnique->getTextureResidency()->getStats(stats);
+    printLog("Textures: " + std::to_string(stats.m_residentBytes) + " of " + std::to_string(stats.m_budget) + " bytes resident, " +
+      std::to_string(stats.m_requiredBytes) + " required, " + std::to_string(stats.m_fullBytes) + " full, " + std::to_string(stats.m_numTextures) +
+      " textures, " + std::to_string(stats.m_numPinned) + " pinned");
+    printLog("Textures: " + std::to_string(stats.m_numRequested) + " requested, " + std::to_string(stats.m_numMisses) + " misses, " +
+      std::to_string(stats.m_numLevelsStreamedIn) + " levels in (" + std::to_string(stats.m_bytesStreamedIn) + " bytes), " +
+      std::to_string(stats.m_numEvictions) + " evicted (" + std::to_string(stats.m_bytesEvicted) + " bytes), " +
+      std::to_string(stats.m_totalBytesStreamedIn) + " bytes loaded in total");
+  }
+
+  void WorldManager::setQuantizeVertices(bool quantize)
+  {
+    m_renderTechnique->setQuantizeVertices(quantize);
+  }
+
+  void WorldManager::printGeometryStats()
+  {
+    // Largest quantization errors over all packed meshes, with the mesh the position error comes from
+    shared_ptr<GeometryPacker> geometryPacker = m_graphics->getGeometryPacker();
+    GeometryPacker::MeshReport maxErrors = {};
+    for (size_t i = 0; i < geometryPacker->numMeshes(); i++)
+    {
+      const GeometryPacker::MeshReport& report = geometryPacker->getMeshReport(i);
+      if (report.m_maxPositionError > maxErrors.m_maxPositionError)
+      {
+        maxErrors.m_name = report.m_name;
+        maxErrors.m_maxPositionError = report.m_maxPositionError;
+      }
+      maxErrors.m_maxNormalError = std::max(maxErrors.m_maxNormalError, report.m_maxNormalError);
+      maxErrors.m_maxTexCoordError = std::max(maxErrors.m_maxTexCoordError, report.m_maxTexCoordError);
+      maxErrors.m_maxTangentError = std::max(maxErrors.m_maxTangentError, report.m_maxTangentError);
+    }
+
+    GeometryPacker::Stats stats;
+    geometryPacker->getStats(stats);
+    printLog("Geometry: " + std::to_string(stats.m_numMeshes) + " meshes, " + std::to_string(stats.m_vertexBytes) + " vertex bytes (" +
+      std::to_string(stats.m_vertexBytesFullLayout) + " with the full layout), quantized " + (geometryPacker->getQuantizeVertices() ? "on" : "off"));
+    printLog("Geometry: Max quantization error position " + std::to_string(maxErrors.m_maxPositionError) + " (" + maxErrors.m_name.substr(0, 64) +
+      "), normal " + std::to_string(maxErrors.m_maxNormalError) + " deg, texcoord " + std::to_string(maxErrors.m_maxTexCoordError) + ", tangent " +
+      std::to_string(maxErrors.m_maxTangentError) + " deg");
+  }
+
+  uint32_t WorldManager::runChecks()
+  {
+    uint32_t numFailed = 0;
+
+    uint32_t numRejected = m_renderTechnique->validateClusterPlanes();
+    numFailed += reportCheck("Cluster Planes", numRejected == 0, std::to_string(numRejected) + " clusters reject their own center");
+
+    uint32_t numMismatches = m_renderTechnique->validateLightGrid();
+    numFailed += reportCheck("Light Grid", numMismatches == 0, std::to_string(numMismatches) + " mismatches");
+
+    // Positions read back from the packed vertices, quantized ones may be off by no more than the packer reported
+    shared_ptr<GeometryPacker> geometryPacker = m_graphics->getGeometryPacker();
+    uint32_t numBadMeshes = 0;
+    float maxPositionError = 0.0f;
+    for (size_t i = 0; i < geometryPacker->numMeshes(); i++)
+    {
+      shared_ptr<Mesh> mesh = geometryPacker->getMesh(i);
+      const GeometryPacker::MeshReport& report = geometryPacker->getMeshReport(i);
+      const float* positions = mesh->getVertexBufferData(0);
+      size_t stride = mesh->getVertexBufferSize(0);
+      if (positions == nullptr || stride < 3)
+      {
+        continue;
+      }
+
+      float meshError = 0.0f;
+      for (uint32_t v = 0; v < report.m_numVertices; v++)
+      {
+        vec3 decoded;
+        geometryPacker->decodePosition(i, v, decoded);
+        meshError = std::max(meshError, glm::length(decoded - vec3(positions[v * stride], positions[v * stride + 1], positions[v * stride + 2])));
+      }
+      maxPositionError = std::max(maxPositionError, meshError);
+      numBadMeshes += meshError > report.m_maxPositionError * 1.001f + 1e-6f ? 1 : 0;
+    }
+    numFailed += reportCheck("Packed Positions", numBadMeshes == 0, std::to_string(geometryPacker->numMeshes()) + " meshes, max error " +
+      std::to_string(maxPositionError) + ", " + std::to_string(numBadMeshes) + " above the reported error");
+
+    numFailed += checkMeshletCulling();
+    numFailed += checkTextureStreaming();
+
+    TransformBenchmark benchmark;
+    benchmarkTransforms(1, benchmark);
+    numFailed += reportCheck("Transforms", benchmark.m_maxError <= 1e-4f, std::to_string(benchmark.m_numNodes) + " nodes, max error " +
+      std::to_string(benchmark.m_maxError));
+
+    printLog("Checks: " + std::to_string(numFailed) + " failed");
+    return numFailed;
+  }
+
+  uint32_t WorldManager::reportCheck(string name, bool passed, string details)
+  {
+    printLog("Check " + name + (passed ? ": passed, " : ": FAILED, ") + details);
+    return passed ? 0 : 1;
+  }
+
+  uint32_t WorldManager::checkMeshletCulling()
+  {
+    // Flat 32x32 quad grid in the xy plane facing +z, all of its meshlets face the same way
+    const uint32_t numQuads = 32;
+    const float size = 20.0f;
+    uint32_t numSideVerts = numQuads + 1;
+    vector<float> positions;
+    for (uint32_t y = 0; y < numSideVerts; y++)
+    {
+      for (uint32_t x = 0; x < numSideVerts; x++)
+      {
+        positions.push_back(((float)x / numQuads - 0.5f) * size);
+        positions.push_back(((float)y / numQuads - 0.5f) * size);
+        positions.push_back(0.0f);
+      }
+    }
+    vector<uint32_t> indices;
+    for (uint32_t y = 0; y < numQuads; y++)
+    {
+      for (uint32_t x = 0; x < numQuads; x++)
+      {
+        uint32_t v0 = y * numSideVerts + x;
+        uint32_t quad[6] = { v0, v0 + 1, v0 + numSideVerts + 1, v0, v0 + numSideVerts + 1, v0 + numSideVerts };
+        indices.insert(indices.end(), quad, quad + 6);
+      }
+    }
+
+    Meshlets meshlets;
+    meshlets.build(indices.data(), indices.size(), positions.data(), 3, numSideVerts * numSideVerts);
+
+    // Planes that keep everything, only the cones decide. Seen from the front every meshlet is drawn
+    // as one merged range, from behind every one of them is backface culled.
+    vec4 planes[6];
+    for (int i = 0; i < 6; i++)
+    {
+      planes[i] = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    }
+    vector<Meshlets::IndexRange> ranges;
+    Meshlets::CullCounts front;
+    Meshlets::CullCounts back;
+    meshlets.cull(planes, vec3(0.0f, 0.0f, size * 0.5f), true, ranges, front);
+    bool frontPassed = front.m_numVisible == front.m_numMeshlets && ranges.size() == 1 && ranges[0].m_numIndices == indices.size();
+    meshlets.cull(planes, vec3(0.0f, 0.0f, -size * 0.5f), true, ranges, back);
+    bool backPassed = back.m_numBackfaceCulled == back.m_numMeshlets && ranges.empty();
+
+    return reportCheck("Meshlet Cones", front.m_numMeshlets > 1 && frontPassed && backPassed, std::to_string(front.m_numMeshlets) + " meshlets, " +
+      std::to_string(front.m_numVisible) + " visible from the front, " + std::to_string(back.m_numBackfaceCulled) + " backface culled from behind");
+  }
+
+  uint32_t WorldManager::checkTextureStreaming()
+  {
+    // Full BC1 chain of a 1024x1024 texture, streamed from a file of zeros
+    vector<Texture::Mip> mips;
+    size_t chainSize = 0;
+    for (uint32_t width = 1024, height = 1024; ; width = std::max(width / 2, 1u), height = std::max(height / 2, 1u))
+    {
+      Texture::Mip mip = { width, height, chainSize, (size_t)std::max(width / 4, 1u) * std::max(height / 4, 1u) * 8 };
+      mips.push_back(mip);
+      chainSize += mip.m_size;
+      if (width == 1 && height == 1)
+      {
+        break;
+      }
+    }
+
+    string filename = "TextureStreamingCheck.tmp";
+    {
+      std::ofstream file(filename, std::ios::binary);
+      vector<char> zeros(chainSize, 0);
+      file.write(zeros.data(), zeros.size());
+    }
+
+    // Eight texels per pixel only need level 3 and the coarser ones, nothing finer may be loaded
+    uint32_t level = 0;
+    size_t residentBytes = 0;
+    size_t fullBytes = 0;
+    size_t expectedBytes = chainSize - mips[3].m_offset;
+    bool mapped = false;
+    {
+      shared_ptr<MappedFile> source = make_shared<MappedFile>();
+      mapped = source->open(filename);
+      if (mapped)
+      {
+        shared_ptr<Texture> texture = make_shared<Texture>(filename, 1024, 1024, 1, 4, chainSize, 0);
+        texture->setMipSource(Texture::COMPRESSION_BC1, mips, source, 0);
+
+        TextureResidency residency;
+        residency.addTexture(texture);
+        level = TextureResidency::selectMip(texture, 8.0f / 1024.0f);
+        residency.request(texture, level, 1);
+        vector<shared_ptr<Texture>> changed;
+        residency.update(1, changed);
+
+        TextureResidency::Stats stats;
+        residency.getStats(stats);
+        residentBytes = stats.m_residentBytes;
+        fullBytes = stats.m_fullBytes;
+      }
+    }
+    DeleteFileA(filename.c_str());
+
+    return reportCheck("Texture Streaming", mapped && level == 3 && residentBytes == expectedBytes && fullBytes == chainSize, "level " +
+      std::to_string(level) + ", " + std::to_string(residentBytes) + " bytes loaded of " + std::to_string(fullBytes) + ", expected " +
+      std::to_string(expectedBytes));
+  }
+
   shared_ptr<Entity> WorldManager::loadAssimpModel(string filename)
   {
-    return m_modelLoader->loadAssimpModel(filename);
+    std::lock_guard<mutex> lock(m_modelLoaderMutex);
+    return m_modelLoader->loadAssimpModel(filename, m_jobSystem.get());
+  }
+
+  WorldManager::ModelLoadHandle WorldManager::loadAssimpModelAsync(string filename, shared_ptr<Entity> parent, const mat4& transform)
+  {
+    ModelLoadHandle load = make_shared<ModelLoad>();
+    load->m_filename = filename;
+    load->m_parent = parent;
+    load->m_transform = transform;
+    load->m_state = ModelLoad::LOAD_QUEUED;
+    load->m_progress = 0.0f;
+    load->m_numBytes = 0;
+    load->m_numFramesWaited = 0;
+    load->m_loadTime = 0;
+    load->m_future = load->m_promise.get_future().share();
+
+    if (!m_loadThread.joinable())
+    {
+      m_loadJobSystem = make_shared<JobSystem>(std::max(JobSystem::defaultNumThreads() / 2, 1u));
+      m_loadThread = thread(&WorldManager::loadLoop, this);
+    }
+
+    {
+      std::lock_guard<mutex> lock(m_loadMutex);
+      m_queuedLoads.push_back(load);
+    }
+    m_numPendingLoads++;
+    m_loadCondition.notify_one();
+    return load;
+  }
+
+  size_t WorldManager::numPendingLoads()
+  {
+    return m_numPendingLoads;
+  }
+
+  void WorldManager::setIntegrationBudget(size_t numBytes)
+  {
+    m_integrationBudget = numBytes;
+  }
+
+  size_t WorldManager::getIntegrationBudget()
+  {
+    return m_integrationBudget;
+  }
+
+  void WorldManager::postCommand(Command command)
+  {
+    std::lock_guard<mutex> lock(m_commandMutex);
+    m_commands.push_back(command);
+  }
+
+  void WorldManager::executeCommands()
+  {
+    vector<Command> commands;
+    {
+      std::lock_guard<mutex> lock(m_commandMutex);
+      commands.swap(m_commands);
+    }
+
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+      commands[i]();
+    }
+  }
+
+  void WorldManager::loadLoop()
+  {
+    while (true)
+    {
+      ModelLoadHandle load;
+      {
+        std::unique_lock<mutex> lock(m_loadMutex);
+        m_loadCondition.wait(lock, [this]() { return m_loadShutdown || !m_queuedLoads.empty(); });
+        if (m_loadShutdown)
+        {
+          return;
+        }
+        load = m_queuedLoads.front();
+        m_queuedLoads.pop_front();
+        load->m_state = ModelLoad::LOAD_LOADING;
+      }
+
+      CpuTimer timer;
+      timer.start();
+      {
+        std::lock_guard<mutex> lock(m_modelLoaderMutex);
+        m_modelLoader->setProgressFunction([load](float progress)
+        {
+          load->m_progress = progress;
+        });
+        load->m_root = m_modelLoader->loadAssimpModel(load->m_filename, m_loadJobSystem.get());
+        m_modelLoader->setProgressFunction(nullptr);
+      }
+      load->m_loadTime = timer.elapsedMilli();
+      load->m_progress = 1.0f;
+
+      // The world is only touched on the frame thread
+      std::lock_guard<mutex> lock(m_loadMutex);
+      m_finishedLoads.push_back(load);
+    }
+  }
+
+  void WorldManager::integrateLoads()
+  {
+    deque<ModelLoadHandle> finishedLoads;
+    {
+      std::lock_guard<mutex> lock(m_loadMutex);
+      finishedLoads.swap(m_finishedLoads);
+    }
+    for (size_t i = 0; i < finishedLoads.size(); i++)
+    {
+      ModelLoadHandle load = finishedLoads[i];
+      if (load->m_root == nullptr)
+      {
+        printLog("Async Load Failed: " + load->m_filename);
+        load->m_state = ModelLoad::LOAD_FAILED;
+        load->m_promise.set_value(nullptr);
+        m_numPendingLoads--;
+        continue;
+      }
+
+      load->m_root->setTransform(load->m_transform);
+      load->m_numBytes = getUploadSize(load->m_root);
+      load->m_state = ModelLoad::LOAD_INTEGRATING;
+      m_integratingLoads.push_back(load);
+    }
+
+    vector<ModelLoadHandle> loads;
+    size_t numBytes = 0;
+    // Loads go in whole and in order, the first one always fits so an oversized model is not starved
+    while (!m_integratingLoads.empty())
+    {
+      ModelLoadHandle load = m_integratingLoads.front();
+      if (!loads.empty() && numBytes + load->m_numBytes > m_integrationBudget)
+      {
+        break;
+      }
+      m_integratingLoads.pop_front();
+      loads.push_back(load);
+      numBytes += load->m_numBytes;
+    }
+    for (size_t i = 0; i < m_integratingLoads.size(); i++)
+    {
+      m_integratingLoads[i]->m_numFramesWaited++;
+    }
+    if (loads.empty())
+    {
+      return;
+    }
+
+    unsigned long long startTime = m_timer.elapsedMicro();
+    for (size_t i = 0; i < loads.size(); i++)
+    {
+      ModelLoadHandle load = loads[i];
+      if (load->m_parent != nullptr)
+      {
+        m_transformHierarchy->clear();
+        load->m_parent->addChild(load->m_root);
+        processAddEntity(load->m_root);
+      }
+      else
+      {
+        addEntity(load->m_root);
+      }
+    }
+
+    // Only the meshes of the models integrated this frame are packed and uploaded
+    m_renderTechnique->appendBuffers();
+    unsigned long long integrateTime = m_timer.elapsedMicro() - startTime;
+
+    for (size_t i = 0; i < loads.size(); i++)
+    {
+      ModelLoadHandle load = loads[i];
+      printLog("Async Load: " + load->m_filename + ", " + std::to_string(load->m_loadTime) + " ms loading, " + std::to_string(load->m_numBytes) +
+        " bytes, " + std::to_string(load->m_numFramesWaited) + " frames waited, " + std::to_string(integrateTime) + " us integrating");
+      load->m_state = ModelLoad::LOAD_DONE;
+      load->m_promise.set_value(load->m_root);
+      m_numPendingLoads--;
+    }
+  }
+
+  size_t WorldManager::getUploadSize(shared_ptr<Entity> entity)
+  {
+    size_t numBytes = 0;
+    for (unsigned int i = 0; i < entity->numComponents(); i++)
+    {
+      shared_ptr<Component> component = entity->getComponent(i);
+      if (component->getType() != Component::RENDER)
+      {
+        continue;
+      }
+
+      shared_ptr<RenderComponent> renderComponent = static_pointer_cast<RenderComponent>(component);
+      for (size_t j = 0; j < renderComponent->numMeshes(); j++)
+      {
+        shared_ptr<Mesh> mesh = renderComponent->getMesh(j);
+        for (size_t k = 0; k < mesh->getNumBuffers(); k++)
+        {
+          numBytes += mesh->getVertexBufferNumBytes(k);
+        }
+        numBytes += (mesh->getIndexBufferSize() + mesh->getLodIndexBufferSize()) * sizeof(unsigned int);
+      }
+    }
+
+    for (unsigned int i = 0; i < entity->numChildren(); i++)
+    {
+      numBytes += getUploadSize(entity->getChild(i));
+    }
+    return numBytes;
+  }
+
+  shared_ptr<Entity> WorldManager::loadCookedModel(string filename)
+  {
+    std::lock_guard<mutex> lock(m_modelLoaderMutex);
+    return m_modelLoader->loadCookedModel(filename, m_jobSystem.get());
+  }
+
+  bool WorldManager::saveCookedModel(string filename, shared_ptr<Entity> root)
+  {
+    std::lock_guard<mutex> lock(m_modelLoaderMutex);
+    return m_modelLoader->saveCookedModel(filename, root);
   }
 
   void WorldManager::printLog(string s)
   {
     string st = s + "\n";
-    TCHAR name[256];
-    _tcscpy_s(name, CA2T(st.c_str()));
-    OutputDebugString(name);
+    OutputDebugString(CA2T(st.c_str()));
   }
 }
\ No newline at end of file
@@ -12,11 +12,20 @@
 #include "Graphics.h"
 #include "CpuTimer.h"
 #include "ModelLoader.h"
+#include "TransformHierarchy.h"
+#include "JobSystem.h"
 
 #include <string>
 #include <vector>
 #include <memory>
 #include <map>
+#include <deque>
+#include <functional>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h> 
@@ -27,6 +36,14 @@ using std::string;
 using std::vector;
 using std::shared_ptr;
 using std::map;
+using std::deque;
+using std::function;
+using std::promise;
+using std::shared_future;
+using std::atomic;
+using std::mutex;
+using std::condition_variable;
+using std::thread;
 
 namespace Bonny
 {
@@ -38,7 +55,51 @@ namespace Bonny
   class WorldManager
   {
   public:
+    struct TransformBenchmark
+    {
+      size_t              m_numNodes;
+      uint32_t            m_iterations;
+      unsigned long long  m_recursiveTime;
+      unsigned long long  m_linearTime;
+      float               m_maxError;
+    };
+
+    // A model loading in the background. The progress is the loader's, the future
+    // resolves on the frame thread once the model's entities are part of the world,
+    // with nullptr when the load failed or the world manager was destroyed first.
+    struct ModelLoad
+    {
+      enum State
+      {
+        LOAD_QUEUED = 0,
+        LOAD_LOADING,
+        LOAD_INTEGRATING,
+        LOAD_DONE,
+        LOAD_FAILED,
+        LOAD_CANCELED
+      };
+
+      string                              m_filename;
+      shared_ptr<Entity>                  m_parent;
+      mat4                                m_transform;
+      atomic<int>                         m_state;
+      atomic<float>                       m_progress;
+      shared_ptr<Entity>                  m_root;
+      size_t                              m_numBytes;
+      uint32_t                            m_numFramesWaited;
+      unsigned long long                  m_loadTime;
+      promise<shared_ptr<Entity>>         m_promise;
+      shared_future<shared_ptr<Entity>>   m_future;
+    };
+
+    typedef shared_ptr<ModelLoad>   ModelLoadHandle;
+    typedef function<void()>        Command;
+
     WorldManager(string name, HINSTANCE hinstance, HWND window);
+
+    // Runs the frame on the headless backend, no GPU or window needed. The engine itself
+    // still builds for Windows only, this doesn't make it portable.
+    WorldManager(string name);
     ~WorldManager();
 
     void                addEntity(shared_ptr<Entity> entity);
@@ -55,21 +116,47 @@ namespace Bonny
     void                handleMouse(MSG* event);
 
     shared_ptr<Entity>  loadAssimpModel(string filename);
+    ModelLoadHandle     loadAssimpModelAsync(string filename, shared_ptr<Entity> parent, const mat4& transform);
+    size_t              numPendingLoads();
+    void                setIntegrationBudget(size_t numBytes);
+    size_t              getIntegrationBudget();
+    void                postCommand(Command command);
+    shared_ptr<Entity>  loadCookedModel(string filename);
+    bool                saveCookedModel(string filename, shared_ptr<Entity> root);
 
     void                buildFrame();
     void                executeFrame();
+    void                benchmarkTransforms(uint32_t iterations, TransformBenchmark& benchmark);
+    size_t              getNumTransformsUpdated();
+    void                setNumJobThreads(uint32_t numThreads);
+    shared_ptr<JobSystem> getJobSystem();
+    void                traceReferenceImage(string filename);
+    void                printLodStats();
+    void                printTextureStats();
+    void                setQuantizeVertices(bool quantize);
+    void                printGeometryStats();
+
+    // Runs the self checks on the current scene, each one logs its result.
+    // Returns the number of checks that failed.
+    uint32_t            runChecks();
 
 
     void                updateWindow(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+    shared_ptr<Graphics>  getGraphics();
+    shared_ptr<RenderTechnique> getRenderTechnique();
     void                printLog(string s);
 
   private:
     string      m_name;
 
     vector<shared_ptr<Entity>>                m_entities;
+    shared_ptr<TransformHierarchy>            m_transformHierarchy;
     vector<shared_ptr<RenderScreenView>>      m_views;
     vector<shared_ptr<ProcessorComponent>>    m_processors;
+    vector<ProcessorComponent*>               m_independentProcessors;
+    vector<ProcessorComponent*>               m_serialProcessors;
     shared_ptr<Graphics>                      m_graphics;
+    shared_ptr<JobSystem>                     m_jobSystem;
     shared_ptr<RenderTechnique>               m_renderTechnique;
     shared_ptr<ModelLoader>                   m_modelLoader;
     CpuTimer                                  m_timer;
@@ -80,6 +167,34 @@ namespace Bonny
     float                                     m_slopeDepthBias;
     bool                                      m_clusterEntityFreeze;
 
+    // Commands may be posted from any thread, they run at the start of the next frame
+    mutex                                     m_commandMutex;
+    vector<Command>                           m_commands;
+
+    // Background loads run one at a time on their own thread and job system, so
+    // their decode and mesh jobs never land in the frame's queues. Finished loads
+    // are handed over in m_finishedLoads and wait in m_integratingLoads, which only
+    // the frame thread touches.
+    shared_ptr<JobSystem>                     m_loadJobSystem;
+    thread                                    m_loadThread;
+    mutex                                     m_loadMutex;
+    condition_variable                        m_loadCondition;
+    deque<ModelLoadHandle>                    m_queuedLoads;
+    deque<ModelLoadHandle>                    m_finishedLoads;
+    bool                                      m_loadShutdown;
+    mutex                                     m_modelLoaderMutex;
+    deque<ModelLoadHandle>                    m_integratingLoads;
+    atomic<uint32_t>                          m_numPendingLoads;
+    size_t                                    m_integrationBudget;
+
+    void createRenderer(shared_ptr<Graphics> graphics, HINSTANCE hinstance, HWND window);
+    void loadLoop();
+    void executeCommands();
+    void integrateLoads();
+    size_t getUploadSize(shared_ptr<Entity> entity);
+    uint32_t reportCheck(string name, bool passed, string details);
+    uint32_t checkMeshletCulling();
+    uint32_t checkTextureStreaming();
     void processAddEntity(shared_ptr<Entity> entity);
     void processRemoveEntity(shared_ptr<Entity> entity);
     void addProcessorComponent(shared_ptr<ProcessorComponent> processorComponent);
@@ -90,8 +205,8 @@ namespace Bonny
     void removeRenderComponent(shared_ptr<RenderComponent> renderComponent, shared_ptr<Entity> entity);
 
 
-    void updateTransforms();
-    void updateTransform(shared_ptr<Entity> entity, mat4& parent);
+    JobSystem::JobHandle updateTransforms();
+    void multiplyTransforms(shared_ptr<Entity> entity, const mat4& parent, vector<mat4>& worldTransforms, vector<Entity*>& entities, size_t& count);
   };
 }
 